@@ -0,0 +1,563 @@
+/**
+ * Microbenchmarks for the card reader protocol primitives
+ *
+ * This pulls in cardd.c directly so that the exact same readPacket,
+ * writePacket, getCardStatus, getTrackIndex, circular buffer and track
+ * copy code that runs in the daemon is measured here. Everything runs
+ * against the in-memory RS422 buffers so no serial port is needed.
+ *
+ * Each benchmark is warmed up, calibrated so that a sample takes roughly
+ * SAMPLE_TARGET_NS, and then sampled REPETITIONS times. The median, min,
+ * mean and standard deviation are reported in ns/op along with cycles/op
+ * and heap allocations/op. Results are written one JSON object per line
+ * so that two runs can be diffed, or compared with --baseline.
+ *
+ * The serial and card file benchmarks are the exception. They go through
+ * a pty and real files so that the plain and io_uring paths of readBytes,
+ * readCard and writeCard can be compared, and the io_uring ones are
+ * skipped on kernels that can't run them.
+ **/
+
+/* For posix_openpt and ptsname */
+#define _GNU_SOURCE
+
+#define main carddMain
+#include "../src/cardd.c"
+#undef main
+
+#include <math.h>
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define WARMUP_NS 50000000ULL
+#define SAMPLE_TARGET_NS 10000000ULL
+#define REPETITIONS 21
+#define DEFAULT_OUTPUT_PATH "build/microbench.json"
+#define CARD_FILE_PATH "build/microbench.card"
+
+/* Allocation counting */
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *pointer, size_t size);
+extern void __libc_free(void *pointer);
+
+static unsigned long long allocations = 0;
+
+void *malloc(size_t size)
+{
+	allocations++;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size)
+{
+	allocations++;
+	return __libc_calloc(count, size);
+}
+
+void *realloc(void *pointer, size_t size)
+{
+	allocations++;
+	return __libc_realloc(pointer, size);
+}
+
+void free(void *pointer)
+{
+	__libc_free(pointer);
+}
+
+/* Timing */
+
+static inline unsigned long long nowNanoseconds()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline unsigned long long nowCycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#elif defined(__aarch64__)
+	unsigned long long value;
+	__asm__ volatile("mrs %0, cntvct_el0" : "=r"(value));
+	return value;
+#else
+	return 0;
+#endif
+}
+
+/* Sinks to stop the compiler from discarding benchmark results */
+static volatile int sinkInt;
+static volatile unsigned char sinkByte;
+
+typedef void (*BenchmarkFunction)(void);
+
+typedef struct
+{
+	const char *name;
+	BenchmarkFunction setup;
+	BenchmarkFunction run;
+	int (*available)(void);
+} Benchmark;
+
+typedef struct
+{
+	const char *name;
+	unsigned long long iterations;
+	double nsMedian;
+	double nsMin;
+	double nsMean;
+	double nsStddev;
+	double cyclesMedian;
+	double allocationsPerOp;
+} BenchmarkResult;
+
+/* Benchmark fixtures */
+
+static unsigned char enquiryFrame[] = {ENQUIRY};
+static unsigned char readFrame[BUFFER_SIZE];
+static int readFrameLength;
+static unsigned char writeFrame[BUFFER_SIZE];
+static int writeFrameLength;
+static unsigned char replyData[BUFFER_SIZE];
+static int replyDataLength;
+static unsigned char scratch[BUFFER_SIZE];
+static CardReader benchReader;
+static int allTracks[3];
+
+static int buildFrame(unsigned char *frame, unsigned char *data, int length)
+{
+	int index = 0;
+	frame[index++] = START_OF_TEXT;
+	frame[index++] = length + 2;
+	unsigned char checksum = length + 2;
+	for (int i = 0; i < length; i++)
+	{
+		frame[index++] = data[i];
+		checksum ^= data[i];
+	}
+	frame[index++] = END_OF_TEXT;
+	checksum ^= END_OF_TEXT;
+	frame[index++] = checksum;
+	return index;
+}
+
+static void resetBuffers()
+{
+	nodes[0].input.head = nodes[0].input.tail = 0;
+	outputReset(&nodes[0].output);
+}
+
+static void loadInput(unsigned char *frame, int length)
+{
+	memcpy(nodes[0].input.buffer, frame, length);
+	nodes[0].input.head = length;
+	nodes[0].input.tail = 0;
+}
+
+static void setupFixtures()
+{
+	unsigned char packet[BUFFER_SIZE];
+
+	// READ all three tracks
+	int length = 0;
+	packet[length++] = READ;
+	packet[length++] = 0x00;
+	packet[length++] = 0x00;
+	packet[length++] = 0x00;
+	packet[length++] = 0x30;
+	packet[length++] = 0x31;
+	packet[length++] = 0x36;
+	readFrameLength = buildFrame(readFrame, packet, length);
+
+	// WRITE all three tracks
+	packet[0] = WRITE;
+	for (int i = 0; i < 3 * TRACK_SIZE; i++)
+		packet[length++] = i & 0xFF;
+	writeFrameLength = buildFrame(writeFrame, packet, length);
+
+	// A status reply carrying all three tracks
+	replyDataLength = 0;
+	replyData[replyDataLength++] = READ;
+	replyData[replyDataLength++] = STATUS_HAS_CARD_1;
+	replyData[replyDataLength++] = STATUS_NO_ERR;
+	replyData[replyDataLength++] = STATUS_NO_JOB;
+	for (int i = 0; i < 3 * TRACK_SIZE; i++)
+		replyData[replyDataLength++] = i & 0xFF;
+
+	benchReader.cardPosition = UNDER_READER;
+	benchReader.coverClosed = 1;
+	benchReader.dispenserFull = 1;
+
+	getTrackIndex(0x36, allTracks);
+
+	nodes[0].ring = 1;
+	outputInit(&nodes[0].output, -1, DEFAULT_OUTPUT_TIMEOUT_MS);
+	resetBuffers();
+}
+
+static void benchReadPacketEnquiry()
+{
+	loadInput(enquiryFrame, sizeof(enquiryFrame));
+	sinkInt = readPacket(scratch, &nodes[0]);
+}
+
+static void benchReadPacketRead()
+{
+	loadInput(readFrame, readFrameLength);
+	sinkInt = readPacket(scratch, &nodes[0]);
+}
+
+static void benchReadPacketWrite()
+{
+	loadInput(writeFrame, writeFrameLength);
+	sinkInt = readPacket(scratch, &nodes[0]);
+}
+
+static void benchWritePacketAck()
+{
+	outputReset(&nodes[0].output);
+	writePacket(replyData, 4, &nodes[0]);
+	sinkInt = nodes[0].output.count;
+}
+
+static void benchWritePacketTracks()
+{
+	outputReset(&nodes[0].output);
+	writePacket(replyData, replyDataLength, &nodes[0]);
+	sinkInt = nodes[0].output.count;
+}
+
+static void benchGetCardStatusShutter()
+{
+	benchReader.cardPosition = (benchReader.cardPosition + 1) % (EJECTING_CARD + 1);
+	sinkByte = getCardStatus(&benchReader, 1);
+}
+
+static void benchGetCardStatusNoShutter()
+{
+	benchReader.cardPosition = (benchReader.cardPosition + 1) % (EJECTING_CARD + 1);
+	sinkByte = getCardStatus(&benchReader, 0);
+}
+
+static void benchGetTrackIndex()
+{
+	static unsigned char track = 0x30;
+	int trackIndex[3];
+	getTrackIndex(track, trackIndex);
+	track = track == 0x36 ? 0x30 : track + 1;
+	sinkInt = trackIndex[0] + trackIndex[1] + trackIndex[2];
+}
+
+static void benchCircularBufferPush()
+{
+	outputReset(&nodes[0].output);
+	sinkInt = writeBytes(replyData, 16, &nodes[0]);
+}
+
+static void benchCircularBufferPop()
+{
+	nodes[0].input.head = 16;
+	nodes[0].input.tail = 0;
+	sinkInt = readBytes(scratch, BUFFER_SIZE, &nodes[0]);
+}
+
+static void benchReadTracks()
+{
+	sinkInt = readTracks(&benchReader, allTracks, scratch);
+}
+
+static void benchWriteTracks()
+{
+	sinkInt = writeTracks(&benchReader, allTracks, &replyData[4]);
+}
+
+/* Serial port and card file fixtures */
+
+static int hostPort = -1;
+
+static int openSerialPair()
+{
+	if (hostPort >= 0)
+		return 0;
+
+	hostPort = posix_openpt(O_RDWR | O_NOCTTY);
+	if (hostPort < 0 || grantpt(hostPort) < 0 || unlockpt(hostPort) < 0)
+		return -1;
+
+	struct termios raw;
+	tcgetattr(hostPort, &raw);
+	cfmakeraw(&raw);
+	tcsetattr(hostPort, TCSANOW, &raw);
+
+	serialIO = open(ptsname(hostPort), O_RDWR | O_NOCTTY | O_NDELAY);
+	if (serialIO < 0)
+		return -1;
+
+	applySerialOptions(serialIO, B115200, 0, 0, TCSANOW);
+	outputInit(&serialOutput, serialIO, DEFAULT_OUTPUT_TIMEOUT_MS);
+	return 0;
+}
+
+static void setupSerialPosix()
+{
+	uringClose();
+	openSerialPair();
+}
+
+static int serialUringAvailable()
+{
+	return openSerialPair() == 0 && uringInit(serialIO) == 0 && uringSerialEnabled();
+}
+
+static void setupCardFile()
+{
+	strcpy(benchReader.cardPath, CARD_FILE_PATH);
+	memset(benchReader.tracks, 0x5A, sizeof(benchReader.tracks));
+}
+
+static void setupCardFilePosix()
+{
+	uringClose();
+	setupCardFile();
+}
+
+static int cardFileUringAvailable()
+{
+	setupCardFile();
+	return uringInit(-1) == 0 && uringFilesEnabled();
+}
+
+static void benchSerialRead()
+{
+	write(hostPort, enquiryFrame, sizeof(enquiryFrame));
+	sinkInt = readBytes(scratch, BUFFER_SIZE, NULL);
+}
+
+static void benchCardSave()
+{
+	writeCard(&benchReader, benchReader.cardPath, benchReader.tracks);
+}
+
+/* The plain path with the same fsync the io_uring path does */
+static void benchCardSaveSync()
+{
+	int fd = open(CARD_FILE_PATH, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	sinkInt = write(fd, benchReader.tracks, 3 * TRACK_SIZE);
+	fdatasync(fd);
+	close(fd);
+}
+
+static void benchCardLoad()
+{
+	sinkInt = readCard(&benchReader, benchReader.cardPath, benchReader.tracks);
+}
+
+static Benchmark benchmarks[] = {
+	{"readPacket/enquiry", resetBuffers, benchReadPacketEnquiry},
+	{"readPacket/read", resetBuffers, benchReadPacketRead},
+	{"readPacket/write", resetBuffers, benchReadPacketWrite},
+	{"writePacket/status", resetBuffers, benchWritePacketAck},
+	{"writePacket/tracks", resetBuffers, benchWritePacketTracks},
+	{"getCardStatus/shutter", NULL, benchGetCardStatusShutter},
+	{"getCardStatus/noShutter", NULL, benchGetCardStatusNoShutter},
+	{"getTrackIndex", NULL, benchGetTrackIndex},
+	{"circularBuffer/push16", resetBuffers, benchCircularBufferPush},
+	{"circularBuffer/pop16", resetBuffers, benchCircularBufferPop},
+	{"tracks/readCopy", NULL, benchReadTracks},
+	{"tracks/writeCopy", NULL, benchWriteTracks},
+	{"serialRead/posix", setupSerialPosix, benchSerialRead},
+	{"serialRead/uring", NULL, benchSerialRead, serialUringAvailable},
+	{"cardSave/posix", setupCardFilePosix, benchCardSave},
+	{"cardSave/posixFsync", setupCardFilePosix, benchCardSaveSync},
+	{"cardSave/uring", NULL, benchCardSave, cardFileUringAvailable},
+	{"cardLoad/posix", setupCardFilePosix, benchCardLoad},
+	{"cardLoad/uring", NULL, benchCardLoad, cardFileUringAvailable},
+};
+
+/* Runner */
+
+static int compareDoubles(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+static unsigned long long runIterations(BenchmarkFunction run, unsigned long long iterations)
+{
+	unsigned long long start = nowNanoseconds();
+	for (unsigned long long i = 0; i < iterations; i++)
+		run();
+	return nowNanoseconds() - start;
+}
+
+static BenchmarkResult runBenchmark(Benchmark *benchmark)
+{
+	BenchmarkResult result = {0};
+	result.name = benchmark->name;
+
+	if (benchmark->setup)
+		benchmark->setup();
+
+	// Warm up and calibrate the number of iterations per sample
+	unsigned long long iterations = 1;
+	unsigned long long warmupStart = nowNanoseconds();
+	while (1)
+	{
+		unsigned long long elapsed = runIterations(benchmark->run, iterations);
+		if (elapsed >= SAMPLE_TARGET_NS && nowNanoseconds() - warmupStart >= WARMUP_NS)
+			break;
+		if (elapsed < SAMPLE_TARGET_NS)
+			iterations *= 2;
+	}
+
+	double nanoseconds[REPETITIONS];
+	double cycles[REPETITIONS];
+	unsigned long long allocationsBefore = allocations;
+
+	for (int r = 0; r < REPETITIONS; r++)
+	{
+		unsigned long long cycleStart = nowCycles();
+		unsigned long long elapsed = runIterations(benchmark->run, iterations);
+		unsigned long long cycleEnd = nowCycles();
+		nanoseconds[r] = (double)elapsed / iterations;
+		cycles[r] = (double)(cycleEnd - cycleStart) / iterations;
+	}
+
+	result.iterations = iterations;
+	result.allocationsPerOp = (double)(allocations - allocationsBefore) / (iterations * REPETITIONS);
+
+	double sum = 0;
+	for (int r = 0; r < REPETITIONS; r++)
+		sum += nanoseconds[r];
+	result.nsMean = sum / REPETITIONS;
+
+	double squares = 0;
+	for (int r = 0; r < REPETITIONS; r++)
+		squares += (nanoseconds[r] - result.nsMean) * (nanoseconds[r] - result.nsMean);
+	result.nsStddev = sqrt(squares / (REPETITIONS - 1));
+
+	qsort(nanoseconds, REPETITIONS, sizeof(double), compareDoubles);
+	qsort(cycles, REPETITIONS, sizeof(double), compareDoubles);
+	result.nsMin = nanoseconds[0];
+	result.nsMedian = nanoseconds[REPETITIONS / 2];
+	result.cyclesMedian = cycles[REPETITIONS / 2];
+
+	return result;
+}
+
+/**
+ * Looks up the median ns/op of a benchmark in a previous results file
+ *
+ * @returns The median, or a negative number if it was not found
+ **/
+static double baselineMedian(const char *baselinePath, const char *name)
+{
+	FILE *file = fopen(baselinePath, "r");
+	if (!file)
+		return -1;
+
+	char line[512];
+	char pattern[128];
+	snprintf(pattern, sizeof(pattern), "\"name\": \"%s\"", name);
+
+	double median = -1;
+	while (fgets(line, sizeof(line), file))
+	{
+		if (!strstr(line, pattern))
+			continue;
+		char *field = strstr(line, "\"ns_median\": ");
+		if (field)
+			median = atof(field + strlen("\"ns_median\": "));
+		break;
+	}
+
+	fclose(file);
+	return median;
+}
+
+int main(int argc, char *argv[])
+{
+	char *outputPath = DEFAULT_OUTPUT_PATH;
+	char *baselinePath = NULL;
+	char *filter = NULL;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc)
+			baselinePath = argv[++i];
+		else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc)
+			filter = argv[++i];
+		else if (strcmp(argv[i], "--help") == 0)
+		{
+			printf("usage: %s [output.json] [--baseline old.json] [--filter name]\n", argv[0]);
+			return EXIT_SUCCESS;
+		}
+		else
+			outputPath = argv[i];
+	}
+
+	FILE *output = fopen(outputPath, "w");
+	if (!output)
+	{
+		printf("Error: Couldn't open %s for writing\n", outputPath);
+		return EXIT_FAILURE;
+	}
+
+	setupFixtures();
+
+	printf("%-26s %12s %10s %10s %10s %10s %10s", "benchmark", "iterations", "ns/op", "min", "stddev", "cycles/op", "allocs/op");
+	if (baselinePath)
+		printf(" %10s", "delta");
+	printf("\n");
+
+	for (int i = 0; i < (int)(sizeof(benchmarks) / sizeof(benchmarks[0])); i++)
+	{
+		if (filter && !strstr(benchmarks[i].name, filter))
+			continue;
+
+		if (benchmarks[i].available && !benchmarks[i].available())
+		{
+			printf("%-26s %12s\n", benchmarks[i].name, "unavailable");
+			continue;
+		}
+
+		BenchmarkResult result = runBenchmark(&benchmarks[i]);
+
+		printf("%-26s %12llu %10.2f %10.2f %10.2f %10.1f %10.3f",
+			   result.name, result.iterations, result.nsMedian, result.nsMin,
+			   result.nsStddev, result.cyclesMedian, result.allocationsPerOp);
+
+		if (baselinePath)
+		{
+			double previous = baselineMedian(baselinePath, result.name);
+			if (previous > 0)
+				printf(" %+9.1f%%", (result.nsMedian - previous) / previous * 100.0);
+			else
+				printf(" %10s", "new");
+		}
+		printf("\n");
+
+		fprintf(output,
+				"{\"name\": \"%s\", \"iterations\": %llu, \"repetitions\": %d, "
+				"\"ns_median\": %.3f, \"ns_min\": %.3f, \"ns_mean\": %.3f, \"ns_stddev\": %.3f, "
+				"\"cycles_median\": %.1f, \"allocs_per_op\": %.3f}\n",
+				result.name, result.iterations, REPETITIONS,
+				result.nsMedian, result.nsMin, result.nsMean, result.nsStddev,
+				result.cyclesMedian, result.allocationsPerOp);
+		fflush(output);
+	}
+
+	fclose(output);
+	uringClose();
+	unlink(CARD_FILE_PATH);
+	printf("\nResults written to %s\n", outputPath);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,727 @@
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "backup.h"
+#include "clock.h"
+#include "common.h"
+#include "manifest.h"
+#include "probes.h"
+#include "service.h"
+
+/**
+ * Online incremental backups of the card collection
+ *
+ * Every card loaded or saved since cardd started is kept in a table with
+ * its latest image and the generation it was last changed at, a counter
+ * raised on every WRITE, ERASE and NEW_CARD. A backup starts by noting the
+ * current generation, its cut. From then until it finishes, the first
+ * change to any card keeps the image the card had at the cut alongside
+ * the new one, so the backup copies every card exactly as it was at the
+ * cut while the readers carry on writing. A save already under way at the
+ * cut counts as made before it. Card files are only read for
+ * cards the table has never seen, and a read that races a save is thrown
+ * away in favour of the image kept by the save.
+ *
+ * A backup is a directory of snapshots. Each snapshot only stores the
+ * cards that changed since the one before it, those that didn't are
+ * listed in its manifest against the older snapshot that holds them.
+ * Changes are found from the generations when the last snapshot was
+ * taken by this same run of cardd, and from file times and checksums
+ * after a restart.
+ **/
+
+#define BACKUP_TRACKS_SIZE (3 * TRACK_SIZE)
+
+typedef enum
+{
+	FROZEN_NONE,
+	FROZEN_IMAGE,
+	FROZEN_ABSENT,
+} FrozenState;
+
+typedef struct TrackedCard
+{
+	struct TrackedCard *next;
+	char path[256];
+	unsigned long long generation;
+	unsigned char image[BACKUP_TRACKS_SIZE];
+	FrozenState frozen;
+	unsigned long long frozenGeneration;
+	unsigned char frozenImage[BACKUP_TRACKS_SIZE];
+	int late;
+} TrackedCard;
+
+typedef struct
+{
+	dev_t device;
+	ino_t inode;
+	TrackedCard *card;
+} TrackedFile;
+
+typedef struct
+{
+	int socket;
+	char destination[256];
+} BackupArguments;
+
+typedef struct
+{
+	char *text;
+	int length;
+	int size;
+} ManifestText;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static TrackedCard *cards[BACKUP_BUCKETS];
+static unsigned long long generation;
+static unsigned long long epoch;
+static int active;
+static int running;
+static unsigned long long cut;
+static unsigned long long lateChanges;
+static char collectionPath[512];
+
+static unsigned int hashPath(const char *path)
+{
+	unsigned int hash = 2166136261u;
+	for (const unsigned char *byte = (const unsigned char *)path; *byte; byte++)
+	{
+		hash ^= *byte;
+		hash *= 16777619u;
+	}
+	return hash % BACKUP_BUCKETS;
+}
+
+static TrackedCard *findCard(const char *path, int create)
+{
+	unsigned int bucket = hashPath(path);
+
+	for (TrackedCard *card = cards[bucket]; card; card = card->next)
+	{
+		if (strcmp(card->path, path) == 0)
+			return card;
+	}
+
+	if (!create || strlen(path) >= sizeof(cards[0]->path))
+		return NULL;
+
+	TrackedCard *card = calloc(1, sizeof(TrackedCard));
+	if (!card)
+		return NULL;
+
+	strcpy(card->path, path);
+	card->late = active;
+	card->next = cards[bucket];
+	cards[bucket] = card;
+	return card;
+}
+
+/**
+ * Starts tracking card changes for backups of a collection
+ *
+ * @returns 0 on success, -1 on failure
+ **/
+int backupInit(const char *collectionDirectory)
+{
+	if (strlen(collectionDirectory) >= sizeof(collectionPath))
+		return -1;
+
+	strcpy(collectionPath, collectionDirectory);
+
+	// Generations only mean something within the run of cardd that counted them
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	epoch = now.tv_sec * 1000000000ULL + now.tv_nsec;
+	return 0;
+}
+
+/**
+ * Remembers the image of a card as it was loaded into a reader
+ **/
+void backupCardLoaded(const char *path, unsigned char tracks[3][TRACK_SIZE])
+{
+	if (!collectionPath[0])
+		return;
+
+	pthread_mutex_lock(&lock);
+
+	TrackedCard *card = findCard(path, 0);
+	if (!card && (card = findCard(path, 1)))
+	{
+		memcpy(card->image, tracks, BACKUP_TRACKS_SIZE);
+		if (active)
+			lateChanges++;
+	}
+
+	pthread_mutex_unlock(&lock);
+}
+
+static int readCardFile(const char *path, unsigned char *image)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	struct stat status;
+	int result = fstat(fd, &status) == 0 && status.st_size == BACKUP_TRACKS_SIZE ? transferReadAll(fd, image, BACKUP_TRACKS_SIZE) : -1;
+	close(fd);
+	return result;
+}
+
+/**
+ * Called just before a card file is written
+ *
+ * While a backup is running this keeps the image the card had at the cut,
+ * reading it from the card file if the card hasn't been seen before.
+ **/
+void backupCardWriting(const char *path)
+{
+	if (!collectionPath[0])
+		return;
+
+	pthread_mutex_lock(&lock);
+
+	if (active)
+	{
+		TrackedCard *card = findCard(path, 0);
+
+		if (!card && (card = findCard(path, 1)))
+		{
+			card->frozen = readCardFile(path, card->image) == 0 ? FROZEN_IMAGE : FROZEN_ABSENT;
+			memcpy(card->frozenImage, card->image, BACKUP_TRACKS_SIZE);
+			lateChanges++;
+		}
+		else if (card && card->frozen == FROZEN_NONE && card->generation <= cut)
+		{
+			card->frozen = FROZEN_IMAGE;
+			card->frozenGeneration = card->generation;
+			memcpy(card->frozenImage, card->image, BACKUP_TRACKS_SIZE);
+			lateChanges++;
+		}
+	}
+
+	pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Called once a card file has been written, moving the card on a generation
+ **/
+void backupCardWritten(const char *path, unsigned char tracks[3][TRACK_SIZE])
+{
+	if (!collectionPath[0])
+		return;
+
+	pthread_mutex_lock(&lock);
+
+	TrackedCard *card = findCard(path, 1);
+	if (card)
+	{
+		memcpy(card->image, tracks, BACKUP_TRACKS_SIZE);
+		card->generation = ++generation;
+
+		// The write was already under way at the cut, so it counts as before it
+		if (active && card->frozen == FROZEN_NONE)
+		{
+			card->frozen = FROZEN_IMAGE;
+			card->frozenGeneration = card->generation;
+			memcpy(card->frozenImage, tracks, BACKUP_TRACKS_SIZE);
+		}
+
+		if (active)
+			lateChanges++;
+	}
+
+	pthread_mutex_unlock(&lock);
+}
+
+/**
+ * The image a tracked card had at the cut, called with the lock held
+ *
+ * @returns 1 if the image was copied, 0 if the card didn't exist at the cut
+ **/
+static int imageAtCut(TrackedCard *card, unsigned char *image, unsigned long long *cardGeneration)
+{
+	if (card->frozen == FROZEN_IMAGE)
+	{
+		memcpy(image, card->frozenImage, BACKUP_TRACKS_SIZE);
+		*cardGeneration = card->frozenGeneration;
+		return 1;
+	}
+
+	// A card that wasn't in the collection at the cut
+	if (card->frozen == FROZEN_ABSENT || card->generation > cut)
+		return 0;
+
+	memcpy(image, card->image, BACKUP_TRACKS_SIZE);
+	*cardGeneration = card->generation;
+	return 1;
+}
+
+static int compareFiles(const void *a, const void *b)
+{
+	const TrackedFile *x = a, *y = b;
+	if (x->device != y->device)
+		return x->device < y->device ? -1 : 1;
+	return (x->inode > y->inode) - (x->inode < y->inode);
+}
+
+static int compareNames(const void *a, const void *b)
+{
+	return strcmp(((const ManifestCard *)a)->name, ((const ManifestCard *)b)->name);
+}
+
+/**
+ * Lists the tracked cards by the file each one is, so cards are matched
+ * to the collection however their paths were written
+ *
+ * @param late Only cards first seen after the cut
+ **/
+static TrackedFile *indexTrackedCards(int late, int *count)
+{
+	int capacity = 256;
+	TrackedFile *files = malloc(capacity * sizeof(TrackedFile));
+	*count = 0;
+
+	pthread_mutex_lock(&lock);
+
+	for (int bucket = 0; files && bucket < BACKUP_BUCKETS; bucket++)
+	{
+		for (TrackedCard *card = cards[bucket]; card; card = card->next)
+		{
+			if (late && !card->late)
+				continue;
+
+			if (*count == capacity)
+			{
+				capacity *= 2;
+				TrackedFile *grown = realloc(files, capacity * sizeof(TrackedFile));
+				if (!grown)
+				{
+					free(files);
+					files = NULL;
+					break;
+				}
+				files = grown;
+			}
+
+			files[(*count)++].card = card;
+		}
+	}
+
+	pthread_mutex_unlock(&lock);
+
+	if (!files)
+		return NULL;
+
+	// Tracked cards are never freed, so they can be looked at without the lock
+	int kept = 0;
+	for (int i = 0; i < *count; i++)
+	{
+		struct stat status;
+		if (stat(files[i].card->path, &status) == 0)
+		{
+			files[kept].device = status.st_dev;
+			files[kept].inode = status.st_ino;
+			files[kept++].card = files[i].card;
+		}
+	}
+
+	*count = kept;
+	qsort(files, kept, sizeof(TrackedFile), compareFiles);
+	return files;
+}
+
+static TrackedCard *findFile(TrackedFile *files, int count, struct stat *status)
+{
+	TrackedFile key = {.device = status->st_dev, .inode = status->st_ino};
+	TrackedFile *found = files ? bsearch(&key, files, count, sizeof(TrackedFile), compareFiles) : NULL;
+	return found ? found->card : NULL;
+}
+
+static int appendManifest(ManifestText *manifest, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+static int appendManifest(ManifestText *manifest, const char *format, ...)
+{
+	for (;;)
+	{
+		va_list arguments;
+		va_start(arguments, format);
+		int length = vsnprintf(manifest->text + manifest->length, manifest->size - manifest->length, format, arguments);
+		va_end(arguments);
+
+		if (length < 0)
+			return -1;
+
+		if (manifest->length + length < manifest->size)
+		{
+			manifest->length += length;
+			return 0;
+		}
+
+		char *grown = realloc(manifest->text, manifest->size * 2);
+		if (!grown)
+			return -1;
+		manifest->text = grown;
+		manifest->size *= 2;
+	}
+}
+
+static int writeFile(int directory, const char *name, const void *data, int length)
+{
+	int fd = openat(directory, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return -1;
+
+	int result = transferWriteAll(fd, data, length);
+	if (close(fd) < 0)
+		result = -1;
+	return result;
+}
+
+/**
+ * Names a new snapshot after the time it was taken
+ **/
+static int newSnapshot(int destination, char *snapshot)
+{
+	time_t now = time(NULL);
+	struct tm local;
+	localtime_r(&now, &local);
+
+	char base[MANIFEST_SNAPSHOT_SIZE];
+	strftime(base, sizeof(base), "%Y%m%d-%H%M%S", &local);
+
+	for (int attempt = 0; attempt < 100; attempt++)
+	{
+		struct stat status;
+		if (attempt == 0)
+			snprintf(snapshot, MANIFEST_SNAPSHOT_SIZE, "%s", base);
+		else
+			snprintf(snapshot, MANIFEST_SNAPSHOT_SIZE, "%s.%d", base, attempt);
+
+		if (fstatat(destination, snapshot, &status, 0) < 0 && errno == ENOENT)
+			return 0;
+	}
+
+	return -1;
+}
+
+/**
+ * Takes one snapshot of the collection into a backup
+ *
+ * @returns NULL on success, or what went wrong
+ **/
+static const char *takeBackup(const char *destinationPath, char *snapshot, unsigned int *totals)
+{
+	const char *error = NULL;
+	Manifest previous = {0};
+	char manifestError[256];
+	ManifestText manifest = {malloc(64 * 1024), 0, 64 * 1024};
+	TrackedFile *files = NULL;
+	int fileCount = 0;
+	DIR *collection = NULL;
+	int destination = -1, cardsDirectory = -1;
+	char partial[MANIFEST_SNAPSHOT_SIZE + 16];
+
+	if (mkdir(destinationPath, 0755) < 0 && errno != EEXIST)
+	{
+		error = "Couldn't create the backup directory";
+		goto done;
+	}
+
+	destination = open(destinationPath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	collection = opendir(collectionPath);
+	if (destination < 0 || !collection || !manifest.text)
+	{
+		error = destination < 0 ? "Couldn't open the backup directory" : "Couldn't open the card collection";
+		goto done;
+	}
+
+	// Without a usable last snapshot every card is copied
+	char latest[MANIFEST_SNAPSHOT_SIZE];
+	if (manifestRead(destinationPath, NULL, &previous, manifestError, sizeof(manifestError)) < 0)
+	{
+		if (manifestLatest(destinationPath, latest) == 0)
+			printf("Warning: %s, taking a full backup\n", manifestError);
+		memset(&previous, 0, sizeof(previous));
+	}
+	qsort(previous.cards, previous.count, sizeof(ManifestCard), compareNames);
+
+	if (newSnapshot(destination, snapshot) < 0)
+	{
+		error = "Couldn't name the snapshot";
+		goto done;
+	}
+
+	snprintf(partial, sizeof(partial), ".%s.partial", snapshot);
+	char cardsPath[sizeof(partial) + 8];
+	snprintf(cardsPath, sizeof(cardsPath), "%s/cards", partial);
+
+	if (mkdirat(destination, partial, 0755) < 0 || mkdirat(destination, cardsPath, 0755) < 0 ||
+		(cardsDirectory = openat(destination, cardsPath, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+	{
+		error = "Couldn't create the snapshot directory";
+		goto done;
+	}
+
+	// The cut, every card is backed up as it was at this generation
+	pthread_mutex_lock(&lock);
+	active = 1;
+	cut = generation;
+	lateChanges = 0;
+	pthread_mutex_unlock(&lock);
+
+	files = indexTrackedCards(0, &fileCount);
+	int sameRun = previous.cards && previous.epoch == epoch;
+
+	appendManifest(&manifest, "%s\nsnapshot %s\nepoch %llu\ngeneration %llu\n", MANIFEST_MAGIC, snapshot, epoch, cut);
+	int cardsLine = manifest.length;
+	appendManifest(&manifest, "cards %10u\n", 0);
+
+	unsigned int count = 0, copied = 0, unchanged = 0, skipped = 0;
+	struct dirent *entry;
+
+	while ((entry = readdir(collection)))
+	{
+		const char *name = entry->d_name;
+		struct stat status;
+
+		if (!manifestValidName(name) || strlen(name) >= TRANSFER_NAME_SIZE || (entry->d_type != DT_REG && entry->d_type != DT_UNKNOWN) ||
+			fstatat(dirfd(collection), name, &status, AT_SYMLINK_NOFOLLOW) < 0 || !S_ISREG(status.st_mode))
+			continue;
+
+		ManifestCard key;
+		strcpy(key.name, name);
+		ManifestCard *last = previous.cards ? bsearch(&key, previous.cards, previous.count, sizeof(ManifestCard), compareNames) : NULL;
+
+		unsigned char image[BACKUP_TRACKS_SIZE];
+		unsigned long long cardGeneration = 0;
+		unsigned long long mtimeNs = status.st_mtim.tv_sec * 1000000000ULL + status.st_mtim.tv_nsec;
+		int haveImage = 0;
+
+		TrackedCard *card = findFile(files, fileCount, &status);
+		if (card)
+		{
+			pthread_mutex_lock(&lock);
+			int existed = imageAtCut(card, image, &cardGeneration);
+			if (card->frozen != FROZEN_NONE)
+				mtimeNs = 0;
+			pthread_mutex_unlock(&lock);
+
+			if (!existed)
+				continue;
+			haveImage = 1;
+		}
+		else if (last && last->mtimeNs == mtimeNs && last->size == status.st_size)
+		{
+			// Untouched since the last snapshot, nothing to read
+			cardGeneration = last->generation;
+		}
+		else
+		{
+			pthread_mutex_lock(&lock);
+			unsigned long long changesBefore = lateChanges;
+			pthread_mutex_unlock(&lock);
+
+			char path[sizeof(collectionPath) + TRANSFER_NAME_SIZE + 1];
+			snprintf(path, sizeof(path), "%s/%s", collectionPath, name);
+			int result = readCardFile(path, image);
+
+			pthread_mutex_lock(&lock);
+			int raced = lateChanges != changesBefore;
+			pthread_mutex_unlock(&lock);
+
+			// A save started while the file was read, the save kept the card's image at the cut
+			if (raced)
+			{
+				int lateCount;
+				TrackedFile *lateFiles = indexTrackedCards(1, &lateCount);
+				TrackedCard *lateCard = findFile(lateFiles, lateCount, &status);
+				free(lateFiles);
+
+				if (lateCard)
+				{
+					pthread_mutex_lock(&lock);
+					int existed = imageAtCut(lateCard, image, &cardGeneration);
+					pthread_mutex_unlock(&lock);
+
+					if (!existed)
+						continue;
+					result = 0;
+					mtimeNs = 0;
+				}
+			}
+
+			if (result < 0)
+			{
+				skipped++;
+				continue;
+			}
+			haveImage = 1;
+		}
+
+		unsigned int crc = haveImage ? transferChecksum(0, image, BACKUP_TRACKS_SIZE) : last->crc;
+		int changed = !last || (haveImage && (sameRun ? cardGeneration > previous.generation : crc != last->crc));
+
+		if (changed)
+		{
+			if (writeFile(cardsDirectory, name, image, BACKUP_TRACKS_SIZE) < 0)
+			{
+				error = "Couldn't write a card to the backup";
+				goto done;
+			}
+			copied++;
+		}
+		else
+			unchanged++;
+
+		appendManifest(&manifest, "%08x %llu %llu %u %s %s\n", crc, cardGeneration, mtimeNs, BACKUP_TRACKS_SIZE, changed ? snapshot : last->location, name);
+		count++;
+	}
+
+	// The count was left blank until every card had been seen
+	char countText[12];
+	snprintf(countText, sizeof(countText), "%10u", count);
+	memcpy(manifest.text + cardsLine + strlen("cards "), countText, 10);
+	appendManifest(&manifest, "checksum %08x\n", transferChecksum(0, (unsigned char *)manifest.text, manifest.length));
+
+	char manifestPath[sizeof(partial) + 16];
+	snprintf(manifestPath, sizeof(manifestPath), "%s/manifest", partial);
+	char latestText[MANIFEST_SNAPSHOT_SIZE + 1];
+	snprintf(latestText, sizeof(latestText), "%s\n", snapshot);
+
+	// Everything is on disk before the snapshot is renamed into place and made the latest
+	if (writeFile(destination, manifestPath, manifest.text, manifest.length) < 0 || syncfs(destination) < 0 ||
+		renameat(destination, partial, destination, snapshot) < 0 ||
+		writeFile(destination, "." MANIFEST_LATEST, latestText, strlen(latestText)) < 0 ||
+		renameat(destination, "." MANIFEST_LATEST, destination, MANIFEST_LATEST) < 0 || fsync(destination) < 0)
+	{
+		error = "Couldn't write the snapshot manifest";
+		goto done;
+	}
+
+	totals[0] = count;
+	totals[1] = copied;
+	totals[2] = unchanged;
+	totals[3] = skipped;
+
+done:
+	pthread_mutex_lock(&lock);
+	if (active)
+	{
+		active = 0;
+		for (int bucket = 0; bucket < BACKUP_BUCKETS; bucket++)
+		{
+			for (TrackedCard *card = cards[bucket]; card; card = card->next)
+			{
+				card->frozen = FROZEN_NONE;
+				card->late = 0;
+			}
+		}
+	}
+	pthread_mutex_unlock(&lock);
+
+	manifestFree(&previous);
+	free(manifest.text);
+	free(files);
+	if (collection)
+		closedir(collection);
+	if (cardsDirectory >= 0)
+		close(cardsDirectory);
+	if (destination >= 0)
+		close(destination);
+
+	return error;
+}
+
+static void *backupThread(void *vargp)
+{
+	BackupArguments *arguments = (BackupArguments *)vargp;
+	unsigned char reply[1 + 1 + 255 + 5 * 4];
+	int length = 0;
+
+	char snapshot[MANIFEST_SNAPSHOT_SIZE] = "";
+	unsigned int totals[4] = {0};
+	unsigned long long startedAt = clockNowNs();
+
+	const char *error = takeBackup(arguments->destination, snapshot, totals);
+	unsigned int elapsedMs = (clockNowNs() - startedAt) / 1000000ULL;
+
+	reply[length++] = error ? COMMAND_FAILURE : COMMAND_SUCCESS;
+	const char *text = error ? error : snapshot;
+	reply[length++] = strlen(text);
+	memcpy(&reply[length], text, strlen(text));
+	length += strlen(text);
+
+	if (!error)
+	{
+		printf("Info: Backed up %u cards to %s/%s in %ums, %u copied, %u unchanged\n", totals[0], arguments->destination, snapshot,
+			   elapsedMs, totals[1], totals[2]);
+
+		unsigned int numbers[] = {totals[0], totals[1], totals[2], totals[3], elapsedMs};
+		for (int i = 0; i < 5; i++)
+		{
+			reply[length++] = numbers[i] >> 24;
+			reply[length++] = numbers[i] >> 16;
+			reply[length++] = numbers[i] >> 8;
+			reply[length++] = numbers[i];
+		}
+	}
+	else
+	{
+		printf("Error: Backup to %s failed, %s\n", arguments->destination, error);
+	}
+
+	PROBE2(backup__done, totals[1], error ? -1 : (int)elapsedMs);
+
+	transferWriteAll(arguments->socket, reply, length);
+	close(arguments->socket);
+	free(arguments);
+
+	__atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/**
+ * Hands a control connection over to a backup thread
+ *
+ * The thread owns the socket from here on and closes it when done.
+ *
+ * @returns 0 if the backup started, -1 if the caller still owns the socket
+ **/
+int backupServe(int socket, const char *destination)
+{
+	if (!collectionPath[0] || serviceEnabled() || __atomic_exchange_n(&running, 1, __ATOMIC_ACQ_REL))
+		return -1;
+
+	BackupArguments *arguments = malloc(sizeof(BackupArguments));
+	if (!arguments)
+	{
+		__atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+		return -1;
+	}
+
+	arguments->socket = socket;
+	snprintf(arguments->destination, sizeof(arguments->destination), "%s", destination);
+
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, backupThread, arguments) != 0)
+	{
+		free(arguments);
+		__atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+		return -1;
+	}
+
+	pthread_detach(thread);
+	return 0;
+}
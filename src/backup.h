@@ -0,0 +1,15 @@
+#ifndef BACKUP_H
+#define BACKUP_H
+
+#include "cardd.h"
+
+/* Buckets in the table of cards seen since cardd started */
+#define BACKUP_BUCKETS 4096
+
+int backupInit(const char *collectionDirectory);
+void backupCardLoaded(const char *path, unsigned char tracks[3][TRACK_SIZE]);
+void backupCardWriting(const char *path);
+void backupCardWritten(const char *path, unsigned char tracks[3][TRACK_SIZE]);
+int backupServe(int socket, const char *destination);
+
+#endif
@@ -6,19 +6,1198 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "common.h"
+#include "config.h"
+#include "fault.h"
+#include "manifest.h"
+#include "schema.h"
+#include "transfer.h"
+
+/**
+ * Sends a length prefixed string to cardd
+ **/
+void writeString(int sockfd, const char *string)
+{
+    unsigned char length = strlen(string);
+    write(sockfd, &length, 1);
+    write(sockfd, string, length);
+}
+
+/**
+ * Sends a 32 bit number in network byte order to cardd
+ **/
+void writeNumber(int sockfd, unsigned int number)
+{
+    unsigned char bytes[4] = {number >> 24, number >> 16, number >> 8, number};
+    write(sockfd, bytes, 4);
+}
+
+/**
+ * Reads exactly the given number of bytes from cardd
+ *
+ * @returns 0 on success, -1 if the connection closed early
+ **/
+int readExactly(int sockfd, void *buffer, int length)
+{
+    int received = 0;
+    while (received < length)
+    {
+        int bytesRead = read(sockfd, (unsigned char *)buffer + received, length - received);
+        if (bytesRead < 1)
+            return -1;
+        received += bytesRead;
+    }
+    return 0;
+}
+
+/**
+ * Reads a length prefixed string from cardd into a 256 byte buffer
+ **/
+int readString(int sockfd, char *string)
+{
+    unsigned char length;
+    if (readExactly(sockfd, &length, 1) < 0 || readExactly(sockfd, string, length) < 0)
+        return -1;
+    string[length] = '\0';
+    return 0;
+}
+
+/**
+ * Reads a 32 bit number in network byte order from cardd
+ **/
+int readNumber(int sockfd, unsigned int *number)
+{
+    unsigned char bytes[4];
+    if (readExactly(sockfd, bytes, 4) < 0)
+        return -1;
+    *number = (bytes[0] << 24) | (bytes[1] << 16) | (bytes[2] << 8) | bytes[3];
+    return 0;
+}
+
+/**
+ * Reads the one byte command response from cardd
+ *
+ * @returns 1 if the command succeeded
+ **/
+int readResponse(int sockfd)
+{
+    unsigned char byte = COMMAND_FAILURE;
+    read(sockfd, &byte, 1);
+    if (byte != COMMAND_SUCCESS)
+    {
+        printf("Command failed\n");
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Reads the configuration file cardd was started with
+ **/
+Config *loadConfig()
+{
+    static Config config;
+    static int loaded = 0;
+
+    if (loaded)
+        return &config;
+
+    char *customConfigPath = getenv("CARD_CONFIG_PATH");
+    configInit(customConfigPath ? customConfigPath : DEFAULT_CONFIG_PATH);
+
+    char error[CONFIG_ERROR_SIZE];
+    if (configLoad(&config, error) < 0)
+    {
+        printf("Warning: %s, using the defaults\n", error);
+        configDefaults(&config);
+    }
+
+    loaded = 1;
+    return &config;
+}
+
+/**
+ * Finds the control port cardd listens on from its configuration file
+ **/
+int controlPort()
+{
+    return loadConfig()->port;
+}
+
+/* The ring node chosen with --node, -1 leaves commands with node 0 */
+static int selectedNode = -1;
+
+/**
+ * Connects to the control port of cardd
+ *
+ * @returns The connected socket, or -1 on failure
+ **/
+int connectToDaemon()
+{
+    struct sockaddr_in servaddr;
+
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd < 0)
+    {
+        printf("Error: Failed to open socket");
+        return -1;
+    }
+
+    bzero(&servaddr, sizeof(servaddr));
+
+    servaddr.sin_family = AF_INET;
+    servaddr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    servaddr.sin_port = htons(controlPort());
+
+    if (connect(sockfd, (struct sockaddr *)&servaddr, sizeof(servaddr)) != 0)
+    {
+        printf("Cannot connect to cardd on port %d, is it running?\n", controlPort());
+        close(sockfd);
+        return -1;
+    }
+
+    if (selectedNode >= 0)
+    {
+        unsigned char select[] = {COMMAND_NODE, selectedNode};
+        write(sockfd, select, sizeof(select));
+    }
+
+    return sockfd;
+}
+
+int queueCommand(int sockfd, int argc, char *argv[])
+{
+    if (argc < 3)
+    {
+        printf("usage: %s queue [add path | list | move from to | remove position | clear | delay ms]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    unsigned char byte;
+
+    if (strcmp(argv[2], "add") == 0 && argc >= 4)
+    {
+        for (int i = 3; i < argc; i++)
+        {
+            // cardd takes one command per connection
+            if (i > 3 && (sockfd = connectToDaemon()) < 0)
+                return EXIT_FAILURE;
+
+            byte = COMMAND_QUEUE_ADD;
+            write(sockfd, &byte, 1);
+            writeString(sockfd, argv[i]);
+            int success = readResponse(sockfd);
+            if (i + 1 < argc)
+                close(sockfd);
+            if (!success)
+                return EXIT_FAILURE;
+            printf("queued %s\n", argv[i]);
+        }
+        return EXIT_SUCCESS;
+    }
+
+    if (strcmp(argv[2], "list") == 0)
+    {
+        byte = COMMAND_QUEUE_LIST;
+        write(sockfd, &byte, 1);
+        if (!readResponse(sockfd))
+            return EXIT_FAILURE;
+
+        unsigned int delayMs;
+        unsigned char pending, count;
+        char path[256];
+
+        readNumber(sockfd, &delayMs);
+        printf("delay: %ums\n", delayMs);
+
+        readExactly(sockfd, &pending, 1);
+        if (pending && readString(sockfd, path) == 0)
+            printf("  next: %s\n", path);
+
+        readExactly(sockfd, &count, 1);
+        for (int i = 0; i < count; i++)
+        {
+            if (readString(sockfd, path) < 0)
+                break;
+            printf("  %3d: %s\n", i + 1, path);
+        }
+
+        if (!pending && count == 0)
+            printf("queue is empty\n");
+        return EXIT_SUCCESS;
+    }
+
+    if (strcmp(argv[2], "move") == 0 && argc >= 5)
+    {
+        unsigned char command[3] = {COMMAND_QUEUE_MOVE, atoi(argv[3]) - 1, atoi(argv[4]) - 1};
+        write(sockfd, command, 3);
+        return readResponse(sockfd) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (strcmp(argv[2], "remove") == 0 && argc >= 4)
+    {
+        unsigned char command[2] = {COMMAND_QUEUE_REMOVE, atoi(argv[3]) - 1};
+        write(sockfd, command, 2);
+        return readResponse(sockfd) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (strcmp(argv[2], "clear") == 0)
+    {
+        byte = COMMAND_QUEUE_CLEAR;
+        write(sockfd, &byte, 1);
+        return readResponse(sockfd) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (strcmp(argv[2], "delay") == 0 && argc >= 4)
+    {
+        byte = COMMAND_QUEUE_DELAY;
+        write(sockfd, &byte, 1);
+        writeNumber(sockfd, atoi(argv[3]));
+        return readResponse(sockfd) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    printf("Error: Unknown queue option '%s'\n", argv[2]);
+    return EXIT_FAILURE;
+}
+
+typedef struct
+{
+    const char *name;
+    unsigned int value;
+} NamedValue;
+
+static const NamedValue faultOpcodes[] = {
+    {"any", FAULT_ANY_OPCODE}, {"enq", ENQUIRY}, {"init", INIT}, {"status", GET_STATUS},
+    {"read", READ}, {"write", WRITE}, {"erase", ERASE}, {"print", PRINT},
+    {"new-card", NEW_CARD}, {"eject", EJECT_CARD}, {"clean", CLEAN_CARD},
+    {"shutter", SET_SHUTTER}, {"cancel", CANCEL}, {NULL, 0},
+};
+
+static const NamedValue faultTypes[] = {
+    {"error", FAULT_ERROR}, {"job", FAULT_JOB}, {"delay", FAULT_DELAY},
+    {"drop", FAULT_DROP}, {"corrupt", FAULT_CORRUPT}, {"jam", FAULT_JAM}, {NULL, 0},
+};
+
+static const NamedValue faultErrors[] = {
+    {"read", STATUS_READ_ERR}, {"write", STATUS_WRITE_ERR}, {"jam", STATUS_CARD_JAM},
+    {"motor", STATUS_MOTOR_ERR}, {"print", STATUS_PRINT_ERR}, {"illegal", STATUS_ILLEGAL_ERR},
+    {"battery", STATUS_BATTERY_ERR}, {"system", STATUS_SYSTEM_ERR},
+    {"track1", STATUS_TRACK_1_READ_ERR}, {"track2", STATUS_TRACK_2_READ_ERR},
+    {"track3", STATUS_TRACK_3_READ_ERR}, {"track12", STATUS_TRACK_1_AND_2_READ_ERR},
+    {"track13", STATUS_TRACK_1_AND_3_READ_ERR}, {"track23", STATUS_TRACK_2_AND_3_READ_ERR},
+    {NULL, 0},
+};
+
+static const NamedValue faultJobs[] = {
+    {"illegal", STATUS_ILLEGAL_COMMAND}, {"running", STATUS_RUNNING_COMMAND},
+    {"waiting", STATUS_WAITING_FOR_CARD}, {"dispenser-empty", STATUS_DISPENSER_EMPTY},
+    {"no-dispenser", STATUS_NO_DISPENSER}, {"card-full", STATUS_CARD_FULL}, {NULL, 0},
+};
+
+/**
+ * Looks a value up by name, falling back to a number, hex for opcodes and
+ * status codes
+ *
+ * @returns 0 on success, -1 if the text is neither
+ **/
+static int parseNamed(const NamedValue *table, const char *text, int base, unsigned int *value)
+{
+    for (int i = 0; table && table[i].name; i++)
+    {
+        if (strcmp(table[i].name, text) == 0)
+        {
+            *value = table[i].value;
+            return 0;
+        }
+    }
+
+    char *end;
+    *value = strtoul(text, &end, base);
+    return *text != '\0' && *end == '\0' ? 0 : -1;
+}
+
+static const char *findName(const NamedValue *table, unsigned int value)
+{
+    for (int i = 0; table[i].name; i++)
+    {
+        if (table[i].value == value)
+            return table[i].name;
+    }
+    return NULL;
+}
+
+int faultCommand(int sockfd, int argc, char *argv[])
+{
+    if (argc < 3)
+    {
+        printf("usage: %s fault [add opcode type percent [value] | list | clear]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    unsigned char byte;
+
+    if (strcmp(argv[2], "add") == 0 && argc >= 6)
+    {
+        unsigned int opcode, type, value = 0;
+        double percent = atof(argv[5]);
+
+        if (parseNamed(faultOpcodes, argv[3], 16, &opcode) < 0 || opcode > FAULT_ANY_OPCODE)
+        {
+            printf("Error: Unknown opcode '%s'\n", argv[3]);
+            return EXIT_FAILURE;
+        }
+
+        if (parseNamed(faultTypes, argv[4], 10, &type) < 0 || type >= FAULT_TYPES)
+        {
+            printf("Error: Unknown fault '%s'\n", argv[4]);
+            return EXIT_FAILURE;
+        }
+
+        if (percent < 0 || percent > 100)
+        {
+            printf("Error: The probability must be between 0 and 100 percent\n");
+            return EXIT_FAILURE;
+        }
+
+        const NamedValue *values = type == FAULT_ERROR ? faultErrors : type == FAULT_JOB ? faultJobs : NULL;
+        if ((type == FAULT_ERROR || type == FAULT_JOB || type == FAULT_DELAY) &&
+            (argc < 7 || parseNamed(values, argv[6], values ? 16 : 10, &value) < 0))
+        {
+            printf("Error: The %s fault needs a %s\n", argv[4], type == FAULT_DELAY ? "delay in ms" : "status");
+            return EXIT_FAILURE;
+        }
+
+        byte = COMMAND_FAULT_ADD;
+        write(sockfd, &byte, 1);
+        writeNumber(sockfd, opcode);
+        byte = type;
+        write(sockfd, &byte, 1);
+        writeNumber(sockfd, percent / 100 * FAULT_CERTAIN + 0.5);
+        writeNumber(sockfd, value);
+        if (!readResponse(sockfd))
+            return EXIT_FAILURE;
+        printf("fault added\n");
+        return EXIT_SUCCESS;
+    }
+
+    if (strcmp(argv[2], "list") == 0)
+    {
+        byte = COMMAND_FAULT_LIST;
+        write(sockfd, &byte, 1);
+        if (!readResponse(sockfd))
+            return EXIT_FAILURE;
+
+        unsigned char count;
+        if (readExactly(sockfd, &count, 1) < 0)
+            return EXIT_FAILURE;
+
+        if (count == 0)
+            printf("no faults\n");
+
+        for (int i = 0; i < count; i++)
+        {
+            unsigned int opcode, probability, value;
+            unsigned char type;
+
+            if (readNumber(sockfd, &opcode) < 0 || readExactly(sockfd, &type, 1) < 0 ||
+                readNumber(sockfd, &probability) < 0 || readNumber(sockfd, &value) < 0)
+                return EXIT_FAILURE;
+
+            char frame[16], detail[32] = "";
+            const char *name = findName(faultOpcodes, opcode);
+            if (name)
+                snprintf(frame, sizeof(frame), "%s", name);
+            else
+                snprintf(frame, sizeof(frame), "%02X", opcode);
+
+            if (type == FAULT_DELAY)
+                snprintf(detail, sizeof(detail), "%ums", value);
+            else if (type == FAULT_ERROR || type == FAULT_JOB)
+            {
+                name = findName(type == FAULT_ERROR ? faultErrors : faultJobs, value);
+                if (name)
+                    snprintf(detail, sizeof(detail), "%s", name);
+                else
+                    snprintf(detail, sizeof(detail), "%02X", value);
+            }
+
+            printf("  %3d: %-8s %-7s %7.3f%% %s\n", i + 1, frame, type < FAULT_TYPES ? faultTypes[type].name : "?",
+                   probability * 100.0 / FAULT_CERTAIN, detail);
+        }
+
+        unsigned int injected[FAULT_TYPES], recoveries, meanMs, minMs, maxMs, recoveringMs;
+        unsigned char recovering, jammed;
+
+        for (int type = 0; type < FAULT_TYPES; type++)
+        {
+            if (readNumber(sockfd, &injected[type]) < 0)
+                return EXIT_FAILURE;
+        }
+
+        if (readNumber(sockfd, &recoveries) < 0 || readNumber(sockfd, &meanMs) < 0 ||
+            readNumber(sockfd, &minMs) < 0 || readNumber(sockfd, &maxMs) < 0 ||
+            readExactly(sockfd, &recovering, 1) < 0 || readNumber(sockfd, &recoveringMs) < 0 ||
+            readExactly(sockfd, &jammed, 1) < 0)
+            return EXIT_FAILURE;
+
+        printf("\ninjected:");
+        for (int type = 0; type < FAULT_TYPES; type++)
+            printf(" %s %u", faultTypes[type].name, injected[type]);
+        printf("\nrecoveries: %u", recoveries);
+        if (recoveries)
+            printf(", mean %ums, min %ums, max %ums", meanMs, minMs, maxMs);
+        printf("\n");
+        if (recovering)
+            printf("recovering for %ums%s\n", recoveringMs, jammed ? ", card jammed until INIT" : "");
+        return EXIT_SUCCESS;
+    }
+
+    if (strcmp(argv[2], "clear") == 0)
+    {
+        byte = COMMAND_FAULT_CLEAR;
+        write(sockfd, &byte, 1);
+        return readResponse(sockfd) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    printf("Error: Unknown fault option '%s'\n", argv[2]);
+    return EXIT_FAILURE;
+}
+
+static double secondsNow()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Prints a progress line over the last one, at most ten times a second
+ **/
+void showProgress(const char *verb, unsigned int done, unsigned int total, unsigned long long bytes, double started, int final)
+{
+    static double lastShown = 0;
+    double now = secondsNow();
+
+    if (!final && now - lastShown < 0.1)
+        return;
+    lastShown = now;
+
+    double elapsed = now - started > 0 ? now - started : 1e-9;
+    fprintf(stderr, "\r%s %u/%u cards, %.0f cards/s, %.1f MB/s", verb, done, total, done / elapsed, bytes / elapsed / 1e6);
+    if (final)
+        fprintf(stderr, " in %.2fs\n", elapsed);
+}
+
+/**
+ * Streams the card collection out of cardd into a file
+ *
+ * Every card's checksum is verified on the way through, so a file that
+ * exported cleanly will import cleanly.
+ **/
+int exportCommand(int sockfd, const char *path)
+{
+    int fd = strcmp(path, "-") == 0 ? STDOUT_FILENO : open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        printf("Error: Couldn't create %s\n", path);
+        return EXIT_FAILURE;
+    }
+
+    unsigned char byte = COMMAND_EXPORT;
+    write(sockfd, &byte, 1);
+    if (!readResponse(sockfd))
+        return EXIT_FAILURE;
+
+    unsigned int total, exported = 0, skipped = 0, corrupt = 0;
+    if (transferReadHeader(sockfd, &total) < 0 || transferWriteHeader(fd, total) < 0)
+    {
+        printf("Error: Bad export stream\n");
+        return EXIT_FAILURE;
+    }
+
+    TransferChunk *chunk = malloc(sizeof(TransferChunk));
+    char name[TRANSFER_NAME_SIZE];
+    unsigned char tracks[TRANSFER_TRACKS_SIZE];
+    unsigned long long bytes = 0;
+    double started = secondsNow();
+    int cards;
+
+    while ((cards = transferChunkRead(sockfd, chunk)) > 0)
+    {
+        int result;
+        while ((result = transferChunkNext(chunk, name, tracks)) != 0)
+        {
+            if (result < 0)
+                corrupt++;
+            if (result == -2)
+                break;
+        }
+
+        bytes += chunk->length;
+        exported += cards;
+        if (transferChunkWrite(fd, chunk) < 0)
+        {
+            printf("Error: Couldn't write to %s\n", path);
+            free(chunk);
+            return EXIT_FAILURE;
+        }
+        showProgress("exported", exported, total, bytes, started, 0);
+    }
+
+    // Close the file with the same empty chunk that ended the stream
+    int ended = cards == 0 && transferChunkWrite(fd, chunk) == 0;
+    free(chunk);
+
+    if (!ended || transferReadNumber(sockfd, &exported) < 0 || transferReadNumber(sockfd, &skipped) < 0)
+    {
+        printf("Error: The export stream ended early\n");
+        return EXIT_FAILURE;
+    }
+
+    showProgress("exported", exported, total, bytes, started, 1);
+
+    if (skipped)
+        fprintf(stderr, "skipped %u unreadable cards\n", skipped);
+    if (corrupt)
+        fprintf(stderr, "%u cards failed their checksum\n", corrupt);
+
+    if (fd != STDOUT_FILENO)
+        close(fd);
+
+    return corrupt ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/**
+ * Streams an exported file back into the card collection
+ **/
+int importCommand(int sockfd, const char *path)
+{
+    int fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY);
+    unsigned int total;
+
+    if (fd < 0 || transferReadHeader(fd, &total) < 0)
+    {
+        printf("Error: %s is not a card export\n", path);
+        return EXIT_FAILURE;
+    }
+
+    unsigned char byte = COMMAND_IMPORT;
+    write(sockfd, &byte, 1);
+    transferWriteHeader(sockfd, total);
+
+    TransferChunk *chunk = malloc(sizeof(TransferChunk));
+    unsigned int sent = 0;
+    unsigned long long bytes = 0;
+    double started = secondsNow();
+    int cards;
+
+    while ((cards = transferChunkRead(fd, chunk)) > 0)
+    {
+        bytes += chunk->length;
+        sent += cards;
+        if (transferChunkWrite(sockfd, chunk) < 0)
+            break;
+        showProgress("imported", sent, total, bytes, started, 0);
+    }
+
+    // A truncated file still ends the stream cleanly, the daemon keeps what it got
+    transferChunkReset(chunk);
+    transferChunkWrite(sockfd, chunk);
+    free(chunk);
+
+    unsigned int imported = 0, rejected = 0, skipped = 0;
+    int success = readResponse(sockfd);
+    transferReadNumber(sockfd, &imported);
+    transferReadNumber(sockfd, &rejected);
+    transferReadNumber(sockfd, &skipped);
+
+    showProgress("imported", imported, total, bytes, started, 1);
+
+    if (rejected)
+        fprintf(stderr, "rejected %u cards\n", rejected);
+    if (skipped)
+        fprintf(stderr, "skipped %u cards in use by the reader\n", skipped);
+    if (cards < 0)
+        fprintf(stderr, "%s ended early\n", path);
+
+    if (fd != STDIN_FILENO)
+        close(fd);
+
+    return success && !rejected && cards == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * Shows how close replies have come to the game's deadline, and the time
+ * breakdown of the most recent replies that missed it
+ **/
+int deadlinesCommand(int sockfd)
+{
+    unsigned char byte = COMMAND_DEADLINES;
+    write(sockfd, &byte, 1);
+    if (!readResponse(sockfd))
+        return EXIT_FAILURE;
+
+    unsigned int budgetUs, transactions, nearMisses, misses, worstUs;
+    unsigned char count;
+
+    if (readNumber(sockfd, &budgetUs) < 0 || readNumber(sockfd, &transactions) < 0 ||
+        readNumber(sockfd, &nearMisses) < 0 || readNumber(sockfd, &misses) < 0 ||
+        readNumber(sockfd, &worstUs) < 0 || readExactly(sockfd, &count, 1) < 0)
+        return EXIT_FAILURE;
+
+    printf("      budget: %uus\n", budgetUs);
+    printf("transactions: %u\n", transactions);
+    printf(" near misses: %u\n", nearMisses);
+    printf("      misses: %u\n", misses);
+    printf("       worst: %uus\n", worstUs);
+
+    if (count == 0)
+        return EXIT_SUCCESS;
+
+    printf("\n%-19s %6s %9s %8s %8s %9s %8s %8s\n", "time", "frame", "total", "read", "parse", "dispatch", "file", "write");
+    for (int i = 0; i < count; i++)
+    {
+        unsigned int when, total, phases[5];
+        unsigned char opcode;
+
+        if (readNumber(sockfd, &when) < 0 || readExactly(sockfd, &opcode, 1) < 0 || readNumber(sockfd, &total) < 0)
+            return EXIT_FAILURE;
+        for (int phase = 0; phase < 5; phase++)
+        {
+            if (readNumber(sockfd, &phases[phase]) < 0)
+                return EXIT_FAILURE;
+        }
+
+        char timestamp[32];
+        time_t seconds = when;
+        strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", localtime(&seconds));
+
+        char frame[8];
+        snprintf(frame, sizeof(frame), opcode == 0x05 ? "ENQ" : "%02X", opcode);
+
+        printf("%-19s %6s %7uus %6uus %6uus %7uus %6uus %6uus\n", timestamp, frame, total,
+               phases[0], phases[1], phases[2], phases[3], phases[4]);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Parses a time given as seconds since the epoch or a local date and time
+ * such as "2024-05-01 18:30:00"
+ *
+ * @returns 0 on success, -1 if the time isn't understood
+ **/
+static int parseTime(const char *text, unsigned int *seconds)
+{
+    char *end;
+    unsigned long number = strtoul(text, &end, 10);
+    if (*text != '\0' && *end == '\0')
+    {
+        *seconds = number;
+        return 0;
+    }
+
+    struct tm local = {0};
+    int fields = sscanf(text, "%d-%d-%d %d:%d:%d", &local.tm_year, &local.tm_mon, &local.tm_mday,
+                        &local.tm_hour, &local.tm_min, &local.tm_sec);
+    if (fields != 3 && fields < 5)
+        return -1;
+
+    local.tm_year -= 1900;
+    local.tm_mon -= 1;
+    local.tm_isdst = -1;
+
+    time_t when = mktime(&local);
+    if (when < 0)
+        return -1;
+
+    *seconds = when;
+    return 0;
+}
+
+static void printTime(unsigned int seconds, unsigned int milliseconds)
+{
+    char timestamp[32];
+    time_t when = seconds;
+    strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", localtime(&when));
+    printf("%s.%03u", timestamp, milliseconds);
+}
+
+/**
+ * Shows how the output queues of the serial port and the RS422 ring are
+ * keeping up
+ **/
+int outputCommand(int sockfd)
+{
+    unsigned char byte = COMMAND_OUTPUT;
+    write(sockfd, &byte, 1);
+    if (!readResponse(sockfd))
+        return EXIT_FAILURE;
+
+    const char *names[] = {"serial", "ring"};
+    printf("%-7s %6s %6s %10s %8s %8s %8s %8s %10s %6s %9s\n", "queue", "depth", "max", "bytes", "frames",
+           "partial", "eagain", "waits", "waited", "drops", "port q");
+
+    for (int i = 0; i < 2; i++)
+    {
+        unsigned int stats[12];
+        for (int j = 0; j < 12; j++)
+        {
+            if (readNumber(sockfd, &stats[j]) < 0)
+                return EXIT_FAILURE;
+        }
+
+        printf("%-7s %6u %6u %10u %8u %8u %8u %8u %8uus %6u %4u/%4u\n", names[i], stats[0], stats[1], stats[2],
+               stats[3], stats[4], stats[5], stats[6], stats[7], stats[8], stats[10], stats[11]);
+    }
+
+    unsigned int forwarded, dropped;
+    if (readNumber(sockfd, &forwarded) < 0 || readNumber(sockfd, &dropped) < 0)
+        return EXIT_FAILURE;
+
+    if (forwarded)
+        printf("%u ring frames for other readers passed on\n", forwarded);
+    if (dropped)
+        printf("%u ring bytes dropped, a reader fell behind the host\n", dropped);
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Shows how many blank cards are ready, optionally changing how many are kept
+ **/
+int dispenserCommand(int sockfd, int argc, char *argv[])
+{
+    unsigned int capacity = 0xFFFFFFFF;
+
+    if (argc >= 3 && (strcmp(argv[2], "capacity") != 0 || argc < 4))
+    {
+        printf("usage: %s dispenser [capacity count]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (argc >= 4)
+        capacity = atoi(argv[3]);
+
+    unsigned char byte = COMMAND_DISPENSER;
+    write(sockfd, &byte, 1);
+    writeNumber(sockfd, capacity);
+
+    if (!readResponse(sockfd))
+        return EXIT_FAILURE;
+
+    unsigned int count, dispensed, empty, failed;
+    if (readNumber(sockfd, &count) < 0 || readNumber(sockfd, &capacity) < 0 || readNumber(sockfd, &dispensed) < 0 ||
+        readNumber(sockfd, &empty) < 0 || readNumber(sockfd, &failed) < 0)
+        return EXIT_FAILURE;
+
+    printf("    blanks: %u of %u\n", count, capacity);
+    printf(" dispensed: %u\n", dispensed);
+    printf("ran out of: %u\n", empty);
+    if (failed)
+        printf("    failed: %u blanks couldn't be made\n", failed);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Shows the versions of a card kept in the history, or the version it had
+ * at a given time
+ **/
+int historyCommand(int sockfd, int argc, char *argv[])
+{
+    unsigned int seconds = 0;
+
+    if (argc >= 4 && parseTime(argv[3], &seconds) < 0)
+    {
+        printf("Error: Couldn't understand the time '%s'\n", argv[3]);
+        return EXIT_FAILURE;
+    }
+
+    unsigned char byte = COMMAND_HISTORY;
+    write(sockfd, &byte, 1);
+    writeString(sockfd, argc >= 3 ? argv[2] : "");
+    writeNumber(sockfd, seconds);
+
+    if (!readResponse(sockfd))
+    {
+        printf("no history%s\n", argc >= 3 ? " for that card" : "");
+        return EXIT_FAILURE;
+    }
+
+    if (argc < 3)
+    {
+        unsigned int cards, versions, objects, deltas, kilobytes, deduplicated, dropped;
+        if (readNumber(sockfd, &cards) < 0 || readNumber(sockfd, &versions) < 0 ||
+            readNumber(sockfd, &objects) < 0 || readNumber(sockfd, &deltas) < 0 ||
+            readNumber(sockfd, &kilobytes) < 0 || readNumber(sockfd, &deduplicated) < 0 ||
+            readNumber(sockfd, &dropped) < 0)
+            return EXIT_FAILURE;
+
+        printf("       cards: %u\n", cards);
+        printf("    versions: %u\n", versions);
+        printf("      images: %u, %u stored as deltas\n", objects, deltas);
+        printf("        size: %ukB\n", kilobytes);
+        printf("deduplicated: %u\n", deduplicated);
+        printf("     dropped: %u\n", dropped);
+        return EXIT_SUCCESS;
+    }
+
+    unsigned int total, count;
+    if (readNumber(sockfd, &total) < 0 || readNumber(sockfd, &count) < 0)
+        return EXIT_FAILURE;
+
+    if (count < total)
+        printf("  (%u older versions not shown)\n", total - count);
+
+    for (unsigned int i = 0; i < count; i++)
+    {
+        unsigned int when, milliseconds, hashHigh, hashLow;
+        if (readNumber(sockfd, &when) < 0 || readNumber(sockfd, &milliseconds) < 0 ||
+            readNumber(sockfd, &hashHigh) < 0 || readNumber(sockfd, &hashLow) < 0)
+            return EXIT_FAILURE;
+
+        printf("  ");
+        printTime(when, milliseconds);
+        printf("  %08x%08x\n", hashHigh, hashLow);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Puts a card back to the version it had at a given time
+ **/
+int rollbackCommand(int sockfd, int argc, char *argv[])
+{
+    unsigned int seconds;
+
+    if (argc < 4)
+    {
+        printf("usage: %s rollback [path] [time]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (parseTime(argv[3], &seconds) < 0)
+    {
+        printf("Error: Couldn't understand the time '%s'\n", argv[3]);
+        return EXIT_FAILURE;
+    }
+
+    unsigned char byte = COMMAND_ROLLBACK;
+    write(sockfd, &byte, 1);
+    writeString(sockfd, argv[2]);
+    writeNumber(sockfd, seconds);
+
+    int success = readResponse(sockfd);
+    char error[256];
+
+    if (!success)
+    {
+        if (readString(sockfd, error) == 0)
+            printf("%s\n", error);
+        return EXIT_FAILURE;
+    }
+
+    unsigned int when, milliseconds;
+    if (readNumber(sockfd, &when) < 0 || readNumber(sockfd, &milliseconds) < 0)
+        return EXIT_FAILURE;
+
+    printf("%s rolled back to its version from ", argv[2]);
+    printTime(when, milliseconds);
+    printf("\n");
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Takes a snapshot of the card collection into a backup directory
+ **/
+int backupCommand(int sockfd, const char *destination)
+{
+    // cardd may well run from another directory
+    char path[256];
+    char directory[256];
+    if (destination[0] != '/' && getcwd(directory, sizeof(directory)))
+        snprintf(path, sizeof(path), "%s/%s", directory, destination);
+    else
+        snprintf(path, sizeof(path), "%s", destination);
+
+    unsigned char byte = COMMAND_BACKUP;
+    write(sockfd, &byte, 1);
+    writeString(sockfd, path);
+
+    int success = readResponse(sockfd);
+    char text[256];
+
+    if (readString(sockfd, text) < 0)
+        return EXIT_FAILURE;
+
+    if (!success)
+    {
+        printf("%s\n", text);
+        return EXIT_FAILURE;
+    }
+
+    unsigned int cards, copied, unchanged, skipped, milliseconds;
+    if (readNumber(sockfd, &cards) < 0 || readNumber(sockfd, &copied) < 0 || readNumber(sockfd, &unchanged) < 0 ||
+        readNumber(sockfd, &skipped) < 0 || readNumber(sockfd, &milliseconds) < 0)
+        return EXIT_FAILURE;
+
+    printf("snapshot %s\n", text);
+    printf("   cards: %u\n", cards);
+    printf("  copied: %u\n", copied);
+    printf("  reused: %u\n", unchanged);
+    if (skipped)
+        printf(" skipped: %u unreadable\n", skipped);
+    printf("    took: %.2fs\n", milliseconds / 1000.0);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Checks every card of a snapshot against its manifest, without cardd
+ **/
+int verifyCommand(int argc, char *argv[])
+{
+    Manifest manifest;
+    char error[256];
+
+    if (manifestRead(argv[2], argc >= 4 ? argv[3] : NULL, &manifest, error, sizeof(error)) < 0)
+    {
+        printf("%s\n", error);
+        return EXIT_FAILURE;
+    }
+
+    unsigned int good = 0, bad = 0, missing = 0;
+
+    for (unsigned int i = 0; i < manifest.count; i++)
+    {
+        ManifestCard *card = &manifest.cards[i];
+        char path[1024];
+        snprintf(path, sizeof(path), "%s/%s/cards/%s", argv[2], card->location, card->name);
+
+        unsigned char tracks[TRANSFER_TRACKS_SIZE + 1];
+        int fd = open(path, O_RDONLY);
+        if (fd < 0)
+        {
+            printf("missing %s\n", path);
+            missing++;
+            continue;
+        }
+
+        int length = read(fd, tracks, sizeof(tracks));
+        close(fd);
+
+        if (length != (int)card->size || transferChecksum(0, tracks, length) != card->crc)
+        {
+            printf("bad     %s\n", path);
+            bad++;
+            continue;
+        }
+        good++;
+    }
+
+    printf("snapshot %s: %u cards, %u good, %u bad, %u missing\n", manifest.snapshot, manifest.count, good, bad, missing);
+    manifestFree(&manifest);
+    return bad || missing ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/**
+ * Shows every field of a card as the game's schema lays it out, without cardd
+ **/
+int decodeCommand(const char *path)
+{
+    char *customSchemaPath = getenv("CARD_SCHEMA_PATH");
+    const char *game = configGameName(loadConfig()->game);
+    Schema schema;
+    char error[SCHEMA_ERROR_SIZE];
+
+    if (schemaLoad(&schema, customSchemaPath ? customSchemaPath : DEFAULT_SCHEMA_PATH, game, error) < 0)
+    {
+        printf("%s\n", error);
+        return EXIT_FAILURE;
+    }
+
+    unsigned char tracks[3][TRACK_SIZE];
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || transferReadAll(fd, tracks, sizeof(tracks)) < 0)
+    {
+        printf("Error: Couldn't read a card from %s\n", path);
+        if (fd >= 0)
+            close(fd);
+        return EXIT_FAILURE;
+    }
+    close(fd);
+
+    int width = 0;
+    for (int i = 0; i < schema.count; i++)
+    {
+        if (strlen(schema.fields[i].name) > width)
+            width = strlen(schema.fields[i].name);
+    }
+
+    for (int i = 0; i < schema.count; i++)
+    {
+        char value[SCHEMA_VALUE_SIZE];
+        schemaDecode(&schema.fields[i], tracks, value);
+        printf("%*s: %s\n", width, schema.fields[i].name, value);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Looks cards up by the contents of their indexed fields
+ *
+ * Each argument is a term, either field=words or just words to look for in
+ * any indexed field, and a card has to match every word.
+ **/
+int findCommand(int sockfd, int argc, char *argv[])
+{
+    char query[256] = "";
+    int length = 0;
+
+    for (int i = 2; i < argc; i++)
+        length += snprintf(query + length, length < sizeof(query) ? sizeof(query) - length : 0, "%s%s", i > 2 ? "\n" : "", argv[i]);
+
+    if (length >= sizeof(query))
+    {
+        printf("Error: The search is too long\n");
+        return EXIT_FAILURE;
+    }
+
+    unsigned char byte = COMMAND_FIND;
+    write(sockfd, &byte, 1);
+    writeString(sockfd, query);
+
+    int success = readResponse(sockfd);
+    char text[256];
+
+    if (!success)
+    {
+        if (readString(sockfd, text) == 0)
+            printf("%s\n", text);
+        return EXIT_FAILURE;
+    }
+
+    unsigned int ready, indexed, total, count;
+    if (readNumber(sockfd, &ready) < 0 || readNumber(sockfd, &indexed) < 0 || readNumber(sockfd, &total) < 0 ||
+        readNumber(sockfd, &count) < 0)
+        return EXIT_FAILURE;
+
+    for (unsigned int i = 0; i < count; i++)
+    {
+        char summary[256];
+        if (readString(sockfd, text) < 0 || readString(sockfd, summary) < 0)
+            return EXIT_FAILURE;
+        printf("%s\n  %s\n", text, summary);
+    }
+
+    if (count < total)
+        printf("(%u more not shown)\n", total - count);
+    printf("%u of %u cards match\n", total, indexed);
+    if (!ready)
+        printf("The collection is still being indexed, try again shortly for every match\n");
+
+    return total ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * Shows the card in the reader as it was last loaded or saved
+ **/
+int cardCommand(int sockfd)
+{
+    unsigned char byte = COMMAND_CARD;
+    write(sockfd, &byte, 1);
+
+    unsigned int version;
+    unsigned char tracks[3][TRACK_SIZE];
+    if (!readResponse(sockfd) || readNumber(sockfd, &version) < 0 || readExactly(sockfd, tracks, sizeof(tracks)) < 0)
+        return EXIT_FAILURE;
+
+    printf("version %u\n", version);
+    for (int track = 0; track < 3; track++)
+    {
+        for (int offset = 0; offset < TRACK_SIZE; offset += 23)
+        {
+            printf(offset ? "         " : "track %d: ", track + 1);
+            for (int i = offset; i < offset + 23 && i < TRACK_SIZE; i++)
+                printf("%02x", tracks[track][i]);
+            printf("\n");
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Shows how many sessions were logged and dropped since cardd started
+ **/
+int sessionsCommand(int sockfd)
+{
+    unsigned char byte = COMMAND_SESSIONS;
+    write(sockfd, &byte, 1);
+
+    unsigned int logged, dropped;
+    if (!readResponse(sockfd))
+    {
+        printf("the session log is off\n");
+        return EXIT_FAILURE;
+    }
+
+    if (readNumber(sockfd, &logged) < 0 || readNumber(sockfd, &dropped) < 0)
+        return EXIT_FAILURE;
+
+    printf(" logged: %u\n", logged);
+    printf("dropped: %u\n", dropped);
+
+    return EXIT_SUCCESS;
+}
 
 int main(int argc, char *argv[])
 {
+    // Sends the command to another reader on the ring
+    if (argc >= 3 && strcmp(argv[1], "--node") == 0)
+    {
+        selectedNode = atoi(argv[2]);
+        argv[2] = argv[0];
+        argv += 2;
+        argc -= 2;
+    }
+
     if (argc < 2)
     {
-        printf("usage: %s [option]\n", argv[0]);
+        printf("usage: %s [--node n] [option]\n", argv[0]);
         printf(" options:\n");
+        printf("  --node n       | Sends the option to reader n on the ring instead of reader 0\n");
         printf("  status         | Gets the card reader status\n");
         printf("  insert [path]  | Inserts a new card at path\n");
         printf("  eject          | Ejects the card\n");
+        printf("  card           | Shows the tracks of the card in the reader\n");
+        printf("  queue add [path...]    | Queues cards to insert after each eject\n");
+        printf("  queue list             | Shows the queued cards\n");
+        printf("  queue move [from] [to] | Moves a queued card to another position\n");
+        printf("  queue remove [pos]     | Removes a card from the queue\n");
+        printf("  queue clear            | Empties the queue\n");
+        printf("  queue delay [ms]       | Sets the delay before the next card goes in\n");
+        printf("  fault add [opcode] [type] [percent] [value] | Injects a fault into replies\n");
+        printf("  fault list             | Shows the faults and how long the host took to recover\n");
+        printf("  fault clear            | Removes every fault\n");
+        printf("  dispenser [capacity n] | Shows the blank cards ready to dispense\n");
+        printf("  history [path] [time]  | Shows the saved versions of a card, or the one it had at a time\n");
+        printf("  rollback [path] [time] | Puts a card back to the version it had at a time\n");
+        printf("  sessions       | Shows how many sessions were logged and dropped\n");
+        printf("  reload         | Reloads the configuration file\n");
+        printf("  output         | Shows the output queue depths and drops\n");
+        printf("  deadlines      | Shows replies that came close to or missed the host's deadline\n");
+        printf("  export [file]  | Streams every card in the collection to a file\n");
+        printf("  import [file]  | Streams an exported file back into the collection\n");
+        printf("  backup [dir]   | Adds a snapshot of the collection to a backup, copying only changed cards\n");
+        printf("  verify [dir] [snapshot] | Checks the cards of a backup snapshot against its manifest\n");
+        printf("  find [field=]words...   | Finds the cards whose indexed fields have every word\n");
+        printf("  decode [path]  | Shows the fields of a card as the game's schema lays them out\n");
         printf("  version        | Gets the version number of the cardctl program\n");
         return EXIT_SUCCESS;
     }
@@ -28,25 +1207,30 @@ int main(int argc, char *argv[])
         return EXIT_SUCCESS;
     }
 
-    int sockfd, connfd;
-    struct sockaddr_in servaddr, cli;
-
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0)
+    // Backups are checked straight from disk, cardd needn't be running
+    if (strcmp(argv[1], "verify") == 0)
     {
-        printf("Error: Failed to open socket");
-        return EXIT_FAILURE;
+        if (argc < 3)
+        {
+            printf("usage: %s verify [dir] [snapshot]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+        return verifyCommand(argc, argv);
     }
 
-    bzero(&servaddr, sizeof(servaddr));
-
-    servaddr.sin_family = AF_INET;
-    servaddr.sin_addr.s_addr = inet_addr("127.0.0.1");
-    servaddr.sin_port = htons(PORT);
+    if (strcmp(argv[1], "decode") == 0)
+    {
+        if (argc < 3)
+        {
+            printf("usage: %s decode [path]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+        return decodeCommand(argv[2]);
+    }
 
-    if (connect(sockfd, (struct sockaddr *)&servaddr, sizeof(servaddr)) != 0)
+    int sockfd = connectToDaemon();
+    if (sockfd < 0)
     {
-        printf("Cannot connect to cardd on port %d, is it running?\n", PORT);
         return EXIT_FAILURE;
     }
 
@@ -89,10 +1273,11 @@ int main(int argc, char *argv[])
 
         write(sockfd, argv[2], length);
 
-        read(sockfd, &byte, 1);
-        if (byte != COMMAND_SUCCESS)
+        // Fails when the card is in use in another cabinet
+        if (!readResponse(sockfd))
         {
-            printf("Command failed\n");
+            close(sockfd);
+            return EXIT_FAILURE;
         }
         printf("card inserted\n");
         close(sockfd);
@@ -115,6 +1300,122 @@ int main(int argc, char *argv[])
         return EXIT_SUCCESS;
     }
 
+    if ((strcmp(argv[1], "export") == 0 || strcmp(argv[1], "import") == 0 || strcmp(argv[1], "backup") == 0 ||
+         strcmp(argv[1], "find") == 0) && argc < 3)
+    {
+        const char *argument = strcmp(argv[1], "backup") == 0 ? "[dir]" : strcmp(argv[1], "find") == 0 ? "[field=]words..." : "[file]";
+        printf("usage: %s %s %s\n", argv[0], argv[1], argument);
+        close(sockfd);
+        return EXIT_FAILURE;
+    }
+
+    if (strcmp(argv[1], "reload") == 0)
+    {
+        unsigned char byte = COMMAND_RELOAD;
+        write(sockfd, &byte, 1);
+
+        int success = readResponse(sockfd);
+        char error[256];
+        if (!success && readString(sockfd, error) == 0)
+            printf("%s\n", error);
+        else if (success)
+            printf("configuration reloaded\n");
+
+        close(sockfd);
+        return success ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (strcmp(argv[1], "output") == 0)
+    {
+        int result = outputCommand(sockfd);
+        close(sockfd);
+        return result;
+    }
+
+    if (strcmp(argv[1], "deadlines") == 0)
+    {
+        int result = deadlinesCommand(sockfd);
+        close(sockfd);
+        return result;
+    }
+
+    if (strcmp(argv[1], "export") == 0)
+    {
+        int result = exportCommand(sockfd, argv[2]);
+        close(sockfd);
+        return result;
+    }
+
+    if (strcmp(argv[1], "import") == 0)
+    {
+        int result = importCommand(sockfd, argv[2]);
+        close(sockfd);
+        return result;
+    }
+
+    if (strcmp(argv[1], "find") == 0)
+    {
+        int result = findCommand(sockfd, argc, argv);
+        close(sockfd);
+        return result;
+    }
+
+    if (strcmp(argv[1], "card") == 0)
+    {
+        int result = cardCommand(sockfd);
+        close(sockfd);
+        return result;
+    }
+
+    if (strcmp(argv[1], "backup") == 0)
+    {
+        int result = backupCommand(sockfd, argv[2]);
+        close(sockfd);
+        return result;
+    }
+
+    if (strcmp(argv[1], "dispenser") == 0)
+    {
+        int result = dispenserCommand(sockfd, argc, argv);
+        close(sockfd);
+        return result;
+    }
+
+    if (strcmp(argv[1], "history") == 0)
+    {
+        int result = historyCommand(sockfd, argc, argv);
+        close(sockfd);
+        return result;
+    }
+
+    if (strcmp(argv[1], "sessions") == 0)
+    {
+        int result = sessionsCommand(sockfd);
+        close(sockfd);
+        return result;
+    }
+
+    if (strcmp(argv[1], "rollback") == 0)
+    {
+        int result = rollbackCommand(sockfd, argc, argv);
+        close(sockfd);
+        return result;
+    }
+
+    if (strcmp(argv[1], "fault") == 0)
+    {
+        int result = faultCommand(sockfd, argc, argv);
+        close(sockfd);
+        return result;
+    }
+
+    if (strcmp(argv[1], "queue") == 0)
+    {
+        int result = queueCommand(sockfd, argc, argv);
+        close(sockfd);
+        return result;
+    }
+
     printf("Error: Unknown option '%s'\n", argv[1]);
 
     close(sockfd);
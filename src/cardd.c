@@ -1,116 +1,74 @@
+#include <errno.h>
 #include <fcntl.h>
-#include <linux/serial.h>
 #include <netinet/in.h>
 #include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "backup.h"
+#include "cardd.h"
+#include "clock.h"
+#include "collection.h"
 #include "common.h"
+#include "config.h"
+#include "dispenser.h"
+#include "fault.h"
+#include "history.h"
+#include "image.h"
+#include "job.h"
+#include "link.h"
+#include "output.h"
+#include "probes.h"
+#include "queue.h"
+#include "schema.h"
+#include "search.h"
+#include "service.h"
+#include "session.h"
+#include "simulation.h"
+#include "snapshot.h"
+#include "timerwheel.h"
+#include "uring.h"
+#include "watchdog.h"
 
 #define TIMEOUT_SELECT 1000
-#define BUFFER_SIZE 1024
-
-unsigned char inputBuffer[BUFFER_SIZE];
-unsigned char outputBuffer[BUFFER_SIZE];
+#define CONTROL_BUFFER_SIZE 16384
 
 int serialIO = -1;
 
-/* Card Status Definitions */
-#define STATUS_NO_CARD 0x30
-#define STATUS_HAS_CARD_1 0x31
-#define STATUS_CARD_ERROR 0x32
-#define STATUS_HAS_CARD_2 0x33
-#define STATUS_EJECTING_CARD 0x34
-
-/* Reader Status Definitions */
-#define STATUS_NO_ERR 0x30
-#define STATUS_READ_ERR 0x31
-#define STATUS_WRITE_ERR 0x32
-#define STATUS_CARD_JAM 0x33
-#define STATUS_MOTOR_ERR 0x34
-#define STATUS_PRINT_ERR 0x35
-#define STATUS_ILLEGAL_ERR 0x38
-#define STATUS_BATTERY_ERR 0x40
-#define STATUS_SYSTEM_ERR 0x41
-#define STATUS_TRACK_1_READ_ERR 0x51
-#define STATUS_TRACK_2_READ_ERR 0x52
-#define STATUS_TRACK_3_READ_ERR 0x53
-#define STATUS_TRACK_1_AND_2_READ_ERR 0x54
-#define STATUS_TRACK_1_AND_3_READ_ERR 0x55
-#define STATUS_TRACK_2_AND_3_READ_ERR 0x56
-
-/* Job Status Definitions */
-#define STATUS_NO_JOB 0x30
-#define STATUS_ILLEGAL_COMMAND 0x32
-#define STATUS_RUNNING_COMMAND 0x33
-#define STATUS_WAITING_FOR_CARD 0x34
-#define STATUS_DISPENSER_EMPTY 0x35
-#define STATUS_NO_DISPENSER 0x36
-#define STATUS_CARD_FULL 0x37
-
-/* Protocol Symbolic Bytes */
-#define START_OF_TEXT 0x02
-#define END_OF_TEXT 0x03
-#define ENQUIRY 0x05
-#define ACK 0x06
-
-/* Command Bytes */
-#define INIT 0x10
-#define REGISTER_FONT 0x7A
-#define GET_STATUS 0x20
-#define SET_SHUTTER 0xD0
-#define CLEAN_CARD 0xA0
-#define EJECT_CARD 0x80
-#define READ 0x33
-#define WRITE 0x53
-#define ERASE 0x7D
-#define PRINT 0x7C
-#define SET_PRINT_PARAM 0x78
-#define NEW_CARD 0xB0
-#define CANCEL 0x40
-
-/* Data sizes */
-#define TRACK_SIZE 69
-
-/* Default Paths */
-#define DEFAULT_SERIAL_PATH "/dev/ttyUSB0"
-
-typedef enum
-{
-	DERBY_OWNERS_CLUB,
-	DERBY_OWNERS_CLUB_RS232,
-	WANGAN_MIDNIGHT_MAXIMUM_TUNE_3,
-	F_ZERO_AX,
-	F_ZERO_AX_MONSTER_RIDE,
-	MARIO_KART_ARCADE_GP,
-	MARIO_KART_ARCADE_GP_2,
-	INITIAL_D,
-} Game;
-
-typedef enum
-{
-	NOT_INSERTED,
-	INSERTED_IN_FRONT,
-	UNDER_PRINT_HEAD,
-	UNDER_READER,
-	DISPENCING_FROM_BACK,
-	EJECTING_CARD,
-} CardPosition;
-
-typedef struct
-{
-	CardPosition cardPosition;
-	int dispenserFull;
-	int coverClosed;
-	unsigned char readerStatus;
-	unsigned char jobStatus;
-} CardReader;
+/* Set when the host is a simulation script rather than a serial port */
+int simulationMode = 0;
+
+/* Card transport timings of each game's reader */
+MotionProfile motionProfiles[] = {
+	[DERBY_OWNERS_CLUB] = {400, 350, 1200, 1600, 2500},
+	[DERBY_OWNERS_CLUB_RS232] = {400, 350, 1200, 1600, 2500},
+	[WANGAN_MIDNIGHT_MAXIMUM_TUNE_3] = {350, 300, 1000, 1400, 2500},
+	[F_ZERO_AX] = {300, 300, 900, 1400, 2000},
+	[F_ZERO_AX_MONSTER_RIDE] = {300, 300, 900, 1400, 2000},
+	[MARIO_KART_ARCADE_GP] = {300, 300, 900, 1400, 2000},
+	[MARIO_KART_ARCADE_GP_2] = {300, 300, 900, 1400, 2000},
+	[INITIAL_D] = {350, 300, 1000, 1400, 2500},
+};
+
+/* How long each game waits for the reply to a frame before giving up */
+unsigned int replyBudgetsUs[] = {
+	[DERBY_OWNERS_CLUB] = 20000,
+	[DERBY_OWNERS_CLUB_RS232] = 20000,
+	[WANGAN_MIDNIGHT_MAXIMUM_TUNE_3] = 15000,
+	[F_ZERO_AX] = 15000,
+	[F_ZERO_AX_MONSTER_RIDE] = 15000,
+	[MARIO_KART_ARCADE_GP] = 15000,
+	[MARIO_KART_ARCADE_GP_2] = 15000,
+	[INITIAL_D] = 15000,
+};
 
 typedef struct
 {
@@ -120,57 +78,465 @@ typedef struct
 
 typedef struct
 {
-	CardReader *reader;
+	int port;
 } ControlThreadArguments;
 
+/**
+ * Bytes the ring thread has taken off the ring for a node
+ *
+ * arrivedNs is when the oldest byte still in the buffer arrived, so a
+ * frame is timed from when the host sent it rather than when the node got
+ * round to reading it.
+ **/
 typedef struct
 {
 	unsigned char buffer[BUFFER_SIZE];
 	int head;
 	int tail;
+	unsigned long long arrivedNs;
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
 } CircularBuffer;
 
-CircularBuffer rs422InputBuffer;
-CircularBuffer rs422OutputBuffer;
+/**
+ * One emulated reader and the buffers between it and the host
+ *
+ * Each node runs its own protocol loop. On the RS422 ring every node has
+ * its own address, the bytes the host sent it and the replies waiting for
+ * the host to poll them off the ring. On a plain serial port there is
+ * only node 0, which reads and writes the port itself.
+ **/
+typedef struct
+{
+	int ring;
+	CircularBuffer input;
+	unsigned long long inputArrivedNs;
+	OutputQueue output;
+	int corruptChecksum;
+	CardReader reader;
+	pthread_t thread;
+} Node;
+
+Node nodes[RING_NODES_MAX];
+int nodeCount = 1;
+
+typedef struct
+{
+	Node *node;
+	Config *config;
+	int *running;
+} NodeThreadArguments;
+
+/* Guards the configuration shared by the nodes while node 0 replaces it */
+static pthread_mutex_t configLock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int configGeneration = 0;
+
+/* Ring frames that weren't for any node and were passed on */
+unsigned long long ringForwarded = 0;
 
-char cardPath[256];
+/* Ring data bytes dropped because their node's input was full */
+unsigned long long ringDropped = 0;
 
-unsigned char tracks[3][TRACK_SIZE];
+/* Bytes waiting for room in the serial port */
+OutputQueue serialOutput;
 
-void saveCardToFile() {
-    FILE *file = fopen(cardPath, "wb");
+TimerWheel timerWheel;
+
+/**
+ * Writes a card file with stdio, the path without io_uring
+ *
+ * @returns The number of bytes written, or -1 if the file couldn't be opened
+ **/
+static int saveCardPosix(const char *path, unsigned char tracks[3][TRACK_SIZE]) {
+    FILE *file = fopen(path, "wb");
 
     if (file == NULL) {
-        perror("Error: Couldn't open file for writing");
-        return;
+        return -1;
     }
 
     size_t written = fwrite(tracks, sizeof(unsigned char), 3 * TRACK_SIZE, file);
+
+    fclose(file);
+
+    return (int)written;
+}
+
+/**
+ * Reads a card file with stdio, the path without io_uring
+ *
+ * @returns The number of bytes read, or -1 if the file couldn't be opened
+ **/
+static int loadCardPosix(const char *path, unsigned char tracks[3][TRACK_SIZE]) {
+    FILE *file = fopen(path, "rb");
+
+    if (file == NULL) {
+        return -1;
+    }
+
+    size_t read = fread(tracks, sizeof(unsigned char), 3 * TRACK_SIZE, file);
+
+    fclose(file);
+
+    return (int)read;
+}
+
+/**
+ * Writes the tracks out as the card at path
+ *
+ * @returns 0 on success, -1 if the card couldn't be saved
+ **/
+static int writeCard(CardReader *reader, const char *path, unsigned char tracks[3][TRACK_SIZE]) {
+    PROBE2(card__save__start, reader->id, path);
+
+    // The card service holds the lease and writes the card out in its next batch
+    if (serviceEnabled()) {
+        if (serviceSave(path, tracks) < 0) {
+            PROBE3(card__save__done, reader->id, path, -1);
+            return -1;
+        }
+
+        PROBE3(card__save__done, reader->id, path, 3 * TRACK_SIZE);
+        return 0;
+    }
+
+    // With io_uring the card is also on disk by the time this returns, if
+    // io_uring gives up part way through the card is written directly
+    int written = uringFilesEnabled() ? uringSaveCard(path, tracks[0], 3 * TRACK_SIZE) : -1;
+    if (!uringFilesEnabled())
+        written = saveCardPosix(path, tracks);
+
+    if (written < 0) {
+        perror("Error: Couldn't open file for writing");
+        PROBE3(card__save__done, reader->id, path, -1);
+        return -1;
+    }
+
     if (written != 3 * TRACK_SIZE) {
         printf("Error : Couldn't write tracks to file");
     }
 
-    fclose(file);
+    PROBE3(card__save__done, reader->id, path, written);
+
+    return written == 3 * TRACK_SIZE ? 0 : -1;
 }
 
-void loadCardFromFile() {
-    FILE *file = fopen(cardPath, "rb");
-    if (!file) {
+static int readCard(CardReader *reader, const char *path, unsigned char tracks[3][TRACK_SIZE]) {
+    PROBE2(card__load__start, reader->id, path);
+
+    if (serviceEnabled()) {
+        int result = serviceAcquire(path, tracks);
+        PROBE3(card__load__done, reader->id, path, result < 0 ? -1 : 3 * TRACK_SIZE);
+        return result;
+    }
+
+    int read = uringFilesEnabled() ? uringLoadCard(path, tracks[0], 3 * TRACK_SIZE) : -1;
+    if (!uringFilesEnabled())
+        read = loadCardPosix(path, tracks);
+    if (read < 0) {
+        PROBE3(card__load__done, reader->id, path, -1);
+
         printf("Error: Failed to open file for reading, creating a new card.\n");
 
 		for (int i = 0; i < 3; i++)
 				for (int j = 0; j < TRACK_SIZE; j++)
 					tracks[i][j] = 0x00;
 
-        return saveCardToFile();
+        writeCard(reader, path, tracks);
+        return 0;
     }
 
-    size_t read = fread(tracks, sizeof(unsigned char), 3 * TRACK_SIZE, file);
     if (read != 3 * TRACK_SIZE) {
         printf("Error: Failed to read complete data from file");
     }
 
-    fclose(file);
+    PROBE3(card__load__done, reader->id, path, read);
+
+    return 0;
+}
+
+/**
+ * Saves a card's tracks, on the protocol thread or a job worker
+ *
+ * Jobs pass the path and tracks they copied when they were prepared, so a
+ * card put in meanwhile is never written with another card's tracks.
+ *
+ * @returns 0 on success, -1 if the card couldn't be saved
+ **/
+int saveCardToFile(CardReader *reader, const char *path, unsigned char tracks[3][TRACK_SIZE])
+{
+	unsigned long long started = clockNowNs();
+	backupCardWriting(path);
+	int result = writeCard(reader, path, tracks);
+	backupCardWritten(path, tracks);
+	watchdogFileIo(reader, clockNowNs() - started);
+
+	if (cardCurrent(reader, path))
+		imagePublish(reader, tracks);
+	historyRecord(path, tracks);
+	searchCardSaved(path, tracks);
+
+	return result;
+}
+
+/**
+ * Loads the card at path into tracks, leaving reader->tracks alone
+ *
+ * With a card service this also takes the lease on the card.
+ *
+ * @returns 0 on success, -1 if the card is in use in another cabinet
+ **/
+int loadCard(CardReader *reader, const char *path, unsigned char tracks[3][TRACK_SIZE])
+{
+	unsigned long long started = clockNowNs();
+	int result = readCard(reader, path, tracks);
+	watchdogFileIo(reader, clockNowNs() - started);
+
+	if (result == 0)
+		cardLoaded(reader, path, tracks);
+
+	return result;
+}
+
+/**
+ * Hands the image a card was loaded with to the modules that keep the
+ * card as it was before this session changes it
+ **/
+void cardLoaded(CardReader *reader, const char *path, unsigned char tracks[3][TRACK_SIZE])
+{
+	if (cardCurrent(reader, path))
+		imagePublish(reader, tracks);
+	historyRecord(path, tracks);
+	backupCardLoaded(path, tracks);
+	searchCardSaved(path, tracks);
+}
+
+/**
+ * Loads the tracks of the card at reader->cardPath into the reader
+ *
+ * @returns 0 on success, -1 if the card is in use in another cabinet
+ **/
+int loadCardFromFile(CardReader *reader)
+{
+	char path[sizeof(reader->cardPath)];
+	pthread_mutex_lock(&reader->lock);
+	strcpy(path, reader->cardPath);
+	pthread_mutex_unlock(&reader->lock);
+
+	unsigned char tracks[3][TRACK_SIZE];
+	int result = loadCard(reader, path, tracks);
+
+	if (result == 0)
+	{
+		pthread_mutex_lock(&reader->lock);
+		if (strcmp(reader->cardPath, path) == 0)
+			memcpy(reader->tracks, tracks, sizeof(reader->tracks));
+		pthread_mutex_unlock(&reader->lock);
+	}
+
+	return result;
+}
+
+/**
+ * Whether path is still the card in the reader
+ **/
+int cardCurrent(CardReader *reader, const char *path)
+{
+	pthread_mutex_lock(&reader->lock);
+	int current = strcmp(reader->cardPath, path) == 0;
+	pthread_mutex_unlock(&reader->lock);
+
+	return current;
+}
+
+/**
+ * Reads a card image from a file without touching any reader
+ *
+ * @param path The path of the card file
+ * @param tracks The buffer to read the tracks into
+ * @returns 0 on success, -1 if the card couldn't be read
+ **/
+int readCardImage(const char *path, unsigned char tracks[3][TRACK_SIZE])
+{
+	// Cards are only read under a lease when there is a card service
+	if (serviceEnabled())
+		return -1;
+
+	FILE *file = fopen(path, "rb");
+	if (!file)
+		return -1;
+
+	size_t read = fread(tracks, sizeof(unsigned char), 3 * TRACK_SIZE, file);
+	fclose(file);
+
+	return read == 3 * TRACK_SIZE ? 0 : -1;
+}
+
+/**
+ * Replaces the image of a card that isn't in a reader
+ *
+ * With a card service the card is leased for the write, so this fails if
+ * the card is in use in another cabinet.
+ *
+ * @returns 0 on success, -1 on failure
+ **/
+int writeCardImage(const char *path, unsigned char tracks[3][TRACK_SIZE])
+{
+	if (serviceEnabled())
+	{
+		unsigned char current[3][TRACK_SIZE];
+		if (serviceAcquire(path, current) < 0)
+			return -1;
+
+		int result = serviceSave(path, tracks);
+		serviceRelease(path);
+		return result;
+	}
+
+	// Written alongside and renamed over so the card is never half written
+	char temporary[300];
+	snprintf(temporary, sizeof(temporary), "%s.rollback", path);
+
+	backupCardWriting(path);
+
+	FILE *file = fopen(temporary, "wb");
+	if (!file)
+		return -1;
+
+	// Synced before the rename so a crash can't leave an empty card behind
+	size_t written = fwrite(tracks, sizeof(unsigned char), 3 * TRACK_SIZE, file);
+	int synced = fflush(file) == 0 && fsync(fileno(file)) == 0;
+	if (fclose(file) != 0 || !synced || written != 3 * TRACK_SIZE || rename(temporary, path) < 0)
+	{
+		unlink(temporary);
+		return -1;
+	}
+
+	backupCardWritten(path, tracks);
+	return 0;
+}
+
+/**
+ * Called by the timer wheel when the card reaches the end of a movement
+ **/
+void motionComplete(void *data)
+{
+	CardReader *reader = (CardReader *)data;
+
+	pthread_mutex_lock(&reader->lock);
+
+	// The card was moved again before this movement finished
+	if (!reader->moving || reader->motionTimer.pending)
+	{
+		pthread_mutex_unlock(&reader->lock);
+		return;
+	}
+
+	reader->moving = 0;
+	reader->cardPosition = reader->motionTarget;
+	sessionCardMoved(reader);
+
+	if (reader->jobStatus == STATUS_RUNNING_COMMAND)
+		reader->jobStatus = STATUS_NO_JOB;
+
+	int removed = reader->cardPosition == NOT_INSERTED;
+	int ejected = removed && reader->lastCommand == EJECT_CARD;
+	if (removed)
+		printf("Info: Removing card\n");
+
+	char cardPath[sizeof(reader->cardPath)];
+	strcpy(cardPath, reader->cardPath);
+
+	snapshotSave(reader);
+
+	pthread_mutex_unlock(&reader->lock);
+
+	if (removed && serviceEnabled() && cardPath[0])
+		serviceRelease(cardPath);
+
+	if (ejected)
+		queueCardEjected(reader);
+}
+
+/**
+ * Moves the card through the card transport
+ *
+ * While the card is moving it sits at the transit position and the reader
+ * reports STATUS_RUNNING_COMMAND. Once the duration has elapsed on the timer
+ * wheel the card arrives at its target position and the job completes. Any
+ * movement still in progress is abandoned.
+ *
+ * @param reader The card reader whose card is moving
+ * @param transit The position reported while the card is moving
+ * @param target The position the card ends up in
+ * @param durationMs How long the movement takes, 0 to move instantly
+ **/
+void moveCard(CardReader *reader, CardPosition transit, CardPosition target, unsigned int durationMs)
+{
+	pthread_mutex_lock(&reader->lock);
+
+	if (durationMs == 0)
+	{
+		placeCard(reader, target);
+
+		char cardPath[sizeof(reader->cardPath)];
+		strcpy(cardPath, reader->cardPath);
+
+		pthread_mutex_unlock(&reader->lock);
+
+		if (target == NOT_INSERTED && serviceEnabled() && cardPath[0])
+			serviceRelease(cardPath);
+
+		if (target == NOT_INSERTED && reader->lastCommand == EJECT_CARD)
+			queueCardEjected(reader);
+		return;
+	}
+
+	timerWheelCancel(&timerWheel, &reader->motionTimer);
+	reader->motionTarget = target;
+	reader->moving = 1;
+	reader->cardPosition = transit;
+	sessionCardMoved(reader);
+	reader->jobStatus = STATUS_RUNNING_COMMAND;
+	timerWheelSchedule(&timerWheel, &reader->motionTimer, durationMs, motionComplete, reader);
+	snapshotSave(reader);
+
+	pthread_mutex_unlock(&reader->lock);
+}
+
+/**
+ * Puts the card straight into a position, abandoning any movement
+ *
+ * Called with reader->lock held, so a caller can check the position and
+ * change it without anything moving the card in between.
+ **/
+void placeCard(CardReader *reader, CardPosition position)
+{
+	timerWheelCancel(&timerWheel, &reader->motionTimer);
+	reader->motionTarget = position;
+	reader->moving = 0;
+	reader->cardPosition = position;
+	sessionCardMoved(reader);
+	snapshotSave(reader);
+}
+
+/**
+ * Puts a card into the front of the reader as if a player had inserted it
+ *
+ * @param reader The card reader the card goes into
+ * @param path The path of the card image
+ * @returns 0 on success, -1 if the card is in use in another cabinet
+ **/
+int insertCard(CardReader *reader, const char *path)
+{
+	pthread_mutex_lock(&reader->lock);
+	snprintf(reader->cardPath, sizeof(reader->cardPath), "%s", path);
+	pthread_mutex_unlock(&reader->lock);
+
+	if (loadCardFromFile(reader) < 0)
+		return -1;
+
+	moveCard(reader, INSERTED_IN_FRONT, INSERTED_IN_FRONT, 0);
+	return 0;
 }
 
 /**
@@ -235,10 +601,14 @@ char getCardStatus(CardReader *reader, int shutterMode)
 	return result;
 }
 
-int setSerialAttributes(int fd, int myBaud, int parity, int flow)
+/**
+ * Sets the line settings of the serial port
+ *
+ * @param when TCSANOW at startup, TCSADRAIN to let a reply finish first
+ **/
+void applySerialOptions(int fd, int myBaud, int parity, int flow, int when)
 {
 	struct termios options;
-	int status;
 	tcgetattr(fd, &options);
 
 	cfmakeraw(&options);
@@ -266,12 +636,20 @@ int setSerialAttributes(int fd, int myBaud, int parity, int flow)
 		options.c_cflag |= CRTSCTS;
 	}
 
-	// SET INTER BYTE TIMEOUTS TO 0
-	options.c_cc[VMIN] = 0;
+	// SET INTER BYTE TIMEOUTS TO 0, with one byte as the minimum so an
+	// empty port reports EAGAIN rather than end of file to io_uring
+	options.c_cc[VMIN] = 1;
 	options.c_cc[VTIME] = 0;
 
 	// SET OPTIONS
-	tcsetattr(fd, TCSANOW, &options);
+	tcsetattr(fd, when, &options);
+}
+
+int setSerialAttributes(int fd, int myBaud, int parity, int flow)
+{
+	int status;
+
+	applySerialOptions(fd, myBaud, parity, flow, TCSANOW);
 
 	/*
 	ioctl(fd, TIOCMGET, &status);
@@ -281,91 +659,112 @@ int setSerialAttributes(int fd, int myBaud, int parity, int flow)
 
 	ioctl(fd, TIOCMSET, &status);
 */
-	usleep(100 * 1000); // 10mS
-
-	struct serial_struct serial_settings;
-
-	ioctl(fd, TIOCGSERIAL, &serial_settings);
-
-	serial_settings.flags |= ASYNC_LOW_LATENCY;
-	ioctl(fd, TIOCSSERIAL, &serial_settings);
+	clockSleepUs(100 * 1000); // 10mS
 
 	tcflush(fd, TCIOFLUSH);
-	usleep(100 * 1000);
+	clockSleepUs(100 * 1000);
 
 	return 0;
 }
 
-int readBytes(unsigned char *buffer, int amount, int rs422Mode)
+/**
+ * Reads what has arrived for a node
+ *
+ * @param node The node on the ring to read for, or NULL or a node that
+ *             isn't on the ring to read the serial port itself
+ **/
+int readBytes(unsigned char *buffer, int amount, Node *node)
 {
-	if (rs422Mode)
+	if (simulationMode)
+		return simulationRead(buffer, amount);
+
+	if (node && node->ring)
 	{
-		if (rs422InputBuffer.head == rs422InputBuffer.tail)
+		CircularBuffer *input = &node->input;
+
+		pthread_mutex_lock(&input->lock);
+
+		// The ring thread wakes the node as soon as a byte arrives for it
+		if (input->head == input->tail)
 		{
-			usleep(TIMEOUT_SELECT * 1000);
-			return 0;
-		}
+			struct timespec until;
+			clock_gettime(CLOCK_REALTIME, &until);
+			until.tv_sec += TIMEOUT_SELECT / 1000;
+			until.tv_nsec += (TIMEOUT_SELECT % 1000) * 1000000L;
+			if (until.tv_nsec >= 1000000000L)
+			{
+				until.tv_sec++;
+				until.tv_nsec -= 1000000000L;
+			}
 
-		int size = BUFFER_SIZE + rs422InputBuffer.head - rs422InputBuffer.tail;
-		if (rs422InputBuffer.head >= rs422InputBuffer.tail)
-			size = rs422InputBuffer.head - rs422InputBuffer.tail;
+			while (input->head == input->tail && pthread_cond_timedwait(&input->ready, &input->lock, &until) == 0)
+				;
+		}
 
-		memcpy(buffer, &rs422InputBuffer.buffer[rs422InputBuffer.tail], size);
+		int size = 0;
+		while (input->tail != input->head && size < amount)
+		{
+			buffer[size++] = input->buffer[input->tail];
+			input->tail = input->tail + 1 == BUFFER_SIZE ? 0 : input->tail + 1;
+		}
+		node->inputArrivedNs = input->arrivedNs;
 
-		if (rs422InputBuffer.tail + size > BUFFER_SIZE)
-			rs422InputBuffer.tail = rs422InputBuffer.tail + size - BUFFER_SIZE;
-		else
-			rs422InputBuffer.tail += size;
+		pthread_mutex_unlock(&input->lock);
 
 		return size;
 	}
 
-	fd_set fd_serial;
+	// Also wake up when output that didn't fit in the port can go
+	int flushing = outputPending(&serialOutput) > 0;
+
+	if (uringSerialEnabled())
+	{
+		int writable;
+		int bytesRead = uringSerialRead(buffer, amount, TIMEOUT_SELECT, flushing, &writable);
+
+		if (writable)
+			outputFlush(&serialOutput);
+
+		return bytesRead;
+	}
+
+	fd_set fd_serial, fd_writable;
 	struct timeval tv;
 
 	FD_ZERO(&fd_serial);
 	FD_SET(serialIO, &fd_serial);
 
+	FD_ZERO(&fd_writable);
+	if (flushing)
+		FD_SET(serialIO, &fd_writable);
+
 	tv.tv_sec = 0;
 	tv.tv_usec = TIMEOUT_SELECT * 1000;
 
-	int filesReadyToRead = select(serialIO + 1, &fd_serial, NULL, NULL, &tv);
+	int filesReadyToRead = select(serialIO + 1, &fd_serial, flushing ? &fd_writable : NULL, NULL, &tv);
 
 	if (filesReadyToRead < 1)
 		return -1;
 
+	if (flushing && FD_ISSET(serialIO, &fd_writable))
+		outputFlush(&serialOutput);
+
 	if (!FD_ISSET(serialIO, &fd_serial))
-		return -1;
+		return flushing ? 0 : -1;
 
 	return read(serialIO, buffer, amount);
 }
 
-int writeBytes(unsigned char *buffer, int amount, int rs422Mode)
+int writeBytes(unsigned char *buffer, int amount, Node *node)
 {
 	if (amount < 1)
 		return 0;
 
-	if (rs422Mode)
-	{
-		if (rs422OutputBuffer.head + 1 == rs422OutputBuffer.tail)
-			return 0;
-
-		if (rs422OutputBuffer.head + amount > BUFFER_SIZE)
-		{
-			int firstPart = BUFFER_SIZE - rs422OutputBuffer.head;
-			int secondPart = amount - firstPart;
-			memcpy(&rs422OutputBuffer.buffer[rs422OutputBuffer.head], buffer, firstPart);
-			memcpy(&rs422OutputBuffer.buffer[0], buffer + firstPart, secondPart);
-			rs422OutputBuffer.head = secondPart;
-		}
-		else
-		{
-			memcpy(&rs422OutputBuffer.buffer[rs422OutputBuffer.head], buffer, amount);
-			rs422OutputBuffer.head += amount;
-		}
+	if (simulationMode)
+		return simulationWrite(buffer, amount);
 
-		return amount;
-	}
+	if (node && node->ring)
+		return outputWrite(&node->output, buffer, amount);
 
 	/*printf("writeBytes: ");
 	for (int i = 0; i < amount; i++)
@@ -374,7 +773,7 @@ int writeBytes(unsigned char *buffer, int amount, int rs422Mode)
 	}
 	printf("\n");*/
 
-	return write(serialIO, buffer, amount);
+	return outputWrite(&serialOutput, buffer, amount);
 }
 
 int closeDevice(int fd)
@@ -383,7 +782,7 @@ int closeDevice(int fd)
 	return close(fd) == 0;
 }
 
-int writePacket(unsigned char *packet, int length, int rs422Mode)
+int writePacket(unsigned char *packet, int length, Node *node)
 {
 	unsigned char outputPacket[BUFFER_SIZE];
 
@@ -403,9 +802,13 @@ int writePacket(unsigned char *packet, int length, int rs422Mode)
 	outputPacket[index++] = END_OF_TEXT;
 	checksum ^= outputPacket[index - 1];
 
-	outputPacket[index++] = checksum;
+	// Set by fault injection to send the next packet with a bad checksum
+	outputPacket[index++] = node->corruptChecksum ? ~checksum : checksum;
+	node->corruptChecksum = 0;
+
+	PROBE3(packet__transmit, packet[0], length, node->ring);
 
-	writeBytes(outputPacket, (length + 4), rs422Mode);
+	return writeBytes(outputPacket, (length + 4), node);
 }
 
 /**
@@ -416,22 +819,30 @@ int writePacket(unsigned char *packet, int length, int rs422Mode)
  * data byte.
  *
  * @param packet The address of the packet buffer to fill with the read packet
- * @param rs422Mode Set if reader is connected directly to the Naomi RS422 pins
+ * @param node The node to read for, on the ring if connected directly to the Naomi RS422 pins
  * @returns The length of the packet read
  * */
-int readPacket(unsigned char *packet, int rs422Mode)
+int readPacket(unsigned char *packet, Node *node)
 {
+	unsigned char inputBuffer[BUFFER_SIZE];
 	int bytesAvailable = 0, phase = 0, index = 0, dataIndex = 0, finished = 0;
 	unsigned char checksum = 0x00;
 	unsigned char length;
 
 	while (!finished)
 	{
-		int bytesRead = readBytes(inputBuffer + bytesAvailable, BUFFER_SIZE - bytesAvailable, rs422Mode);
+		int bytesRead = readBytes(inputBuffer + bytesAvailable, BUFFER_SIZE - bytesAvailable, node);
 
 		if (bytesRead < 0)
 			return -1;
 
+		if (bytesRead > 0)
+		{
+			if (bytesAvailable == 0)
+				watchdogFrameStart(&node->reader, node->ring ? node->inputArrivedNs : clockNowNs());
+			watchdogFrameRead(&node->reader);
+		}
+
 		bytesAvailable += bytesRead;
 
 		while ((index < bytesAvailable) && !finished)
@@ -442,6 +853,8 @@ int readPacket(unsigned char *packet, int rs422Mode)
 				if (inputBuffer[index] == ENQUIRY)
 				{
 					packet[0] = inputBuffer[index];
+					PROBE3(packet__receive, ENQUIRY, 1, node->ring);
+					watchdogFrameParsed(&node->reader);
 					return 1;
 				}
 				else if (inputBuffer[index] == START_OF_TEXT)
@@ -465,6 +878,7 @@ int readPacket(unsigned char *packet, int rs422Mode)
 				if (checksum != inputBuffer[index])
 				{
 					printf("Error: The checksums did not match.\n");
+					PROBE2(packet__checksum__error, checksum, inputBuffer[index]);
 					return -1;
 				}
 				finished = 1;
@@ -476,6 +890,9 @@ int readPacket(unsigned char *packet, int rs422Mode)
 		}
 	}
 
+	PROBE3(packet__receive, packet[0], length - 2, node->ring);
+	watchdogFrameParsed(&node->reader);
+
 	return length - 2;
 }
 
@@ -516,37 +933,155 @@ void getTrackIndex(unsigned char track, int *trackIndex)
 }
 
 /**
- * Listens for control commands from cardctl
+ * Copies the selected tracks from the card into a reply buffer
  *
- * This is a TCP control thread that listens for commands
- * from cardctl. When a command is received, it is parsed
- * and the appropriate action is taken such as insert/eject.
- */
-void *controlThread(void *vargp)
+ * @param reader The card reader holding the card
+ * @param trackIndex The track indexes as filled in by getTrackIndex
+ * @param data The buffer to append the track data to
+ * @returns The number of bytes copied into data
+ **/
+int readTracks(CardReader *reader, int *trackIndex, unsigned char *data)
 {
-	ControlThreadArguments *arguments = (ControlThreadArguments *)vargp;
-
-	int new_socket, opt = 1;
-	struct sockaddr_in address;
-	int addrlen = sizeof(address);
+	int length = 0;
 
-	int server_fd = socket(AF_INET, SOCK_STREAM, 0);
-
-	if (server_fd == 0)
+	for (int i = 0; i < 3; i++)
 	{
-		printf("Error: Failed to create socket\n");
-		return 0;
+		if (trackIndex[i] == -1)
+			continue;
+		for (int j = 0; j < TRACK_SIZE; j++)
+			data[length++] = reader->tracks[trackIndex[i]][j];
 	}
 
-	if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt, sizeof(opt)))
-	{
+	return length;
+}
+
+/**
+ * Copies track data from a write packet onto the selected tracks of the card
+ *
+ * @param reader The card reader holding the card
+ * @param trackIndex The track indexes as filled in by getTrackIndex
+ * @param data The track data, one TRACK_SIZE block per selected track
+ * @returns The number of bytes consumed from data
+ **/
+int writeTracks(CardReader *reader, int *trackIndex, unsigned char *data)
+{
+	int length = 0;
+
+	for (int i = 0; i < 3; i++)
+	{
+		if (trackIndex[i] == -1)
+			continue;
+		for (int j = 0; j < TRACK_SIZE; j++)
+			reader->tracks[trackIndex[i]][j] = data[length++];
+	}
+
+	return length;
+}
+
+/**
+ * Reads a length prefixed string sent by cardctl
+ *
+ * @param socket The control connection
+ * @param string The buffer to read into, at least 256 bytes
+ * @returns 0 on success, -1 if the string was cut short
+ **/
+int readControlString(int socket, char *string)
+{
+	unsigned char length = 0;
+
+	if (read(socket, &length, 1) != 1)
+		return -1;
+
+	int received = 0;
+	while (received < length)
+	{
+		int bytesRead = read(socket, string + received, length - received);
+		if (bytesRead < 1)
+			return -1;
+		received += bytesRead;
+	}
+
+	string[length] = '\0';
+	return 0;
+}
+
+/**
+ * Reads a 32 bit number in network byte order sent by cardctl
+ *
+ * @returns 0 on success, -1 if the number was cut short
+ **/
+int readControlNumber(int socket, unsigned int *number)
+{
+	unsigned char bytes[4];
+	int received = 0;
+
+	while (received < 4)
+	{
+		int bytesRead = read(socket, bytes + received, 4 - received);
+		if (bytesRead < 1)
+			return -1;
+		received += bytesRead;
+	}
+
+	*number = (bytes[0] << 24) | (bytes[1] << 16) | (bytes[2] << 8) | bytes[3];
+	return 0;
+}
+
+/**
+ * Appends a 32 bit number in network byte order to a control response
+ **/
+int writeControlNumber(unsigned char *buffer, unsigned int number)
+{
+	buffer[0] = number >> 24;
+	buffer[1] = number >> 16;
+	buffer[2] = number >> 8;
+	buffer[3] = number;
+	return 4;
+}
+
+/**
+ * Appends a length prefixed string to a control response
+ **/
+int writeControlString(unsigned char *buffer, const char *string)
+{
+	int length = strlen(string);
+	buffer[0] = length;
+	memcpy(buffer + 1, string, length);
+	return length + 1;
+}
+
+/**
+ * Listens for control commands from cardctl
+ *
+ * This is a TCP control thread that listens for commands
+ * from cardctl. When a command is received, it is parsed
+ * and the appropriate action is taken such as insert/eject.
+ */
+void *controlThread(void *vargp)
+{
+	ControlThreadArguments *arguments = (ControlThreadArguments *)vargp;
+
+	int new_socket, opt = 1;
+	struct sockaddr_in address;
+	int addrlen = sizeof(address);
+
+	int server_fd = socket(AF_INET, SOCK_STREAM, 0);
+
+	if (server_fd == 0)
+	{
+		printf("Error: Failed to create socket\n");
+		return 0;
+	}
+
+	if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt, sizeof(opt)))
+	{
 		printf("Error: Failed to set socket options\n");
 		return 0;
 	}
 
 	address.sin_family = AF_INET;
 	address.sin_addr.s_addr = INADDR_ANY;
-	address.sin_port = htons(PORT);
+	address.sin_port = htons(arguments->port);
 
 	if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0)
 	{
@@ -564,6 +1099,10 @@ void *controlThread(void *vargp)
 	{
 		if ((new_socket = accept(server_fd, (struct sockaddr *)&address, (socklen_t *)&addrlen)) < 0)
 		{
+			// A SIGHUP landing on this thread interrupts the wait
+			if (errno == EINTR)
+				continue;
+
 			printf("Error: Failed to accept\n");
 			return 0;
 		}
@@ -571,23 +1110,44 @@ void *controlThread(void *vargp)
 		unsigned char control = 0;
 		int bytesRead = read(new_socket, &control, 1);
 
+		// Commands go to node 0 unless the connection picks another reader first
+		Node *node = &nodes[0];
+		if (bytesRead == 1 && control == COMMAND_NODE)
+		{
+			unsigned char address = 0;
+			if (read(new_socket, &address, 1) != 1 || address >= nodeCount)
+			{
+				unsigned char failure = COMMAND_FAILURE;
+				write(new_socket, &failure, 1);
+				close(new_socket);
+				continue;
+			}
+
+			node = &nodes[address];
+			bytesRead = read(new_socket, &control, 1);
+		}
+
 		if (bytesRead < 1)
 		{
 			close(new_socket);
 			continue;
 		}
 
+		CardReader *reader = &node->reader;
+
 		unsigned char response = COMMAND_SUCCESS;
 
-		unsigned char responseBuffer[BUFFER_SIZE];
-		unsigned char responseLength = 0;
+		unsigned char responseBuffer[CONTROL_BUFFER_SIZE];
+		int responseLength = 0;
+
+		PROBE1(control__command, control);
 
 		switch (control)
 		{
 		case COMMAND_GET_STATUS:
 		{
-			printf("COMMAND GET STATUS %d\n", arguments->reader->cardPosition);
-			if (arguments->reader->cardPosition != NOT_INSERTED)
+			printf("COMMAND GET STATUS %d\n", reader->cardPosition);
+			if (reader->cardPosition != NOT_INSERTED)
 			{
 				responseBuffer[responseLength++] = COMMAND_STATUS_CARD_INSERTED;
 			} else {
@@ -613,51 +1173,507 @@ void *controlThread(void *vargp)
 			read(new_socket, &filePath, length);
 			
 
-			strcpy(cardPath, filePath);
-			printf("File path updated %s\n", cardPath);
-
-			loadCardFromFile();
-
-			arguments->reader->cardPosition = INSERTED_IN_FRONT;
+			if (insertCard(reader, (char *)filePath) < 0)
+			{
+				response = COMMAND_FAILURE;
+				break;
+			}
+			printf("File path updated %s\n", reader->cardPath);
 		}
 		break;
 			
 		case COMMAND_EJECT_CARD:
 			printf("COMMAND EJECT CARD\n");
-			arguments->reader->cardPosition = NOT_INSERTED;
+			moveCard(reader, NOT_INSERTED, NOT_INSERTED, 0);
+			break;
+
+		case COMMAND_QUEUE_ADD:
+		{
+			printf("COMMAND QUEUE ADD\n");
+			char filePath[256];
+
+			if (readControlString(new_socket, filePath) < 0 || queueAdd(reader, filePath) < 0)
+			{
+				response = COMMAND_FAILURE;
+				break;
+			}
+
+			printf("Queued %s\n", filePath);
+		}
+		break;
+
+		case COMMAND_QUEUE_LIST:
+		{
+			printf("COMMAND QUEUE LIST\n");
+			CardQueue *queue = reader->queue;
+
+			pthread_mutex_lock(&queue->lock);
+			responseLength += writeControlNumber(&responseBuffer[responseLength], queue->delayMs);
+			responseBuffer[responseLength++] = queue->pending;
+			if (queue->pending)
+				responseLength += writeControlString(&responseBuffer[responseLength], queue->preloadedPath);
+			responseBuffer[responseLength++] = queue->count;
+			for (int i = 0; i < queue->count; i++)
+				responseLength += writeControlString(&responseBuffer[responseLength], queue->paths[i]);
+			pthread_mutex_unlock(&queue->lock);
+		}
+		break;
+
+		case COMMAND_QUEUE_MOVE:
+		{
+			printf("COMMAND QUEUE MOVE\n");
+			unsigned char positions[2];
+
+			if (read(new_socket, positions, 2) != 2 || queueMove(reader, positions[0], positions[1]) < 0)
+				response = COMMAND_FAILURE;
+		}
+		break;
+
+		case COMMAND_QUEUE_REMOVE:
+		{
+			printf("COMMAND QUEUE REMOVE\n");
+			unsigned char position;
+
+			if (read(new_socket, &position, 1) != 1 || queueRemove(reader, position) < 0)
+				response = COMMAND_FAILURE;
+		}
+		break;
+
+		case COMMAND_QUEUE_CLEAR:
+			printf("COMMAND QUEUE CLEAR\n");
+			queueClear(reader);
 			break;
 
+		case COMMAND_QUEUE_DELAY:
+		{
+			printf("COMMAND QUEUE DELAY\n");
+			unsigned int delayMs;
+
+			if (readControlNumber(new_socket, &delayMs) < 0)
+			{
+				response = COMMAND_FAILURE;
+				break;
+			}
+
+			queueSetDelay(reader, delayMs);
+		}
+		break;
+
+		case COMMAND_DEADLINES:
+		{
+			printf("COMMAND DEADLINES\n");
+			WatchdogReport report;
+			watchdogGetReport(reader, &report);
+
+			responseLength += writeControlNumber(&responseBuffer[responseLength], report.budgetUs);
+			responseLength += writeControlNumber(&responseBuffer[responseLength], report.transactions);
+			responseLength += writeControlNumber(&responseBuffer[responseLength], report.nearMisses);
+			responseLength += writeControlNumber(&responseBuffer[responseLength], report.misses);
+			responseLength += writeControlNumber(&responseBuffer[responseLength], report.worstUs);
+			responseBuffer[responseLength++] = report.count;
+
+			for (int i = 0; i < report.count; i++)
+			{
+				WatchdogMiss *miss = &report.log[i];
+				responseLength += writeControlNumber(&responseBuffer[responseLength], miss->when);
+				responseBuffer[responseLength++] = miss->opcode;
+				responseLength += writeControlNumber(&responseBuffer[responseLength], miss->totalUs);
+				for (int phase = 0; phase < WATCHDOG_PHASES; phase++)
+					responseLength += writeControlNumber(&responseBuffer[responseLength], miss->phaseUs[phase]);
+			}
+		}
+		break;
+
+		case COMMAND_RELOAD:
+		{
+			printf("COMMAND RELOAD\n");
+			Config next;
+			char error[CONFIG_ERROR_SIZE];
+
+			// Check the file here so cardctl can say what is wrong with it
+			if (configLoad(&next, error) < 0)
+			{
+				response = COMMAND_FAILURE;
+				responseLength += writeControlString(&responseBuffer[responseLength], error);
+				break;
+			}
+
+			configRequestReload();
+		}
+		break;
+
+		case COMMAND_FAULT_ADD:
+		{
+			printf("COMMAND FAULT ADD\n");
+			FaultRule rule;
+			unsigned char type;
+
+			if (readControlNumber(new_socket, &rule.opcode) < 0 || read(new_socket, &type, 1) != 1 ||
+				readControlNumber(new_socket, &rule.probability) < 0 || readControlNumber(new_socket, &rule.value) < 0)
+			{
+				response = COMMAND_FAILURE;
+				break;
+			}
+
+			rule.type = type;
+			if (faultAdd(reader, &rule) < 0)
+				response = COMMAND_FAILURE;
+		}
+		break;
+
+		case COMMAND_FAULT_LIST:
+		{
+			printf("COMMAND FAULT LIST\n");
+			FaultRule rules[FAULT_RULES];
+			FaultStats stats;
+
+			int count = faultRules(reader, rules);
+			faultGetStats(reader, &stats);
+
+			responseBuffer[responseLength++] = count;
+			for (int i = 0; i < count; i++)
+			{
+				responseLength += writeControlNumber(&responseBuffer[responseLength], rules[i].opcode);
+				responseBuffer[responseLength++] = rules[i].type;
+				responseLength += writeControlNumber(&responseBuffer[responseLength], rules[i].probability);
+				responseLength += writeControlNumber(&responseBuffer[responseLength], rules[i].value);
+			}
+
+			for (int type = 0; type < FAULT_TYPES; type++)
+				responseLength += writeControlNumber(&responseBuffer[responseLength], stats.injected[type]);
+			responseLength += writeControlNumber(&responseBuffer[responseLength], stats.recoveries);
+			responseLength += writeControlNumber(&responseBuffer[responseLength], stats.recoveries ? stats.recoveryTotalMs / stats.recoveries : 0);
+			responseLength += writeControlNumber(&responseBuffer[responseLength], stats.recoveryMinMs);
+			responseLength += writeControlNumber(&responseBuffer[responseLength], stats.recoveryMaxMs);
+			responseBuffer[responseLength++] = stats.recovering;
+			responseLength += writeControlNumber(&responseBuffer[responseLength], stats.recoveringMs);
+			responseBuffer[responseLength++] = stats.jammed;
+		}
+		break;
+
+		case COMMAND_FAULT_CLEAR:
+			printf("COMMAND FAULT CLEAR\n");
+			faultClear(reader);
+			break;
+
+		case COMMAND_DISPENSER:
+		{
+			printf("COMMAND DISPENSER\n");
+			CardDispenser *dispenser = reader->dispenser;
+			unsigned int capacity;
+
+			if (!dispenser || readControlNumber(new_socket, &capacity) < 0)
+			{
+				response = COMMAND_FAILURE;
+				break;
+			}
+
+			// All ones leaves the capacity as it is
+			if (capacity != 0xFFFFFFFF && dispenserSetCapacity(reader, capacity) < 0)
+			{
+				response = COMMAND_FAILURE;
+				break;
+			}
+
+			pthread_mutex_lock(&dispenser->lock);
+			responseLength += writeControlNumber(&responseBuffer[responseLength], dispenser->count);
+			responseLength += writeControlNumber(&responseBuffer[responseLength], dispenser->capacity);
+			responseLength += writeControlNumber(&responseBuffer[responseLength], dispenser->dispensed);
+			responseLength += writeControlNumber(&responseBuffer[responseLength], dispenser->empty);
+			responseLength += writeControlNumber(&responseBuffer[responseLength], dispenser->failed);
+			pthread_mutex_unlock(&dispenser->lock);
+		}
+		break;
+
+		case COMMAND_OUTPUT:
+		{
+			printf("COMMAND OUTPUT\n");
+			OutputQueue *queues[] = {&serialOutput, &node->output};
+
+			for (int i = 0; i < 2; i++)
+			{
+				OutputStats stats;
+				outputGetStats(queues[i], &stats);
+
+				responseLength += writeControlNumber(&responseBuffer[responseLength], stats.depth);
+				responseLength += writeControlNumber(&responseBuffer[responseLength], stats.maxDepth);
+				responseLength += writeControlNumber(&responseBuffer[responseLength], stats.bytes);
+				responseLength += writeControlNumber(&responseBuffer[responseLength], stats.frames);
+				responseLength += writeControlNumber(&responseBuffer[responseLength], stats.partialWrites);
+				responseLength += writeControlNumber(&responseBuffer[responseLength], stats.wouldBlock);
+				responseLength += writeControlNumber(&responseBuffer[responseLength], stats.waits);
+				responseLength += writeControlNumber(&responseBuffer[responseLength], stats.waitUs);
+				responseLength += writeControlNumber(&responseBuffer[responseLength], stats.drops);
+				responseLength += writeControlNumber(&responseBuffer[responseLength], stats.droppedBytes);
+				responseLength += writeControlNumber(&responseBuffer[responseLength], stats.kernelQueued);
+				responseLength += writeControlNumber(&responseBuffer[responseLength], stats.maxKernelQueued);
+			}
+
+			responseLength += writeControlNumber(&responseBuffer[responseLength], __atomic_load_n(&ringForwarded, __ATOMIC_RELAXED));
+			responseLength += writeControlNumber(&responseBuffer[responseLength], __atomic_load_n(&ringDropped, __ATOMIC_RELAXED));
+		}
+		break;
+
+		case COMMAND_HISTORY:
+		{
+			printf("COMMAND HISTORY\n");
+			char cardPath[256];
+			unsigned int seconds;
+
+			if (readControlString(new_socket, cardPath) < 0 || readControlNumber(new_socket, &seconds) < 0 || !historyEnabled())
+			{
+				response = COMMAND_FAILURE;
+				break;
+			}
+
+			// Without a card, the totals for the whole store
+			if (cardPath[0] == '\0')
+			{
+				HistoryStats stats;
+				historyGetStats(&stats);
+				responseLength += writeControlNumber(&responseBuffer[responseLength], stats.cards);
+				responseLength += writeControlNumber(&responseBuffer[responseLength], stats.versions);
+				responseLength += writeControlNumber(&responseBuffer[responseLength], stats.objects);
+				responseLength += writeControlNumber(&responseBuffer[responseLength], stats.deltas);
+				responseLength += writeControlNumber(&responseBuffer[responseLength], stats.bytes / 1024);
+				responseLength += writeControlNumber(&responseBuffer[responseLength], stats.deduplicated);
+				responseLength += writeControlNumber(&responseBuffer[responseLength], stats.dropped);
+				break;
+			}
+
+			static HistoryVersion versions[HISTORY_LIST_MAX];
+			unsigned int total;
+			int count;
+
+			if (seconds)
+			{
+				unsigned char tracks[3][TRACK_SIZE];
+				count = historyStateAt(cardPath, seconds * 1000ULL + 999, tracks, &versions[0]) == 0 ? 1 : -1;
+				total = 1;
+			}
+			else
+			{
+				count = historyList(cardPath, versions, HISTORY_LIST_MAX, &total);
+			}
+
+			if (count < 0)
+			{
+				response = COMMAND_FAILURE;
+				break;
+			}
+
+			responseLength += writeControlNumber(&responseBuffer[responseLength], total);
+			responseLength += writeControlNumber(&responseBuffer[responseLength], count);
+			for (int i = 0; i < count; i++)
+			{
+				responseLength += writeControlNumber(&responseBuffer[responseLength], versions[i].timeMs / 1000);
+				responseLength += writeControlNumber(&responseBuffer[responseLength], versions[i].timeMs % 1000);
+				responseLength += writeControlNumber(&responseBuffer[responseLength], versions[i].hash >> 32);
+				responseLength += writeControlNumber(&responseBuffer[responseLength], versions[i].hash);
+			}
+		}
+		break;
+
+		case COMMAND_ROLLBACK:
+		{
+			printf("COMMAND ROLLBACK\n");
+			char cardPath[256];
+			unsigned int seconds;
+			unsigned char tracks[3][TRACK_SIZE];
+			HistoryVersion version;
+			const char *error = NULL;
+
+			if (readControlString(new_socket, cardPath) < 0 || readControlNumber(new_socket, &seconds) < 0)
+				error = "Bad request";
+			else if (!historyEnabled())
+				error = "Card history is off";
+
+			if (!error)
+			{
+				// The same card is the same file however its path was written
+				struct stat file;
+				int exists = stat(cardPath, &file) == 0;
+				int live = 0;
+				for (int i = 0; i < nodeCount && exists; i++)
+				{
+					char path[sizeof(nodes[i].reader.cardPath)];
+
+					pthread_mutex_lock(&nodes[i].reader.lock);
+					int inserted = nodes[i].reader.cardPosition != NOT_INSERTED;
+					strcpy(path, nodes[i].reader.cardPath);
+					pthread_mutex_unlock(&nodes[i].reader.lock);
+
+					struct stat readerFile;
+					live |= inserted && stat(path, &readerFile) == 0 && readerFile.st_dev == file.st_dev && readerFile.st_ino == file.st_ino;
+				}
+
+				if (live)
+					error = "The card is in the reader, eject it first";
+				else if (historyStateAt(cardPath, seconds * 1000ULL + 999, tracks, &version) < 0)
+					error = "The card has no history that old";
+				else if (writeCardImage(cardPath, tracks) < 0)
+					error = "Couldn't write the card, it may be in use in another cabinet";
+			}
+
+			if (error)
+			{
+				response = COMMAND_FAILURE;
+				responseLength += writeControlString(&responseBuffer[responseLength], error);
+				break;
+			}
+
+			// The rollback is itself a new version, so it can be undone
+			historyRecord(cardPath, tracks);
+			searchCardSaved(cardPath, tracks);
+
+			printf("Info: Rolled %s back to its version from %llu\n", cardPath, version.timeMs / 1000);
+			responseLength += writeControlNumber(&responseBuffer[responseLength], version.timeMs / 1000);
+			responseLength += writeControlNumber(&responseBuffer[responseLength], version.timeMs % 1000);
+		}
+		break;
+
+		case COMMAND_EXPORT:
+		case COMMAND_IMPORT:
+		{
+			printf("COMMAND %s\n", control == COMMAND_EXPORT ? "EXPORT" : "IMPORT");
+
+			CardReader *readers[RING_NODES_MAX];
+			for (int i = 0; i < nodeCount; i++)
+				readers[i] = &nodes[i].reader;
+
+			// The transfer thread replies and closes the connection itself
+			if (collectionServe(readers, nodeCount, new_socket, control) == 0)
+			{
+				PROBE2(control__done, control, response);
+				continue;
+			}
+
+			response = COMMAND_FAILURE;
+		}
+		break;
+
+		case COMMAND_FIND:
+		{
+			printf("COMMAND FIND\n");
+			char query[256];
+			char error[256];
+			static SearchResult results[SEARCH_RESULTS_MAX];
+			unsigned int total;
+			int count;
+
+			if (readControlString(new_socket, query) < 0 || !searchEnabled())
+			{
+				response = COMMAND_FAILURE;
+				responseLength += writeControlString(&responseBuffer[responseLength], "Card search is off, there is no schema for the game");
+				break;
+			}
+
+			if ((count = searchFind(query, results, SEARCH_RESULTS_MAX, &total, error)) < 0)
+			{
+				response = COMMAND_FAILURE;
+				responseLength += writeControlString(&responseBuffer[responseLength], error);
+				break;
+			}
+
+			SearchStats stats;
+			searchGetStats(&stats);
+
+			responseLength += writeControlNumber(&responseBuffer[responseLength], stats.ready);
+			responseLength += writeControlNumber(&responseBuffer[responseLength], stats.cards);
+			responseLength += writeControlNumber(&responseBuffer[responseLength], total);
+			responseLength += writeControlNumber(&responseBuffer[responseLength], count);
+			for (int i = 0; i < count; i++)
+			{
+				responseLength += writeControlString(&responseBuffer[responseLength], results[i].path);
+				responseLength += writeControlString(&responseBuffer[responseLength], results[i].summary);
+			}
+		}
+		break;
+
+		case COMMAND_CARD:
+		{
+			printf("COMMAND CARD\n");
+			unsigned char tracks[3][TRACK_SIZE];
+
+			// Read from the published image, so never waits on the reader
+			unsigned long long version = imageRead(reader, tracks);
+			responseLength += writeControlNumber(&responseBuffer[responseLength], version);
+			memcpy(&responseBuffer[responseLength], tracks, sizeof(tracks));
+			responseLength += sizeof(tracks);
+		}
+		break;
+
+		case COMMAND_SESSIONS:
+		{
+			printf("COMMAND SESSIONS\n");
+
+			if (!sessionLogEnabled())
+			{
+				response = COMMAND_FAILURE;
+				break;
+			}
+
+			SessionStats stats;
+			sessionGetStats(&stats);
+			responseLength += writeControlNumber(&responseBuffer[responseLength], stats.logged);
+			responseLength += writeControlNumber(&responseBuffer[responseLength], stats.dropped);
+		}
+		break;
+
+		case COMMAND_BACKUP:
+		{
+			printf("COMMAND BACKUP\n");
+			char destination[256];
+
+			// The backup thread replies and closes the connection itself
+			if (readControlString(new_socket, destination) == 0 && backupServe(new_socket, destination) == 0)
+			{
+				PROBE2(control__done, control, response);
+				continue;
+			}
+
+			response = COMMAND_FAILURE;
+			responseLength += writeControlString(&responseBuffer[responseLength], "A backup is already running or the collection is off");
+		}
+		break;
+
 		default:
 			printf("UNKNOWN CONTROL COMMAND\n");
 			response = COMMAND_FAILURE;
 			break;
 		}
 
+		PROBE2(control__done, control, response);
+
 		write(new_socket, &response, 1);
 
 		if(responseLength != 0) {
 			write(new_socket, &responseBuffer, responseLength);
 		}
+
+		close(new_socket);
 	}
 
 	return 0;
 }
 
 /**
- * This thread deals with the RS422 ring network communication
+ * Serves the ring frames for every node
  *
- * Derby Owners Club uses a conversion board that speaks RS422 and
- * converts to RS232. This thread will act as that conversion board
- * and fill the input/output buffer with correct packets.
+ * The address of the node a frame is for is in bits 4 to 6 of its type,
+ * so node 0 answers to the 0x01, 0x80 and 0x81 the real board does, node 1
+ * to 0x11, 0x90 and 0x91 and so on. Replies carry the same type back.
+ * Frames for addresses nobody here answers to, or of types we don't know,
+ * are passed on round the ring unchanged.
  **/
 void *rs422Thread(void *vargp)
 {
 	RS422ThreadArguments *arguments = (RS422ThreadArguments *)vargp;
 
-	rs422InputBuffer.head = rs422OutputBuffer.head = 0;
-	rs422InputBuffer.tail = rs422OutputBuffer.tail = 0;
+	// When the last ring reply went out, 0 once the host has gone quiet
+	unsigned long long repliedAt = 0;
 
-	while (arguments->running)
+	while (*arguments->running)
 	{
 		unsigned char buffer[2];
 
@@ -665,126 +1681,204 @@ void *rs422Thread(void *vargp)
 
 		int bytesRead = 0;
 
+		unsigned long long frameAt = 0;
+
 		while (bytesLeft > 0)
 		{
-			bytesRead = readBytes(buffer + (2 - bytesLeft), bytesLeft, 0);
+			bytesRead = readBytes(buffer + (2 - bytesLeft), bytesLeft, NULL);
+			if (bytesRead < 0)
+				repliedAt = 0;
 			if (bytesRead < 1)
 				continue;
+			if (!frameAt)
+				frameAt = clockNowNs();
 			bytesLeft -= bytesRead;
 		}
 
-		switch (buffer[0])
+		if (repliedAt)
+			linkEchoSample(frameAt - repliedAt);
+
+		int address = RING_ADDRESS(buffer[0]);
+		Node *node = address < nodeCount ? &nodes[address] : NULL;
+
+		PROBE3(ring__frame, buffer[0], buffer[1], node && outputPending(&node->output) != 0);
+
+		switch (node ? RING_TYPE(buffer[0]) : 0)
 		{
-		case 0x01:
+		case RING_DATA:
 		{
-			writeBytes(buffer, 2, 0);
+			writeBytes(buffer, 2, NULL);
+
+			// A node that has fallen behind loses the byte, the others carry on
+			CircularBuffer *input = &node->input;
+			pthread_mutex_lock(&input->lock);
 
-			if (rs422InputBuffer.head + 1 == rs422InputBuffer.tail)
+			int next = input->head + 1 == BUFFER_SIZE ? 0 : input->head + 1;
+			if (next == input->tail)
 			{
-				printf("Error: Buffer full\n");
-				arguments->running = 0;
-				continue;
+				pthread_mutex_unlock(&input->lock);
+				__atomic_add_fetch(&ringDropped, 1, __ATOMIC_RELAXED);
+				PROBE2(ring__drop, address, buffer[1]);
+				break;
 			}
 
-			rs422InputBuffer.buffer[rs422InputBuffer.head] = buffer[1];
+			if (input->head == input->tail)
+				input->arrivedNs = frameAt;
+			input->buffer[input->head] = buffer[1];
+			input->head = next;
 
-			if (rs422InputBuffer.head + 1 == BUFFER_SIZE)
-				rs422InputBuffer.head = 0;
-			else
-				rs422InputBuffer.head++;
+			pthread_cond_signal(&input->ready);
+			pthread_mutex_unlock(&input->lock);
 		}
 		break;
 
-		case 0x80:
+		case RING_POLL:
 		{
-			unsigned char outputBuffer[2] = {0x80, 0x00}; // Empty
-			if (rs422OutputBuffer.head != rs422OutputBuffer.tail)
+			unsigned char outputBuffer[2] = {buffer[0], 0x00}; // Empty
+			if (outputPending(&node->output))
 			{
 				outputBuffer[1] = 0x40; // Not empty
 			}
-			writeBytes(outputBuffer, 2, 0);
+			writeBytes(outputBuffer, 2, NULL);
 		}
 		break;
 
-		case 0x81:
+		case RING_FETCH:
 		{
-			unsigned char outputBuffer[2] = {0x81, 0x00}; // Empty
-			if (rs422OutputBuffer.head != rs422OutputBuffer.tail)
-			{
-				outputBuffer[1] = rs422OutputBuffer.buffer[rs422OutputBuffer.tail];
+			unsigned char outputBuffer[2] = {buffer[0], 0x00}; // Empty
+			int taken = outputTake(&node->output, &outputBuffer[1]);
+			writeBytes(outputBuffer, 2, NULL);
 
-				if (rs422OutputBuffer.tail + 1 == BUFFER_SIZE)
-					rs422OutputBuffer.tail = 0;
-				else
-					rs422OutputBuffer.tail++;
-			}
-			writeBytes(outputBuffer, 2, 0);
+			// The reply deadline is met once the host has the reply's last byte
+			if (taken)
+				watchdogReplyFetched(&node->reader);
 		}
 		break;
 
 		default:
-			printf("Error: RS422 Thread %d is an unknown byte\n", buffer[0]);
-			arguments->running = 0;
+			// Not for us, pass it on to the next node round the ring
+			writeBytes(buffer, 2, NULL);
+			__atomic_add_fetch(&ringForwarded, 1, __ATOMIC_RELAXED);
+			PROBE2(ring__forward, buffer[0], buffer[1]);
 			break;
 		}
+
+		repliedAt = clockNowNs();
 	}
 
 	printf("RS422 Thread Stopped.\n");
 }
 
-int main(int argc, char *argv[])
+/**
+ * Applies a reloaded configuration between packets
+ *
+ * Settings that only change how replies are built take effect straight
+ * away. Line settings are changed in place once any reply in flight has
+ * drained, so the port stays open and the host sees at most one bad frame.
+ * The connection mode and control port are only read at startup.
+ **/
+static void applyConfig(Config *config, Config *next)
 {
-	printf("Card Emulator Version %d.%d\n\n", MAJOR_VERSION, MINOR_VERSION);
-
-	Game game = DERBY_OWNERS_CLUB;
-
-    char *customSerialPath = getenv("CARD_SERIAL_PATH");
-    char *serialPath = customSerialPath ? customSerialPath : DEFAULT_SERIAL_PATH;
+	if (next->rs422Mode != config->rs422Mode || next->ringNodes != config->ringNodes || next->port != config->port)
+		printf("Warning: Connection mode, ring node and control port changes need a restart\n");
 
-	int rs422Mode = 1;
-	int shutterMode = 1;
-	int evenParity = 0;
-	int flowControl = 0;
-	int baudRate = B2000000;
+	next->rs422Mode = config->rs422Mode;
+	next->ringNodes = config->ringNodes;
+	next->port = config->port;
 
-	printf("      Serial Path: %s\n", serialPath);
-	printf("  Connection Mode: %s\n", rs422Mode ? "RS422 Mode" : "RS232 Mode");
-	printf("   Emulation Mode: %s\n", shutterMode ? "Shutter" : "No Shutter");
-	printf("           Parity: %s\n", evenParity ? "Even" : "None");
-	printf("     Flow Control: %s\n\n", flowControl ? "RTS/CTS" : "None");
+	if (serialIO >= 0 && (next->baudRate != config->baudRate || next->evenParity != config->evenParity || next->flowControl != config->flowControl))
+	{
+		applySerialOptions(serialIO, next->baudRate, next->evenParity, next->flowControl, TCSADRAIN);
+		printf("Info: Serial settings now %u baud, %s parity, %s flow control\n", next->baud,
+			   next->evenParity ? "even" : "no", next->flowControl ? "RTS/CTS" : "no");
+	}
 
-	if ((serialIO = open(serialPath, O_RDWR | O_NOCTTY | O_SYNC | O_NDELAY)) < 0)
+	if (next->game != config->game)
 	{
-		printf("Error: Could not open %s\n", serialPath);
-		return EXIT_FAILURE;
+		for (int i = 0; i < nodeCount; i++)
+		{
+			pthread_mutex_lock(&nodes[i].reader.lock);
+			nodes[i].reader.motion = &motionProfiles[next->game];
+			pthread_mutex_unlock(&nodes[i].reader.lock);
+		}
+		printf("Info: Now emulating %s\n", configGameName(next->game));
 	}
 
-	setSerialAttributes(serialIO, baudRate, evenParity, flowControl);
+	char *customReplyBudget = getenv("CARD_REPLY_BUDGET_US");
+	if (!customReplyBudget)
+		watchdogSetBudget(next->replyBudgetUs ? next->replyBudgetUs : replyBudgetsUs[next->game]);
 
-	pthread_t rs422ThreadID;
-	int running = 1;
+	// Only node 0 writes the shared copy, the others take their own copy of
+	// it under the lock once they see the generation move on
+	pthread_mutex_lock(&configLock);
+	*config = *next;
+	__atomic_add_fetch(&configGeneration, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&configLock);
+}
 
-	if (rs422Mode)
+static void reloadSignal(int signal)
+{
+	(void)signal;
+	configRequestReload();
+}
+
+/**
+ * Turns the timer wheel whenever the virtual clock moves forward
+ **/
+static void simulationAdvance(unsigned long long nowNs)
+{
+	timerWheelAdvanceTo(&timerWheel, nowNs / 1000000ULL);
+}
+
+/**
+ * Loads the card for READ and copies out the tracks asked for, on a job worker
+ *
+ * The card is loaded into the job and only becomes the reader's card when
+ * the protocol thread collects it, so nothing else sees it half loaded.
+ **/
+static void readJob(ReaderJob *job)
+{
+	job->dataLength = 0;
+	job->hasTracks = loadCard(job->reader, job->cardPath, job->tracks) == 0;
+
+	if (!job->hasTracks)
 	{
-		RS422ThreadArguments arguments = {0};
-		arguments.fd = serialIO;
-		arguments.running = &running;
-		pthread_create(&rs422ThreadID, NULL, rs422Thread, &arguments);
+		job->readerStatus = STATUS_SYSTEM_ERR;
+		return;
 	}
 
-	CardReader reader = {0};
-	reader.dispenserFull = 1;
-	reader.coverClosed = 0;
-	reader.cardPosition = NOT_INSERTED;
-	reader.readerStatus = STATUS_NO_ERR;
-	reader.jobStatus = STATUS_NO_JOB;
+	for (int i = 0; i < 3; i++)
+	{
+		if (job->trackIndex[i] == -1)
+			continue;
+		memcpy(&job->data[job->dataLength], job->tracks[job->trackIndex[i]], TRACK_SIZE);
+		job->dataLength += TRACK_SIZE;
+	}
+}
 
-	pthread_t controlThreadID;
-	ControlThreadArguments arguments = {0};
-	arguments.reader = &reader;
-	pthread_create(&controlThreadID, NULL, controlThread, &arguments);
+/**
+ * Saves the card after WRITE, ERASE or NEW_CARD, on a job worker
+ *
+ * The path and tracks are the ones copied when the job was prepared.
+ **/
+static void saveJob(ReaderJob *job)
+{
+	if (saveCardToFile(job->reader, job->cardPath, job->tracks) < 0)
+		job->readerStatus = STATUS_SYSTEM_ERR;
+}
+
+/**
+ * The protocol loop of one node, reading packets from the host and
+ * answering them until the daemon stops
+ **/
+static void serveNode(Node *node, Config *shared, int *running)
+{
+	CardReader *reader = &node->reader;
+	char configError[CONFIG_ERROR_SIZE];
 
-	unsigned char lastCommand = 0x00;
+	// Each node works from its own copy of the configuration
+	Config config;
+	unsigned int configSeen = configGeneration - 1;
 
 	int inputPacketLength = 0;
 	unsigned char inputPacket[BUFFER_SIZE];
@@ -795,14 +1889,41 @@ int main(int argc, char *argv[])
 	int outputPacketDataLength = 0;
 	unsigned char outputPacketData[BUFFER_SIZE];
 
-	memset(&tracks, 0x00, 3 * TRACK_SIZE);
 
-	while (running)
+	while (*running)
 	{
-		inputPacketLength = readPacket(inputPacket, rs422Mode);
+		// Only node 0 reloads, every node sees the new configuration
+		if (node == &nodes[0] && configReloadRequested())
+		{
+			Config next;
+			if (configLoad(&next, configError) == 0)
+			{
+				applyConfig(shared, &next);
+				printf("Info: Reloaded %s\n", configPath());
+			}
+			else
+			{
+				printf("Error: Keeping the old configuration, %s\n", configError);
+			}
+		}
+
+		unsigned int generation = __atomic_load_n(&configGeneration, __ATOMIC_ACQUIRE);
+		if (generation != configSeen)
+		{
+			pthread_mutex_lock(&configLock);
+			config = *shared;
+			configSeen = generation;
+			pthread_mutex_unlock(&configLock);
+		}
+
+		inputPacketLength = readPacket(inputPacket, node);
 
 		if (inputPacketLength < 1)
+		{
+			if (simulationMode && simulationFinished())
+				break;
 			continue;
+		}
 
 		/*printf("ReadPacket: ");
 		for (int i = 0; i < inputPacketLength; i++)
@@ -814,43 +1935,62 @@ int main(int argc, char *argv[])
 		// Should we send a packet
 		if (inputPacketLength == 1 && inputPacket[0] == ENQUIRY)
 		{
+			jobCollect(reader, outputPacketData, &outputPacketDataLength);
+
 			// Build the reply packet
 			outputPacketLength = 0;
-			outputPacket[outputPacketLength++] = lastCommand;
+			outputPacket[outputPacketLength++] = reader->lastCommand;
 
-			// Build the status reply bytes
-			outputPacket[outputPacketLength++] = getCardStatus(&reader, shutterMode);
-			outputPacket[outputPacketLength++] = reader.readerStatus;
-			outputPacket[outputPacketLength++] = reader.jobStatus;
+			// Build the status reply bytes, a job still running holds the command open
+			outputPacket[outputPacketLength++] = getCardStatus(reader, config.shutterMode);
+			outputPacket[outputPacketLength++] = reader->readerStatus;
+			outputPacket[outputPacketLength++] = jobPending(reader) ? STATUS_RUNNING_COMMAND : reader->jobStatus;
 
-			// Copy any data response from the command such as card data
-			memcpy(&outputPacket[outputPacketLength], &outputPacketData, outputPacketDataLength);
-			outputPacketLength += outputPacketDataLength;
-			outputPacketDataLength = 0;
+			// Copy any data response from the command such as card data, once the card has finished moving
+			if (outputPacket[3] != STATUS_RUNNING_COMMAND)
+			{
+				memcpy(&outputPacket[outputPacketLength], &outputPacketData, outputPacketDataLength);
+				outputPacketLength += outputPacketDataLength;
+				outputPacketDataLength = 0;
+			}
 
-			// Send the packet to the Naomi
-			writePacket(outputPacket, outputPacketLength, rs422Mode);
+			FaultAction fault;
+			faultCheck(reader, ENQUIRY, &fault);
+			if (fault.readerStatus >= 0)
+				outputPacket[2] = fault.readerStatus;
+			if (fault.jobStatus >= 0)
+				outputPacket[3] = fault.jobStatus;
 
-			// Now we run the physical simulation
-			if (reader.jobStatus == STATUS_RUNNING_COMMAND)
-				reader.jobStatus = STATUS_NO_JOB;
+			PROBE4(enquiry, reader->id, reader->lastCommand, outputPacket[3], outputPacketLength - 4);
 
-			/*if (reader.cardPosition == NOT_INSERTED)
-			{
-				reader.cardPosition = INSERTED_IN_FRONT;
-				printf("Info: Inserted card\n");
-			}*/
+			if (fault.delayMs)
+				clockSleepUs(fault.delayMs * 1000);
 
-			if (reader.cardPosition == EJECTING_CARD)
-			{
-				reader.cardPosition = NOT_INSERTED;
-				printf("Info: Removing card\n");
-			}
+			// Send the packet to the Naomi
+			if (fault.corrupt)
+				node->corruptChecksum = 1;
+			watchdogReplyStart(reader);
+			int queued = fault.drop ? 0 : writePacket(outputPacket, outputPacketLength, node);
+			watchdogReplyDone(reader, ENQUIRY, node->ring ? queued : 0);
 
 			continue;
 		}
 
-		lastCommand = inputPacket[0];
+		// The host didn't wait for the last job, so this command waits for it
+		// instead, and the reply deadline sees the wait as file I/O
+		unsigned long long waitStarted = clockNowNs();
+		jobFinish(reader, outputPacketData, &outputPacketDataLength);
+		watchdogFileIo(reader, clockNowNs() - waitStarted);
+
+		reader->lastCommand = inputPacket[0];
+
+		PROBE3(command__start, reader->id, inputPacket[0], inputPacketLength);
+
+		FaultAction fault;
+		faultCheck(reader, inputPacket[0], &fault);
+
+		int dataBefore = outputPacketDataLength;
+		int dataPending = 0;
 
 		switch (inputPacket[0])
 		{
@@ -858,8 +1998,8 @@ int main(int argc, char *argv[])
 		case INIT:
 		{
 			printf("Command: Init\n");
-			reader.readerStatus = STATUS_NO_ERR;
-			reader.jobStatus = STATUS_NO_JOB;
+			reader->readerStatus = STATUS_NO_ERR;
+			reader->jobStatus = STATUS_NO_JOB;
 		}
 		break;
 
@@ -867,8 +2007,8 @@ int main(int argc, char *argv[])
 		case REGISTER_FONT:
 		{
 			printf("Command: Register Font\n");
-			reader.readerStatus = STATUS_NO_ERR;
-			reader.jobStatus = STATUS_NO_JOB;
+			reader->readerStatus = STATUS_NO_ERR;
+			reader->jobStatus = STATUS_NO_JOB;
 		}
 		break;
 
@@ -876,18 +2016,18 @@ int main(int argc, char *argv[])
 		case GET_STATUS:
 		{
 			printf("Command: Get Status\n");
-			reader.readerStatus = STATUS_NO_ERR;
-			reader.jobStatus = STATUS_NO_JOB;
+			reader->readerStatus = STATUS_NO_ERR;
+			reader->jobStatus = STATUS_NO_JOB;
 		}
 		break;
 
 		// Set the shutter on the front of the reader to open/closed
 		case SET_SHUTTER:
 		{
-			reader.coverClosed = (inputPacket[4] == 0x31);
-			printf("Command: %s shutter\n", reader.coverClosed ? "Open" : "Closed");
-			reader.readerStatus = STATUS_NO_ERR;
-			reader.jobStatus = STATUS_NO_JOB;
+			reader->coverClosed = (inputPacket[4] == 0x31);
+			printf("Command: %s shutter\n", reader->coverClosed ? "Open" : "Closed");
+			reader->readerStatus = STATUS_NO_ERR;
+			reader->jobStatus = STATUS_NO_JOB;
 		}
 		break;
 
@@ -895,10 +2035,10 @@ int main(int argc, char *argv[])
 		case CLEAN_CARD:
 		{
 			printf("Command: Clean Card\n");
-			reader.coverClosed = 0;
-			reader.cardPosition = NOT_INSERTED;
-			reader.readerStatus = STATUS_NO_ERR;
-			reader.jobStatus = STATUS_NO_JOB;
+			reader->coverClosed = 0;
+			reader->readerStatus = STATUS_NO_ERR;
+			reader->jobStatus = STATUS_NO_JOB;
+			moveCard(reader, reader->cardPosition, NOT_INSERTED, reader->motion->cleanMs);
 		}
 		break;
 
@@ -906,10 +2046,10 @@ int main(int argc, char *argv[])
 		case EJECT_CARD:
 		{
 			printf("Command: Eject Card\n");
-			reader.coverClosed = 0;
-			reader.cardPosition = EJECTING_CARD;
-			reader.readerStatus = STATUS_NO_ERR;
-			reader.jobStatus = STATUS_NO_JOB;
+			reader->coverClosed = 0;
+			reader->readerStatus = STATUS_NO_ERR;
+			reader->jobStatus = STATUS_NO_JOB;
+			moveCard(reader, EJECTING_CARD, NOT_INSERTED, reader->motion->ejectMs);
 		}
 		break;
 
@@ -918,14 +2058,15 @@ int main(int argc, char *argv[])
 		{
 			printf("Command: Read (");
 
-			if (reader.cardPosition == NOT_INSERTED || reader.cardPosition == EJECTING_CARD)
+			if (reader->cardPosition == NOT_INSERTED || reader->cardPosition == EJECTING_CARD)
 			{
 				printf("Error Card not inserted)\n");
-				reader.jobStatus = STATUS_WAITING_FOR_CARD;
+				reader->jobStatus = STATUS_WAITING_FOR_CARD;
 				break;
 			}
 
-			loadCardFromFile();
+			// The card is loaded and its tracks copied out by a job worker
+			ReaderJob *job = jobPrepare(reader, READ, readJob);
 
 			char readParam1 = inputPacket[4];
 			char readParam2 = inputPacket[5];
@@ -933,23 +2074,27 @@ int main(int argc, char *argv[])
 
 			if (readParam1 == 0x30)
 			{
-				int trackIndex[3];
-				getTrackIndex(readParam3, trackIndex);
+				getTrackIndex(readParam3, job->trackIndex);
 
 				for (int i = 0; i < 3; i++)
 				{
-					if (trackIndex[i] == -1)
-						continue;
-					printf("Track%d, ", i);
-					for (int j = 0; j < TRACK_SIZE; j++)
-						outputPacketData[outputPacketDataLength++] = tracks[trackIndex[i]][j];
+					if (job->trackIndex[i] != -1)
+					{
+						printf("Track%d, ", i);
+						dataPending += TRACK_SIZE;
+					}
 				}
 			}
+			else
+			{
+				job->trackIndex[0] = job->trackIndex[1] = job->trackIndex[2] = -1;
+			}
 			printf(")\n");
 
-			reader.cardPosition = UNDER_READER;
-			reader.readerStatus = STATUS_NO_ERR;
-			reader.jobStatus = STATUS_NO_JOB;
+			reader->readerStatus = STATUS_NO_ERR;
+			reader->jobStatus = STATUS_NO_JOB;
+			if (reader->cardPosition != UNDER_READER)
+				moveCard(reader, reader->cardPosition, UNDER_READER, reader->motion->toReaderMs);
 		}
 		break;
 
@@ -958,10 +2103,10 @@ int main(int argc, char *argv[])
 		{
 			printf("Command: Write (");
 
-			if (reader.cardPosition == NOT_INSERTED || reader.cardPosition == EJECTING_CARD)
+			if (reader->cardPosition == NOT_INSERTED || reader->cardPosition == EJECTING_CARD)
 			{
 				printf("Error Card not inserted)\n");
-				reader.jobStatus = STATUS_WAITING_FOR_CARD;
+				reader->jobStatus = STATUS_WAITING_FOR_CARD;
 				break;
 			}
 
@@ -974,23 +2119,24 @@ int main(int argc, char *argv[])
 				int trackIndex[3];
 				getTrackIndex(readParam3, trackIndex);
 
-				int inputPacketPointer = 7;
 				for (int i = 0; i < 3; i++)
 				{
-					if (trackIndex[i] == -1)
-						continue;
-					printf("Track%d, ", i);
-					for (int j = 0; j < TRACK_SIZE; j++)
-						tracks[trackIndex[i]][j] = inputPacket[inputPacketPointer++];
+					if (trackIndex[i] != -1)
+						printf("Track%d, ", i);
 				}
+
+				pthread_mutex_lock(&reader->lock);
+				writeTracks(reader, trackIndex, &inputPacket[7]);
+				pthread_mutex_unlock(&reader->lock);
 				printf(")\n");
 			}
 
-			reader.cardPosition = UNDER_READER;
-			reader.readerStatus = STATUS_NO_ERR;
-			reader.jobStatus = STATUS_NO_JOB;
+			reader->readerStatus = STATUS_NO_ERR;
+			reader->jobStatus = STATUS_NO_JOB;
+			if (reader->cardPosition != UNDER_READER)
+				moveCard(reader, reader->cardPosition, UNDER_READER, reader->motion->toReaderMs);
 
-			saveCardToFile();
+			jobPrepare(reader, inputPacket[0], saveJob);
 		}
 		break;
 
@@ -998,14 +2144,15 @@ int main(int argc, char *argv[])
 		case ERASE:
 		{
 			printf("Command: Erase\n");
-			for (int i = 0; i < 3; i++)
-				for (int j = 0; j < TRACK_SIZE; j++)
-					tracks[i][j] = 0x00;
-			reader.cardPosition = UNDER_READER;
-			reader.readerStatus = STATUS_NO_ERR;
-			reader.jobStatus = STATUS_NO_JOB;
-
-			saveCardToFile();
+			pthread_mutex_lock(&reader->lock);
+			memset(reader->tracks, 0, sizeof(reader->tracks));
+			pthread_mutex_unlock(&reader->lock);
+			reader->readerStatus = STATUS_NO_ERR;
+			reader->jobStatus = STATUS_NO_JOB;
+			if (reader->cardPosition != UNDER_READER)
+				moveCard(reader, reader->cardPosition, UNDER_READER, reader->motion->toReaderMs);
+
+			jobPrepare(reader, inputPacket[0], saveJob);
 		}
 		break;
 
@@ -1013,9 +2160,10 @@ int main(int argc, char *argv[])
 		case PRINT:
 		{
 			printf("Command: Print\n");
-			reader.cardPosition = UNDER_PRINT_HEAD;
-			reader.readerStatus = STATUS_NO_ERR;
-			reader.jobStatus = STATUS_NO_JOB;
+			reader->readerStatus = STATUS_NO_ERR;
+			reader->jobStatus = STATUS_NO_JOB;
+			if (reader->cardPosition != UNDER_PRINT_HEAD)
+				moveCard(reader, reader->cardPosition, UNDER_PRINT_HEAD, reader->motion->toPrintHeadMs);
 		}
 		break;
 
@@ -1023,16 +2171,61 @@ int main(int argc, char *argv[])
 		case NEW_CARD:
 		{
 			printf("Command: Get new card\n");
-			for (int i = 0; i < 3; i++)
-				for (int j = 0; j < TRACK_SIZE; j++)
-					tracks[i][j] = 0x00;
+			reader->readerStatus = STATUS_NO_ERR;
+
+			if (reader->dispenser)
+			{
+				char cardPath[sizeof(reader->cardPath)];
+
+				unsigned long long started = clockNowNs();
+				int result = dispenserTake(reader, cardPath, sizeof(cardPath));
+				watchdogFileIo(reader, clockNowNs() - started);
+
+				if (result < 0)
+				{
+					printf("Warning: The dispenser is empty\n");
+					reader->jobStatus = STATUS_DISPENSER_EMPTY;
+					break;
+				}
+
+				// Any card already in the reader is left as it was
+				if (reader->cardPosition != NOT_INSERTED && serviceEnabled())
+					serviceRelease(reader->cardPath);
+
+				pthread_mutex_lock(&reader->lock);
+				strcpy(reader->cardPath, cardPath);
+				memset(reader->tracks, 0, sizeof(reader->tracks));
+				pthread_mutex_unlock(&reader->lock);
+				imagePublish(reader, reader->tracks);
+
+				// The blank is already on disk, the service only needs the lease
+				if (serviceEnabled() && loadCardFromFile(reader) < 0)
+				{
+					reader->readerStatus = STATUS_SYSTEM_ERR;
+					break;
+				}
+
+				if (!serviceEnabled())
+				{
+					historyRecord(reader->cardPath, reader->tracks);
+					backupCardWritten(reader->cardPath, reader->tracks);
+					searchCardSaved(reader->cardPath, reader->tracks);
+				}
+
+				printf("Info: Dispensed %s\n", reader->cardPath);
+			}
+			else
+			{
+				pthread_mutex_lock(&reader->lock);
+				memset(reader->tracks, 0, sizeof(reader->tracks));
+				pthread_mutex_unlock(&reader->lock);
 
-			reader.cardPosition = DISPENCING_FROM_BACK;
-			reader.coverClosed = 1;
-			reader.readerStatus = STATUS_NO_ERR;
-			reader.jobStatus = STATUS_NO_JOB;
+				jobPrepare(reader, NEW_CARD, saveJob);
+			}
 
-			saveCardToFile();
+			reader->coverClosed = 1;
+			reader->jobStatus = STATUS_NO_JOB;
+			moveCard(reader, DISPENCING_FROM_BACK, DISPENCING_FROM_BACK, reader->motion->dispenseMs);
 		}
 		break;
 
@@ -1040,45 +2233,383 @@ int main(int argc, char *argv[])
 		case CANCEL:
 		{
 			printf("Command: Cancel\n");
-			// reader.cardPosition = NOT_INSERTED;
-			reader.readerStatus = STATUS_NO_ERR;
-			reader.jobStatus = STATUS_NO_JOB;
+			// reader->cardPosition = NOT_INSERTED;
+			reader->readerStatus = STATUS_NO_ERR;
+			reader->jobStatus = STATUS_NO_JOB;
 		}
 		break;
 
 		case SET_PRINT_PARAM:
 		{
 			printf("Command: Set print param\n");
-			// reader.cardPosition = UNDER_PRINT_HEAD;
-			reader.readerStatus = STATUS_NO_ERR;
-			reader.jobStatus = STATUS_NO_JOB;
+			// reader->cardPosition = UNDER_PRINT_HEAD;
+			reader->readerStatus = STATUS_NO_ERR;
+			reader->jobStatus = STATUS_NO_JOB;
 		}
 		break;
 
 		default:
 		{
 			printf("Error: %X is an unknown command\n", inputPacket[0]);
-			running = 0;
+			*running = 0;
 			continue;
 		}
 		}
 
+		// Injected errors replace whatever the command reported, and a
+		// failed command has no data to send back
+		if (fault.readerStatus >= 0)
+		{
+			reader->readerStatus = fault.readerStatus;
+			outputPacketDataLength = 0;
+		}
+		if (fault.jobStatus >= 0)
+			reader->jobStatus = fault.jobStatus;
+
+		jobStart(reader, fault.readerStatus, fault.jobStatus);
+
+		sessionCommand(reader, inputPacket[0], (outputPacketDataLength > dataBefore ? outputPacketDataLength - dataBefore : 0) + dataPending,
+					   inputPacket[0] == WRITE && inputPacketLength > 7 ? inputPacketLength - 7 : 0);
+
+		pthread_mutex_lock(&reader->lock);
+		snapshotSave(reader);
+		pthread_mutex_unlock(&reader->lock);
+
+		if (fault.delayMs)
+			clockSleepUs(fault.delayMs * 1000);
+
+		// A corrupted checksum shows up on the status reply for this command
+		node->corruptChecksum = fault.corrupt;
+
 		// Send the ack reply
 		unsigned char ack[] = {ACK};
-		int n = writeBytes(ack, 1, rs422Mode);
-		/*printf("ACK %d\n", n);*/
+		watchdogReplyStart(reader);
+		int queued = fault.drop ? 0 : writeBytes(ack, 1, node);
+		watchdogReplyDone(reader, inputPacket[0], node->ring ? queued : 0);
+
+		if (!fault.drop)
+			faultTransactionDone(reader, &fault, reader->readerStatus);
+
+		PROBE4(command__done, reader->id, inputPacket[0], reader->readerStatus, reader->jobStatus);
 
 		// Seperate for debugging purposes
 		// printf("\n");
 	}
 
+	// A save still running would otherwise be lost as cardd exits
+	jobFinish(reader, outputPacketData, &outputPacketDataLength);
+}
+
+static void *nodeThread(void *vargp)
+{
+	NodeThreadArguments *arguments = (NodeThreadArguments *)vargp;
+	serveNode(arguments->node, arguments->config, arguments->running);
+	free(arguments);
+	return 0;
+}
+
+/**
+ * The path of a per-reader directory, node 0 uses the base path unchanged
+ **/
+static void nodePath(char *path, int size, const char *base, int address)
+{
+	if (address == 0)
+		snprintf(path, size, "%s", base);
+	else
+		snprintf(path, size, "%s.%d", base, address);
+}
+
+/**
+ * Sets up the reader behind one node, restoring it from its own snapshot
+ *
+ * Snapshots are already kept per reader id. The dispenser stock of node 0
+ * stays where it always was, the other nodes add their address to the end
+ * of its path so each reader has its own blanks.
+ *
+ * @returns 0 on success, -1 if the daemon can't start
+ **/
+static int nodeInit(Node *node, int address, Config *config, int ring, unsigned int outputTimeoutMs, unsigned long long faultSeed)
+{
+	CardReader *reader = &node->reader;
+	node->ring = ring;
+	pthread_mutex_init(&node->input.lock, NULL);
+	pthread_cond_init(&node->input.ready, NULL);
+
+	pthread_mutex_init(&reader->lock, NULL);
+	reader->id = address;
+	reader->motion = &motionProfiles[config->game];
+	reader->dispenserFull = 1;
+	reader->coverClosed = 0;
+	reader->cardPosition = NOT_INSERTED;
+	reader->readerStatus = STATUS_NO_ERR;
+	reader->jobStatus = STATUS_NO_JOB;
+
+	// Restore the reader from its snapshot before the host can see it
+	char *customStatePath = getenv("CARD_STATE_PATH");
+	char *statePath = customStatePath ? customStatePath : DEFAULT_STATE_PATH;
+
+	if (!simulationMode && snapshotOpen(reader, statePath) == 0 && snapshotRestore(reader))
+	{
+		printf("Info: Restored reader %d state, card %s\n", address, reader->cardPosition != NOT_INSERTED ? reader->cardPath : "not inserted");
+	}
+
+	// The control port and exports read the card through its published images
+	if (imageReaderInit(reader) < 0)
+	{
+		return -1;
+	}
+
+	if (!simulationMode && getenv("CARD_SERVICE_PATH") && reader->cardPosition != NOT_INSERTED && loadCardFromFile(reader) < 0)
+	{
+		printf("Warning: Restored card %s is in use elsewhere, ejecting it\n", reader->cardPath);
+		reader->cardPosition = NOT_INSERTED;
+		snapshotSave(reader);
+	}
+
+	if (sessionInit(reader) < 0)
+	{
+		return -1;
+	}
+
+	if (jobReaderInit(reader) < 0)
+	{
+		return -1;
+	}
+
+	if (watchdogReaderInit(reader) < 0)
+	{
+		return -1;
+	}
+
+	char *customQueueDelay = getenv("CARD_QUEUE_DELAY");
+	if (queueInit(reader, customQueueDelay ? atoi(customQueueDelay) : DEFAULT_QUEUE_DELAY_MS) < 0)
+	{
+		return -1;
+	}
+
+	if (faultInit(reader, faultSeed + address) < 0)
+	{
+		return -1;
+	}
+
+	// Without a dispenser new cards are written over the last card path
+	char *customDispenserPath = getenv("CARD_DISPENSER_PATH");
+	char *customDispenserCapacity = getenv("CARD_DISPENSER_CAPACITY");
+	char *customCollectionPath = getenv("CARD_COLLECTION_PATH");
+	char dispenserPath[512];
+	nodePath(dispenserPath, sizeof(dispenserPath), customDispenserPath ? customDispenserPath : DEFAULT_DISPENSER_PATH, address);
+
+	if (!simulationMode && dispenserInit(reader, dispenserPath, customCollectionPath ? customCollectionPath : DEFAULT_COLLECTION_PATH,
+										 customDispenserCapacity ? atoi(customDispenserCapacity) : DEFAULT_DISPENSER_CAPACITY) < 0)
+	{
+		printf("Warning: The card dispenser of reader %d is off\n", address);
+	}
+
+	outputInit(&node->output, -1, outputTimeoutMs);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	printf("Card Emulator Version %d.%d\n\n", MAJOR_VERSION, MINOR_VERSION);
+
+    char *customSerialPath = getenv("CARD_SERIAL_PATH");
+    char *serialPath = customSerialPath ? customSerialPath : DEFAULT_SERIAL_PATH;
+
+	char *customConfigPath = getenv("CARD_CONFIG_PATH");
+	configInit(customConfigPath ? customConfigPath : DEFAULT_CONFIG_PATH);
+
+	Config config;
+	char configError[CONFIG_ERROR_SIZE];
+	if (configLoad(&config, configError) < 0)
+	{
+		printf("Error: %s\n", configError);
+		return EXIT_FAILURE;
+	}
+
+	// The connection mode is fixed for the life of the process
+	int rs422Mode = config.rs422Mode;
+
+	// Replays a host script against a virtual clock instead of a serial port
+	char *simulationScript = NULL;
+	if (argc > 2 && strcmp(argv[1], "--simulate") == 0)
+	{
+		simulationScript = argv[2];
+		simulationMode = 1;
+		rs422Mode = config.rs422Mode = 0;
+		clockUseVirtual(0);
+		clockSetAdvanceHook(simulationAdvance);
+	}
+
+	printf("      Config Path: %s\n", configPath());
+	printf("             Game: %s\n", configGameName(config.game));
+	printf("      Serial Path: %s\n", serialPath);
+	printf("        Baud Rate: %u\n", config.baud);
+	printf("  Connection Mode: %s\n", rs422Mode ? "RS422 Mode" : "RS232 Mode");
+	printf("   Emulation Mode: %s\n", config.shutterMode ? "Shutter" : "No Shutter");
+	printf("           Parity: %s\n", config.evenParity ? "Even" : "None");
+	printf("     Flow Control: %s\n", config.flowControl ? "RTS/CTS" : "None");
+	printf("     Control Port: %d\n\n", config.port);
+
+	if (timerWheelInit(&timerWheel) < 0 || timerWheelStart(&timerWheel) < 0)
+	{
+		return EXIT_FAILURE;
+	}
+
+	char *customReplyBudget = getenv("CARD_REPLY_BUDGET_US");
+	watchdogInit(customReplyBudget ? atoi(customReplyBudget) : config.replyBudgetUs ? config.replyBudgetUs : replyBudgetsUs[config.game]);
+
+	// Share cards with the other cabinets through the card service
+	char *servicePath = getenv("CARD_SERVICE_PATH");
+	if (!simulationMode && servicePath && serviceConnect(servicePath) < 0)
+	{
+		return EXIT_FAILURE;
+	}
+
+	char *customHistoryPath = getenv("CARD_HISTORY_PATH");
+	char *customHistoryKeepDays = getenv("CARD_HISTORY_KEEP_DAYS");
+	if (!simulationMode && historyInit(customHistoryPath ? customHistoryPath : DEFAULT_HISTORY_PATH,
+									   customHistoryKeepDays ? atoi(customHistoryKeepDays) : DEFAULT_HISTORY_KEEP_DAYS) < 0)
+	{
+		printf("Warning: Card history is off\n");
+	}
+
+	char *customCollectionPath = getenv("CARD_COLLECTION_PATH");
+	if (!simulationMode)
+	{
+		collectionInit(customCollectionPath ? customCollectionPath : DEFAULT_COLLECTION_PATH);
+		backupInit(customCollectionPath ? customCollectionPath : DEFAULT_COLLECTION_PATH);
+	}
+
+	// Cards can only be searched once the game's track layout is known
+	char *customSchemaPath = getenv("CARD_SCHEMA_PATH");
+	Schema schema;
+	char schemaError[SCHEMA_ERROR_SIZE];
+	if (!simulationMode)
+	{
+		if (schemaLoad(&schema, customSchemaPath ? customSchemaPath : DEFAULT_SCHEMA_PATH, configGameName(config.game), schemaError) < 0)
+			printf("Info: %s, card search is off\n", schemaError);
+		else if (searchInit(&schema, customCollectionPath ? customCollectionPath : DEFAULT_COLLECTION_PATH) < 0)
+			printf("Warning: Card search is off, the schema has no indexed fields\n");
+	}
+
+	char *customSessionPath = getenv("CARD_SESSION_PATH");
+	if (!simulationMode && sessionLogInit(customSessionPath ? customSessionPath : DEFAULT_SESSION_PATH) < 0)
+	{
+		printf("Warning: The session log is off\n");
+	}
+
+	// Simulations run every job inline so replays stay deterministic
+	char *customJobWorkers = getenv("CARD_JOB_WORKERS");
+	if (jobInit(simulationMode ? 0 : customJobWorkers ? atoi(customJobWorkers) : DEFAULT_JOB_WORKERS) < 0)
+	{
+		return EXIT_FAILURE;
+	}
+
+	char *customOutputTimeout = getenv("CARD_OUTPUT_TIMEOUT_MS");
+	unsigned int outputTimeoutMs = customOutputTimeout ? atoi(customOutputTimeout) : DEFAULT_OUTPUT_TIMEOUT_MS;
+
+	char *customFaultSeed = getenv("CARD_FAULT_SEED");
+	unsigned long long faultSeed = customFaultSeed ? strtoull(customFaultSeed, NULL, 0) : clockNowNs();
+
+	nodeCount = rs422Mode ? config.ringNodes : 1;
+	for (int i = 0; i < nodeCount; i++)
+	{
+		if (nodeInit(&nodes[i], i, &config, rs422Mode, outputTimeoutMs, faultSeed) < 0)
+			return EXIT_FAILURE;
+	}
+
+	if (nodeCount > 1)
+		printf("Info: Emulating %d readers on the ring\n", nodeCount);
+
+	if (simulationMode)
+	{
+		if (simulationInit(&nodes[0].reader, simulationScript) < 0)
+			return EXIT_FAILURE;
+	}
+	else
+	{
+		if ((serialIO = open(serialPath, O_RDWR | O_NOCTTY | O_SYNC | O_NDELAY)) < 0)
+		{
+			printf("Error: Could not open %s\n", serialPath);
+			return EXIT_FAILURE;
+		}
+
+		setSerialAttributes(serialIO, config.baudRate, config.evenParity, config.flowControl);
+
+		// The adapter's own buffering costs more than anything cardd does with a frame
+		char *customSysfsRoot = getenv("CARD_SYSFS_ROOT");
+		char *customLatencyTimer = getenv("CARD_LATENCY_TIMER_MS");
+		linkTune(serialPath, serialIO, customSysfsRoot ? customSysfsRoot : DEFAULT_SYSFS_ROOT,
+				 customLatencyTimer ? atoi(customLatencyTimer) : DEFAULT_LATENCY_TIMER_MS);
+		outputInit(&serialOutput, serialIO, outputTimeoutMs);
+
+		char *customIoUring = getenv("CARD_IO_URING");
+		if ((customIoUring ? atoi(customIoUring) : DEFAULT_IO_URING) && uringInit(serialIO) == 0)
+		{
+			printf("Info: Using io_uring for %s%s%s\n", uringSerialEnabled() ? "the serial port" : "",
+				   uringSerialEnabled() && uringFilesEnabled() ? " and " : "", uringFilesEnabled() ? "card files" : "");
+		}
+	}
+
+	// Restarted so a reload doesn't fail whatever read or accept it interrupts
+	struct sigaction reload = {0};
+	reload.sa_handler = reloadSignal;
+	reload.sa_flags = SA_RESTART;
+	sigaction(SIGHUP, &reload, NULL);
+
+	pthread_t rs422ThreadID = 0;
+	int running = 1;
+
+	// Outlives the ring thread, which is joined before main returns
+	RS422ThreadArguments ringArguments = {0};
+	if (rs422Mode)
+	{
+		ringArguments.fd = serialIO;
+		ringArguments.running = &running;
+		pthread_create(&rs422ThreadID, NULL, rs422Thread, &ringArguments);
+	}
+
+	pthread_t controlThreadID = 0;
+	ControlThreadArguments arguments = {0};
+	arguments.port = config.port;
+	if (!simulationMode)
+		pthread_create(&controlThreadID, NULL, controlThread, &arguments);
+
+	// Node 0 runs on this thread, the others each have their own
+	for (int i = 1; i < nodeCount; i++)
+	{
+		NodeThreadArguments *nodeArguments = malloc(sizeof(NodeThreadArguments));
+		nodeArguments->node = &nodes[i];
+		nodeArguments->config = &config;
+		nodeArguments->running = &running;
+		pthread_create(&nodes[i].thread, NULL, nodeThread, nodeArguments);
+	}
+
+	serveNode(&nodes[0], &config, &running);
+
+	for (int i = 1; i < nodeCount; i++)
+		pthread_join(nodes[i].thread, NULL);
+
 	if (rs422Mode && rs422ThreadID)
 	{
 		pthread_join(rs422ThreadID, NULL);
 	}
 
+	if (simulationMode)
+	{
+		timerWheelStop(&timerWheel);
+		return simulationReport();
+	}
+
 	pthread_join(controlThreadID, NULL);
 
+	timerWheelStop(&timerWheel);
+
+	for (int i = 0; i < nodeCount; i++)
+		snapshotClose(&nodes[i].reader);
+
+	uringClose();
 	closeDevice(serialIO);
 
 	return EXIT_SUCCESS;
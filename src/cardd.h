@@ -0,0 +1,152 @@
+#ifndef CARDD_H
+#define CARDD_H
+
+#include <pthread.h>
+
+#include "timerwheel.h"
+
+#define BUFFER_SIZE 1024
+
+/* Card Status Definitions */
+#define STATUS_NO_CARD 0x30
+#define STATUS_HAS_CARD_1 0x31
+#define STATUS_CARD_ERROR 0x32
+#define STATUS_HAS_CARD_2 0x33
+#define STATUS_EJECTING_CARD 0x34
+
+/* Reader Status Definitions */
+#define STATUS_NO_ERR 0x30
+#define STATUS_READ_ERR 0x31
+#define STATUS_WRITE_ERR 0x32
+#define STATUS_CARD_JAM 0x33
+#define STATUS_MOTOR_ERR 0x34
+#define STATUS_PRINT_ERR 0x35
+#define STATUS_ILLEGAL_ERR 0x38
+#define STATUS_BATTERY_ERR 0x40
+#define STATUS_SYSTEM_ERR 0x41
+#define STATUS_TRACK_1_READ_ERR 0x51
+#define STATUS_TRACK_2_READ_ERR 0x52
+#define STATUS_TRACK_3_READ_ERR 0x53
+#define STATUS_TRACK_1_AND_2_READ_ERR 0x54
+#define STATUS_TRACK_1_AND_3_READ_ERR 0x55
+#define STATUS_TRACK_2_AND_3_READ_ERR 0x56
+
+/* Job Status Definitions */
+#define STATUS_NO_JOB 0x30
+#define STATUS_ILLEGAL_COMMAND 0x32
+#define STATUS_RUNNING_COMMAND 0x33
+#define STATUS_WAITING_FOR_CARD 0x34
+#define STATUS_DISPENSER_EMPTY 0x35
+#define STATUS_NO_DISPENSER 0x36
+#define STATUS_CARD_FULL 0x37
+
+/* Protocol Symbolic Bytes */
+#define START_OF_TEXT 0x02
+#define END_OF_TEXT 0x03
+#define ENQUIRY 0x05
+#define ACK 0x06
+
+/* Command Bytes */
+#define INIT 0x10
+#define REGISTER_FONT 0x7A
+#define GET_STATUS 0x20
+#define SET_SHUTTER 0xD0
+#define CLEAN_CARD 0xA0
+#define EJECT_CARD 0x80
+#define READ 0x33
+#define WRITE 0x53
+#define ERASE 0x7D
+#define PRINT 0x7C
+#define SET_PRINT_PARAM 0x78
+#define NEW_CARD 0xB0
+#define CANCEL 0x40
+
+/* RS422 Ring Frame Types */
+#define RING_DATA 0x01
+#define RING_POLL 0x80
+#define RING_FETCH 0x81
+
+/* Ring nodes are addressed by bits 4 to 6 of the frame type */
+#define RING_NODES_MAX 8
+#define RING_ADDRESS(type) (((type) >> 4) & 0x07)
+#define RING_TYPE(type) ((type) & ~0x70)
+
+/* Data sizes */
+#define TRACK_SIZE 69
+
+/* Default Paths */
+#define DEFAULT_SERIAL_PATH "/dev/ttyUSB0"
+
+typedef enum
+{
+	DERBY_OWNERS_CLUB,
+	DERBY_OWNERS_CLUB_RS232,
+	WANGAN_MIDNIGHT_MAXIMUM_TUNE_3,
+	F_ZERO_AX,
+	F_ZERO_AX_MONSTER_RIDE,
+	MARIO_KART_ARCADE_GP,
+	MARIO_KART_ARCADE_GP_2,
+	INITIAL_D,
+} Game;
+
+typedef enum
+{
+	NOT_INSERTED,
+	INSERTED_IN_FRONT,
+	UNDER_PRINT_HEAD,
+	UNDER_READER,
+	DISPENCING_FROM_BACK,
+	EJECTING_CARD,
+} CardPosition;
+
+/* Time in milliseconds the card transport takes for each movement */
+typedef struct
+{
+	unsigned int toReaderMs;
+	unsigned int toPrintHeadMs;
+	unsigned int ejectMs;
+	unsigned int dispenseMs;
+	unsigned int cleanMs;
+} MotionProfile;
+
+typedef struct
+{
+	int id;
+	CardPosition cardPosition;
+	int dispenserFull;
+	int coverClosed;
+	unsigned char readerStatus;
+	unsigned char jobStatus;
+	MotionProfile *motion;
+	CardPosition motionTarget;
+	int moving;
+	Timer motionTimer;
+	pthread_mutex_t lock;
+	unsigned char lastCommand;
+	char cardPath[256];
+	unsigned char tracks[3][TRACK_SIZE];
+	struct ReaderSnapshot *snapshot;
+	struct CardQueue *queue;
+	struct FaultInjector *faults;
+	struct CardDispenser *dispenser;
+	struct ReaderSession *session;
+	struct ReaderJob *job;
+	struct CardImage *image;
+	struct ReaderWatchdog *watchdog;
+} CardReader;
+
+/* Defined in cardd.c for use by the daemon modules */
+extern TimerWheel timerWheel;
+
+void moveCard(CardReader *reader, CardPosition transit, CardPosition target, unsigned int durationMs);
+void placeCard(CardReader *reader, CardPosition position);
+int loadCard(CardReader *reader, const char *path, unsigned char tracks[3][TRACK_SIZE]);
+int saveCardToFile(CardReader *reader, const char *path, unsigned char tracks[3][TRACK_SIZE]);
+void cardLoaded(CardReader *reader, const char *path, unsigned char tracks[3][TRACK_SIZE]);
+int loadCardFromFile(CardReader *reader);
+int cardCurrent(CardReader *reader, const char *path);
+int insertCard(CardReader *reader, const char *path);
+int readCardImage(const char *path, unsigned char tracks[3][TRACK_SIZE]);
+int writeCardImage(const char *path, unsigned char tracks[3][TRACK_SIZE]);
+
+#endif
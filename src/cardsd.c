@@ -0,0 +1,474 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cardservice.h"
+#include "common.h"
+
+/**
+ * The card service
+ *
+ * Many cardd instances on one machine share their cards through this
+ * daemon instead of each opening the card files themselves. A cardd takes
+ * an exclusive lease on a card when it is inserted and gives it back when
+ * it is ejected, so two cabinets can never hold the same card at once.
+ *
+ * Active cards are kept in memory, saves only update the cache and
+ * changed cards are written to disk in batches, so a card that is written
+ * many times during a game costs one file write per flush.
+ **/
+
+#define MAX_CLIENTS 64
+#define CACHE_BUCKETS 4096
+#define CLIENT_BUFFER_SIZE 1024
+#define CLIENT_NAME_SIZE 64
+
+/* Cards nobody holds are dropped from memory after this long */
+#define CACHE_IDLE_MS (60 * 1000)
+
+typedef struct CachedCard
+{
+	struct CachedCard *next;
+	char path[256];
+	unsigned char tracks[SERVICE_TRACKS_SIZE];
+	int dirty;
+	int owner;
+	unsigned long long lastUsed;
+} CachedCard;
+
+typedef struct
+{
+	int fd;
+	char name[CLIENT_NAME_SIZE];
+	unsigned char buffer[CLIENT_BUFFER_SIZE];
+	int length;
+} Client;
+
+static CachedCard *cache[CACHE_BUCKETS];
+static Client clients[MAX_CLIENTS];
+static volatile sig_atomic_t running = 1;
+
+static struct
+{
+	unsigned long long acquires;
+	unsigned long long refused;
+	unsigned long long saves;
+	unsigned long long diskReads;
+	unsigned long long diskWrites;
+} stats;
+
+static unsigned long long nowMs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000ULL;
+}
+
+static unsigned int hashPath(const char *path)
+{
+	unsigned int hash = 2166136261u;
+	while (*path)
+		hash = (hash ^ (unsigned char)*path++) * 16777619u;
+	return hash % CACHE_BUCKETS;
+}
+
+static CachedCard *findCard(const char *path)
+{
+	for (CachedCard *card = cache[hashPath(path)]; card; card = card->next)
+	{
+		if (strcmp(card->path, path) == 0)
+			return card;
+	}
+	return NULL;
+}
+
+/**
+ * Finds a card in the cache, reading it from disk if it isn't there
+ *
+ * A card with no file starts out blank, the same as cardd does on its own.
+ **/
+static CachedCard *loadCard(const char *path)
+{
+	CachedCard *card = findCard(path);
+	if (card)
+		return card;
+
+	card = calloc(1, sizeof(CachedCard));
+	if (!card)
+		return NULL;
+
+	strcpy(card->path, path);
+	card->owner = -1;
+
+	FILE *file = fopen(path, "rb");
+	if (file)
+	{
+		if (fread(card->tracks, 1, SERVICE_TRACKS_SIZE, file) != SERVICE_TRACKS_SIZE)
+			printf("Warning: %s is short, the rest of the card is blank\n", path);
+		fclose(file);
+		stats.diskReads++;
+	}
+	else
+	{
+		printf("Info: Creating a new card %s\n", path);
+		card->dirty = 1;
+	}
+
+	unsigned int bucket = hashPath(path);
+	card->next = cache[bucket];
+	cache[bucket] = card;
+
+	return card;
+}
+
+/**
+ * Writes a card to a temporary file and renames it over the old one, so a
+ * crash mid write never leaves half a card behind
+ **/
+static int writeCard(CachedCard *card)
+{
+	char temporary[sizeof(card->path) + 16];
+	snprintf(temporary, sizeof(temporary), "%s.cardsd", card->path);
+
+	FILE *file = fopen(temporary, "wb");
+	if (!file)
+	{
+		printf("Error: Couldn't write %s\n", card->path);
+		return -1;
+	}
+
+	// Synced before the rename so a crash can't leave an empty card behind
+	size_t written = fwrite(card->tracks, 1, SERVICE_TRACKS_SIZE, file);
+	int synced = fflush(file) == 0 && fsync(fileno(file)) == 0;
+
+	if (fclose(file) != 0 || !synced || written != SERVICE_TRACKS_SIZE || rename(temporary, card->path) < 0)
+	{
+		printf("Error: Couldn't write %s\n", card->path);
+		unlink(temporary);
+		return -1;
+	}
+
+	stats.diskWrites++;
+	return 0;
+}
+
+/**
+ * Writes every changed card to disk and forgets cards that have gone idle
+ *
+ * @param evict Whether to drop idle cards from memory
+ **/
+static void flushCache(int evict)
+{
+	unsigned long long now = nowMs();
+
+	for (int bucket = 0; bucket < CACHE_BUCKETS; bucket++)
+	{
+		CachedCard **link = &cache[bucket];
+		while (*link)
+		{
+			CachedCard *card = *link;
+
+			if (card->dirty && writeCard(card) == 0)
+				card->dirty = 0;
+
+			if (evict && !card->dirty && card->owner < 0 && now - card->lastUsed > CACHE_IDLE_MS)
+			{
+				*link = card->next;
+				free(card);
+				continue;
+			}
+
+			link = &card->next;
+		}
+	}
+}
+
+/**
+ * Gives back every lease a client holds, used when it disconnects
+ **/
+static void releaseAll(int client)
+{
+	for (int bucket = 0; bucket < CACHE_BUCKETS; bucket++)
+	{
+		for (CachedCard *card = cache[bucket]; card; card = card->next)
+		{
+			if (card->owner == client)
+			{
+				printf("Info: %s released %s on disconnect\n", clients[client].name, card->path);
+				card->owner = -1;
+			}
+		}
+	}
+}
+
+static void reply(int client, unsigned char status, unsigned char *tracks)
+{
+	unsigned char response[1 + SERVICE_TRACKS_SIZE];
+	int length = 0;
+
+	response[length++] = status;
+	if (tracks)
+	{
+		memcpy(&response[length], tracks, SERVICE_TRACKS_SIZE);
+		length += SERVICE_TRACKS_SIZE;
+	}
+
+	if (write(clients[client].fd, response, length) != length)
+		printf("Warning: Couldn't reply to %s\n", clients[client].name);
+}
+
+/**
+ * Handles one complete request from a client
+ **/
+static void handleRequest(int client, unsigned char op, const char *path, unsigned char *tracks)
+{
+	Client *self = &clients[client];
+
+	if (op == SERVICE_HELLO)
+	{
+		snprintf(self->name, sizeof(self->name), "%s", path);
+		printf("Info: %s connected\n", self->name);
+		reply(client, SERVICE_OK, NULL);
+		return;
+	}
+
+	// cardd sends resolved absolute paths, so each card has exactly one lease
+	if (path[0] != '/')
+	{
+		printf("Warning: %s sent the relative path %s\n", self->name, path);
+		reply(client, op == SERVICE_RELEASE ? SERVICE_NOT_HELD : SERVICE_ERROR, NULL);
+		return;
+	}
+
+	CachedCard *card = op == SERVICE_RELEASE ? findCard(path) : loadCard(path);
+
+	if (op == SERVICE_RELEASE)
+	{
+		if (!card || card->owner != client)
+		{
+			reply(client, SERVICE_NOT_HELD, NULL);
+			return;
+		}
+
+		card->owner = -1;
+		card->lastUsed = nowMs();
+		printf("Info: %s released %s\n", self->name, path);
+		reply(client, SERVICE_OK, NULL);
+		return;
+	}
+
+	if (!card)
+	{
+		reply(client, SERVICE_ERROR, NULL);
+		return;
+	}
+
+	if (card->owner >= 0 && card->owner != client)
+	{
+		stats.refused++;
+		printf("Warning: %s asked for %s, which %s holds\n", self->name, path, clients[card->owner].name);
+		reply(client, SERVICE_LEASED, NULL);
+		return;
+	}
+
+	// A save without a lease takes one, so leases survive cardsd restarting
+	if (card->owner != client)
+		printf("Info: %s leased %s\n", self->name, path);
+	card->owner = client;
+	card->lastUsed = nowMs();
+
+	if (op == SERVICE_ACQUIRE)
+	{
+		stats.acquires++;
+		reply(client, SERVICE_OK, card->tracks);
+		return;
+	}
+
+	stats.saves++;
+	memcpy(card->tracks, tracks, SERVICE_TRACKS_SIZE);
+	card->dirty = 1;
+	reply(client, SERVICE_OK, NULL);
+}
+
+/**
+ * Takes every complete request out of a client's buffer
+ *
+ * @returns 0 on success, -1 if the client sent something malformed
+ **/
+static int handleInput(int client)
+{
+	Client *self = &clients[client];
+	int offset = 0;
+
+	while (self->length - offset >= 2)
+	{
+		unsigned char *request = &self->buffer[offset];
+		unsigned char op = request[0];
+		int pathLength = request[1];
+		int length = 2 + pathLength + (op == SERVICE_SAVE ? SERVICE_TRACKS_SIZE : 0);
+
+		if (op < SERVICE_HELLO || op > SERVICE_RELEASE || pathLength == 0)
+			return -1;
+
+		if (self->length - offset < length)
+			break;
+
+		char path[256];
+		memcpy(path, &request[2], pathLength);
+		path[pathLength] = '\0';
+
+		handleRequest(client, op, path, &request[2 + pathLength]);
+		offset += length;
+	}
+
+	memmove(self->buffer, &self->buffer[offset], self->length - offset);
+	self->length -= offset;
+
+	return 0;
+}
+
+static void stop(int signal)
+{
+	running = 0;
+}
+
+int main(int argc, char *argv[])
+{
+	printf("Card Service Version %d.%d\n\n", MAJOR_VERSION, MINOR_VERSION);
+
+	char *customServicePath = getenv("CARD_SERVICE_PATH");
+	char *servicePath = customServicePath ? customServicePath : DEFAULT_SERVICE_PATH;
+
+	char *customFlush = getenv("CARD_SERVICE_FLUSH_MS");
+	unsigned int flushMs = customFlush ? atoi(customFlush) : DEFAULT_SERVICE_FLUSH_MS;
+
+	printf("      Socket Path: %s\n", servicePath);
+	printf("   Flush Interval: %ums\n\n", flushMs);
+
+	struct sockaddr_un address = {0};
+	address.sun_family = AF_UNIX;
+
+	if (strlen(servicePath) >= sizeof(address.sun_path))
+	{
+		printf("Error: Socket path %s is too long\n", servicePath);
+		return EXIT_FAILURE;
+	}
+	strcpy(address.sun_path, servicePath);
+
+	int server = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	unlink(servicePath);
+
+	if (server < 0 || bind(server, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(server, MAX_CLIENTS) < 0)
+	{
+		printf("Error: Couldn't listen on %s\n", servicePath);
+		return EXIT_FAILURE;
+	}
+
+	struct sigaction action = {0};
+	action.sa_handler = stop;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	for (int i = 0; i < MAX_CLIENTS; i++)
+		clients[i].fd = -1;
+
+	unsigned long long nextFlush = nowMs() + flushMs;
+
+	while (running)
+	{
+		struct pollfd fds[MAX_CLIENTS + 1];
+		int owners[MAX_CLIENTS + 1];
+		int count = 0;
+
+		fds[count].fd = server;
+		fds[count].events = POLLIN;
+		owners[count++] = -1;
+
+		for (int i = 0; i < MAX_CLIENTS; i++)
+		{
+			if (clients[i].fd < 0)
+				continue;
+			fds[count].fd = clients[i].fd;
+			fds[count].events = POLLIN;
+			owners[count++] = i;
+		}
+
+		unsigned long long now = nowMs();
+		int timeout = now >= nextFlush ? 0 : nextFlush - now;
+
+		if (poll(fds, count, timeout) < 0 && errno != EINTR)
+		{
+			printf("Error: Poll failed\n");
+			break;
+		}
+
+		if (nowMs() >= nextFlush)
+		{
+			flushCache(1);
+			nextFlush = nowMs() + flushMs;
+		}
+
+		if (fds[0].revents & POLLIN)
+		{
+			int fd = accept(server, NULL, NULL);
+			int slot = -1;
+
+			for (int i = 0; fd >= 0 && i < MAX_CLIENTS && slot < 0; i++)
+			{
+				if (clients[i].fd < 0)
+					slot = i;
+			}
+
+			if (slot < 0)
+			{
+				if (fd >= 0)
+					close(fd);
+			}
+			else
+			{
+				clients[slot].fd = fd;
+				clients[slot].length = 0;
+				snprintf(clients[slot].name, sizeof(clients[slot].name), "client %d", slot);
+			}
+		}
+
+		for (int i = 1; i < count; i++)
+		{
+			if (!fds[i].revents)
+				continue;
+
+			Client *client = &clients[owners[i]];
+			int bytesRead = read(client->fd, &client->buffer[client->length], CLIENT_BUFFER_SIZE - client->length);
+
+			if (bytesRead > 0)
+			{
+				client->length += bytesRead;
+				if (handleInput(owners[i]) == 0)
+					continue;
+				printf("Error: %s sent a malformed request\n", client->name);
+			}
+
+			releaseAll(owners[i]);
+			close(client->fd);
+			client->fd = -1;
+		}
+	}
+
+	flushCache(0);
+	close(server);
+	unlink(servicePath);
+
+	printf("Info: %llu acquires (%llu refused), %llu saves, %llu disk reads, %llu disk writes\n",
+		   stats.acquires, stats.refused, stats.saves, stats.diskReads, stats.diskWrites);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,37 @@
+#ifndef CARDSERVICE_H
+#define CARDSERVICE_H
+
+/**
+ * The protocol between cardd and the card service, cardsd
+ *
+ * Each cardd keeps one Unix socket connection open to cardsd and sends one
+ * request at a time. A request is an operation byte, a length prefixed
+ * card path and, for saves, the card tracks. The reply is a status byte,
+ * followed by the tracks when a lease is granted.
+ *
+ * Leases belong to the connection, so a cardd that exits or crashes gives
+ * up all of its cards.
+ **/
+
+/* Default socket the card service listens on */
+#define DEFAULT_SERVICE_PATH "/var/tmp/cardd/cardsd.sock"
+
+/* How often the card service writes changed cards to disk */
+#define DEFAULT_SERVICE_FLUSH_MS 1000
+
+/* The size of a card image, three tracks of TRACK_SIZE bytes */
+#define SERVICE_TRACKS_SIZE (3 * 69)
+
+/* Operations */
+#define SERVICE_HELLO 1
+#define SERVICE_ACQUIRE 2
+#define SERVICE_SAVE 3
+#define SERVICE_RELEASE 4
+
+/* Reply statuses */
+#define SERVICE_OK 0
+#define SERVICE_LEASED 1
+#define SERVICE_NOT_HELD 2
+#define SERVICE_ERROR 255
+
+#endif
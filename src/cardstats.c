@@ -0,0 +1,404 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "session.h"
+
+/**
+ * Session log queries
+ *
+ * Adds up the sessions cardd has logged without going through cardd. The
+ * segment files are mapped read only and only the columns a query needs
+ * are read, a whole segment is skipped when its name puts it outside the
+ * days asked for. It is safe to run against segments cardd is still
+ * appending to.
+ **/
+
+#define MS_PER_DAY (24ULL * 60 * 60 * 1000)
+
+/* Cards shown when grouping by card, busiest first */
+#define TOP_CARDS 20
+
+typedef enum
+{
+	BY_READER,
+	BY_DAY,
+	BY_CARD,
+} Grouping;
+
+typedef struct
+{
+	unsigned long long key;
+	unsigned long long sessions;
+	unsigned long long durationMs;
+	unsigned long long longestMs;
+	unsigned long long opcodes[SESSION_OPCODES];
+	unsigned long long bytesRead;
+	unsigned long long bytesWritten;
+	unsigned long long errors;
+	unsigned long long dispensed;
+} Totals;
+
+typedef struct
+{
+	Totals *slots;
+	unsigned int capacity;
+	unsigned int count;
+} Groups;
+
+typedef struct
+{
+	unsigned long long fromMs;
+	unsigned long long toMs;
+	int reader;
+	int filterCard;
+	unsigned long long cardId;
+	Grouping grouping;
+} Query;
+
+static unsigned long long nowMs()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	return now.tv_sec * 1000ULL + now.tv_nsec / 1000000;
+}
+
+static unsigned long long localDayStartMs(unsigned long long timeMs)
+{
+	time_t seconds = timeMs / 1000;
+	struct tm day;
+	localtime_r(&seconds, &day);
+	day.tm_hour = day.tm_min = day.tm_sec = 0;
+	day.tm_isdst = -1;
+	return mktime(&day) * 1000ULL;
+}
+
+/**
+ * Reads a date as YYYY-MM-DD
+ *
+ * @returns 0 on success, -1 if it isn't a date
+ **/
+static int parseDate(const char *text, unsigned long long *startMs)
+{
+	struct tm day = {0};
+	char end;
+
+	if (sscanf(text, "%d-%d-%d%c", &day.tm_year, &day.tm_mon, &day.tm_mday, &end) != 3)
+		return -1;
+
+	day.tm_year -= 1900;
+	day.tm_mon -= 1;
+	day.tm_isdst = -1;
+
+	time_t seconds = mktime(&day);
+	if (seconds < 0)
+		return -1;
+
+	*startMs = seconds * 1000ULL;
+	return 0;
+}
+
+static unsigned long long columnValue(const SessionSegment *segment, SessionColumn column, unsigned int index)
+{
+	const unsigned char *value = (const unsigned char *)segment + segment->offset[column] + (unsigned long long)segment->width[column] * index;
+
+	switch (segment->width[column])
+	{
+	case 8:
+		return *(const unsigned long long *)value;
+	case 4:
+		return *(const unsigned int *)value;
+	default:
+		return *value;
+	}
+}
+
+static Totals *findGroup(Groups *groups, unsigned long long key)
+{
+	if (groups->count * 2 >= groups->capacity)
+	{
+		Groups grown = {calloc(groups->capacity * 2, sizeof(Totals)), groups->capacity * 2, 0};
+		if (!grown.slots)
+			return NULL;
+
+		for (unsigned int i = 0; i < groups->capacity; i++)
+		{
+			if (groups->slots[i].sessions)
+				*findGroup(&grown, groups->slots[i].key) = groups->slots[i];
+		}
+
+		free(groups->slots);
+		*groups = grown;
+	}
+
+	unsigned int slot = (key * 0x9E3779B97F4A7C15ULL) >> 32 & (groups->capacity - 1);
+
+	while (groups->slots[slot].sessions && groups->slots[slot].key != key)
+		slot = (slot + 1) & (groups->capacity - 1);
+
+	if (!groups->slots[slot].sessions)
+	{
+		groups->slots[slot].key = key;
+		groups->count++;
+	}
+
+	return &groups->slots[slot];
+}
+
+static void addSession(Totals *totals, const SessionSegment *segment, unsigned int index, unsigned long long durationMs)
+{
+	totals->sessions++;
+	totals->durationMs += durationMs;
+	if (durationMs > totals->longestMs)
+		totals->longestMs = durationMs;
+
+	for (int i = 0; i < SESSION_OPCODES; i++)
+		totals->opcodes[i] += columnValue(segment, SESSION_COUNT_READS + i, index);
+
+	totals->bytesRead += columnValue(segment, SESSION_BYTES_READ, index);
+	totals->bytesWritten += columnValue(segment, SESSION_BYTES_WRITTEN, index);
+	totals->errors += columnValue(segment, SESSION_ERRORS, index);
+	if (columnValue(segment, SESSION_FLAGS, index) & SESSION_DISPENSED)
+		totals->dispensed++;
+}
+
+/**
+ * Adds the sessions of one segment that match the query
+ *
+ * @returns The number of sessions added, or -1 if the file isn't a segment
+ **/
+static int scanSegment(const char *path, const Query *query, Totals *all, Groups *groups)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	struct stat status;
+	if (fstat(fd, &status) < 0 || status.st_size < sizeof(SessionSegment))
+	{
+		close(fd);
+		return -1;
+	}
+
+	const SessionSegment *segment = mmap(NULL, status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (segment == MAP_FAILED)
+		return -1;
+
+	if (memcmp(segment->magic, SESSION_MAGIC, SESSION_MAGIC_SIZE) != 0 || segment->capacity == 0 ||
+		segment->offset[SESSION_COLUMNS - 1] + (unsigned long long)segment->width[SESSION_COLUMNS - 1] * segment->capacity > status.st_size)
+	{
+		munmap((void *)segment, status.st_size);
+		return -1;
+	}
+
+	// Sessions below the count are complete even while cardd appends
+	unsigned int count = __atomic_load_n(&segment->count, __ATOMIC_ACQUIRE);
+	if (count > segment->capacity)
+		count = segment->capacity;
+
+	int added = 0;
+	unsigned long long dayStart = 0, dayEnd = 0;
+	for (unsigned int i = 0; i < count; i++)
+	{
+		unsigned long long insertedMs = columnValue(segment, SESSION_INSERTED_MS, i);
+		if (insertedMs < query->fromMs || insertedMs >= query->toMs)
+			continue;
+
+		if (query->reader >= 0 && columnValue(segment, SESSION_READER, i) != query->reader)
+			continue;
+
+		unsigned long long cardId = columnValue(segment, SESSION_CARD_ID, i);
+		if (query->filterCard && cardId != query->cardId)
+			continue;
+
+		unsigned long long key = query->grouping == BY_CARD ? cardId : columnValue(segment, SESSION_READER, i);
+
+		// Sessions come in time order, so the day only needs working out when it changes
+		if (query->grouping == BY_DAY)
+		{
+			if (insertedMs < dayStart || insertedMs >= dayEnd)
+			{
+				dayStart = localDayStartMs(insertedMs);
+				dayEnd = localDayStartMs(dayStart + MS_PER_DAY + MS_PER_DAY / 2);
+			}
+			key = dayStart;
+		}
+
+		unsigned long long durationMs = columnValue(segment, SESSION_DURATION_MS, i);
+		addSession(all, segment, i, durationMs);
+
+		Totals *group = findGroup(groups, key);
+		if (group)
+			addSession(group, segment, i, durationMs);
+		added++;
+	}
+
+	munmap((void *)segment, status.st_size);
+	return added;
+}
+
+static int compareKeys(const void *a, const void *b)
+{
+	const Totals *x = a, *y = b;
+	return (x->key > y->key) - (x->key < y->key);
+}
+
+static int compareSessions(const void *a, const void *b)
+{
+	const Totals *x = a, *y = b;
+	return (x->sessions < y->sessions) - (x->sessions > y->sessions);
+}
+
+static void printTotals(const char *key, const Totals *totals)
+{
+	printf("%-16s %8llu %8llus %8llus %8llu %8llu %8llu %8llu %10llu %10llu %6llu %6.1f%%\n", key, totals->sessions,
+		   totals->durationMs / totals->sessions / 1000, totals->longestMs / 1000, totals->opcodes[SESSION_READS],
+		   totals->opcodes[SESSION_WRITES], totals->opcodes[SESSION_ERASES], totals->opcodes[SESSION_PRINTS], totals->bytesRead,
+		   totals->bytesWritten, totals->errors, totals->dispensed * 100.0 / totals->sessions);
+}
+
+static void usage(const char *name)
+{
+	printf("usage: %s [option...] [directory]\n", name);
+	printf(" options:\n");
+	printf("  --days n         | Sessions from the last n days, 30 by default\n");
+	printf("  --from date      | Sessions from the start of a day, as YYYY-MM-DD\n");
+	printf("  --to date        | Sessions up to the end of a day, as YYYY-MM-DD\n");
+	printf("  --reader n       | Only sessions in reader n\n");
+	printf("  --card path      | Only sessions of one card\n");
+	printf("  --by reader|day|card | How the sessions are broken down, by reader by default\n");
+}
+
+int main(int argc, char *argv[])
+{
+	char *customSessionPath = getenv("CARD_SESSION_PATH");
+	const char *directory = customSessionPath ? customSessionPath : DEFAULT_SESSION_PATH;
+
+	unsigned long long now = nowMs();
+	Query query = {0};
+	query.fromMs = localDayStartMs(now) - 29 * MS_PER_DAY;
+	query.toMs = now + MS_PER_DAY;
+	query.reader = -1;
+
+	for (int i = 1; i < argc; i++)
+	{
+		int more = i + 1 < argc;
+
+		if (strcmp(argv[i], "--days") == 0 && more)
+			query.fromMs = localDayStartMs(now) - (atoi(argv[++i]) - 1) * MS_PER_DAY;
+		else if (strcmp(argv[i], "--from") == 0 && more && parseDate(argv[i + 1], &query.fromMs) == 0)
+			i++;
+		else if (strcmp(argv[i], "--to") == 0 && more && parseDate(argv[i + 1], &query.toMs) == 0)
+			query.toMs += MS_PER_DAY, i++;
+		else if (strcmp(argv[i], "--reader") == 0 && more)
+			query.reader = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--card") == 0 && more)
+			query.filterCard = 1, query.cardId = sessionCardId(argv[++i]);
+		else if (strcmp(argv[i], "--by") == 0 && more && strcmp(argv[i + 1], "reader") == 0)
+			query.grouping = BY_READER, i++;
+		else if (strcmp(argv[i], "--by") == 0 && more && strcmp(argv[i + 1], "day") == 0)
+			query.grouping = BY_DAY, i++;
+		else if (strcmp(argv[i], "--by") == 0 && more && strcmp(argv[i + 1], "card") == 0)
+			query.grouping = BY_CARD, i++;
+		else if (argv[i][0] != '-')
+			directory = argv[i];
+		else
+		{
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	DIR *entries = opendir(directory);
+	if (!entries)
+	{
+		printf("Error: Couldn't open the session log %s\n", directory);
+		return EXIT_FAILURE;
+	}
+
+	struct timespec started, finished;
+	clock_gettime(CLOCK_MONOTONIC, &started);
+
+	Totals all = {0};
+	Groups groups = {calloc(64, sizeof(Totals)), 64, 0};
+	int segments = 0;
+
+	struct dirent *entry;
+	while ((entry = readdir(entries)))
+	{
+		char date[11];
+		int part;
+		unsigned long long dayMs;
+
+		if (sscanf(entry->d_name, "%10[0-9-].%d.seg", date, &part) != 2 || parseDate(date, &dayMs) < 0)
+			continue;
+
+		// Sessions are filed under the day they ended, a card left in overnight went in the day before
+		if (dayMs + MS_PER_DAY <= query.fromMs || dayMs >= query.toMs + MS_PER_DAY)
+			continue;
+
+		char path[1024];
+		snprintf(path, sizeof(path), "%s/%s", directory, entry->d_name);
+		if (scanSegment(path, &query, &all, &groups) < 0)
+			printf("Warning: %s isn't a session segment\n", path);
+		else
+			segments++;
+	}
+
+	closedir(entries);
+	clock_gettime(CLOCK_MONOTONIC, &finished);
+
+	if (all.sessions == 0)
+	{
+		printf("No sessions\n");
+		return EXIT_SUCCESS;
+	}
+
+	// Pack the groups to the front of the table to sort them
+	unsigned int count = 0;
+	for (unsigned int i = 0; i < groups.capacity; i++)
+	{
+		if (groups.slots[i].sessions)
+			groups.slots[count++] = groups.slots[i];
+	}
+
+	qsort(groups.slots, count, sizeof(Totals), query.grouping == BY_CARD ? compareSessions : compareKeys);
+	if (query.grouping == BY_CARD && count > TOP_CARDS)
+		count = TOP_CARDS;
+
+	printf("%-16s %8s %9s %9s %8s %8s %8s %8s %10s %10s %6s %7s\n", query.grouping == BY_CARD ? "card" : query.grouping == BY_DAY ? "day" : "reader",
+		   "sessions", "average", "longest", "reads", "writes", "erases", "prints", "bytes in", "bytes out", "errors", "new");
+
+	for (unsigned int i = 0; i < count; i++)
+	{
+		char key[32];
+		time_t seconds = groups.slots[i].key / 1000;
+		struct tm day;
+
+		if (query.grouping == BY_CARD)
+			snprintf(key, sizeof(key), "%016llx", groups.slots[i].key);
+		else if (query.grouping == BY_DAY && localtime_r(&seconds, &day))
+			strftime(key, sizeof(key), "%Y-%m-%d", &day);
+		else
+			snprintf(key, sizeof(key), "%llu", groups.slots[i].key);
+
+		printTotals(key, &groups.slots[i]);
+	}
+
+	printTotals("all", &all);
+
+	unsigned long long elapsedUs = (finished.tv_sec - started.tv_sec) * 1000000ULL + (finished.tv_nsec - started.tv_nsec) / 1000;
+	printf("\n%llu sessions from %d segments in %llu.%03llums\n", all.sessions, segments, elapsedUs / 1000, elapsedUs % 1000);
+
+	free(groups.slots);
+	return EXIT_SUCCESS;
+}
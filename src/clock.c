@@ -0,0 +1,102 @@
+#include <time.h>
+#include <unistd.h>
+
+#include "clock.h"
+
+static int virtualClock = 0;
+static volatile unsigned long long virtualNs = 0;
+static unsigned long long virtualWallNs = 0;
+static ClockAdvanceHook advanceHook = 0;
+
+/**
+ * Switches the daemon onto virtual time
+ *
+ * This must happen before any other thread starts using the clock.
+ *
+ * @param startNs The time the virtual clock starts at
+ **/
+void clockUseVirtual(unsigned long long startNs)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	virtualWallNs = (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec - startNs;
+
+	virtualNs = startNs;
+	virtualClock = 1;
+}
+
+int clockIsVirtual()
+{
+	return virtualClock;
+}
+
+/**
+ * Sets a function to call every time virtual time moves forward
+ *
+ * The simulation uses this to turn the timer wheel, as there is no timerfd
+ * thread to do it on virtual time.
+ **/
+void clockSetAdvanceHook(ClockAdvanceHook hook)
+{
+	advanceHook = hook;
+}
+
+unsigned long long clockNowNs()
+{
+	if (virtualClock)
+		return __atomic_load_n(&virtualNs, __ATOMIC_ACQUIRE);
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+unsigned long long clockNowMs()
+{
+	return clockNowNs() / 1000000ULL;
+}
+
+/**
+ * Wall clock time in milliseconds since the epoch, for timestamps kept on
+ * disk
+ *
+ * On virtual time this starts at the wall clock time the switch was made
+ * and moves with the virtual clock.
+ **/
+unsigned long long clockWallMs()
+{
+	if (virtualClock)
+		return (virtualWallNs + __atomic_load_n(&virtualNs, __ATOMIC_ACQUIRE)) / 1000000ULL;
+
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (unsigned long long)ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Moves virtual time forward, does nothing on the wall clock
+ **/
+void clockAdvanceNs(unsigned long long ns)
+{
+	if (!virtualClock)
+		return;
+
+	unsigned long long now = __atomic_add_fetch(&virtualNs, ns, __ATOMIC_ACQ_REL);
+
+	if (advanceHook)
+		advanceHook(now);
+}
+
+/**
+ * Sleeps for the given time, on virtual time this returns immediately
+ **/
+void clockSleepUs(unsigned long long us)
+{
+	if (virtualClock)
+	{
+		clockAdvanceNs(us * 1000ULL);
+		return;
+	}
+
+	usleep(us);
+}
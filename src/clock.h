@@ -0,0 +1,23 @@
+#ifndef CLOCK_H
+#define CLOCK_H
+
+/**
+ * The daemon's source of time
+ *
+ * Every sleep, timeout and timestamp in cardd goes through here so that the
+ * simulation mode can swap wall-clock time for a virtual clock that only
+ * moves when the simulation advances it.
+ **/
+
+typedef void (*ClockAdvanceHook)(unsigned long long nowNs);
+
+void clockUseVirtual(unsigned long long startNs);
+int clockIsVirtual();
+void clockSetAdvanceHook(ClockAdvanceHook hook);
+unsigned long long clockNowNs();
+unsigned long long clockNowMs();
+unsigned long long clockWallMs();
+void clockAdvanceNs(unsigned long long ns);
+void clockSleepUs(unsigned long long us);
+
+#endif
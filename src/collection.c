@@ -0,0 +1,401 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "backup.h"
+#include "clock.h"
+#include "collection.h"
+#include "common.h"
+#include "history.h"
+#include "image.h"
+#include "search.h"
+#include "service.h"
+#include "transfer.h"
+
+/**
+ * Bulk export and import of the card collection
+ *
+ * Each transfer runs on its own thread with its own connection, so a full
+ * export never holds up the control port or the readers. The only shared
+ * state touched is the cards in the readers, which are copied from their
+ * latest published images rather than read from files that may be half
+ * way through being saved.
+ **/
+
+static char collectionPath[512];
+
+typedef struct
+{
+	CardReader *readers[RING_NODES_MAX];
+	int readerCount;
+	int socket;
+	unsigned char command;
+} TransferArguments;
+
+/* The files behind the cards in every reader when a transfer started */
+typedef struct
+{
+	CardReader *reader[RING_NODES_MAX];
+	struct stat file[RING_NODES_MAX];
+	int count;
+} LiveCards;
+
+/**
+ * Sets up the directory the collection is kept in
+ *
+ * @returns 0 on success, -1 on failure
+ **/
+int collectionInit(const char *directory)
+{
+	if (strlen(directory) >= sizeof(collectionPath))
+		return -1;
+
+	if (mkdir(directory, 0755) < 0 && errno != EEXIST)
+	{
+		printf("Error: Couldn't create collection directory %s\n", directory);
+		return -1;
+	}
+
+	strcpy(collectionPath, directory);
+	return 0;
+}
+
+/**
+ * Finds the files behind the cards in the readers, for those that have one
+ **/
+static void findLiveCards(TransferArguments *arguments, LiveCards *live)
+{
+	live->count = 0;
+
+	for (int i = 0; i < arguments->readerCount; i++)
+	{
+		CardReader *reader = arguments->readers[i];
+		char path[sizeof(reader->cardPath)];
+
+		pthread_mutex_lock(&reader->lock);
+		int inserted = reader->cardPosition != NOT_INSERTED;
+		strcpy(path, reader->cardPath);
+		pthread_mutex_unlock(&reader->lock);
+
+		if (inserted && stat(path, &live->file[live->count]) == 0)
+			live->reader[live->count++] = reader;
+	}
+}
+
+/**
+ * @returns The reader holding the card in file, or NULL if no reader does
+ **/
+static CardReader *liveReader(LiveCards *live, struct stat *file)
+{
+	for (int i = 0; i < live->count; i++)
+	{
+		if (live->file[i].st_dev == file->st_dev && live->file[i].st_ino == file->st_ino)
+			return live->reader[i];
+	}
+	return NULL;
+}
+
+static int validName(const char *name)
+{
+	return name[0] != '\0' && name[0] != '.' && !strchr(name, '/');
+}
+
+static void exportCollection(TransferArguments *arguments)
+{
+	int socket = arguments->socket;
+	unsigned char response = COMMAND_FAILURE;
+
+	DIR *directory = opendir(collectionPath);
+	if (!directory)
+	{
+		printf("Error: Couldn't open collection directory %s\n", collectionPath);
+		write(socket, &response, 1);
+		return;
+	}
+
+	// Names are gathered first so the client knows how many cards to expect
+	int namesSize = 64 * 1024, namesLength = 0;
+	unsigned int count = 0;
+	char *names = malloc(namesSize);
+	TransferChunk *chunk = malloc(sizeof(TransferChunk));
+
+	struct dirent *entry;
+	while (names && (entry = readdir(directory)))
+	{
+		if (!validName(entry->d_name) || (entry->d_type != DT_REG && entry->d_type != DT_UNKNOWN))
+			continue;
+
+		int length = strlen(entry->d_name) + 1;
+		if (length > TRANSFER_NAME_SIZE)
+			continue;
+
+		if (namesLength + length > namesSize)
+		{
+			namesSize *= 2;
+			char *grown = realloc(names, namesSize);
+			if (!grown)
+			{
+				free(names);
+				names = NULL;
+				break;
+			}
+			names = grown;
+		}
+
+		memcpy(&names[namesLength], entry->d_name, length);
+		namesLength += length;
+		count++;
+	}
+
+	if (!names || !chunk)
+	{
+		printf("Error: Couldn't allocate the collection export\n");
+		write(socket, &response, 1);
+		goto done;
+	}
+
+	response = COMMAND_SUCCESS;
+	if (transferWriteAll(socket, &response, 1) < 0 || transferWriteHeader(socket, count) < 0)
+		goto done;
+
+	LiveCards live;
+	findLiveCards(arguments, &live);
+
+	unsigned long long startedAt = clockNowNs();
+	unsigned int exported = 0, skipped = 0;
+	unsigned char tracks[TRANSFER_TRACKS_SIZE];
+	transferChunkReset(chunk);
+
+	for (int offset = 0; offset < namesLength; offset += strlen(&names[offset]) + 1)
+	{
+		char *name = &names[offset];
+		struct stat file;
+
+		int fd = openat(dirfd(directory), name, O_RDONLY | O_CLOEXEC);
+		if (fd < 0 || fstat(fd, &file) < 0 || !S_ISREG(file.st_mode))
+		{
+			if (fd >= 0)
+				close(fd);
+			skipped++;
+			continue;
+		}
+
+		CardReader *reader = liveReader(&live, &file);
+		if (reader)
+		{
+			imageRead(reader, (unsigned char (*)[TRACK_SIZE])tracks);
+		}
+		else if (transferReadAll(fd, tracks, TRANSFER_TRACKS_SIZE) < 0)
+		{
+			close(fd);
+			skipped++;
+			continue;
+		}
+
+		close(fd);
+
+		if (transferChunkAdd(chunk, name, tracks) < 0)
+		{
+			if (transferChunkWrite(socket, chunk) < 0)
+				goto done;
+			transferChunkAdd(chunk, name, tracks);
+		}
+
+		exported++;
+	}
+
+	if (chunk->count && transferChunkWrite(socket, chunk) < 0)
+		goto done;
+
+	// The empty chunk ends the stream, then the real totals follow
+	if (transferChunkWrite(socket, chunk) < 0 || transferWriteNumber(socket, exported) < 0 || transferWriteNumber(socket, skipped) < 0)
+		goto done;
+
+	printf("Info: Exported %u cards in %llums, skipped %u\n", exported, (clockNowNs() - startedAt) / 1000000ULL, skipped);
+
+done:
+	free(names);
+	free(chunk);
+	closedir(directory);
+}
+
+/**
+ * Writes one imported card next to its final name then renames it in, so
+ * nothing ever sees half a card
+ *
+ * @returns 0 on success, -1 on failure
+ **/
+static int importCard(int directory, const char *name, const unsigned char *tracks)
+{
+	char temporary[TRANSFER_NAME_SIZE + 16];
+	snprintf(temporary, sizeof(temporary), ".%s.import", name);
+
+	int fd = openat(directory, temporary, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return -1;
+
+	// Synced before the rename so a crash can't leave an empty card behind
+	int result = transferWriteAll(fd, tracks, TRANSFER_TRACKS_SIZE);
+	if (fsync(fd) < 0)
+		result = -1;
+	if (close(fd) < 0)
+		result = -1;
+
+	char path[sizeof(collectionPath) + TRANSFER_NAME_SIZE + 1];
+	snprintf(path, sizeof(path), "%s/%s", collectionPath, name);
+	backupCardWriting(path);
+
+	// The image being replaced goes into the history first, dated from when
+	// it was written, so a bad import can be rolled back
+	if (historyEnabled())
+	{
+		unsigned char previous[TRANSFER_TRACKS_SIZE];
+		struct stat status;
+		int existing = openat(directory, name, O_RDONLY | O_CLOEXEC);
+
+		if (existing >= 0)
+		{
+			if (fstat(existing, &status) == 0 && transferReadAll(existing, previous, TRANSFER_TRACKS_SIZE) == 0)
+				historyRecordWait(path, (unsigned char (*)[TRACK_SIZE])previous, status.st_mtim.tv_sec * 1000ULL + status.st_mtim.tv_nsec / 1000000);
+			close(existing);
+		}
+	}
+
+	if (result < 0 || renameat(directory, temporary, directory, name) < 0)
+	{
+		unlinkat(directory, temporary, 0);
+		return -1;
+	}
+
+	backupCardWritten(path, (unsigned char (*)[TRACK_SIZE])tracks);
+	historyRecordWait(path, (unsigned char (*)[TRACK_SIZE])tracks, 0);
+	searchCardSavedWait(path, (unsigned char (*)[TRACK_SIZE])tracks);
+	return 0;
+}
+
+static void importCollection(TransferArguments *arguments)
+{
+	int socket = arguments->socket;
+	unsigned char response = COMMAND_FAILURE;
+	unsigned int imported = 0, rejected = 0, skipped = 0, count;
+
+	TransferChunk *chunk = malloc(sizeof(TransferChunk));
+	int directory = open(collectionPath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+	if (!chunk || directory < 0 || transferReadHeader(socket, &count) < 0)
+	{
+		printf("Error: Couldn't start the collection import\n");
+		goto done;
+	}
+
+	LiveCards live;
+	findLiveCards(arguments, &live);
+
+	unsigned long long startedAt = clockNowNs();
+	char name[TRANSFER_NAME_SIZE];
+	unsigned char tracks[TRANSFER_TRACKS_SIZE];
+	int cards;
+
+	while ((cards = transferChunkRead(socket, chunk)) > 0)
+	{
+		int result, processed = 0;
+		while ((result = transferChunkNext(chunk, name, tracks)) != 0)
+		{
+			if (result == -2)
+			{
+				rejected += cards - processed;
+				break;
+			}
+
+			processed++;
+
+			struct stat file;
+			if (result < 0 || !validName(name))
+				rejected++;
+			else if (fstatat(directory, name, &file, 0) == 0 && liveReader(&live, &file))
+				skipped++;
+			else if (importCard(directory, name, tracks) < 0)
+				rejected++;
+			else
+				imported++;
+		}
+	}
+
+	if (cards == 0)
+		response = COMMAND_SUCCESS;
+
+	printf("Info: Imported %u cards in %llums, rejected %u, skipped %u in the reader\n",
+		   imported, (clockNowNs() - startedAt) / 1000000ULL, rejected, skipped);
+
+done:
+	if (transferWriteAll(socket, &response, 1) == 0)
+	{
+		transferWriteNumber(socket, imported);
+		transferWriteNumber(socket, rejected);
+		transferWriteNumber(socket, skipped);
+	}
+
+	if (directory >= 0)
+		close(directory);
+	free(chunk);
+}
+
+static void *transferThread(void *vargp)
+{
+	TransferArguments *arguments = (TransferArguments *)vargp;
+
+	if (arguments->command == COMMAND_EXPORT)
+		exportCollection(arguments);
+	else
+		importCollection(arguments);
+
+	close(arguments->socket);
+	free(arguments);
+	return 0;
+}
+
+/**
+ * Hands a control connection over to a transfer thread
+ *
+ * The thread owns the socket from here on and closes it when done.
+ * Transfers are refused with a card service, which keeps its own copy of
+ * each card and would write it back over an imported file.
+ *
+ * @param readers Every reader, whose cards are exported from memory and
+ *                left alone by an import
+ * @param command COMMAND_EXPORT or COMMAND_IMPORT
+ * @returns 0 if the transfer started, -1 if the caller still owns the socket
+ **/
+int collectionServe(CardReader **readers, int readerCount, int socket, unsigned char command)
+{
+	if (serviceEnabled())
+	{
+		printf("Error: Export and import are off with a card service\n");
+		return -1;
+	}
+
+	TransferArguments *arguments = malloc(sizeof(TransferArguments));
+	if (!arguments)
+		return -1;
+
+	memcpy(arguments->readers, readers, readerCount * sizeof(CardReader *));
+	arguments->readerCount = readerCount;
+	arguments->socket = socket;
+	arguments->command = command;
+
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, transferThread, arguments) != 0)
+	{
+		free(arguments);
+		return -1;
+	}
+
+	pthread_detach(thread);
+	return 0;
+}
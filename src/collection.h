@@ -0,0 +1,12 @@
+#ifndef COLLECTION_H
+#define COLLECTION_H
+
+#include "cardd.h"
+
+/* Default directory the card collection is kept in */
+#define DEFAULT_COLLECTION_PATH "/var/tmp/cardd/cards"
+
+int collectionInit(const char *directory);
+int collectionServe(CardReader **readers, int readerCount, int socket, unsigned char command);
+
+#endif
@@ -2,6 +2,28 @@
 #define COMMAND_GET_STATUS 1
 #define COMMAND_INSERT_CARD 2
 #define COMMAND_EJECT_CARD 3
+#define COMMAND_QUEUE_ADD 4
+#define COMMAND_QUEUE_LIST 5
+#define COMMAND_QUEUE_MOVE 6
+#define COMMAND_QUEUE_REMOVE 7
+#define COMMAND_QUEUE_CLEAR 8
+#define COMMAND_QUEUE_DELAY 9
+#define COMMAND_EXPORT 10
+#define COMMAND_IMPORT 11
+#define COMMAND_DEADLINES 12
+#define COMMAND_RELOAD 13
+#define COMMAND_FAULT_ADD 14
+#define COMMAND_FAULT_LIST 15
+#define COMMAND_FAULT_CLEAR 16
+#define COMMAND_HISTORY 17
+#define COMMAND_ROLLBACK 18
+#define COMMAND_DISPENSER 19
+#define COMMAND_OUTPUT 20
+#define COMMAND_NODE 21
+#define COMMAND_BACKUP 22
+#define COMMAND_FIND 23
+#define COMMAND_CARD 24
+#define COMMAND_SESSIONS 25
 
 /* Statuses of the card */
 #define COMMAND_STATUS_CARD_INSERTED 1
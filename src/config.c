@@ -0,0 +1,272 @@
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <termios.h>
+
+#include "common.h"
+#include "config.h"
+
+/**
+ * The configuration file
+ *
+ * A plain list of `key = value` lines, with # starting a comment. Every
+ * key is optional and anything left out keeps its default. cardctl reads
+ * the same file to find the control port.
+ **/
+
+static char path[512] = DEFAULT_CONFIG_PATH;
+static volatile int reloadRequested = 0;
+
+static const struct
+{
+	const char *name;
+	Game game;
+} games[] = {
+	{"derby-owners-club", DERBY_OWNERS_CLUB},
+	{"derby-owners-club-rs232", DERBY_OWNERS_CLUB_RS232},
+	{"wangan-midnight-maximum-tune-3", WANGAN_MIDNIGHT_MAXIMUM_TUNE_3},
+	{"f-zero-ax", F_ZERO_AX},
+	{"f-zero-ax-monster-ride", F_ZERO_AX_MONSTER_RIDE},
+	{"mario-kart-arcade-gp", MARIO_KART_ARCADE_GP},
+	{"mario-kart-arcade-gp-2", MARIO_KART_ARCADE_GP_2},
+	{"initial-d", INITIAL_D},
+};
+
+static const struct
+{
+	unsigned int baud;
+	int baudRate;
+} baudRates[] = {
+	{9600, B9600},
+	{19200, B19200},
+	{38400, B38400},
+	{57600, B57600},
+	{115200, B115200},
+	{230400, B230400},
+	{460800, B460800},
+	{500000, B500000},
+	{921600, B921600},
+	{1000000, B1000000},
+	{1500000, B1500000},
+	{2000000, B2000000},
+	{3000000, B3000000},
+};
+
+void configInit(const char *configPath)
+{
+	snprintf(path, sizeof(path), "%s", configPath);
+}
+
+const char *configPath()
+{
+	return path;
+}
+
+void configDefaults(Config *config)
+{
+	config->game = DERBY_OWNERS_CLUB;
+	config->rs422Mode = 1;
+	config->shutterMode = 1;
+	config->evenParity = 0;
+	config->flowControl = 0;
+	config->baud = 2000000;
+	config->baudRate = B2000000;
+	config->port = PORT;
+	config->replyBudgetUs = 0;
+	config->ringNodes = 1;
+}
+
+const char *configGameName(Game game)
+{
+	for (int i = 0; i < sizeof(games) / sizeof(games[0]); i++)
+	{
+		if (games[i].game == game)
+			return games[i].name;
+	}
+	return "unknown";
+}
+
+static int parseBoolean(const char *value, int *result)
+{
+	if (!strcasecmp(value, "yes") || !strcasecmp(value, "true") || !strcasecmp(value, "on") || !strcmp(value, "1"))
+		*result = 1;
+	else if (!strcasecmp(value, "no") || !strcasecmp(value, "false") || !strcasecmp(value, "off") || !strcmp(value, "0"))
+		*result = 0;
+	else
+		return -1;
+	return 0;
+}
+
+static int parseNumber(const char *value, unsigned int *result)
+{
+	char *end;
+	errno = 0;
+	unsigned long number = strtoul(value, &end, 10);
+	if (errno || end == value || *end || number > 0xFFFFFFFF)
+		return -1;
+	*result = number;
+	return 0;
+}
+
+static char *trim(char *string)
+{
+	while (isspace((unsigned char)*string))
+		string++;
+
+	char *end = string + strlen(string);
+	while (end > string && isspace((unsigned char)end[-1]))
+		*--end = '\0';
+
+	return string;
+}
+
+static int setting(Config *config, const char *key, const char *value)
+{
+	unsigned int number;
+
+	if (!strcmp(key, "game"))
+	{
+		for (int i = 0; i < sizeof(games) / sizeof(games[0]); i++)
+		{
+			if (!strcasecmp(value, games[i].name))
+			{
+				config->game = games[i].game;
+				return 0;
+			}
+		}
+		return -1;
+	}
+
+	if (!strcmp(key, "rs422Mode"))
+		return parseBoolean(value, &config->rs422Mode);
+	if (!strcmp(key, "shutterMode"))
+		return parseBoolean(value, &config->shutterMode);
+	if (!strcmp(key, "evenParity"))
+		return parseBoolean(value, &config->evenParity);
+	if (!strcmp(key, "flowControl"))
+		return parseBoolean(value, &config->flowControl);
+
+	if (!strcmp(key, "baudRate"))
+	{
+		if (parseNumber(value, &number) < 0)
+			return -1;
+		for (int i = 0; i < sizeof(baudRates) / sizeof(baudRates[0]); i++)
+		{
+			if (baudRates[i].baud == number)
+			{
+				config->baud = number;
+				config->baudRate = baudRates[i].baudRate;
+				return 0;
+			}
+		}
+		return -1;
+	}
+
+	if (!strcmp(key, "port"))
+	{
+		if (parseNumber(value, &number) < 0 || number == 0 || number > 65535)
+			return -1;
+		config->port = number;
+		return 0;
+	}
+
+	if (!strcmp(key, "replyBudgetUs"))
+		return parseNumber(value, &config->replyBudgetUs);
+
+	if (!strcmp(key, "ringNodes"))
+	{
+		if (parseNumber(value, &number) < 0 || number == 0 || number > RING_NODES_MAX)
+			return -1;
+		config->ringNodes = number;
+		return 0;
+	}
+
+	return -2;
+}
+
+/**
+ * Reads the configuration file over the defaults
+ *
+ * The file is parsed into a copy and only copied into config if every line
+ * is valid, so a bad edit never leaves a half applied configuration.
+ *
+ * @param config The configuration to load into
+ * @param error A CONFIG_ERROR_SIZE buffer describing what went wrong
+ * @returns 0 on success or if there is no file, -1 on failure
+ **/
+int configLoad(Config *config, char *error)
+{
+	Config loaded;
+	configDefaults(&loaded);
+
+	FILE *file = fopen(path, "r");
+	if (!file)
+	{
+		if (errno == ENOENT)
+		{
+			*config = loaded;
+			return 0;
+		}
+		snprintf(error, CONFIG_ERROR_SIZE, "Couldn't open %s", path);
+		return -1;
+	}
+
+	char line[512];
+	int lineNumber = 0;
+
+	while (fgets(line, sizeof(line), file))
+	{
+		lineNumber++;
+
+		char *comment = strchr(line, '#');
+		if (comment)
+			*comment = '\0';
+
+		char *key = trim(line);
+		if (!*key)
+			continue;
+
+		char *equals = strchr(key, '=');
+		if (!equals)
+		{
+			snprintf(error, CONFIG_ERROR_SIZE, "%s line %d: expected key = value", path, lineNumber);
+			fclose(file);
+			return -1;
+		}
+
+		*equals = '\0';
+		key = trim(key);
+		char *value = trim(equals + 1);
+
+		int result = setting(&loaded, key, value);
+		if (result < 0)
+		{
+			snprintf(error, CONFIG_ERROR_SIZE, result == -2 ? "%s line %d: unknown setting %s" : "%s line %d: bad value for %s",
+					 path, lineNumber, key);
+			fclose(file);
+			return -1;
+		}
+	}
+
+	fclose(file);
+	*config = loaded;
+	return 0;
+}
+
+/**
+ * Asks the protocol loop to reload the configuration before the next packet
+ *
+ * This only sets a flag, so it is safe to call from a signal handler.
+ **/
+void configRequestReload()
+{
+	reloadRequested = 1;
+}
+
+int configReloadRequested()
+{
+	return __atomic_exchange_n(&reloadRequested, 0, __ATOMIC_ACQ_REL);
+}
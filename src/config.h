@@ -0,0 +1,33 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include "cardd.h"
+
+/* Default location of the configuration file, a missing file means defaults */
+#define DEFAULT_CONFIG_PATH "/etc/cardd.conf"
+
+#define CONFIG_ERROR_SIZE 256
+
+typedef struct
+{
+	Game game;
+	int rs422Mode;
+	int shutterMode;
+	int evenParity;
+	int flowControl;
+	unsigned int baud;
+	int baudRate;
+	int port;
+	unsigned int replyBudgetUs;
+	unsigned int ringNodes;
+} Config;
+
+void configInit(const char *path);
+const char *configPath();
+void configDefaults(Config *config);
+int configLoad(Config *config, char *error);
+const char *configGameName(Game game);
+void configRequestReload();
+int configReloadRequested();
+
+#endif
@@ -0,0 +1,276 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dispenser.h"
+#include "probes.h"
+
+static int validId(const char *name)
+{
+	if (strlen(name) != DISPENSER_ID_SIZE - 1)
+		return 0;
+
+	for (int i = 0; name[i]; i++)
+	{
+		if (!strchr("0123456789abcdef", name[i]))
+			return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * Tells the game whether there are cards left, called with the dispenser
+ * locked
+ **/
+static void updateStock(CardReader *reader)
+{
+	int stocked = reader->dispenser->count > 0;
+
+	pthread_mutex_lock(&reader->lock);
+	reader->dispenserFull = stocked;
+	pthread_mutex_unlock(&reader->lock);
+}
+
+/**
+ * Makes one blank card in the stock directory
+ *
+ * The card is written under a temporary name and renamed into place, so
+ * the stock never holds half a card after a crash.
+ *
+ * @returns 0 on success, -1 on failure
+ **/
+static int makeBlank(CardDispenser *dispenser, char *id)
+{
+	unsigned long long random;
+	char temporary[300], path[300];
+
+	if (getrandom(&random, sizeof(random), 0) != sizeof(random))
+		return -1;
+
+	snprintf(id, DISPENSER_ID_SIZE, "%016llx", random);
+	snprintf(temporary, sizeof(temporary), "%s/.%s", dispenser->stockPath, id);
+	snprintf(path, sizeof(path), "%s/%s", dispenser->stockPath, id);
+
+	int fd = open(temporary, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return -1;
+
+	unsigned char tracks[3 * TRACK_SIZE] = {0};
+	int result = write(fd, tracks, sizeof(tracks)) == sizeof(tracks) && fdatasync(fd) == 0 ? 0 : -1;
+	close(fd);
+
+	// Linking fails rather than replacing a card that already has the id
+	if (result < 0 || link(temporary, path) < 0)
+	{
+		unlink(temporary);
+		return -1;
+	}
+
+	unlink(temporary);
+	return 0;
+}
+
+static void *dispenserThread(void *vargp)
+{
+	CardReader *reader = (CardReader *)vargp;
+	CardDispenser *dispenser = reader->dispenser;
+
+	pthread_mutex_lock(&dispenser->lock);
+
+	for (;;)
+	{
+		while (dispenser->count >= dispenser->capacity)
+			pthread_cond_wait(&dispenser->replenish, &dispenser->lock);
+
+		// Blanks are made without the lock so dispensing never waits on the disk
+		pthread_mutex_unlock(&dispenser->lock);
+
+		char id[DISPENSER_ID_SIZE];
+		int result = makeBlank(dispenser, id);
+
+		pthread_mutex_lock(&dispenser->lock);
+
+		if (result < 0)
+		{
+			dispenser->failed++;
+			printf("Error: Couldn't make a blank card in %s\n", dispenser->stockPath);
+
+			struct timespec retry;
+			clock_gettime(CLOCK_REALTIME, &retry);
+			retry.tv_sec++;
+			pthread_cond_timedwait(&dispenser->replenish, &dispenser->lock, &retry);
+			continue;
+		}
+
+		if (dispenser->count < DISPENSER_SIZE)
+		{
+			strcpy(dispenser->ids[dispenser->count++], id);
+			if (dispenser->count == 1)
+				updateStock(reader);
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Sets up the dispenser for a reader with whatever blank cards were left in
+ * stock, and starts topping it up
+ *
+ * @param stockPath The directory blank cards are kept in
+ * @param cardsPath The directory dispensed cards are moved to
+ * @param capacity The number of blank cards to keep ready
+ * @returns 0 on success, -1 on failure
+ **/
+int dispenserInit(CardReader *reader, const char *stockPath, const char *cardsPath, int capacity)
+{
+	if (strlen(stockPath) >= 256 || strlen(cardsPath) >= 256)
+		return -1;
+
+	if (mkdir(stockPath, 0755) < 0 && errno != EEXIST)
+	{
+		printf("Error: Couldn't create dispenser directory %s\n", stockPath);
+		return -1;
+	}
+
+	DIR *directory = opendir(stockPath);
+	CardDispenser *dispenser = calloc(1, sizeof(CardDispenser));
+
+	if (!directory || !dispenser)
+	{
+		printf("Error: Couldn't set up the card dispenser\n");
+		if (directory)
+			closedir(directory);
+		free(dispenser);
+		return -1;
+	}
+
+	strcpy(dispenser->stockPath, stockPath);
+	strcpy(dispenser->cardsPath, cardsPath);
+	dispenser->capacity = capacity < 0 ? 0 : capacity > DISPENSER_SIZE ? DISPENSER_SIZE : capacity;
+	pthread_mutex_init(&dispenser->lock, NULL);
+	pthread_cond_init(&dispenser->replenish, NULL);
+
+	struct dirent *entry;
+	while ((entry = readdir(directory)))
+	{
+		struct stat card;
+
+		// Left behind by a blank that was being made when cardd stopped
+		if (entry->d_name[0] == '.' && validId(&entry->d_name[1]))
+		{
+			unlinkat(dirfd(directory), entry->d_name, 0);
+			continue;
+		}
+
+		if (!validId(entry->d_name) || dispenser->count == DISPENSER_SIZE)
+			continue;
+
+		if (fstatat(dirfd(directory), entry->d_name, &card, 0) == 0 && S_ISREG(card.st_mode) && card.st_size == 3 * TRACK_SIZE)
+			strcpy(dispenser->ids[dispenser->count++], entry->d_name);
+	}
+
+	closedir(directory);
+
+	reader->dispenser = dispenser;
+	updateStock(reader);
+
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, dispenserThread, reader) != 0)
+	{
+		reader->dispenser = NULL;
+		free(dispenser);
+		return -1;
+	}
+	pthread_detach(thread);
+
+	printf("Info: Dispenser has %d blank cards\n", dispenser->count);
+
+	return 0;
+}
+
+/**
+ * Dispenses the top blank card into the collection
+ *
+ * @param cardPath Set to the path of the new card
+ * @param size The size of cardPath
+ * @returns 0 on success, -1 if the dispenser is empty
+ **/
+int dispenserTake(CardReader *reader, char *cardPath, int size)
+{
+	CardDispenser *dispenser = reader->dispenser;
+	char stock[300];
+
+	pthread_mutex_lock(&dispenser->lock);
+
+	while (dispenser->count)
+	{
+		char *id = dispenser->ids[--dispenser->count];
+
+		snprintf(stock, sizeof(stock), "%s/%s", dispenser->stockPath, id);
+		snprintf(cardPath, size, "%s/%s.bin", dispenser->cardsPath, id);
+
+		if (rename(stock, cardPath) < 0)
+		{
+			// A blank that has gone missing is skipped for the next one,
+			// but if the collection can't take it, it stays in stock
+			if (access(stock, F_OK) == 0)
+			{
+				dispenser->count++;
+				break;
+			}
+			continue;
+		}
+
+		dispenser->dispensed++;
+		pthread_cond_signal(&dispenser->replenish);
+		if (dispenser->count == 0)
+			updateStock(reader);
+		pthread_mutex_unlock(&dispenser->lock);
+
+		PROBE2(dispenser__take, reader->id, cardPath);
+		return 0;
+	}
+
+	dispenser->empty++;
+	pthread_cond_signal(&dispenser->replenish);
+	updateStock(reader);
+	pthread_mutex_unlock(&dispenser->lock);
+
+	return -1;
+}
+
+/**
+ * Changes how many blank cards are kept ready
+ *
+ * Blanks over the new capacity are left in the stock directory for later.
+ *
+ * @returns 0 on success, -1 if the capacity is too large
+ **/
+int dispenserSetCapacity(CardReader *reader, int capacity)
+{
+	CardDispenser *dispenser = reader->dispenser;
+
+	if (capacity < 0 || capacity > DISPENSER_SIZE)
+		return -1;
+
+	pthread_mutex_lock(&dispenser->lock);
+
+	dispenser->capacity = capacity;
+	if (dispenser->count > capacity)
+		dispenser->count = capacity;
+
+	pthread_cond_signal(&dispenser->replenish);
+	updateStock(reader);
+	pthread_mutex_unlock(&dispenser->lock);
+
+	return 0;
+}
@@ -0,0 +1,42 @@
+#ifndef DISPENSER_H
+#define DISPENSER_H
+
+#include <pthread.h>
+
+#include "cardd.h"
+
+#define DISPENSER_SIZE 256
+#define DISPENSER_ID_SIZE 17
+
+/* Default directory the blank cards are kept in until they are dispensed */
+#define DEFAULT_DISPENSER_PATH "/var/tmp/cardd/dispenser"
+
+/* Default number of blank cards kept ready */
+#define DEFAULT_DISPENSER_CAPACITY 20
+
+/**
+ * The stack of blank cards behind a reader
+ *
+ * Each blank is a zeroed card file with a unique id, made ahead of time by
+ * the dispenser thread, so dispensing one is taking the top id off the
+ * stack and moving its file into the collection.
+ **/
+typedef struct CardDispenser
+{
+	char stockPath[256];
+	char cardsPath[256];
+	char ids[DISPENSER_SIZE][DISPENSER_ID_SIZE];
+	int count;
+	int capacity;
+	unsigned int dispensed;
+	unsigned int empty;
+	unsigned int failed;
+	pthread_mutex_t lock;
+	pthread_cond_t replenish;
+} CardDispenser;
+
+int dispenserInit(CardReader *reader, const char *stockPath, const char *cardsPath, int capacity);
+int dispenserTake(CardReader *reader, char *cardPath, int size);
+int dispenserSetCapacity(CardReader *reader, int capacity);
+
+#endif
@@ -0,0 +1,239 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "clock.h"
+#include "fault.h"
+#include "probes.h"
+
+/**
+ * Fault injection
+ *
+ * Each reader carries a set of rules, each matching one opcode (or every
+ * opcode) and firing with some probability. A rule can report a reader
+ * error or job status, hold the reply back, drop it, corrupt its checksum
+ * or jam the card until the host sends INIT.
+ *
+ * Recovery latency is the time from the first fault to the next command
+ * the reader acknowledges cleanly, which is how long the game took to get
+ * itself out of its error path.
+ **/
+
+static unsigned long long nextRandom(FaultInjector *faults)
+{
+	// xorshift64*, plenty for deciding whether a fault fires
+	faults->random ^= faults->random >> 12;
+	faults->random ^= faults->random << 25;
+	faults->random ^= faults->random >> 27;
+	return faults->random * 2685821657736338717ULL;
+}
+
+/**
+ * Sets up fault injection for a reader with no rules
+ *
+ * @param seed Seed for the random number generator, so a soak run can be repeated
+ * @returns 0 on success, -1 on failure
+ **/
+int faultInit(CardReader *reader, unsigned long long seed)
+{
+	FaultInjector *faults = calloc(1, sizeof(FaultInjector));
+
+	if (!faults)
+	{
+		printf("Error: Couldn't allocate the fault injector\n");
+		return -1;
+	}
+
+	pthread_mutex_init(&faults->lock, NULL);
+	faults->random = seed ? seed : 0x9E3779B97F4A7C15ULL;
+	reader->faults = faults;
+
+	return 0;
+}
+
+/**
+ * Adds a rule
+ *
+ * @returns 0 on success, -1 if there is no room or the rule is invalid
+ **/
+int faultAdd(CardReader *reader, FaultRule *rule)
+{
+	FaultInjector *faults = reader->faults;
+
+	if (rule->opcode > FAULT_ANY_OPCODE || rule->type >= FAULT_TYPES || rule->probability > FAULT_CERTAIN)
+		return -1;
+
+	pthread_mutex_lock(&faults->lock);
+
+	if (faults->count == FAULT_RULES)
+	{
+		pthread_mutex_unlock(&faults->lock);
+		return -1;
+	}
+
+	faults->rules[faults->count++] = *rule;
+
+	pthread_mutex_unlock(&faults->lock);
+
+	return 0;
+}
+
+/**
+ * Removes every rule, clears a jam and resets the statistics
+ **/
+void faultClear(CardReader *reader)
+{
+	FaultInjector *faults = reader->faults;
+
+	pthread_mutex_lock(&faults->lock);
+	faults->count = 0;
+	faults->jammed = 0;
+	faults->recovering = 0;
+	memset(&faults->stats, 0, sizeof(faults->stats));
+	pthread_mutex_unlock(&faults->lock);
+}
+
+/**
+ * Copies the rules out
+ *
+ * @param rules A buffer of FAULT_RULES rules
+ * @returns The number of rules
+ **/
+int faultRules(CardReader *reader, FaultRule *rules)
+{
+	FaultInjector *faults = reader->faults;
+
+	pthread_mutex_lock(&faults->lock);
+	int count = faults->count;
+	memcpy(rules, faults->rules, count * sizeof(FaultRule));
+	pthread_mutex_unlock(&faults->lock);
+
+	return count;
+}
+
+void faultGetStats(CardReader *reader, FaultStats *stats)
+{
+	FaultInjector *faults = reader->faults;
+
+	pthread_mutex_lock(&faults->lock);
+	*stats = faults->stats;
+	stats->jammed = faults->jammed;
+	stats->recovering = faults->recovering;
+	stats->recoveringMs = faults->recovering ? (clockNowNs() - faults->faultAt) / 1000000ULL : 0;
+	pthread_mutex_unlock(&faults->lock);
+}
+
+/**
+ * Decides which faults to inject into the reply to a frame
+ *
+ * @param opcode The command, or ENQUIRY for a status request
+ * @param action Filled in with what to do to the reply
+ **/
+void faultCheck(CardReader *reader, unsigned char opcode, FaultAction *action)
+{
+	FaultInjector *faults = reader->faults;
+
+	memset(action, 0, sizeof(*action));
+	action->readerStatus = -1;
+	action->jobStatus = -1;
+
+	if (!faults)
+		return;
+
+	pthread_mutex_lock(&faults->lock);
+
+	// A jammed card stays jammed until the host reinitialises the reader
+	if (opcode == INIT)
+		faults->jammed = 0;
+
+	for (int i = 0; i < faults->count; i++)
+	{
+		FaultRule *rule = &faults->rules[i];
+
+		if (rule->opcode != FAULT_ANY_OPCODE && rule->opcode != opcode)
+			continue;
+
+		if (nextRandom(faults) % FAULT_CERTAIN >= rule->probability)
+			continue;
+
+		switch (rule->type)
+		{
+		case FAULT_ERROR:
+			action->readerStatus = rule->value;
+			break;
+		case FAULT_JOB:
+			action->jobStatus = rule->value;
+			break;
+		case FAULT_DELAY:
+			action->delayMs += rule->value;
+			break;
+		case FAULT_DROP:
+			action->drop = 1;
+			break;
+		case FAULT_CORRUPT:
+			action->corrupt = 1;
+			break;
+		case FAULT_JAM:
+			faults->jammed = 1;
+			break;
+		default:
+			continue;
+		}
+
+		faults->stats.injected[rule->type]++;
+		action->injected = 1;
+
+		PROBE3(fault__inject, reader->id, opcode, rule->type);
+	}
+
+	if (faults->jammed && opcode != ENQUIRY)
+	{
+		action->readerStatus = STATUS_CARD_JAM;
+		action->injected = 1;
+	}
+
+	if (action->injected && !faults->recovering)
+	{
+		faults->recovering = 1;
+		faults->faultAt = clockNowNs();
+	}
+
+	pthread_mutex_unlock(&faults->lock);
+}
+
+/**
+ * Records the outcome of a transaction once its reply has gone out
+ *
+ * The first command acknowledged without a fault or error after a fault
+ * ends the recovery.
+ **/
+void faultTransactionDone(CardReader *reader, FaultAction *action, unsigned char readerStatus)
+{
+	FaultInjector *faults = reader->faults;
+
+	if (!faults || action->injected || readerStatus != STATUS_NO_ERR)
+		return;
+
+	pthread_mutex_lock(&faults->lock);
+
+	if (!faults->recovering)
+	{
+		pthread_mutex_unlock(&faults->lock);
+		return;
+	}
+
+	unsigned int recoveryMs = (clockNowNs() - faults->faultAt) / 1000000ULL;
+	FaultStats *stats = &faults->stats;
+
+	faults->recovering = 0;
+	if (stats->recoveries == 0 || recoveryMs < stats->recoveryMinMs)
+		stats->recoveryMinMs = recoveryMs;
+	if (recoveryMs > stats->recoveryMaxMs)
+		stats->recoveryMaxMs = recoveryMs;
+	stats->recoveries++;
+	stats->recoveryTotalMs += recoveryMs;
+
+	pthread_mutex_unlock(&faults->lock);
+
+	PROBE2(fault__recover, reader->id, recoveryMs);
+}
@@ -0,0 +1,81 @@
+#ifndef FAULT_H
+#define FAULT_H
+
+#include <pthread.h>
+
+#include "cardd.h"
+
+#define FAULT_RULES 32
+
+/* Matches every opcode, including enquiries */
+#define FAULT_ANY_OPCODE 0x100
+
+/* Probabilities are in parts per million */
+#define FAULT_CERTAIN 1000000
+
+typedef enum
+{
+	FAULT_ERROR,
+	FAULT_JOB,
+	FAULT_DELAY,
+	FAULT_DROP,
+	FAULT_CORRUPT,
+	FAULT_JAM,
+	FAULT_TYPES,
+} FaultType;
+
+typedef struct
+{
+	unsigned int opcode;
+	FaultType type;
+	unsigned int probability;
+	unsigned int value;
+} FaultRule;
+
+/* What to do to the reply of one transaction */
+typedef struct
+{
+	int injected;
+	unsigned int delayMs;
+	int drop;
+	int corrupt;
+	int readerStatus;
+	int jobStatus;
+} FaultAction;
+
+typedef struct
+{
+	unsigned long long injected[FAULT_TYPES];
+	unsigned long long recoveries;
+	unsigned long long recoveryTotalMs;
+	unsigned int recoveryMinMs;
+	unsigned int recoveryMaxMs;
+	unsigned int recoveringMs;
+	int recovering;
+	int jammed;
+} FaultStats;
+
+/**
+ * The fault injection rules and recovery statistics of one reader
+ **/
+typedef struct FaultInjector
+{
+	FaultRule rules[FAULT_RULES];
+	int count;
+	int jammed;
+	int recovering;
+	unsigned long long faultAt;
+	unsigned long long random;
+	FaultStats stats;
+	pthread_mutex_t lock;
+} FaultInjector;
+
+int faultInit(CardReader *reader, unsigned long long seed);
+int faultAdd(CardReader *reader, FaultRule *rule);
+void faultClear(CardReader *reader);
+int faultRules(CardReader *reader, FaultRule *rules);
+void faultGetStats(CardReader *reader, FaultStats *stats);
+void faultCheck(CardReader *reader, unsigned char opcode, FaultAction *action);
+void faultTransactionDone(CardReader *reader, FaultAction *action, unsigned char readerStatus);
+
+#endif
@@ -0,0 +1,37 @@
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash.h"
+
+/**
+ * 64 bit FNV-1a hash of some bytes
+ **/
+unsigned long long hashBytes(const void *data, size_t length)
+{
+	const unsigned char *bytes = data;
+	unsigned long long hash = 0xCBF29CE484222325ULL;
+
+	for (size_t i = 0; i < length; i++)
+	{
+		hash ^= bytes[i];
+		hash *= 0x100000001B3ULL;
+	}
+
+	return hash;
+}
+
+/**
+ * Hashes a card's path, resolved so the same file always has the same hash
+ * however its path was written
+ *
+ * A path that can't be resolved, such as a card not yet written, is hashed
+ * as given.
+ **/
+unsigned long long hashPath(const char *path)
+{
+	char canonical[PATH_MAX];
+	const char *resolved = realpath(path, canonical) ? canonical : path;
+
+	return hashBytes(resolved, strlen(resolved));
+}
@@ -0,0 +1,9 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+
+unsigned long long hashBytes(const void *data, size_t length);
+unsigned long long hashPath(const char *path);
+
+#endif
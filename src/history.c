@@ -0,0 +1,989 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "clock.h"
+#include "hash.h"
+#include "history.h"
+#include "probes.h"
+#include "transfer.h"
+#include "workqueue.h"
+
+/**
+ * Versioned card history
+ *
+ * Every card image written or loaded is recorded against the card's real path
+ * and the wall clock time. Images are content addressed by a 64 bit
+ * FNV-1a hash, so an image seen before is never stored twice, and a new
+ * image is stored as the bytes that changed from the card's previous one,
+ * up to HISTORY_CHAIN_MAX deltas deep before it is stored whole again.
+ *
+ * The store is two append only files, objects holding the images and
+ * versions holding which image each card had when. Both are read into
+ * memory at startup, the objects as a hash table of file offsets and the
+ * versions as a time ordered array per card, so finding a card's state at
+ * any time is a binary search.
+ *
+ * Cards are handed over through a queue and stored by the history thread,
+ * so a card write never waits on the history. Once a day the store is
+ * compacted, versions older than the keep period are thinned to the last
+ * one of each day and the files are rewritten with fresh delta chains.
+ **/
+
+#define HISTORY_TRACKS_SIZE (3 * TRACK_SIZE)
+#define MS_PER_DAY (24ULL * 60 * 60 * 1000)
+
+#define OBJECTS_MAGIC "CARDOBJ1"
+#define VERSIONS_MAGIC "CARDVER1"
+#define MAGIC_SIZE 8
+
+#define OBJECT_FULL 0
+#define OBJECT_DELTA 1
+
+/* Kind, hash, base hash and payload length */
+#define OBJECT_HEADER_SIZE (1 + 8 + 8 + 2)
+#define OBJECT_RECORD_MAX (OBJECT_HEADER_SIZE + HISTORY_TRACKS_SIZE + 4)
+
+/* Time, hash and name length */
+#define VERSION_HEADER_SIZE (8 + 8 + 1)
+#define VERSION_RECORD_MAX (VERSION_HEADER_SIZE + 255 + 4)
+
+typedef struct
+{
+	unsigned long long hash;
+	unsigned int offset;
+	unsigned int depth;
+} HistoryObject;
+
+typedef struct
+{
+	int fd;
+	unsigned long long size;
+	HistoryObject *table;
+	unsigned int capacity;
+	unsigned int count;
+	unsigned int deltas;
+} HistoryObjects;
+
+typedef struct
+{
+	char *name;
+	HistoryVersion *versions;
+	int count;
+	int capacity;
+} HistoryCard;
+
+typedef struct
+{
+	char path[256];
+	unsigned char tracks[HISTORY_TRACKS_SIZE];
+	unsigned long long timeMs;
+} HistoryEntry;
+
+static char historyPath[512];
+static unsigned int keepDays;
+static int enabled = 0;
+
+static pthread_mutex_t storeLock = PTHREAD_MUTEX_INITIALIZER;
+static HistoryObjects objects;
+static int versionsFd = -1;
+static unsigned long long versionsSize;
+static unsigned int versionCount;
+static unsigned int deduplicated;
+static HistoryCard **cards;
+static unsigned int cardCapacity;
+static unsigned int cardCount;
+
+
+static unsigned long long hashKey(const void *data, int length)
+{
+	unsigned long long hash = hashBytes(data, length);
+
+	// Zero marks an empty slot in the tables
+	return hash ? hash : 1;
+}
+
+static void put64(unsigned char *bytes, unsigned long long number)
+{
+	for (int i = 0; i < 8; i++)
+		bytes[i] = number >> (56 - 8 * i);
+}
+
+static unsigned long long get64(const unsigned char *bytes)
+{
+	unsigned long long number = 0;
+	for (int i = 0; i < 8; i++)
+		number = (number << 8) | bytes[i];
+	return number;
+}
+
+static void put32(unsigned char *bytes, unsigned int number)
+{
+	bytes[0] = number >> 24;
+	bytes[1] = number >> 16;
+	bytes[2] = number >> 8;
+	bytes[3] = number;
+}
+
+static unsigned int get32(const unsigned char *bytes)
+{
+	return (bytes[0] << 24) | (bytes[1] << 16) | (bytes[2] << 8) | bytes[3];
+}
+
+static HistoryObject *findObject(HistoryObjects *store, unsigned long long hash)
+{
+	unsigned int mask = store->capacity - 1;
+
+	if (!store->capacity)
+		return NULL;
+
+	for (unsigned int i = hash & mask; store->table[i].hash; i = (i + 1) & mask)
+	{
+		if (store->table[i].hash == hash)
+			return &store->table[i];
+	}
+
+	return NULL;
+}
+
+static int addObject(HistoryObjects *store, unsigned long long hash, unsigned int offset, unsigned int depth)
+{
+	// Kept at most half full so probes stay short
+	if ((store->count + 1) * 2 > store->capacity)
+	{
+		HistoryObjects grown = *store;
+		grown.capacity = store->capacity ? store->capacity * 2 : 1024;
+		grown.table = calloc(grown.capacity, sizeof(HistoryObject));
+		if (!grown.table)
+			return -1;
+
+		for (unsigned int i = 0; i < store->capacity; i++)
+		{
+			if (!store->table[i].hash)
+				continue;
+			unsigned int slot = store->table[i].hash & (grown.capacity - 1);
+			while (grown.table[slot].hash)
+				slot = (slot + 1) & (grown.capacity - 1);
+			grown.table[slot] = store->table[i];
+		}
+
+		free(store->table);
+		*store = grown;
+	}
+
+	unsigned int slot = hash & (store->capacity - 1);
+	while (store->table[slot].hash)
+		slot = (slot + 1) & (store->capacity - 1);
+
+	store->table[slot].hash = hash;
+	store->table[slot].offset = offset;
+	store->table[slot].depth = depth;
+	store->count++;
+
+	return 0;
+}
+
+/**
+ * Reads a card image back out of the object file, following its deltas
+ *
+ * @returns 0 on success, -1 if the image is missing or damaged
+ **/
+static int readObject(HistoryObjects *store, unsigned long long hash, unsigned char *tracks, int depth)
+{
+	HistoryObject *object = findObject(store, hash);
+	unsigned char record[OBJECT_RECORD_MAX];
+
+	if (!object || depth > HISTORY_CHAIN_MAX)
+		return -1;
+
+	int length = pread(store->fd, record, sizeof(record), object->offset);
+	if (length < OBJECT_HEADER_SIZE)
+		return -1;
+
+	int payloadLength = (record[17] << 8) | record[18];
+	unsigned char *payload = &record[OBJECT_HEADER_SIZE];
+
+	if (OBJECT_HEADER_SIZE + payloadLength > length)
+		return -1;
+
+	if (record[0] == OBJECT_FULL)
+	{
+		if (payloadLength != HISTORY_TRACKS_SIZE)
+			return -1;
+		memcpy(tracks, payload, HISTORY_TRACKS_SIZE);
+		return 0;
+	}
+
+	if (readObject(store, get64(&record[9]), tracks, depth + 1) < 0)
+		return -1;
+
+	// A delta is runs of an offset, a length and the new bytes
+	for (int i = 0; i + 2 <= payloadLength;)
+	{
+		int offset = payload[i], runLength = payload[i + 1];
+		if (offset + runLength > HISTORY_TRACKS_SIZE || i + 2 + runLength > payloadLength)
+			return -1;
+		memcpy(&tracks[offset], &payload[i + 2], runLength);
+		i += 2 + runLength;
+	}
+
+	return 0;
+}
+
+/**
+ * Encodes the bytes that differ between two images
+ *
+ * @returns The length of the delta, or -1 if it is no smaller than the image
+ **/
+static int encodeDelta(const unsigned char *base, const unsigned char *image, unsigned char *delta)
+{
+	int length = 0;
+
+	for (int i = 0; i < HISTORY_TRACKS_SIZE;)
+	{
+		if (base[i] == image[i])
+		{
+			i++;
+			continue;
+		}
+
+		// Gaps of up to two unchanged bytes cost no more to copy than a new run
+		int start = i, last = i;
+		for (int end = i + 1; end < HISTORY_TRACKS_SIZE && end - start < 255 && end - last <= 2; end++)
+		{
+			if (base[end] != image[end])
+				last = end;
+		}
+
+		int runLength = last - start + 1;
+		if (length + 2 + runLength >= HISTORY_TRACKS_SIZE)
+			return -1;
+
+		delta[length++] = start;
+		delta[length++] = runLength;
+		memcpy(&delta[length], &image[start], runLength);
+		length += runLength;
+		i = last + 1;
+	}
+
+	return length;
+}
+
+/**
+ * Appends an image to an object file, as a delta from the base if there is
+ * one and its chain isn't already too long
+ *
+ * @returns 0 on success, -1 on failure
+ **/
+static int storeObject(HistoryObjects *store, unsigned long long hash, const unsigned char *image, HistoryObject *base, const unsigned char *baseImage)
+{
+	unsigned char record[OBJECT_RECORD_MAX];
+	int payloadLength = -1;
+	unsigned int depth = 0;
+
+	if (base && base->depth < HISTORY_CHAIN_MAX)
+		payloadLength = encodeDelta(baseImage, image, &record[OBJECT_HEADER_SIZE]);
+
+	if (payloadLength < 0)
+	{
+		record[0] = OBJECT_FULL;
+		put64(&record[9], 0);
+		memcpy(&record[OBJECT_HEADER_SIZE], image, HISTORY_TRACKS_SIZE);
+		payloadLength = HISTORY_TRACKS_SIZE;
+	}
+	else
+	{
+		record[0] = OBJECT_DELTA;
+		put64(&record[9], base->hash);
+		depth = base->depth + 1;
+	}
+
+	put64(&record[1], hash);
+	record[17] = payloadLength >> 8;
+	record[18] = payloadLength;
+
+	int length = OBJECT_HEADER_SIZE + payloadLength;
+	put32(&record[length], transferChecksum(0, record, length));
+	length += 4;
+
+	if (transferWriteAll(store->fd, record, length) < 0)
+	{
+		ftruncate(store->fd, store->size);
+		return -1;
+	}
+
+	if (addObject(store, hash, store->size, depth) < 0)
+		return -1;
+
+	store->size += length;
+	if (depth)
+		store->deltas++;
+
+	return 0;
+}
+
+static int writeVersion(int fd, unsigned long long *size, const char *name, unsigned long long timeMs, unsigned long long hash)
+{
+	unsigned char record[VERSION_RECORD_MAX];
+	int nameLength = strlen(name);
+
+	put64(&record[0], timeMs);
+	put64(&record[8], hash);
+	record[16] = nameLength;
+	memcpy(&record[VERSION_HEADER_SIZE], name, nameLength);
+
+	int length = VERSION_HEADER_SIZE + nameLength;
+	put32(&record[length], transferChecksum(0, record, length));
+	length += 4;
+
+	if (transferWriteAll(fd, record, length) < 0)
+	{
+		ftruncate(fd, *size);
+		return -1;
+	}
+
+	*size += length;
+	return 0;
+}
+
+/**
+ * Finds a card by path, optionally adding it
+ **/
+static HistoryCard *findCard(const char *name, int add)
+{
+	unsigned int mask = cardCapacity - 1;
+	unsigned int slot = hashKey(name, strlen(name)) & mask;
+
+	for (; cards[slot]; slot = (slot + 1) & mask)
+	{
+		if (strcmp(cards[slot]->name, name) == 0)
+			return cards[slot];
+	}
+
+	if (!add)
+		return NULL;
+
+	if ((cardCount + 1) * 2 > cardCapacity)
+	{
+		unsigned int capacity = cardCapacity * 2;
+		HistoryCard **grown = calloc(capacity, sizeof(HistoryCard *));
+		if (!grown)
+			return NULL;
+
+		for (unsigned int i = 0; i < cardCapacity; i++)
+		{
+			if (!cards[i])
+				continue;
+			unsigned int moved = hashKey(cards[i]->name, strlen(cards[i]->name)) & (capacity - 1);
+			while (grown[moved])
+				moved = (moved + 1) & (capacity - 1);
+			grown[moved] = cards[i];
+		}
+
+		free(cards);
+		cards = grown;
+		cardCapacity = capacity;
+		mask = capacity - 1;
+
+		slot = hashKey(name, strlen(name)) & mask;
+		while (cards[slot])
+			slot = (slot + 1) & mask;
+	}
+
+	HistoryCard *card = calloc(1, sizeof(HistoryCard));
+	if (!card || !(card->name = strdup(name)))
+	{
+		free(card);
+		return NULL;
+	}
+
+	cards[slot] = card;
+	cardCount++;
+
+	return card;
+}
+
+static int addVersion(HistoryCard *card, unsigned long long timeMs, unsigned long long hash)
+{
+	if (card->count == card->capacity)
+	{
+		int capacity = card->capacity ? card->capacity * 2 : 8;
+		HistoryVersion *grown = realloc(card->versions, capacity * sizeof(HistoryVersion));
+		if (!grown)
+			return -1;
+		card->versions = grown;
+		card->capacity = capacity;
+	}
+
+	card->versions[card->count].timeMs = timeMs;
+	card->versions[card->count].hash = hash;
+	card->count++;
+	versionCount++;
+
+	return 0;
+}
+
+/**
+ * Finds the last version at or before a time
+ *
+ * @returns The index of the version, or -1 if the card is newer than that
+ **/
+static int findVersion(HistoryCard *card, unsigned long long timeMs)
+{
+	int low = 0, high = card->count;
+
+	while (low < high)
+	{
+		int middle = low + (high - low) / 2;
+		if (card->versions[middle].timeMs <= timeMs)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	return low - 1;
+}
+
+static int storeVersion(HistoryEntry *entry)
+{
+	unsigned long long hash = hashKey(entry->tracks, HISTORY_TRACKS_SIZE);
+	unsigned long long timeMs = entry->timeMs;
+
+	HistoryCard *card = findCard(entry->path, 1);
+	if (!card)
+		return -1;
+
+	HistoryVersion *latest = card->count ? &card->versions[card->count - 1] : NULL;
+
+	// Saving a card that hasn't changed isn't a new version
+	if (latest && latest->hash == hash)
+		return 0;
+
+	// Versions stay in order if the wall clock is stepped back
+	if (latest && timeMs < latest->timeMs)
+		timeMs = latest->timeMs;
+
+	if (findObject(&objects, hash))
+	{
+		deduplicated++;
+	}
+	else
+	{
+		unsigned char base[HISTORY_TRACKS_SIZE];
+		HistoryObject *baseObject = NULL;
+
+		if (latest && readObject(&objects, latest->hash, base, 0) == 0)
+			baseObject = findObject(&objects, latest->hash);
+
+		if (storeObject(&objects, hash, entry->tracks, baseObject, base) < 0)
+			return -1;
+	}
+
+	if (writeVersion(versionsFd, &versionsSize, entry->path, timeMs, hash) < 0)
+		return -1;
+
+	return addVersion(card, timeMs, hash);
+}
+
+static int keepVersion(HistoryCard *card, int index, unsigned long long cutoffMs)
+{
+	HistoryVersion *version = &card->versions[index];
+
+	return index == card->count - 1 || version->timeMs >= cutoffMs ||
+		   version->timeMs / MS_PER_DAY != card->versions[index + 1].timeMs / MS_PER_DAY;
+}
+
+static int openStoreFile(const char *path, const char *magic, int truncate)
+{
+	int fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC | (truncate ? O_TRUNC : 0), 0644);
+	struct stat file;
+
+	if (fd < 0 || fstat(fd, &file) < 0)
+	{
+		printf("Error: Couldn't open history file %s\n", path);
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+
+	if (file.st_size == 0 && transferWriteAll(fd, magic, MAGIC_SIZE) < 0)
+	{
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/**
+ * Rewrites the store without the versions past the keep period
+ *
+ * Called with the store locked.
+ **/
+static void compact()
+{
+	unsigned long long cutoffMs = clockWallMs() - keepDays * MS_PER_DAY;
+	unsigned int dropping = 0;
+
+	for (unsigned int i = 0; i < cardCapacity; i++)
+	{
+		for (int index = 0; cards[i] && index < cards[i]->count; index++)
+			dropping += !keepVersion(cards[i], index, cutoffMs);
+	}
+
+	if (dropping == 0)
+		return;
+
+	char objectsPath[600], versionsPath[600], newObjectsPath[600], newVersionsPath[600];
+	snprintf(objectsPath, sizeof(objectsPath), "%s/objects", historyPath);
+	snprintf(versionsPath, sizeof(versionsPath), "%s/versions", historyPath);
+	snprintf(newObjectsPath, sizeof(newObjectsPath), "%s/objects.compact", historyPath);
+	snprintf(newVersionsPath, sizeof(newVersionsPath), "%s/versions.compact", historyPath);
+
+	HistoryObjects next = {.size = MAGIC_SIZE};
+	unsigned long long nextVersionsSize = MAGIC_SIZE;
+	unsigned long long before = objects.size + versionsSize;
+
+	next.fd = openStoreFile(newObjectsPath, OBJECTS_MAGIC, 1);
+	int nextVersionsFd = openStoreFile(newVersionsPath, VERSIONS_MAGIC, 1);
+
+	if (next.fd < 0 || nextVersionsFd < 0)
+		goto failed;
+
+	for (unsigned int i = 0; i < cardCapacity; i++)
+	{
+		HistoryCard *card = cards[i];
+		unsigned char image[HISTORY_TRACKS_SIZE], previous[HISTORY_TRACKS_SIZE];
+		unsigned long long previousHash = 0;
+
+		for (int index = 0; card && index < card->count; index++)
+		{
+			HistoryVersion *version = &card->versions[index];
+
+			if (!keepVersion(card, index, cutoffMs) || readObject(&objects, version->hash, image, 0) < 0)
+				continue;
+
+			if (!findObject(&next, version->hash))
+			{
+				HistoryObject *base = previousHash ? findObject(&next, previousHash) : NULL;
+				if (storeObject(&next, version->hash, image, base, previous) < 0)
+					goto failed;
+			}
+
+			if (writeVersion(nextVersionsFd, &nextVersionsSize, card->name, version->timeMs, version->hash) < 0)
+				goto failed;
+
+			memcpy(previous, image, HISTORY_TRACKS_SIZE);
+			previousHash = version->hash;
+		}
+	}
+
+	// The objects go first, versions left pointing at dropped images are
+	// skipped when the store is loaded
+	if (fdatasync(next.fd) < 0 || fdatasync(nextVersionsFd) < 0 || rename(newObjectsPath, objectsPath) < 0)
+		goto failed;
+
+	// The new objects are in place from here, so they are used even if the
+	// versions can't follow, the old versions are then kept as they are on
+	// disk less those of dropped images, the same as a reload would
+	close(objects.fd);
+	free(objects.table);
+	objects = next;
+
+	int replaced = rename(newVersionsPath, versionsPath) == 0;
+	if (replaced)
+	{
+		close(versionsFd);
+		versionsFd = nextVersionsFd;
+		versionsSize = nextVersionsSize;
+	}
+	else
+	{
+		printf("Error: Couldn't replace the card history versions, keeping the old ones\n");
+		close(nextVersionsFd);
+		unlink(newVersionsPath);
+	}
+
+	versionCount = 0;
+
+	for (unsigned int i = 0; i < cardCapacity; i++)
+	{
+		HistoryCard *card = cards[i];
+		int kept = 0;
+
+		for (int index = 0; card && index < card->count; index++)
+		{
+			if ((!replaced || keepVersion(card, index, cutoffMs)) && findObject(&objects, card->versions[index].hash))
+				card->versions[kept++] = card->versions[index];
+		}
+
+		if (card)
+		{
+			card->count = kept;
+			versionCount += kept;
+		}
+	}
+
+	printf("Info: Compacted the card history, dropped %u versions, %llu to %llu bytes\n",
+		   dropping, before, objects.size + versionsSize);
+	return;
+
+failed:
+	printf("Error: Couldn't compact the card history\n");
+	if (next.fd >= 0)
+		close(next.fd);
+	if (nextVersionsFd >= 0)
+		close(nextVersionsFd);
+	free(next.table);
+	unlink(newObjectsPath);
+	unlink(newVersionsPath);
+}
+
+static unsigned char *readStoreFile(int fd, const char *magic, long *size)
+{
+	struct stat file;
+
+	if (fstat(fd, &file) < 0 || file.st_size < MAGIC_SIZE)
+		return NULL;
+
+	unsigned char *data = malloc(file.st_size);
+	if (!data)
+		return NULL;
+
+	if (pread(fd, data, file.st_size, 0) != file.st_size || memcmp(data, magic, MAGIC_SIZE) != 0)
+	{
+		free(data);
+		return NULL;
+	}
+
+	*size = file.st_size;
+	return data;
+}
+
+/**
+ * Reads the object and version files into memory
+ *
+ * A torn record at the end of either file, from a crash part way through
+ * an append, is cut off.
+ *
+ * @returns 0 on success, -1 on failure
+ **/
+static int loadStore()
+{
+	long size, offset;
+	unsigned char *data = readStoreFile(objects.fd, OBJECTS_MAGIC, &size);
+
+	if (!data)
+	{
+		printf("Error: %s/objects isn't a card history file\n", historyPath);
+		return -1;
+	}
+
+	for (offset = MAGIC_SIZE; offset + OBJECT_HEADER_SIZE + 4 <= size;)
+	{
+		unsigned char *record = &data[offset];
+		int payloadLength = (record[17] << 8) | record[18];
+		int length = OBJECT_HEADER_SIZE + payloadLength;
+		unsigned int depth = 0;
+
+		if (payloadLength > HISTORY_TRACKS_SIZE || offset + length + 4 > size ||
+			get32(&record[length]) != transferChecksum(0, record, length))
+			break;
+
+		if (record[0] == OBJECT_DELTA)
+		{
+			HistoryObject *base = findObject(&objects, get64(&record[9]));
+			if (!base)
+				break;
+			depth = base->depth + 1;
+			objects.deltas++;
+		}
+		else if (record[0] != OBJECT_FULL || payloadLength != HISTORY_TRACKS_SIZE)
+			break;
+
+		if (!findObject(&objects, get64(&record[1])) && addObject(&objects, get64(&record[1]), offset, depth) < 0)
+			break;
+
+		offset += length + 4;
+	}
+
+	if (offset < size)
+	{
+		printf("Warning: Cutting %ld damaged bytes off the end of the card history objects\n", size - offset);
+		ftruncate(objects.fd, offset);
+	}
+
+	objects.size = offset;
+	free(data);
+
+	data = readStoreFile(versionsFd, VERSIONS_MAGIC, &size);
+	if (!data)
+	{
+		printf("Error: %s/versions isn't a card history file\n", historyPath);
+		return -1;
+	}
+
+	for (offset = MAGIC_SIZE; offset + VERSION_HEADER_SIZE + 4 <= size;)
+	{
+		unsigned char *record = &data[offset];
+		int length = VERSION_HEADER_SIZE + record[16];
+		char name[256];
+
+		if (offset + length + 4 > size || get32(&record[length]) != transferChecksum(0, record, length))
+			break;
+
+		memcpy(name, &record[VERSION_HEADER_SIZE], record[16]);
+		name[record[16]] = '\0';
+		offset += length + 4;
+
+		// Left behind by a compaction that stopped between its two renames
+		if (!findObject(&objects, get64(&record[8])))
+			continue;
+
+		HistoryCard *card = findCard(name, 1);
+		if (!card || addVersion(card, get64(&record[0]), get64(&record[8])) < 0)
+		{
+			free(data);
+			return -1;
+		}
+	}
+
+	if (offset < size)
+	{
+		printf("Warning: Cutting %ld damaged bytes off the end of the card history versions\n", size - offset);
+		ftruncate(versionsFd, offset);
+	}
+
+	versionsSize = offset;
+	free(data);
+
+	return 0;
+}
+
+static void storeEntry(void *data)
+{
+	HistoryEntry *entry = data;
+
+	pthread_mutex_lock(&storeLock);
+	if (storeVersion(entry) < 0)
+		printf("Error: Couldn't record the history of %s\n", entry->path);
+	pthread_mutex_unlock(&storeLock);
+}
+
+static void syncStore()
+{
+	fdatasync(objects.fd);
+	fdatasync(versionsFd);
+}
+
+static void compactStore()
+{
+	pthread_mutex_lock(&storeLock);
+	compact();
+	pthread_mutex_unlock(&storeLock);
+}
+
+static WorkQueue queue = {
+	.entrySize = sizeof(HistoryEntry),
+	.capacity = HISTORY_QUEUE_SIZE,
+	.handle = storeEntry,
+	.idle = syncStore,
+	.periodic = compactStore,
+	.periodMs = MS_PER_DAY,
+};
+
+/**
+ * Opens the history store and starts the history thread
+ *
+ * @param keep Days of history kept in full before compaction thins it
+ * @returns 0 on success, -1 on failure
+ **/
+int historyInit(const char *directory, unsigned int keep)
+{
+	char path[600];
+
+	if (strlen(directory) >= sizeof(historyPath))
+		return -1;
+
+	if (mkdir(directory, 0755) < 0 && errno != EEXIST)
+	{
+		printf("Error: Couldn't create history directory %s\n", directory);
+		return -1;
+	}
+
+	strcpy(historyPath, directory);
+	keepDays = keep;
+
+	cardCapacity = 1024;
+	cards = calloc(cardCapacity, sizeof(HistoryCard *));
+	objects.capacity = 1024;
+	objects.table = calloc(objects.capacity, sizeof(HistoryObject));
+	if (!cards || !objects.table)
+		return -1;
+
+	snprintf(path, sizeof(path), "%s/objects", directory);
+	objects.fd = openStoreFile(path, OBJECTS_MAGIC, 0);
+	snprintf(path, sizeof(path), "%s/versions", directory);
+	versionsFd = openStoreFile(path, VERSIONS_MAGIC, 0);
+
+	if (objects.fd < 0 || versionsFd < 0 || loadStore() < 0)
+		return -1;
+
+	if (workQueueStart(&queue) < 0)
+		return -1;
+
+	enabled = 1;
+	printf("Info: Card history has %u versions of %u cards\n", versionCount, cardCount);
+
+	return 0;
+}
+
+int historyEnabled()
+{
+	return enabled;
+}
+
+/**
+ * The path a card's history is kept under
+ *
+ * The same card is the same file however its path was written, falling
+ * back to the path as given if it can't be resolved or is too long.
+ **/
+static const char *cardKey(const char *cardPath, char *canonical)
+{
+	return realpath(cardPath, canonical) && strlen(canonical) < sizeof(((HistoryEntry *)0)->path) ? canonical : cardPath;
+}
+
+static void enqueue(const char *cardPath, unsigned char tracks[3][TRACK_SIZE], unsigned long long timeMs, int wait)
+{
+	HistoryEntry entry;
+
+	if (!enabled || cardPath[0] == '\0')
+		return;
+
+	char canonical[PATH_MAX];
+	cardPath = cardKey(cardPath, canonical);
+	if (strlen(cardPath) >= sizeof(entry.path))
+		return;
+
+	strcpy(entry.path, cardPath);
+	memcpy(entry.tracks, tracks, HISTORY_TRACKS_SIZE);
+	entry.timeMs = timeMs ? timeMs : clockWallMs();
+
+	if (workQueuePush(&queue, &entry, wait) < 0)
+		PROBE1(history__drop, cardPath);
+}
+
+/**
+ * Hands a card image to the history thread
+ *
+ * Never waits on the store, if the queue is full the version is dropped.
+ **/
+void historyRecord(const char *cardPath, unsigned char tracks[3][TRACK_SIZE])
+{
+	enqueue(cardPath, tracks, 0, 0);
+}
+
+/**
+ * Hands a card image to the history thread, waiting for room in the queue
+ *
+ * For bulk writers off the protocol loop, which would otherwise overrun the
+ * queue and drop versions.
+ *
+ * @param timeMs When the card got this image, 0 for now
+ **/
+void historyRecordWait(const char *cardPath, unsigned char tracks[3][TRACK_SIZE], unsigned long long timeMs)
+{
+	enqueue(cardPath, tracks, timeMs, 1);
+}
+
+/**
+ * Copies out the most recent versions of a card
+ *
+ * @param max The most versions to copy
+ * @param total Set to the number of versions the card has
+ * @returns The number of versions copied, oldest first, or -1 if the card has no history
+ **/
+int historyList(const char *cardPath, HistoryVersion *versions, int max, unsigned int *total)
+{
+	if (!enabled)
+		return -1;
+
+	char canonical[PATH_MAX];
+	cardPath = cardKey(cardPath, canonical);
+
+	pthread_mutex_lock(&storeLock);
+
+	HistoryCard *card = findCard(cardPath, 0);
+	if (!card || card->count == 0)
+	{
+		pthread_mutex_unlock(&storeLock);
+		return -1;
+	}
+
+	int count = card->count < max ? card->count : max;
+	memcpy(versions, &card->versions[card->count - count], count * sizeof(HistoryVersion));
+	*total = card->count;
+
+	pthread_mutex_unlock(&storeLock);
+
+	return count;
+}
+
+/**
+ * Reads back the image a card had at a given time
+ *
+ * @param timeMs Wall clock time in milliseconds
+ * @param version Set to the version found
+ * @returns 0 on success, -1 if there is no version that old or it couldn't be read
+ **/
+int historyStateAt(const char *cardPath, unsigned long long timeMs, unsigned char tracks[3][TRACK_SIZE], HistoryVersion *version)
+{
+	if (!enabled)
+		return -1;
+
+	char canonical[PATH_MAX];
+	cardPath = cardKey(cardPath, canonical);
+
+	pthread_mutex_lock(&storeLock);
+
+	HistoryCard *card = findCard(cardPath, 0);
+	int index = card ? findVersion(card, timeMs) : -1;
+	int result = -1;
+
+	if (index >= 0)
+	{
+		*version = card->versions[index];
+		result = readObject(&objects, version->hash, (unsigned char *)tracks, 0);
+	}
+
+	pthread_mutex_unlock(&storeLock);
+
+	return result;
+}
+
+void historyGetStats(HistoryStats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+
+	if (!enabled)
+		return;
+
+	pthread_mutex_lock(&storeLock);
+	stats->cards = cardCount;
+	stats->versions = versionCount;
+	stats->objects = objects.count;
+	stats->deltas = objects.deltas;
+	stats->bytes = objects.size + versionsSize;
+	stats->deduplicated = deduplicated;
+	pthread_mutex_unlock(&storeLock);
+
+	stats->dropped = workQueueDropped(&queue);
+}
@@ -0,0 +1,46 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include "cardd.h"
+
+/* Default directory the card history is kept in */
+#define DEFAULT_HISTORY_PATH "/var/tmp/cardd/history"
+
+/* Days of history kept in full, older versions are thinned to one a day */
+#define DEFAULT_HISTORY_KEEP_DAYS 7
+
+/* The longest chain of deltas before a card image is stored whole again */
+#define HISTORY_CHAIN_MAX 8
+
+/* Card writes waiting for the history thread, beyond this they are dropped */
+#define HISTORY_QUEUE_SIZE 256
+
+/* The most versions sent back for a single card */
+#define HISTORY_LIST_MAX 512
+
+typedef struct
+{
+	unsigned long long timeMs;
+	unsigned long long hash;
+} HistoryVersion;
+
+typedef struct
+{
+	unsigned int cards;
+	unsigned int versions;
+	unsigned int objects;
+	unsigned int deltas;
+	unsigned long long bytes;
+	unsigned int deduplicated;
+	unsigned int dropped;
+} HistoryStats;
+
+int historyInit(const char *directory, unsigned int keepDays);
+int historyEnabled();
+void historyRecord(const char *cardPath, unsigned char tracks[3][TRACK_SIZE]);
+void historyRecordWait(const char *cardPath, unsigned char tracks[3][TRACK_SIZE], unsigned long long timeMs);
+int historyList(const char *cardPath, HistoryVersion *versions, int max, unsigned int *total);
+int historyStateAt(const char *cardPath, unsigned long long timeMs, unsigned char tracks[3][TRACK_SIZE], HistoryVersion *version);
+void historyGetStats(HistoryStats *stats);
+
+#endif
@@ -0,0 +1,175 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "image.h"
+#include "probes.h"
+
+/**
+ * Versioned card images for threads other than the protocol loop
+ *
+ * The protocol loop works on reader->tracks as it always has. Whenever it
+ * has loaded or changed the card it publishes a copy as a new immutable
+ * CardImage by swapping the reader's image pointer, so the control port,
+ * exports and snapshots can read a whole, consistent card at any time
+ * without a lock the protocol loop would have to take.
+ *
+ * Old images are reclaimed by epoch. A thread holding an image first
+ * claims a slot holding the epoch it started in, then loads the pointer.
+ * A replaced image is retired against the epoch at the time of the swap,
+ * and freed once no slot holds that epoch or an earlier one, as any
+ * thread that could still see it must have claimed its slot before then.
+ **/
+
+typedef struct
+{
+	unsigned long long epoch;
+	char padding[64 - sizeof(unsigned long long)];
+} ImageSlot;
+
+static ImageSlot slots[IMAGE_SLOTS] __attribute__((aligned(64)));
+static unsigned long long globalEpoch = 1;
+
+/* Publishing is rare next to reading, so writers share one lock */
+static pthread_mutex_t retireLock = PTHREAD_MUTEX_INITIALIZER;
+static CardImage *retiredImages;
+static unsigned int retiredCount;
+
+int imageReaderInit(CardReader *reader)
+{
+	CardImage *image = calloc(1, sizeof(CardImage));
+	if (!image)
+		return -1;
+
+	memcpy(image->tracks, reader->tracks, sizeof(image->tracks));
+	__atomic_store_n(&reader->image, image, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/**
+ * Frees retired images no thread can still be holding, called with the lock held
+ **/
+static void reclaim()
+{
+	unsigned long long oldest = ~0ULL;
+	for (int i = 0; i < IMAGE_SLOTS; i++)
+	{
+		unsigned long long epoch = __atomic_load_n(&slots[i].epoch, __ATOMIC_SEQ_CST);
+		if (epoch && epoch < oldest)
+			oldest = epoch;
+	}
+
+	CardImage **link = &retiredImages;
+	while (*link)
+	{
+		CardImage *image = *link;
+		if (image->retiredEpoch < oldest)
+		{
+			*link = image->retired;
+			free(image);
+			retiredCount--;
+		}
+		else
+		{
+			link = &image->retired;
+		}
+	}
+}
+
+/**
+ * Publishes tracks as the reader's next card image
+ *
+ * Called by whichever thread has just loaded or changed the card, which
+ * may not be in reader->tracks yet.
+ **/
+void imagePublish(CardReader *reader, unsigned char tracks[3][TRACK_SIZE])
+{
+	CardImage *image = malloc(sizeof(CardImage));
+	if (!image || !__atomic_load_n(&reader->image, __ATOMIC_RELAXED))
+	{
+		free(image);
+		return;
+	}
+
+	image->retired = NULL;
+
+	// Copied under the lock so the newest version always has the newest tracks
+	pthread_mutex_lock(&retireLock);
+	memcpy(image->tracks, tracks, sizeof(image->tracks));
+
+	CardImage *old = __atomic_load_n(&reader->image, __ATOMIC_RELAXED);
+	image->version = old->version + 1;
+	__atomic_store_n(&reader->image, image, __ATOMIC_SEQ_CST);
+
+	old->retiredEpoch = __atomic_fetch_add(&globalEpoch, 1, __ATOMIC_SEQ_CST);
+	old->retired = retiredImages;
+	retiredImages = old;
+	retiredCount++;
+
+	reclaim();
+
+	pthread_mutex_unlock(&retireLock);
+
+	PROBE3(image__publish, reader->id, (int)image->version, retiredCount);
+}
+
+/**
+ * Holds the reader's current card image until imageRelease
+ *
+ * The image must be released before the thread waits on anything. When
+ * every slot is in use this spins until one is let go.
+ **/
+const CardImage *imageAcquire(CardReader *reader, ImageHold *hold)
+{
+	// Spread threads over the slots so they rarely race for the same one
+	int start = ((unsigned long)pthread_self() >> 6) % IMAGE_SLOTS;
+
+	for (;;)
+	{
+		for (int i = 0; i < IMAGE_SLOTS; i++)
+		{
+			int slot = (start + i) % IMAGE_SLOTS;
+			unsigned long long unused = 0;
+			unsigned long long epoch = __atomic_load_n(&globalEpoch, __ATOMIC_SEQ_CST);
+
+			if (__atomic_load_n(&slots[slot].epoch, __ATOMIC_RELAXED) == 0 &&
+				__atomic_compare_exchange_n(&slots[slot].epoch, &unused, epoch, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+			{
+				hold->slot = slot;
+				return __atomic_load_n(&reader->image, __ATOMIC_SEQ_CST);
+			}
+		}
+
+		sched_yield();
+	}
+}
+
+void imageRelease(ImageHold *hold)
+{
+	__atomic_store_n(&slots[hold->slot].epoch, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Copies out the reader's current card image
+ *
+ * @returns The version of the image copied
+ **/
+unsigned long long imageRead(CardReader *reader, unsigned char tracks[3][TRACK_SIZE])
+{
+	// Readers without images, such as the microbenchmark's, only have their tracks
+	if (!__atomic_load_n(&reader->image, __ATOMIC_ACQUIRE))
+	{
+		memcpy(tracks, reader->tracks, 3 * TRACK_SIZE);
+		return 0;
+	}
+
+	ImageHold hold;
+	const CardImage *image = imageAcquire(reader, &hold);
+	unsigned long long version = image->version;
+	memcpy(tracks, image->tracks, 3 * TRACK_SIZE);
+	imageRelease(&hold);
+
+	return version;
+}
@@ -0,0 +1,32 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include "cardd.h"
+
+/* Card images that can be held at once across every thread */
+#define IMAGE_SLOTS 64
+
+/**
+ * One version of the card in a reader, never changed once published
+ **/
+typedef struct CardImage
+{
+	unsigned long long version;
+	unsigned char tracks[3][TRACK_SIZE];
+	struct CardImage *retired;
+	unsigned long long retiredEpoch;
+} CardImage;
+
+/* What imageRelease needs to let go of a held image */
+typedef struct
+{
+	int slot;
+} ImageHold;
+
+int imageReaderInit(CardReader *reader);
+void imagePublish(CardReader *reader, unsigned char tracks[3][TRACK_SIZE]);
+const CardImage *imageAcquire(CardReader *reader, ImageHold *hold);
+void imageRelease(ImageHold *hold);
+unsigned long long imageRead(CardReader *reader, unsigned char tracks[3][TRACK_SIZE]);
+
+#endif
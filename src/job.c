@@ -0,0 +1,232 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "clock.h"
+#include "job.h"
+#include "probes.h"
+
+/**
+ * Slow card jobs run off the protocol thread
+ *
+ * Loading a card for READ and saving it after WRITE, ERASE or NEW_CARD
+ * wait on storage, which can take far longer than the host waits for an
+ * ACK. These are handed to a pool of workers instead, the command is
+ * acknowledged straight away and status replies report
+ * STATUS_RUNNING_COMMAND until the job is done, just as they do while the
+ * card is moving.
+ *
+ * A worker never touches the reply. It fills in the job's own result and
+ * then marks it done, and the protocol thread copies the result into its
+ * reply data the next time it looks, so a status reply has either all of
+ * a job's data or none of it. The protocol thread waits for any job still
+ * running before it starts the next command, so commands still take
+ * effect in the order the host sent them.
+ **/
+
+static unsigned int workerCount;
+
+static pthread_mutex_t queueLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queueReady = PTHREAD_COND_INITIALIZER;
+static ReaderJob *queueHead;
+static ReaderJob *queueTail;
+
+static void complete(ReaderJob *job)
+{
+	PROBE3(job__done, job->reader->id, job->opcode, (int)((clockNowNs() - job->startedNs) / 1000));
+
+	pthread_mutex_lock(&job->lock);
+	__atomic_store_n(&job->state, JOB_DONE, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&job->finished);
+	pthread_mutex_unlock(&job->lock);
+}
+
+static void *workerThread(void *unused)
+{
+	for (;;)
+	{
+		pthread_mutex_lock(&queueLock);
+
+		while (!queueHead)
+			pthread_cond_wait(&queueReady, &queueLock);
+
+		ReaderJob *job = queueHead;
+		queueHead = job->next;
+		if (!queueHead)
+			queueTail = NULL;
+
+		pthread_mutex_unlock(&queueLock);
+
+		job->run(job);
+		complete(job);
+	}
+
+	return NULL;
+}
+
+/**
+ * Starts the workers shared by every reader
+ *
+ * @param workers The number of worker threads, 0 to run jobs inline
+ * @returns 0 on success, -1 if a worker couldn't be started
+ **/
+int jobInit(unsigned int workers)
+{
+	for (workerCount = 0; workerCount < workers; workerCount++)
+	{
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, workerThread, NULL) != 0)
+		{
+			printf("Error: Couldn't start job worker %u\n", workerCount);
+			return -1;
+		}
+		pthread_detach(thread);
+	}
+
+	return 0;
+}
+
+int jobReaderInit(CardReader *reader)
+{
+	ReaderJob *job = calloc(1, sizeof(ReaderJob));
+	if (!job)
+		return -1;
+
+	job->reader = reader;
+	job->state = JOB_IDLE;
+	pthread_mutex_init(&job->lock, NULL);
+	pthread_cond_init(&job->finished, NULL);
+
+	reader->job = job;
+	return 0;
+}
+
+/**
+ * Sets up a job for the command being handled, it runs once jobStart is called
+ *
+ * Any earlier job must have been collected with jobFinish first.
+ *
+ * @param opcode The command the job is for
+ * @param run Does the work and fills in the job's result
+ * @returns The job to fill in the details of
+ **/
+ReaderJob *jobPrepare(CardReader *reader, unsigned char opcode, void (*run)(ReaderJob *job))
+{
+	ReaderJob *job = reader->job;
+
+	job->run = run;
+	job->opcode = opcode;
+	job->dataLength = 0;
+	job->hasTracks = 0;
+	job->readerStatus = STATUS_NO_ERR;
+
+	pthread_mutex_lock(&reader->lock);
+	strcpy(job->cardPath, reader->cardPath);
+	memcpy(job->tracks, reader->tracks, sizeof(job->tracks));
+	pthread_mutex_unlock(&reader->lock);
+
+	job->jobStatus = STATUS_NO_JOB;
+	job->state = JOB_PREPARED;
+	return job;
+}
+
+/**
+ * Starts the job prepared for the command just handled, if there is one
+ *
+ * @param faultReaderStatus An injected reader status for the command, or -1
+ * @param faultJobStatus An injected job status for the command, or -1
+ **/
+void jobStart(CardReader *reader, int faultReaderStatus, int faultJobStatus)
+{
+	ReaderJob *job = reader->job;
+	if (job->state != JOB_PREPARED)
+		return;
+
+	job->faultReaderStatus = faultReaderStatus;
+	job->faultJobStatus = faultJobStatus;
+	job->startedNs = clockNowNs();
+	job->next = NULL;
+
+	if (workerCount == 0)
+	{
+		job->run(job);
+		complete(job);
+		return;
+	}
+
+	job->state = JOB_QUEUED;
+
+	pthread_mutex_lock(&queueLock);
+	if (queueTail)
+		queueTail->next = job;
+	else
+		queueHead = job;
+	queueTail = job;
+	pthread_cond_signal(&queueReady);
+	pthread_mutex_unlock(&queueLock);
+}
+
+/**
+ * Whether the reader has a job that hasn't finished yet
+ **/
+int jobPending(CardReader *reader)
+{
+	return __atomic_load_n(&reader->job->state, __ATOMIC_ACQUIRE) == JOB_QUEUED;
+}
+
+/**
+ * Takes the result of a finished job into the reply data and reader status
+ *
+ * A job that loaded the card hands it over to the reader here, under the
+ * reader lock. Injected faults replace the job's statuses, and a failed
+ * job has no data to send back.
+ *
+ * @param data The BUFFER_SIZE reply data to append the job's data to
+ * @param length The length of the reply data
+ * @returns 1 if a result was collected, 0 if there was none ready
+ **/
+int jobCollect(CardReader *reader, unsigned char *data, int *length)
+{
+	ReaderJob *job = reader->job;
+	if (__atomic_load_n(&job->state, __ATOMIC_ACQUIRE) != JOB_DONE)
+		return 0;
+
+	unsigned char readerStatus = job->faultReaderStatus >= 0 ? job->faultReaderStatus : job->readerStatus;
+	unsigned char jobStatus = job->faultJobStatus >= 0 ? job->faultJobStatus : job->jobStatus;
+
+	if (readerStatus == STATUS_NO_ERR && *length + job->dataLength <= BUFFER_SIZE)
+	{
+		memcpy(data + *length, job->data, job->dataLength);
+		*length += job->dataLength;
+	}
+
+	pthread_mutex_lock(&reader->lock);
+	// Unless another card has been put in since the job was prepared
+	if (job->hasTracks && strcmp(reader->cardPath, job->cardPath) == 0)
+		memcpy(reader->tracks, job->tracks, sizeof(reader->tracks));
+	reader->readerStatus = readerStatus;
+
+	// The card may still be moving, in which case the movement finishes the job
+	if (!reader->moving || jobStatus != STATUS_NO_JOB)
+		reader->jobStatus = jobStatus;
+	pthread_mutex_unlock(&reader->lock);
+
+	job->state = JOB_IDLE;
+	return 1;
+}
+
+/**
+ * Waits for any outstanding job and collects its result
+ **/
+void jobFinish(CardReader *reader, unsigned char *data, int *length)
+{
+	ReaderJob *job = reader->job;
+
+	pthread_mutex_lock(&job->lock);
+	while (job->state == JOB_QUEUED)
+		pthread_cond_wait(&job->finished, &job->lock);
+	pthread_mutex_unlock(&job->lock);
+
+	jobCollect(reader, data, length);
+}
@@ -0,0 +1,61 @@
+#ifndef JOB_H
+#define JOB_H
+
+#include <pthread.h>
+
+#include "cardd.h"
+
+/* Threads running card loads and saves, 0 runs them on the protocol thread */
+#define DEFAULT_JOB_WORKERS 2
+
+/* The most data a job hands back, every track of a card */
+#define JOB_DATA_SIZE (3 * TRACK_SIZE)
+
+typedef enum
+{
+	JOB_IDLE,
+	JOB_PREPARED,
+	JOB_QUEUED,
+	JOB_DONE,
+} JobState;
+
+/**
+ * The one job a reader can have outstanding
+ *
+ * The protocol thread fills in a job and starts it, a worker runs it and
+ * fills in the result, and the protocol thread collects the result into
+ * its reply data once state has become JOB_DONE. Only the thread whose
+ * turn it is touches anything but state. The card's path and tracks are
+ * copied in when the job is prepared, so a worker never reads the reader.
+ **/
+typedef struct ReaderJob
+{
+	struct ReaderJob *next;
+	CardReader *reader;
+	void (*run)(struct ReaderJob *job);
+	int state;
+	unsigned char opcode;
+	int trackIndex[3];
+	char cardPath[256];
+	unsigned char data[JOB_DATA_SIZE];
+	int dataLength;
+	unsigned char tracks[3][TRACK_SIZE];
+	int hasTracks;
+	unsigned char readerStatus;
+	unsigned char jobStatus;
+	int faultReaderStatus;
+	int faultJobStatus;
+	unsigned long long startedNs;
+	pthread_mutex_t lock;
+	pthread_cond_t finished;
+} ReaderJob;
+
+int jobInit(unsigned int workers);
+int jobReaderInit(CardReader *reader);
+ReaderJob *jobPrepare(CardReader *reader, unsigned char opcode, void (*run)(ReaderJob *job));
+void jobStart(CardReader *reader, int faultReaderStatus, int faultJobStatus);
+int jobPending(CardReader *reader);
+int jobCollect(CardReader *reader, unsigned char *data, int *length);
+void jobFinish(CardReader *reader, unsigned char *data, int *length);
+
+#endif
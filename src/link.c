@@ -0,0 +1,214 @@
+#include <errno.h>
+#include <limits.h>
+#include <linux/serial.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "link.h"
+#include "probes.h"
+#include "watchdog.h"
+
+/**
+ * Tuning and checking the serial link
+ *
+ * Most RS422 adapters are FTDI parts, which hold bytes from the host for
+ * up to their USB latency timer before passing them on. At the default of
+ * 16ms that one timer costs more than everything cardd does with a frame,
+ * and on the ring it is paid for every frame of a transaction. At startup
+ * the adapter behind the serial port is found through sysfs, its latency
+ * timer and the port's low latency flag are set, and both are read back
+ * to check they took.
+ *
+ * What the host actually sees is measured once it starts talking on the
+ * ring: the time from each ring reply going out to the next frame coming
+ * in is a full trip round the link. The first LINK_ECHO_SAMPLES of those
+ * are compared against the game's reply budget.
+ **/
+
+static unsigned int echoUs[LINK_ECHO_SAMPLES];
+static int echoCount = 0;
+
+/**
+ * Reads a small sysfs attribute as a number
+ *
+ * @returns 0 on success, -1 if it couldn't be read
+ **/
+static int readAttribute(const char *path, int *value)
+{
+	FILE *file = fopen(path, "r");
+	if (!file)
+		return -1;
+
+	int result = fscanf(file, "%d", value) == 1 ? 0 : -1;
+	fclose(file);
+	return result;
+}
+
+static int writeAttribute(const char *path, int value)
+{
+	FILE *file = fopen(path, "w");
+	if (!file)
+		return -1;
+
+	fprintf(file, "%d\n", value);
+	return fclose(file) == 0 ? 0 : -1;
+}
+
+/**
+ * Finds the kernel driver behind a tty
+ *
+ * @param name The tty name without /dev/, such as ttyUSB0
+ * @returns 0 on success, -1 if the tty has no device behind it
+ **/
+static int findDriver(const char *sysfsRoot, const char *name, char *driver, int size)
+{
+	char path[PATH_MAX], target[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/class/tty/%s/device/driver", sysfsRoot, name);
+
+	int length = readlink(path, target, sizeof(target) - 1);
+	if (length < 0)
+		return -1;
+	target[length] = '\0';
+
+	char *base = strrchr(target, '/');
+	snprintf(driver, size, "%s", base ? base + 1 : target);
+	return 0;
+}
+
+static int tuneLatencyTimer(const char *sysfsRoot, const char *name, unsigned int latencyTimerMs)
+{
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/class/tty/%s/device/latency_timer", sysfsRoot, name);
+
+	int before;
+	if (readAttribute(path, &before) < 0)
+	{
+		printf("Info: %s has no latency timer to set\n", name);
+		return 0;
+	}
+
+	if ((unsigned int)before <= latencyTimerMs)
+	{
+		printf("Info: Latency timer of %s is %dms\n", name, before);
+		return 0;
+	}
+
+	int after = before;
+	int written = writeAttribute(path, latencyTimerMs);
+	int error = errno;
+
+	if (readAttribute(path, &after) == 0 && (unsigned int)after == latencyTimerMs)
+	{
+		printf("Info: Latency timer of %s set from %dms to %dms\n", name, before, after);
+		return 0;
+	}
+
+	printf("Warning: Couldn't set the latency timer of %s from %dms to %ums (%s), it is %dms and each ring frame can wait that long\n",
+		   name, before, latencyTimerMs, written < 0 ? strerror(error) : "it didn't change", after);
+	return -1;
+}
+
+static int tuneLowLatency(int fd, const char *name)
+{
+	struct serial_struct serial;
+
+	if (ioctl(fd, TIOCGSERIAL, &serial) < 0)
+	{
+		printf("Info: %s has no low latency flag to set\n", name);
+		return 0;
+	}
+
+	if (serial.flags & ASYNC_LOW_LATENCY)
+		return 0;
+
+	serial.flags |= ASYNC_LOW_LATENCY;
+	int set = ioctl(fd, TIOCSSERIAL, &serial);
+	int error = errno;
+
+	if (ioctl(fd, TIOCGSERIAL, &serial) == 0 && (serial.flags & ASYNC_LOW_LATENCY))
+		return 0;
+
+	printf("Warning: Couldn't set the low latency flag of %s (%s)\n", name, set < 0 ? strerror(error) : "it didn't stick");
+	return -1;
+}
+
+/**
+ * Asks the serial port and the adapter behind it for the lowest latency
+ * they can do, then checks they did
+ *
+ * @param serialPath The serial port, links such as /dev/serial/by-id are followed
+ * @param fd The open serial port
+ * @returns 0 if everything was set, -1 if anything couldn't be
+ **/
+int linkTune(const char *serialPath, int fd, const char *sysfsRoot, unsigned int latencyTimerMs)
+{
+	char device[PATH_MAX];
+	if (!realpath(serialPath, device))
+		snprintf(device, sizeof(device), "%s", serialPath);
+
+	char *name = strrchr(device, '/');
+	name = name ? name + 1 : device;
+
+	int result = tuneLowLatency(fd, name);
+
+	char driver[64];
+	if (findDriver(sysfsRoot, name, driver, sizeof(driver)) < 0)
+	{
+		printf("Info: %s isn't a USB serial adapter, its latency timer is left as it is\n", name);
+		return result;
+	}
+
+	printf("Info: %s is driven by %s\n", name, driver);
+	if (tuneLatencyTimer(sysfsRoot, name, latencyTimerMs) < 0)
+		result = -1;
+
+	return result;
+}
+
+static int compareUs(const void *a, const void *b)
+{
+	unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+	return (x > y) - (x < y);
+}
+
+static void reportEcho()
+{
+	qsort(echoUs, LINK_ECHO_SAMPLES, sizeof(echoUs[0]), compareUs);
+
+	unsigned int medianUs = echoUs[LINK_ECHO_SAMPLES / 2];
+	unsigned int p90Us = echoUs[LINK_ECHO_SAMPLES * 9 / 10];
+	unsigned int replyUs = medianUs * LINK_FRAMES_PER_REPLY;
+
+	unsigned int budgetUs = watchdogBudget();
+
+	if (replyUs > budgetUs)
+	{
+		printf("Warning: The ring echo round trip is %uus (%uus at p90), a status reply needs about %uus of link time against a budget of %uus\n",
+			   medianUs, p90Us, replyUs, budgetUs);
+		return;
+	}
+
+	printf("Info: The ring echo round trip is %uus (%uus at p90), a status reply needs about %uus of the %uus budget\n",
+		   medianUs, p90Us, replyUs, budgetUs);
+}
+
+/**
+ * Records the time from a ring reply going out to the host's next frame
+ * arriving, reporting once enough have been seen
+ **/
+void linkEchoSample(unsigned long long roundTripNs)
+{
+	unsigned int roundTripUs = roundTripNs / 1000;
+	PROBE1(ring__echo, roundTripUs);
+
+	if (echoCount >= LINK_ECHO_SAMPLES)
+		return;
+
+	echoUs[echoCount++] = roundTripUs;
+
+	if (echoCount == LINK_ECHO_SAMPLES)
+		reportEcho();
+}
@@ -0,0 +1,20 @@
+#ifndef LINK_H
+#define LINK_H
+
+/* Where sysfs is mounted, CARD_SYSFS_ROOT points it at a fake tree */
+#define DEFAULT_SYSFS_ROOT "/sys"
+
+/* The USB latency timer to ask the adapter for, FTDI parts ship with 16ms */
+#define DEFAULT_LATENCY_TIMER_MS 1
+
+/* Ring frames timed at startup before the echo round trip is reported */
+#define LINK_ECHO_SAMPLES 64
+
+/* Ring frames the host needs to send an ENQ and fetch its status reply, one
+   data frame, one poll and a fetch for each of the eight bytes of the reply */
+#define LINK_FRAMES_PER_REPLY 10
+
+int linkTune(const char *serialPath, int fd, const char *sysfsRoot, unsigned int latencyTimerMs);
+void linkEchoSample(unsigned long long roundTripNs);
+
+#endif
@@ -0,0 +1,162 @@
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "manifest.h"
+
+/**
+ * Finds the newest complete snapshot in a backup
+ *
+ * @param snapshot A MANIFEST_SNAPSHOT_SIZE buffer for its name
+ * @returns 0 on success, -1 if there is no snapshot yet
+ **/
+int manifestLatest(const char *destination, char *snapshot)
+{
+	char path[1024];
+	snprintf(path, sizeof(path), "%s/%s", destination, MANIFEST_LATEST);
+
+	FILE *file = fopen(path, "r");
+	if (!file)
+		return -1;
+
+	char line[MANIFEST_SNAPSHOT_SIZE + 2];
+	int found = fgets(line, sizeof(line), file) != NULL;
+	fclose(file);
+
+	line[strcspn(line, "\n")] = '\0';
+	if (!found || !manifestValidName(line) || strlen(line) >= MANIFEST_SNAPSHOT_SIZE)
+		return -1;
+
+	strcpy(snapshot, line);
+	return 0;
+}
+
+/**
+ * Whether a card or snapshot name is safe to use as a single file name
+ **/
+int manifestValidName(const char *name)
+{
+	return name[0] != '\0' && name[0] != '.' && !strchr(name, '/') && !strchr(name, '\n');
+}
+
+static int fail(char *error, int errorSize, const char *message, const char *snapshot)
+{
+	snprintf(error, errorSize, "%s %s", message, snapshot);
+	return -1;
+}
+
+/**
+ * Reads and checks the manifest of a snapshot
+ *
+ * @param snapshot The snapshot to read, NULL for the newest
+ * @param error Set to what was wrong with the manifest on failure
+ * @returns 0 on success, -1 if there is no such manifest or it is damaged
+ **/
+int manifestRead(const char *destination, const char *snapshot, Manifest *manifest, char *error, int errorSize)
+{
+	char latest[MANIFEST_SNAPSHOT_SIZE];
+	memset(manifest, 0, sizeof(*manifest));
+
+	if (!snapshot)
+	{
+		if (manifestLatest(destination, latest) < 0)
+			return fail(error, errorSize, "There is no backup in", destination);
+		snapshot = latest;
+	}
+
+	char path[1024];
+	snprintf(path, sizeof(path), "%s/%s/manifest", destination, snapshot);
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	struct stat status;
+	if (fd < 0 || fstat(fd, &status) < 0)
+	{
+		if (fd >= 0)
+			close(fd);
+		return fail(error, errorSize, "There is no manifest for snapshot", snapshot);
+	}
+
+	char *text = malloc(status.st_size + 1);
+	int result = text ? transferReadAll(fd, text, status.st_size) : -1;
+	close(fd);
+
+	if (result < 0)
+	{
+		free(text);
+		return fail(error, errorSize, "Couldn't read the manifest of snapshot", snapshot);
+	}
+	text[status.st_size] = '\0';
+
+	// Everything up to the checksum line is covered by it
+	char *footer = status.st_size > 1 ? memrchr(text, '\n', status.st_size - 1) : NULL;
+	unsigned int expected;
+	if (!footer || sscanf(footer + 1, "checksum %8x", &expected) != 1 ||
+		transferChecksum(0, (unsigned char *)text, footer + 1 - text) != expected)
+	{
+		free(text);
+		return fail(error, errorSize, "The manifest checksum doesn't match for snapshot", snapshot);
+	}
+	*footer = '\0';
+
+	char *saved;
+	char *line = strtok_r(text, "\n", &saved);
+	unsigned int index = 0;
+	int header = 0;
+
+	while (line)
+	{
+		if (header == 0 && strcmp(line, MANIFEST_MAGIC) == 0)
+			header++;
+		else if (header == 1 && sscanf(line, "snapshot %31s", manifest->snapshot) == 1)
+			header++;
+		else if (header == 2 && sscanf(line, "epoch %llu", &manifest->epoch) == 1)
+			header++;
+		else if (header == 3 && sscanf(line, "generation %llu", &manifest->generation) == 1)
+			header++;
+		else if (header == 4 && sscanf(line, "cards %u", &manifest->count) == 1)
+		{
+			header++;
+			manifest->cards = calloc(manifest->count ? manifest->count : 1, sizeof(ManifestCard));
+			if (!manifest->cards)
+				break;
+		}
+		else if (header == 5 && index < manifest->count)
+		{
+			ManifestCard *card = &manifest->cards[index];
+			int nameOffset = 0;
+
+			if (sscanf(line, "%8x %llu %llu %u %31s %n", &card->crc, &card->generation, &card->mtimeNs, &card->size, card->location, &nameOffset) != 5 ||
+				nameOffset == 0 || strlen(line + nameOffset) >= TRANSFER_NAME_SIZE || !manifestValidName(line + nameOffset))
+				break;
+
+			strcpy(card->name, line + nameOffset);
+			index++;
+		}
+		else
+			break;
+
+		line = strtok_r(NULL, "\n", &saved);
+	}
+
+	free(text);
+
+	if (header != 5 || index != manifest->count || line)
+	{
+		manifestFree(manifest);
+		return fail(error, errorSize, "The manifest is malformed for snapshot", snapshot);
+	}
+
+	return 0;
+}
+
+void manifestFree(Manifest *manifest)
+{
+	free(manifest->cards);
+	manifest->cards = NULL;
+	manifest->count = 0;
+}
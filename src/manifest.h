@@ -0,0 +1,57 @@
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include "transfer.h"
+
+/**
+ * The backup manifest format shared by cardd and cardctl
+ *
+ * Every snapshot directory in a backup has a manifest listing each card in
+ * the collection at the time of the snapshot, one line per card with the
+ * CRC32 of its image, the generation and file time it was backed up at,
+ * its size, the snapshot its image is stored in and its name. A card that
+ * hadn't changed since the last snapshot is stored in an older one. The
+ * last line is a CRC32 of everything before it.
+ *
+ *   cardd-backup 1
+ *   snapshot 20240501-183000
+ *   epoch 1714584600123456789
+ *   generation 4182
+ *   cards 2
+ *   3e4a9c1f 4180 1714584590000000000 207 20240501-183000 player1.bin
+ *   91b0d2e7 0 1714498190000000000 207 20240430-183000 player2.bin
+ *   checksum 5d1c38a0
+ *
+ * Card images live in <destination>/<snapshot>/cards/<name>, and the
+ * destination's LATEST file names the newest complete snapshot.
+ **/
+
+#define MANIFEST_MAGIC "cardd-backup 1"
+#define MANIFEST_LATEST "LATEST"
+#define MANIFEST_SNAPSHOT_SIZE 32
+
+typedef struct
+{
+	unsigned int crc;
+	unsigned int size;
+	unsigned long long generation;
+	unsigned long long mtimeNs;
+	char location[MANIFEST_SNAPSHOT_SIZE];
+	char name[TRANSFER_NAME_SIZE];
+} ManifestCard;
+
+typedef struct
+{
+	char snapshot[MANIFEST_SNAPSHOT_SIZE];
+	unsigned long long epoch;
+	unsigned long long generation;
+	unsigned int count;
+	ManifestCard *cards;
+} Manifest;
+
+int manifestLatest(const char *destination, char *snapshot);
+int manifestRead(const char *destination, const char *snapshot, Manifest *manifest, char *error, int errorSize);
+void manifestFree(Manifest *manifest);
+int manifestValidName(const char *name);
+
+#endif
@@ -0,0 +1,243 @@
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "clock.h"
+#include "output.h"
+#include "probes.h"
+
+/**
+ * Sets up an empty queue
+ *
+ * @param fd The descriptor to write to, or -1 if the queue is taken from
+ * @param timeoutMs How long a write waits for room before dropping its frame
+ **/
+void outputInit(OutputQueue *queue, int fd, unsigned int timeoutMs)
+{
+	memset(queue, 0, sizeof(*queue));
+	queue->fd = fd;
+	queue->timeoutMs = timeoutMs;
+	pthread_mutex_init(&queue->lock, NULL);
+	pthread_cond_init(&queue->space, NULL);
+}
+
+/**
+ * Throws away anything queued
+ **/
+void outputReset(OutputQueue *queue)
+{
+	pthread_mutex_lock(&queue->lock);
+	queue->head = 0;
+	queue->count = 0;
+	queue->stats.depth = 0;
+	pthread_cond_broadcast(&queue->space);
+	pthread_mutex_unlock(&queue->lock);
+}
+
+static void consume(OutputQueue *queue, int length)
+{
+	queue->head = (queue->head + length) % OUTPUT_QUEUE_SIZE;
+	queue->count -= length;
+	queue->stats.depth = queue->count;
+}
+
+/**
+ * Writes as much as the descriptor will take without blocking, called
+ * with the queue locked
+ **/
+static void flushLocked(OutputQueue *queue)
+{
+	while (queue->count)
+	{
+		int contiguous = OUTPUT_QUEUE_SIZE - queue->head;
+		int length = queue->count < contiguous ? queue->count : contiguous;
+		int written = write(queue->fd, &queue->buffer[queue->head], length);
+
+		if (written < 0 && errno == EINTR)
+			continue;
+
+		if (written < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				queue->stats.wouldBlock++;
+			break;
+		}
+
+		if (written < length)
+			queue->stats.partialWrites++;
+
+		consume(queue, written);
+
+		if (written < length)
+			break;
+	}
+
+	// How much the driver still has to clock out of the port
+	int pending;
+	if (ioctl(queue->fd, TIOCOUTQ, &pending) == 0)
+	{
+		queue->stats.kernelQueued = pending;
+		if ((unsigned int)pending > queue->stats.maxKernelQueued)
+			queue->stats.maxKernelQueued = pending;
+	}
+}
+
+/**
+ * Waits until the queue has room for a frame, flushing it to the
+ * descriptor as it becomes writable. Called with the queue locked.
+ *
+ * @returns 0 once there is room, -1 if the timeout passed first
+ **/
+static int waitForSpace(OutputQueue *queue, int length)
+{
+	unsigned long long started = clockNowNs();
+	unsigned long long deadline = started + queue->timeoutMs * 1000000ULL;
+	int result = 0;
+
+	queue->stats.waits++;
+
+	while (OUTPUT_QUEUE_SIZE - queue->count < length)
+	{
+		unsigned long long now = clockNowNs();
+		if (now >= deadline)
+		{
+			result = -1;
+			break;
+		}
+
+		if (queue->fd >= 0)
+		{
+			struct pollfd writable = {.fd = queue->fd, .events = POLLOUT};
+
+			pthread_mutex_unlock(&queue->lock);
+			poll(&writable, 1, (deadline - now + 999999) / 1000000);
+			pthread_mutex_lock(&queue->lock);
+
+			flushLocked(queue);
+		}
+		else
+		{
+			struct timespec until;
+			clock_gettime(CLOCK_REALTIME, &until);
+			unsigned long long remaining = deadline - now;
+			until.tv_sec += remaining / 1000000000ULL;
+			until.tv_nsec += remaining % 1000000000ULL;
+			if (until.tv_nsec >= 1000000000L)
+			{
+				until.tv_sec++;
+				until.tv_nsec -= 1000000000L;
+			}
+			pthread_cond_timedwait(&queue->space, &queue->lock, &until);
+		}
+	}
+
+	queue->stats.waitUs += (clockNowNs() - started) / 1000;
+	return result;
+}
+
+/**
+ * Queues a whole frame, then writes what it can straight away
+ *
+ * If the queue is too full the caller is held back until there is room,
+ * which stops the protocol loop getting ahead of the port. A frame that
+ * still doesn't fit once the timeout has passed is dropped whole rather
+ * than sent in part.
+ *
+ * @returns The length queued, or 0 if the frame was dropped
+ **/
+int outputWrite(OutputQueue *queue, const unsigned char *data, int length)
+{
+	if (length < 1)
+		return 0;
+
+	pthread_mutex_lock(&queue->lock);
+
+	if (length > OUTPUT_QUEUE_SIZE || (OUTPUT_QUEUE_SIZE - queue->count < length && waitForSpace(queue, length) < 0))
+	{
+		queue->stats.drops++;
+		queue->stats.droppedBytes += length;
+		pthread_mutex_unlock(&queue->lock);
+		PROBE2(output__drop, queue->fd, length);
+		return 0;
+	}
+
+	int tail = (queue->head + queue->count) % OUTPUT_QUEUE_SIZE;
+	int firstPart = OUTPUT_QUEUE_SIZE - tail < length ? OUTPUT_QUEUE_SIZE - tail : length;
+
+	memcpy(&queue->buffer[tail], data, firstPart);
+	memcpy(queue->buffer, data + firstPart, length - firstPart);
+
+	queue->count += length;
+	queue->stats.depth = queue->count;
+	queue->stats.bytes += length;
+	queue->stats.frames++;
+	if (queue->count > queue->stats.maxDepth)
+		queue->stats.maxDepth = queue->count;
+
+	if (queue->fd >= 0)
+		flushLocked(queue);
+
+	pthread_mutex_unlock(&queue->lock);
+
+	return length;
+}
+
+/**
+ * Writes out whatever the descriptor will now take, for when the event
+ * loop sees it is writable
+ *
+ * @returns The number of bytes still queued
+ **/
+int outputFlush(OutputQueue *queue)
+{
+	pthread_mutex_lock(&queue->lock);
+	if (queue->fd >= 0)
+		flushLocked(queue);
+	int pending = queue->count;
+	pthread_mutex_unlock(&queue->lock);
+
+	return pending;
+}
+
+/**
+ * Takes the next byte from a queue without a descriptor
+ *
+ * @returns 1 if a byte was taken, 0 if the queue is empty
+ **/
+int outputTake(OutputQueue *queue, unsigned char *byte)
+{
+	pthread_mutex_lock(&queue->lock);
+
+	if (queue->count == 0)
+	{
+		pthread_mutex_unlock(&queue->lock);
+		return 0;
+	}
+
+	*byte = queue->buffer[queue->head];
+	consume(queue, 1);
+
+	pthread_cond_signal(&queue->space);
+	pthread_mutex_unlock(&queue->lock);
+
+	return 1;
+}
+
+int outputPending(OutputQueue *queue)
+{
+	pthread_mutex_lock(&queue->lock);
+	int pending = queue->count;
+	pthread_mutex_unlock(&queue->lock);
+
+	return pending;
+}
+
+void outputGetStats(OutputQueue *queue, OutputStats *stats)
+{
+	pthread_mutex_lock(&queue->lock);
+	*stats = queue->stats;
+	pthread_mutex_unlock(&queue->lock);
+}
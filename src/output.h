@@ -0,0 +1,55 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <pthread.h>
+
+#define OUTPUT_QUEUE_SIZE 4096
+
+/* How long a reply waits for room in a full queue before it is dropped */
+#define DEFAULT_OUTPUT_TIMEOUT_MS 50
+
+typedef struct
+{
+	unsigned int depth;
+	unsigned int maxDepth;
+	unsigned long long bytes;
+	unsigned int frames;
+	unsigned int partialWrites;
+	unsigned int wouldBlock;
+	unsigned int waits;
+	unsigned long long waitUs;
+	unsigned int drops;
+	unsigned int droppedBytes;
+	unsigned int kernelQueued;
+	unsigned int maxKernelQueued;
+} OutputStats;
+
+/**
+ * Bytes waiting to go out on one transport
+ *
+ * A queue with a file descriptor writes to it without blocking and keeps
+ * what didn't fit for when the descriptor is writable again. A queue
+ * without one is taken from a byte at a time, as the RS422 ring is when the
+ * host polls for output.
+ **/
+typedef struct
+{
+	unsigned char buffer[OUTPUT_QUEUE_SIZE];
+	int head;
+	int count;
+	int fd;
+	unsigned int timeoutMs;
+	OutputStats stats;
+	pthread_mutex_t lock;
+	pthread_cond_t space;
+} OutputQueue;
+
+void outputInit(OutputQueue *queue, int fd, unsigned int timeoutMs);
+void outputReset(OutputQueue *queue);
+int outputWrite(OutputQueue *queue, const unsigned char *data, int length);
+int outputFlush(OutputQueue *queue);
+int outputTake(OutputQueue *queue, unsigned char *byte);
+int outputPending(OutputQueue *queue);
+void outputGetStats(OutputQueue *queue, OutputStats *stats);
+
+#endif
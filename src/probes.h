@@ -0,0 +1,31 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+/**
+ * USDT static tracepoints for perf, bpftrace and SystemTap
+ *
+ * The probes compile down to a single nop each when sys/sdt.h is
+ * available, and to nothing at all when it isn't or when building
+ * with -DCARDD_NO_PROBES. All probes use the cardd provider.
+ **/
+
+#if !defined(CARDD_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define CARDD_PROBES 1
+#endif
+#endif
+
+#ifdef CARDD_PROBES
+#define PROBE1(name, a) DTRACE_PROBE1(cardd, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(cardd, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(cardd, name, a, b, c)
+#define PROBE4(name, a, b, c, d) DTRACE_PROBE4(cardd, name, a, b, c, d)
+#else
+#define PROBE1(name, a) do {} while (0)
+#define PROBE2(name, a, b) do {} while (0)
+#define PROBE3(name, a, b, c) do {} while (0)
+#define PROBE4(name, a, b, c, d) do {} while (0)
+#endif
+
+#endif
@@ -0,0 +1,334 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "image.h"
+#include "queue.h"
+#include "service.h"
+
+/**
+ * Reads the card that goes in next
+ *
+ * With a card service the card is leased now and held until it comes out
+ * of the reader again. Otherwise a card without a file is created blank,
+ * just as when a card is loaded for the reader.
+ *
+ * @returns 0 on success, -1 if the card couldn't be read
+ **/
+static int preload(const char *path, unsigned char tracks[3][TRACK_SIZE])
+{
+	if (serviceEnabled())
+		return serviceAcquire(path, tracks);
+
+	if (readCardImage(path, tracks) == 0)
+		return 0;
+
+	printf("Info: Creating a new card for queued card %s\n", path);
+	memset(tracks, 0, 3 * TRACK_SIZE);
+	return writeCardImage(path, tracks);
+}
+
+/**
+ * Inserts the preloaded card once the delay has passed
+ **/
+static void insertNext(CardReader *reader)
+{
+	CardQueue *queue = reader->queue;
+
+	char path[QUEUE_PATH_SIZE];
+	unsigned char tracks[3][TRACK_SIZE];
+
+	pthread_mutex_lock(&queue->lock);
+
+	if (!queue->pending)
+	{
+		pthread_mutex_unlock(&queue->lock);
+		return;
+	}
+
+	int preloaded = queue->preloaded;
+	strcpy(path, queue->preloadedPath);
+	memcpy(tracks, queue->preloadedTracks, sizeof(tracks));
+	queue->pending = 0;
+
+	pthread_mutex_unlock(&queue->lock);
+
+	if (!preloaded)
+	{
+		printf("Error: Couldn't insert queued card %s\n", path);
+		return;
+	}
+
+	// Checked and moved in one go so a card put in by hand can't slip in
+	// between
+	pthread_mutex_lock(&reader->lock);
+
+	int busy = reader->cardPosition != NOT_INSERTED || reader->moving;
+	if (!busy)
+	{
+		strcpy(reader->cardPath, path);
+		memcpy(reader->tracks, tracks, sizeof(reader->tracks));
+		placeCard(reader, INSERTED_IN_FRONT);
+	}
+
+	pthread_mutex_unlock(&reader->lock);
+
+	// Someone put a card in by hand, so this one goes back to the front
+	if (busy)
+	{
+		if (serviceEnabled())
+			serviceRelease(path);
+
+		pthread_mutex_lock(&queue->lock);
+		if (queue->count < QUEUE_SIZE)
+		{
+			memmove(queue->paths[1], queue->paths[0], queue->count * QUEUE_PATH_SIZE);
+			strcpy(queue->paths[0], path);
+			queue->count++;
+		}
+		pthread_mutex_unlock(&queue->lock);
+
+		printf("Info: Reader busy, returned %s to the queue\n", path);
+		return;
+	}
+
+	cardLoaded(reader, path, tracks);
+
+	printf("Info: Inserted queued card %s\n", path);
+}
+
+static void *queueThread(void *data)
+{
+	CardReader *reader = (CardReader *)data;
+	CardQueue *queue = reader->queue;
+
+	for (;;)
+	{
+		pthread_mutex_lock(&queue->lock);
+
+		while (!queue->preloadWanted && !queue->insertDue)
+			pthread_cond_wait(&queue->work, &queue->lock);
+
+		// The preload always goes first, so an insert due already waits for it
+		if (queue->preloadWanted)
+		{
+			char path[QUEUE_PATH_SIZE];
+			unsigned char tracks[3][TRACK_SIZE];
+
+			strcpy(path, queue->preloadedPath);
+			queue->preloadWanted = 0;
+			pthread_mutex_unlock(&queue->lock);
+
+			int preloaded = preload(path, tracks) == 0;
+
+			pthread_mutex_lock(&queue->lock);
+			memcpy(queue->preloadedTracks, tracks, sizeof(tracks));
+			queue->preloaded = preloaded;
+			pthread_mutex_unlock(&queue->lock);
+			continue;
+		}
+
+		queue->insertDue = 0;
+		pthread_mutex_unlock(&queue->lock);
+
+		insertNext(reader);
+	}
+
+	return NULL;
+}
+
+/**
+ * Called by the timer wheel once the delay has passed, the card is
+ * inserted by the queue thread
+ **/
+static void queueInsertDue(void *data)
+{
+	CardReader *reader = (CardReader *)data;
+	CardQueue *queue = reader->queue;
+
+	pthread_mutex_lock(&queue->lock);
+	queue->insertDue = 1;
+	pthread_cond_signal(&queue->work);
+	pthread_mutex_unlock(&queue->lock);
+}
+
+/**
+ * Sets up an empty insertion queue for a reader and starts its thread
+ *
+ * @returns 0 on success, -1 on failure
+ **/
+int queueInit(CardReader *reader, unsigned int delayMs)
+{
+	CardQueue *queue = calloc(1, sizeof(CardQueue));
+
+	if (!queue)
+	{
+		printf("Error: Couldn't allocate the card queue\n");
+		return -1;
+	}
+
+	pthread_mutex_init(&queue->lock, NULL);
+	pthread_cond_init(&queue->work, NULL);
+	queue->delayMs = delayMs;
+	reader->queue = queue;
+
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, queueThread, reader) != 0)
+	{
+		printf("Error: Couldn't start the card queue thread\n");
+		return -1;
+	}
+	pthread_detach(thread);
+
+	return 0;
+}
+
+/**
+ * Adds a card to the back of the queue
+ *
+ * @returns 0 on success, -1 if the queue is full or the path too long
+ **/
+int queueAdd(CardReader *reader, const char *path)
+{
+	CardQueue *queue = reader->queue;
+
+	if (strlen(path) >= QUEUE_PATH_SIZE)
+		return -1;
+
+	pthread_mutex_lock(&queue->lock);
+
+	if (queue->count == QUEUE_SIZE)
+	{
+		pthread_mutex_unlock(&queue->lock);
+		return -1;
+	}
+
+	strcpy(queue->paths[queue->count++], path);
+
+	pthread_mutex_unlock(&queue->lock);
+
+	pthread_mutex_lock(&reader->lock);
+	int empty = reader->cardPosition == NOT_INSERTED;
+	pthread_mutex_unlock(&reader->lock);
+
+	// Nothing is in the reader so there is no eject to wait for
+	if (empty)
+		queueCardEjected(reader);
+
+	return 0;
+}
+
+/**
+ * Removes the card at the given position in the queue
+ *
+ * @returns 0 on success, -1 if there is no such position
+ **/
+int queueRemove(CardReader *reader, int index)
+{
+	CardQueue *queue = reader->queue;
+
+	pthread_mutex_lock(&queue->lock);
+
+	if (index < 0 || index >= queue->count)
+	{
+		pthread_mutex_unlock(&queue->lock);
+		return -1;
+	}
+
+	memmove(queue->paths[index], queue->paths[index + 1], (queue->count - index - 1) * QUEUE_PATH_SIZE);
+	queue->count--;
+
+	pthread_mutex_unlock(&queue->lock);
+
+	return 0;
+}
+
+/**
+ * Moves a card from one position in the queue to another
+ *
+ * @returns 0 on success, -1 if either position doesn't exist
+ **/
+int queueMove(CardReader *reader, int from, int to)
+{
+	CardQueue *queue = reader->queue;
+
+	pthread_mutex_lock(&queue->lock);
+
+	if (from < 0 || from >= queue->count || to < 0 || to >= queue->count)
+	{
+		pthread_mutex_unlock(&queue->lock);
+		return -1;
+	}
+
+	char path[QUEUE_PATH_SIZE];
+	strcpy(path, queue->paths[from]);
+
+	if (from < to)
+		memmove(queue->paths[from], queue->paths[from + 1], (to - from) * QUEUE_PATH_SIZE);
+	else
+		memmove(queue->paths[to + 1], queue->paths[to], (from - to) * QUEUE_PATH_SIZE);
+
+	strcpy(queue->paths[to], path);
+
+	pthread_mutex_unlock(&queue->lock);
+
+	return 0;
+}
+
+/**
+ * Empties the queue, a card already on its way in is still inserted
+ **/
+void queueClear(CardReader *reader)
+{
+	CardQueue *queue = reader->queue;
+
+	pthread_mutex_lock(&queue->lock);
+	queue->count = 0;
+	pthread_mutex_unlock(&queue->lock);
+}
+
+void queueSetDelay(CardReader *reader, unsigned int delayMs)
+{
+	CardQueue *queue = reader->queue;
+
+	pthread_mutex_lock(&queue->lock);
+	queue->delayMs = delayMs;
+	pthread_mutex_unlock(&queue->lock);
+}
+
+/**
+ * Starts inserting the next card after the previous one has been taken
+ *
+ * The next card is read into memory now by the queue thread so that
+ * inserting it when the delay runs out doesn't touch the disk.
+ **/
+void queueCardEjected(CardReader *reader)
+{
+	CardQueue *queue = reader->queue;
+
+	if (!queue)
+		return;
+
+	pthread_mutex_lock(&queue->lock);
+
+	if (queue->pending || queue->count == 0)
+	{
+		pthread_mutex_unlock(&queue->lock);
+		return;
+	}
+
+	strcpy(queue->preloadedPath, queue->paths[0]);
+	memmove(queue->paths[0], queue->paths[1], (queue->count - 1) * QUEUE_PATH_SIZE);
+	queue->count--;
+	queue->preloaded = 0;
+	queue->pending = 1;
+	queue->preloadWanted = 1;
+	pthread_cond_signal(&queue->work);
+
+	unsigned int delayMs = queue->delayMs;
+	printf("Info: Inserting queued card %s in %ums\n", queue->preloadedPath, delayMs);
+
+	pthread_mutex_unlock(&queue->lock);
+
+	timerWheelSchedule(&timerWheel, &queue->insertTimer, delayMs, queueInsertDue, reader);
+}
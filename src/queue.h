@@ -0,0 +1,48 @@
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include <pthread.h>
+
+#include "cardd.h"
+#include "timerwheel.h"
+
+#define QUEUE_SIZE 32
+#define QUEUE_PATH_SIZE 256
+
+/* Default delay between a card being taken and the next one going in */
+#define DEFAULT_QUEUE_DELAY_MS 3000
+
+/**
+ * The cards waiting to be inserted into a reader
+ *
+ * When the game ejects a card the head of the queue is read into memory
+ * straight away, and inserted once the delay has passed so the player has
+ * time to take their card and step away. Both are done by the queue's own
+ * thread, the timer only wakes it, so neither the protocol loop nor the
+ * timer wheel waits on storage or the card service.
+ **/
+typedef struct CardQueue
+{
+	char paths[QUEUE_SIZE][QUEUE_PATH_SIZE];
+	int count;
+	unsigned int delayMs;
+	int preloaded;
+	int pending;
+	int preloadWanted;
+	int insertDue;
+	char preloadedPath[QUEUE_PATH_SIZE];
+	unsigned char preloadedTracks[3][TRACK_SIZE];
+	Timer insertTimer;
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+} CardQueue;
+
+int queueInit(CardReader *reader, unsigned int delayMs);
+int queueAdd(CardReader *reader, const char *path);
+int queueRemove(CardReader *reader, int index);
+int queueMove(CardReader *reader, int from, int to);
+void queueClear(CardReader *reader);
+void queueSetDelay(CardReader *reader, unsigned int delayMs);
+void queueCardEjected(CardReader *reader);
+
+#endif
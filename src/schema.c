@@ -0,0 +1,213 @@
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "schema.h"
+
+/**
+ * Track layout schemas
+ *
+ * A schema names the fields a game keeps on its cards and where they sit
+ * in the tracks, so a card can be shown as a player and horse name rather
+ * than 207 bytes. Each game has its own file in the schema directory,
+ * named after the game as it is in cardd.conf, with a line per field:
+ *
+ *   # name = track offset length type [indexed]
+ *   horse = 0 20 16 text indexed
+ *   wins = 1 4 2 u16
+ *
+ * Types are text, u8, u16, u32, u16le, u32le, bcd and hex, numbers
+ * without le are big endian. Indexed fields can be searched with
+ * cardctl find.
+ **/
+
+static const struct
+{
+	const char *name;
+	FieldType type;
+	int length;
+} types[] = {
+	{"text", FIELD_TEXT, 0},
+	{"u8", FIELD_U8, 1},
+	{"u16", FIELD_U16, 2},
+	{"u32", FIELD_U32, 4},
+	{"u16le", FIELD_U16LE, 2},
+	{"u32le", FIELD_U32LE, 4},
+	{"bcd", FIELD_BCD, 0},
+	{"hex", FIELD_HEX, 0},
+};
+
+static char *trim(char *text)
+{
+	while (isspace((unsigned char)*text))
+		text++;
+
+	char *end = text + strlen(text);
+	while (end > text && isspace((unsigned char)end[-1]))
+		*--end = '\0';
+
+	return text;
+}
+
+static int parseField(SchemaField *field, char *name, char *value)
+{
+	char type[16], flag[16] = "";
+	int consumed = 0;
+
+	if (strlen(name) >= SCHEMA_NAME_SIZE || strspn(name, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_-") != strlen(name))
+		return -1;
+
+	int matched = sscanf(value, "%d %d %d %15s %15s %n", &field->track, &field->offset, &field->length, type, flag, &consumed);
+	if (matched < 4 || (matched == 5 && strcmp(flag, "indexed") != 0))
+		return -1;
+
+	if (field->track < 0 || field->track > 2 || field->offset < 0 || field->length < 1 || field->offset + field->length > TRACK_SIZE)
+		return -1;
+
+	for (int i = 0; i < sizeof(types) / sizeof(types[0]); i++)
+	{
+		if (strcmp(types[i].name, type) == 0 && (!types[i].length || types[i].length == field->length))
+		{
+			strcpy(field->name, name);
+			field->type = types[i].type;
+			field->indexed = matched == 5;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+/**
+ * Reads the schema for a game
+ *
+ * @param error A SCHEMA_ERROR_SIZE buffer describing what went wrong
+ * @returns 0 on success, -1 if there is no schema or it is malformed
+ **/
+int schemaLoad(Schema *schema, const char *directory, const char *game, char *error)
+{
+	char path[512];
+	snprintf(path, sizeof(path), "%s/%s.schema", directory, game);
+
+	FILE *file = fopen(path, "r");
+	if (!file)
+	{
+		snprintf(error, SCHEMA_ERROR_SIZE, errno == ENOENT ? "There is no schema at %s" : "Couldn't open %s", path);
+		return -1;
+	}
+
+	char line[256];
+	int lineNumber = 0;
+	schema->count = 0;
+
+	while (fgets(line, sizeof(line), file))
+	{
+		lineNumber++;
+
+		char *comment = strchr(line, '#');
+		if (comment)
+			*comment = '\0';
+
+		char *name = trim(line);
+		if (!*name)
+			continue;
+
+		char *equals = strchr(name, '=');
+		if (!equals || schema->count == SCHEMA_FIELDS_MAX)
+		{
+			snprintf(error, SCHEMA_ERROR_SIZE, equals ? "%s line %d: too many fields" : "%s line %d: expected name = track offset length type",
+					 path, lineNumber);
+			fclose(file);
+			return -1;
+		}
+
+		*equals = '\0';
+		name = trim(name);
+
+		if (schemaFind(schema, name) >= 0 || parseField(&schema->fields[schema->count], name, trim(equals + 1)) < 0)
+		{
+			snprintf(error, SCHEMA_ERROR_SIZE, "%s line %d: bad field %s", path, lineNumber, name);
+			fclose(file);
+			return -1;
+		}
+
+		schema->count++;
+	}
+
+	fclose(file);
+	return 0;
+}
+
+/**
+ * Finds a field by name
+ *
+ * @returns The index of the field, or -1 if the schema has no such field
+ **/
+int schemaFind(const Schema *schema, const char *name)
+{
+	for (int i = 0; i < schema->count; i++)
+	{
+		if (strcmp(schema->fields[i].name, name) == 0)
+			return i;
+	}
+	return -1;
+}
+
+/**
+ * Decodes one field of a card
+ *
+ * Text stops at the first NUL, has anything unprintable shown as a space
+ * and loses its trailing padding.
+ *
+ * @param value A SCHEMA_VALUE_SIZE buffer for the value as text
+ * @returns The length of the value
+ **/
+int schemaDecode(const SchemaField *field, unsigned char tracks[3][TRACK_SIZE], char *value)
+{
+	const unsigned char *bytes = &tracks[field->track][field->offset];
+	unsigned long number = 0;
+	int length = 0;
+
+	switch (field->type)
+	{
+	case FIELD_TEXT:
+		while (length < field->length && bytes[length])
+		{
+			value[length] = isprint(bytes[length]) ? bytes[length] : ' ';
+			length++;
+		}
+		while (length > 0 && value[length - 1] == ' ')
+			length--;
+		value[length] = '\0';
+		return length;
+
+	case FIELD_BCD:
+		for (int i = 0; i < field->length; i++)
+		{
+			value[length++] = '0' + (bytes[i] >> 4) % 10;
+			value[length++] = '0' + (bytes[i] & 0x0F) % 10;
+		}
+		value[length] = '\0';
+		return length;
+
+	case FIELD_HEX:
+		for (int i = 0; i < field->length; i++)
+			length += sprintf(value + length, "%02x", bytes[i]);
+		return length;
+
+	case FIELD_U16LE:
+	case FIELD_U32LE:
+		for (int i = field->length - 1; i >= 0; i--)
+			number = (number << 8) | bytes[i];
+		break;
+
+	default:
+		for (int i = 0; i < field->length; i++)
+			number = (number << 8) | bytes[i];
+		break;
+	}
+
+	return sprintf(value, "%lu", number);
+}
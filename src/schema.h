@@ -0,0 +1,48 @@
+#ifndef SCHEMA_H
+#define SCHEMA_H
+
+#include "cardd.h"
+
+/* Default directory of track layout schemas, one <game>.schema file per game */
+#define DEFAULT_SCHEMA_PATH "/etc/cardd/schemas"
+
+#define SCHEMA_FIELDS_MAX 32
+#define SCHEMA_NAME_SIZE 32
+#define SCHEMA_ERROR_SIZE 256
+
+/* Longest decoded value, hex fields take two characters a byte */
+#define SCHEMA_VALUE_SIZE (2 * TRACK_SIZE + 1)
+
+typedef enum
+{
+	FIELD_TEXT,
+	FIELD_U8,
+	FIELD_U16,
+	FIELD_U32,
+	FIELD_U16LE,
+	FIELD_U32LE,
+	FIELD_BCD,
+	FIELD_HEX,
+} FieldType;
+
+typedef struct
+{
+	char name[SCHEMA_NAME_SIZE];
+	int track;
+	int offset;
+	int length;
+	FieldType type;
+	int indexed;
+} SchemaField;
+
+typedef struct
+{
+	int count;
+	SchemaField fields[SCHEMA_FIELDS_MAX];
+} Schema;
+
+int schemaLoad(Schema *schema, const char *directory, const char *game, char *error);
+int schemaDecode(const SchemaField *field, unsigned char tracks[3][TRACK_SIZE], char *value);
+int schemaFind(const Schema *schema, const char *name);
+
+#endif
@@ -0,0 +1,728 @@
+#include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "probes.h"
+#include "search.h"
+#include "transfer.h"
+#include "workqueue.h"
+
+/**
+ * Searchable index of card contents
+ *
+ * Every indexed field of every card, as decoded by the game's schema, is
+ * split into lower case words, and each field and word pair is a term
+ * holding the sorted ids of the cards that have it. A query looks its
+ * words up and intersects their cards, so it never reads a card file.
+ *
+ * The collection is indexed once when cardd starts, then each card is
+ * reindexed as it is saved, which drops the card from the terms it no
+ * longer has. Saves are handed over through a queue and indexed by the
+ * index thread, so a card write never waits on the index. A save dropped
+ * because the queue was full is remembered by path, and the card is read
+ * back from disk once the queue has drained.
+ **/
+
+#define SEARCH_TRACKS_SIZE (3 * TRACK_SIZE)
+
+/* The longest path a queued card can have */
+#define SEARCH_PATH_SIZE 256
+
+/* Dropped saves remembered, beyond this the whole collection is reindexed */
+#define SEARCH_STALE_MAX 64
+
+/* Separates the field from the word in a term */
+#define TERM_SEPARATOR '\x1f'
+
+#define TERM_SIZE (SCHEMA_NAME_SIZE + SCHEMA_VALUE_SIZE + 1)
+
+/* The most words a card or a query is split into */
+#define WORDS_MAX 128
+
+typedef struct
+{
+	char *text;
+	unsigned int *cards;
+	unsigned int count;
+	unsigned int capacity;
+} SearchTerm;
+
+typedef struct
+{
+	char *path;
+	char summary[SEARCH_SUMMARY_SIZE];
+	unsigned int *terms;
+	int termCount;
+} SearchCard;
+
+/* Open addressing from a key to an id, slots hold the id plus one */
+typedef struct
+{
+	unsigned int *slots;
+	unsigned int capacity;
+	unsigned int count;
+} SearchTable;
+
+typedef struct
+{
+	char path[SEARCH_PATH_SIZE];
+	unsigned char tracks[SEARCH_TRACKS_SIZE];
+} SearchEntry;
+
+static Schema schema;
+static char collectionPath[512];
+static int enabled = 0;
+static int ready = 0;
+
+static pthread_mutex_t indexLock = PTHREAD_MUTEX_INITIALIZER;
+static SearchTerm *terms;
+static unsigned int termCount, termCapacity;
+static SearchCard *cards;
+static unsigned int cardCount, cardCapacity;
+static SearchTable termTable, cardTable;
+
+static pthread_mutex_t staleLock = PTHREAD_MUTEX_INITIALIZER;
+static char stale[SEARCH_STALE_MAX][SEARCH_PATH_SIZE];
+static int staleCount = 0;
+static int staleOverflow = 0;
+
+static unsigned int hashText(const char *text)
+{
+	unsigned int hash = 2166136261u;
+	for (const unsigned char *byte = (const unsigned char *)text; *byte; byte++)
+	{
+		hash ^= *byte;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static const char *termKey(unsigned int id)
+{
+	return terms[id].text;
+}
+
+static const char *cardKey(unsigned int id)
+{
+	return cards[id].path;
+}
+
+/**
+ * Finds the slot a key is in, or the empty slot it would go in
+ **/
+static unsigned int *tableSlot(SearchTable *table, const char *key, const char *(*keyOf)(unsigned int))
+{
+	unsigned int mask = table->capacity - 1;
+	unsigned int index = hashText(key) & mask;
+
+	while (table->slots[index] && strcmp(keyOf(table->slots[index] - 1), key) != 0)
+		index = (index + 1) & mask;
+
+	return &table->slots[index];
+}
+
+static int tableGrow(SearchTable *table, const char *(*keyOf)(unsigned int))
+{
+	if ((table->count + 1) * 10 < table->capacity * 7)
+		return 0;
+
+	SearchTable grown = {calloc(table->capacity * 2, sizeof(unsigned int)), table->capacity * 2, table->count};
+	if (!grown.slots)
+		return -1;
+
+	for (unsigned int i = 0; i < table->capacity; i++)
+	{
+		if (table->slots[i])
+			*tableSlot(&grown, keyOf(table->slots[i] - 1), keyOf) = table->slots[i];
+	}
+
+	free(table->slots);
+	*table = grown;
+	return 0;
+}
+
+/**
+ * Finds a term, adding it if it is new
+ *
+ * @returns The term's id, or -1 if it couldn't be added
+ **/
+static int addTerm(const char *text)
+{
+	unsigned int *slot = tableSlot(&termTable, text, termKey);
+	if (*slot)
+		return *slot - 1;
+
+	if (tableGrow(&termTable, termKey) < 0)
+		return -1;
+
+	if (termCount == termCapacity)
+	{
+		SearchTerm *grown = realloc(terms, termCapacity * 2 * sizeof(SearchTerm));
+		if (!grown)
+			return -1;
+		terms = grown;
+		termCapacity *= 2;
+	}
+
+	SearchTerm *term = &terms[termCount];
+	memset(term, 0, sizeof(SearchTerm));
+	if (!(term->text = strdup(text)))
+		return -1;
+
+	*tableSlot(&termTable, text, termKey) = ++termCount;
+	termTable.count++;
+	return termCount - 1;
+}
+
+static int addCard(const char *path)
+{
+	unsigned int *slot = tableSlot(&cardTable, path, cardKey);
+	if (*slot)
+		return *slot - 1;
+
+	if (tableGrow(&cardTable, cardKey) < 0)
+		return -1;
+
+	if (cardCount == cardCapacity)
+	{
+		SearchCard *grown = realloc(cards, cardCapacity * 2 * sizeof(SearchCard));
+		if (!grown)
+			return -1;
+		cards = grown;
+		cardCapacity *= 2;
+	}
+
+	SearchCard *card = &cards[cardCount];
+	memset(card, 0, sizeof(SearchCard));
+	if (!(card->path = strdup(path)))
+		return -1;
+
+	*tableSlot(&cardTable, path, cardKey) = ++cardCount;
+	cardTable.count++;
+	return cardCount - 1;
+}
+
+/**
+ * Finds where a card is or would go in a sorted list of card ids
+ **/
+static unsigned int findPosting(const unsigned int *list, unsigned int count, unsigned int card)
+{
+	unsigned int low = 0, high = count;
+	while (low < high)
+	{
+		unsigned int middle = (low + high) / 2;
+		if (list[middle] < card)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	return low;
+}
+
+static int addPosting(SearchTerm *term, unsigned int card)
+{
+	unsigned int position = findPosting(term->cards, term->count, card);
+	if (position < term->count && term->cards[position] == card)
+		return 0;
+
+	if (term->count == term->capacity)
+	{
+		unsigned int capacity = term->capacity ? term->capacity * 2 : 4;
+		unsigned int *grown = realloc(term->cards, capacity * sizeof(unsigned int));
+		if (!grown)
+			return -1;
+		term->cards = grown;
+		term->capacity = capacity;
+	}
+
+	memmove(&term->cards[position + 1], &term->cards[position], (term->count - position) * sizeof(unsigned int));
+	term->cards[position] = card;
+	term->count++;
+	return 0;
+}
+
+static void removePosting(SearchTerm *term, unsigned int card)
+{
+	unsigned int position = findPosting(term->cards, term->count, card);
+	if (position == term->count || term->cards[position] != card)
+		return;
+
+	memmove(&term->cards[position], &term->cards[position + 1], (term->count - position - 1) * sizeof(unsigned int));
+	term->count--;
+}
+
+/**
+ * Splits a value into the lower case words it is searched by
+ *
+ * Numbers and hex are a single word, text is split at anything that isn't
+ * a letter or a digit.
+ *
+ * @returns The number of words, each NUL terminated in words
+ **/
+static int splitWords(const SchemaField *field, char *value, char *words[], int max)
+{
+	int count = 0;
+
+	if (field->type != FIELD_TEXT)
+	{
+		if (*value && max > 0)
+			words[count++] = value;
+		return count;
+	}
+
+	char *word = NULL;
+	for (char *c = value;; c++)
+	{
+		int part = *c && isalnum((unsigned char)*c);
+		if (part)
+		{
+			*c = tolower((unsigned char)*c);
+			if (!word)
+				word = c;
+			continue;
+		}
+
+		int end = *c == '\0';
+		if (word && count < max)
+		{
+			*c = '\0';
+			words[count++] = word;
+		}
+		word = NULL;
+
+		if (end)
+			return count;
+	}
+}
+
+/**
+ * Indexes a card under the terms its fields have now, called with the lock held
+ **/
+static void indexCard(const char *path, unsigned char tracks[3][TRACK_SIZE])
+{
+	int id = addCard(path);
+	if (id < 0)
+	{
+		printf("Error: Couldn't index %s\n", path);
+		return;
+	}
+
+	unsigned int found[WORDS_MAX];
+	int foundCount = 0;
+	char summary[SEARCH_SUMMARY_SIZE] = "";
+	int summaryLength = 0;
+
+	for (int i = 0; i < schema.count; i++)
+	{
+		const SchemaField *field = &schema.fields[i];
+		if (!field->indexed)
+			continue;
+
+		char value[SCHEMA_VALUE_SIZE];
+		schemaDecode(field, tracks, value);
+
+		if (summaryLength < sizeof(summary))
+			summaryLength += snprintf(summary + summaryLength, sizeof(summary) - summaryLength, "%s%s=%s", summaryLength ? " " : "", field->name, value);
+
+		char *words[WORDS_MAX];
+		int wordCount = splitWords(field, value, words, WORDS_MAX - foundCount);
+
+		for (int w = 0; w < wordCount; w++)
+		{
+			char text[TERM_SIZE];
+			snprintf(text, sizeof(text), "%s%c%s", field->name, TERM_SEPARATOR, words[w]);
+
+			int term = addTerm(text);
+			int seen = 0;
+			for (int j = 0; j < foundCount; j++)
+				seen |= found[j] == (unsigned int)term;
+
+			if (term >= 0 && !seen)
+				found[foundCount++] = term;
+		}
+	}
+
+	SearchCard *card = &cards[id];
+	for (int i = 0; i < card->termCount; i++)
+		removePosting(&terms[card->terms[i]], id);
+
+	unsigned int *kept = realloc(card->terms, (foundCount ? foundCount : 1) * sizeof(unsigned int));
+	if (!kept)
+	{
+		card->termCount = 0;
+		return;
+	}
+
+	card->terms = kept;
+	card->termCount = 0;
+	for (int i = 0; i < foundCount; i++)
+	{
+		if (addPosting(&terms[found[i]], id) == 0)
+			card->terms[card->termCount++] = found[i];
+	}
+
+	strcpy(card->summary, summary);
+}
+
+/**
+ * Reads a card from disk and indexes it
+ *
+ * @returns 0 on success, -1 if the card couldn't be read
+ **/
+static int indexFile(const char *path)
+{
+	unsigned char tracks[3][TRACK_SIZE];
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	int result = transferReadAll(fd, tracks, SEARCH_TRACKS_SIZE);
+	close(fd);
+
+	char canonical[PATH_MAX];
+	if (result < 0 || !realpath(path, canonical) || strlen(canonical) >= SEARCH_PATH_SIZE)
+		return -1;
+
+	pthread_mutex_lock(&indexLock);
+	indexCard(canonical, tracks);
+	pthread_mutex_unlock(&indexLock);
+	return 0;
+}
+
+/**
+ * Indexes every card already in the collection
+ **/
+static void indexCollection()
+{
+	DIR *directory = opendir(collectionPath);
+	if (!directory)
+	{
+		printf("Warning: Couldn't open collection directory %s to index it\n", collectionPath);
+		return;
+	}
+
+	struct dirent *entry;
+	unsigned int indexed = 0;
+
+	while ((entry = readdir(directory)))
+	{
+		if (entry->d_name[0] == '.' || (entry->d_type != DT_REG && entry->d_type != DT_UNKNOWN))
+			continue;
+
+		char path[sizeof(collectionPath) + 256];
+		snprintf(path, sizeof(path), "%s/%s", collectionPath, entry->d_name);
+
+		if (indexFile(path) == 0)
+			indexed++;
+	}
+
+	closedir(directory);
+	printf("Info: Indexed %u cards in %s\n", indexed, collectionPath);
+}
+
+static void indexStarted()
+{
+	indexCollection();
+	__atomic_store_n(&ready, 1, __ATOMIC_RELEASE);
+}
+
+static void indexEntry(void *data)
+{
+	SearchEntry *entry = data;
+
+	// The same card is the same file however its path was written
+	char canonical[PATH_MAX];
+	const char *path = realpath(entry->path, canonical) && strlen(canonical) < sizeof(entry->path) ? canonical : entry->path;
+
+	pthread_mutex_lock(&indexLock);
+	indexCard(path, (unsigned char (*)[TRACK_SIZE])entry->tracks);
+	pthread_mutex_unlock(&indexLock);
+}
+
+/**
+ * Reads back the cards whose saves were dropped, once the queue is empty
+ *
+ * With a card service a card may not have reached the disk yet, in which
+ * case it is indexed as it was and catches up on its next save.
+ **/
+static void indexStale()
+{
+	char paths[SEARCH_STALE_MAX][SEARCH_PATH_SIZE];
+
+	pthread_mutex_lock(&staleLock);
+	int count = staleCount;
+	int overflow = staleOverflow;
+	memcpy(paths, stale, count * SEARCH_PATH_SIZE);
+	staleCount = staleOverflow = 0;
+	pthread_mutex_unlock(&staleLock);
+
+	if (overflow)
+		indexCollection();
+
+	for (int i = 0; i < count; i++)
+		indexFile(paths[i]);
+}
+
+static WorkQueue queue = {
+	.entrySize = sizeof(SearchEntry),
+	.capacity = SEARCH_QUEUE_SIZE,
+	.begin = indexStarted,
+	.handle = indexEntry,
+	.idle = indexStale,
+};
+
+/**
+ * Starts indexing the collection with a game's schema
+ *
+ * @returns 0 on success, -1 if the schema has no indexed fields or the
+ * index couldn't be set up
+ **/
+int searchInit(const Schema *gameSchema, const char *collectionDirectory)
+{
+	int indexed = 0;
+	for (int i = 0; i < gameSchema->count; i++)
+		indexed |= gameSchema->fields[i].indexed;
+
+	if (!indexed || strlen(collectionDirectory) >= sizeof(collectionPath))
+		return -1;
+
+	schema = *gameSchema;
+	strcpy(collectionPath, collectionDirectory);
+
+	termCapacity = cardCapacity = 1024;
+	terms = malloc(termCapacity * sizeof(SearchTerm));
+	cards = malloc(cardCapacity * sizeof(SearchCard));
+	termTable = (SearchTable){calloc(2048, sizeof(unsigned int)), 2048, 0};
+	cardTable = (SearchTable){calloc(2048, sizeof(unsigned int)), 2048, 0};
+
+	if (!terms || !cards || !termTable.slots || !cardTable.slots)
+		return -1;
+
+	if (workQueueStart(&queue) < 0)
+		return -1;
+
+	enabled = 1;
+	return 0;
+}
+
+int searchEnabled()
+{
+	return enabled;
+}
+
+/**
+ * Remembers a card whose save was dropped, to be read back from disk
+ **/
+static void markStale(const char *cardPath)
+{
+	pthread_mutex_lock(&staleLock);
+
+	int found = 0;
+	for (int i = 0; i < staleCount && !found; i++)
+		found = strcmp(stale[i], cardPath) == 0;
+
+	if (!found && staleCount < SEARCH_STALE_MAX)
+		strcpy(stale[staleCount++], cardPath);
+	else if (!found)
+		staleOverflow = 1;
+
+	pthread_mutex_unlock(&staleLock);
+}
+
+static void enqueue(const char *cardPath, unsigned char tracks[3][TRACK_SIZE], int wait)
+{
+	SearchEntry entry;
+
+	if (!enabled || cardPath[0] == '\0' || strlen(cardPath) >= sizeof(entry.path))
+		return;
+
+	strcpy(entry.path, cardPath);
+	memcpy(entry.tracks, tracks, SEARCH_TRACKS_SIZE);
+
+	if (workQueuePush(&queue, &entry, wait) < 0)
+	{
+		markStale(cardPath);
+		PROBE1(search__drop, cardPath);
+	}
+}
+
+/**
+ * Queues a saved card to be reindexed
+ *
+ * Never waits on the index, if the queue is full the card is read back
+ * from disk once the index thread has caught up.
+ **/
+void searchCardSaved(const char *cardPath, unsigned char tracks[3][TRACK_SIZE])
+{
+	enqueue(cardPath, tracks, 0);
+}
+
+/**
+ * Queues a saved card to be reindexed, waiting for room in the queue
+ *
+ * For bulk writers off the protocol loop, which would otherwise overrun the
+ * queue.
+ **/
+void searchCardSavedWait(const char *cardPath, unsigned char tracks[3][TRACK_SIZE])
+{
+	enqueue(cardPath, tracks, 1);
+}
+
+/**
+ * The sorted cards that have a word in a field, or in any indexed field
+ * when field is -1, called with the lock held
+ *
+ * @returns The number of cards, with *list to be freed by the caller
+ **/
+static int matchWord(int field, const char *word, unsigned int **list)
+{
+	unsigned int *matched = NULL;
+	unsigned int count = 0;
+
+	for (int i = 0; i < schema.count; i++)
+	{
+		if (!schema.fields[i].indexed || (field >= 0 && field != i))
+			continue;
+
+		char text[TERM_SIZE];
+		snprintf(text, sizeof(text), "%s%c%s", schema.fields[i].name, TERM_SEPARATOR, word);
+
+		unsigned int *slot = tableSlot(&termTable, text, termKey);
+		if (!*slot || !terms[*slot - 1].count)
+			continue;
+
+		// Merged with what the other fields matched, keeping it sorted
+		SearchTerm *term = &terms[*slot - 1];
+		unsigned int *merged = malloc((count + term->count) * sizeof(unsigned int));
+		if (!merged)
+			break;
+
+		unsigned int a = 0, b = 0, length = 0;
+		while (a < count || b < term->count)
+		{
+			if (b == term->count || (a < count && matched[a] < term->cards[b]))
+				merged[length++] = matched[a++];
+			else if (a == count || term->cards[b] < matched[a])
+				merged[length++] = term->cards[b++];
+			else
+			{
+				merged[length++] = matched[a++];
+				b++;
+			}
+		}
+
+		free(matched);
+		matched = merged;
+		count = length;
+	}
+
+	*list = matched;
+	return count;
+}
+
+/**
+ * Finds the cards matching every word of a query
+ *
+ * Terms are separated by newlines, each either field=words to look in one
+ * field or just words to look in every indexed field. Words are matched
+ * whole and ignoring case.
+ *
+ * @param max The most matches to copy into results
+ * @param total Set to the number of cards matching
+ * @param error A 256 byte buffer describing a bad query
+ * @returns The number of matches copied, or -1 if the query is bad
+ **/
+int searchFind(const char *query, SearchResult *results, int max, unsigned int *total, char *error)
+{
+	char text[256];
+	snprintf(text, sizeof(text), "%s", query);
+
+	int fields[WORDS_MAX];
+	char *words[WORDS_MAX];
+	int wordCount = 0;
+
+	char *saved;
+	for (char *term = strtok_r(text, "\n", &saved); term && wordCount < WORDS_MAX; term = strtok_r(NULL, "\n", &saved))
+	{
+		int field = -1;
+		char *equals = strchr(term, '=');
+
+		if (equals)
+		{
+			*equals = '\0';
+			field = schemaFind(&schema, term);
+			if (field < 0 || !schema.fields[field].indexed)
+			{
+				snprintf(error, 256, "%s isn't an indexed field", term);
+				return -1;
+			}
+			term = equals + 1;
+		}
+
+		// Query words are always split like text so they match either kind of field
+		SchemaField textField = {.type = FIELD_TEXT};
+		int count = splitWords(&textField, term, &words[wordCount], WORDS_MAX - wordCount);
+		for (int i = 0; i < count; i++)
+			fields[wordCount + i] = field;
+		wordCount += count;
+	}
+
+	if (wordCount == 0)
+	{
+		snprintf(error, 256, "Nothing to search for");
+		return -1;
+	}
+
+	pthread_mutex_lock(&indexLock);
+
+	unsigned int *matched = NULL;
+	unsigned int count = matchWord(fields[0], words[0], &matched);
+
+	for (int i = 1; i < wordCount && count; i++)
+	{
+		unsigned int *other;
+		unsigned int otherCount = matchWord(fields[i], words[i], &other);
+
+		unsigned int kept = 0;
+		for (unsigned int j = 0; j < count; j++)
+		{
+			unsigned int position = findPosting(other, otherCount, matched[j]);
+			if (position < otherCount && other[position] == matched[j])
+				matched[kept++] = matched[j];
+		}
+
+		free(other);
+		count = kept;
+	}
+
+	int copied = 0;
+	for (; copied < max && copied < count; copied++)
+	{
+		snprintf(results[copied].path, sizeof(results[copied].path), "%s", cards[matched[copied]].path);
+		strcpy(results[copied].summary, cards[matched[copied]].summary);
+	}
+
+	pthread_mutex_unlock(&indexLock);
+
+	free(matched);
+	*total = count;
+	return copied;
+}
+
+void searchGetStats(SearchStats *stats)
+{
+	pthread_mutex_lock(&indexLock);
+	stats->cards = cardCount;
+	stats->terms = termCount;
+	pthread_mutex_unlock(&indexLock);
+
+	stats->dropped = workQueueDropped(&queue);
+
+	stats->ready = __atomic_load_n(&ready, __ATOMIC_ACQUIRE);
+}
@@ -0,0 +1,37 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include "cardd.h"
+#include "schema.h"
+
+/* Card saves waiting for the index thread, beyond this they are read back later */
+#define SEARCH_QUEUE_SIZE 256
+
+/* The most matching cards sent back for one query */
+#define SEARCH_RESULTS_MAX 25
+
+/* Indexed fields of a card shown with each match */
+#define SEARCH_SUMMARY_SIZE 128
+
+typedef struct
+{
+	char path[256];
+	char summary[SEARCH_SUMMARY_SIZE];
+} SearchResult;
+
+typedef struct
+{
+	unsigned int cards;
+	unsigned int terms;
+	unsigned int dropped;
+	int ready;
+} SearchStats;
+
+int searchInit(const Schema *schema, const char *collectionDirectory);
+int searchEnabled();
+void searchCardSaved(const char *cardPath, unsigned char tracks[3][TRACK_SIZE]);
+void searchCardSavedWait(const char *cardPath, unsigned char tracks[3][TRACK_SIZE]);
+int searchFind(const char *query, SearchResult *results, int max, unsigned int *total, char *error);
+void searchGetStats(SearchStats *stats);
+
+#endif
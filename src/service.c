@@ -0,0 +1,235 @@
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "service.h"
+
+/**
+ * The cardd side of the card service
+ *
+ * When a card service is configured every card load and save goes through
+ * it instead of the card files, and the lease taken on insert is given back
+ * once the card has left the reader. Requests come from the protocol loop,
+ * the control thread and the timer wheel, so they are serialised here.
+ **/
+
+static int serviceSocket = -1;
+static char servicePath[108];
+static pthread_mutex_t serviceLock = PTHREAD_MUTEX_INITIALIZER;
+
+static int openConnection()
+{
+	struct sockaddr_un address = {0};
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, servicePath);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+
+	if (connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0)
+	{
+		close(fd);
+		return -1;
+	}
+
+	char name[64];
+	unsigned char hello[2 + sizeof(name)];
+	int length = snprintf(name, sizeof(name), "cardd %d", getpid());
+
+	hello[0] = SERVICE_HELLO;
+	hello[1] = length;
+	memcpy(&hello[2], name, length);
+
+	unsigned char status;
+	if (write(fd, hello, 2 + length) != 2 + length || read(fd, &status, 1) != 1 || status != SERVICE_OK)
+	{
+		close(fd);
+		return -1;
+	}
+
+	serviceSocket = fd;
+	return 0;
+}
+
+static int readReply(unsigned char *buffer, int length)
+{
+	int received = 0;
+	while (received < length)
+	{
+		int bytesRead = read(serviceSocket, buffer + received, length - received);
+		if (bytesRead < 1)
+			return -1;
+		received += bytesRead;
+	}
+	return 0;
+}
+
+/**
+ * Resolves a card path to the one absolute path the service knows it by,
+ * so every way of naming a card shares the same lease
+ *
+ * A card that doesn't exist yet only needs its directory to.
+ *
+ * @param canonical A PATH_MAX buffer for the resolved path
+ * @returns 0 on success, -1 if the path can't be resolved
+ **/
+static int canonicalPath(const char *path, char *canonical)
+{
+	if (realpath(path, canonical))
+		return 0;
+
+	if (errno != ENOENT)
+		return -1;
+
+	const char *slash = strrchr(path, '/');
+	const char *name = slash ? slash + 1 : path;
+	char directory[PATH_MAX];
+
+	if (!slash)
+		strcpy(directory, ".");
+	else if (slash == path)
+		strcpy(directory, "/");
+	else
+		snprintf(directory, sizeof(directory), "%.*s", (int)(slash - path), path);
+
+	char resolved[PATH_MAX];
+	if (name[0] == '\0' || strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || !realpath(directory, resolved))
+		return -1;
+
+	int length = snprintf(canonical, PATH_MAX, "%s/%s", strcmp(resolved, "/") == 0 ? "" : resolved, name);
+	return length < PATH_MAX ? 0 : -1;
+}
+
+/**
+ * Sends one request and waits for its reply, reconnecting once if the
+ * card service has gone away in the meantime
+ *
+ * @returns The reply status, or SERVICE_ERROR if the service can't be reached
+ **/
+static unsigned char request(unsigned char op, const char *path, unsigned char tracks[3][TRACK_SIZE])
+{
+	char cardPath[PATH_MAX];
+	if (canonicalPath(path, cardPath) < 0)
+		return SERVICE_ERROR;
+
+	int pathLength = strlen(cardPath);
+	if (pathLength > 255)
+		return SERVICE_ERROR;
+
+	unsigned char message[2 + 255 + SERVICE_TRACKS_SIZE];
+	int length = 0;
+
+	message[length++] = op;
+	message[length++] = pathLength;
+	memcpy(&message[length], cardPath, pathLength);
+	length += pathLength;
+
+	if (op == SERVICE_SAVE)
+	{
+		memcpy(&message[length], tracks, SERVICE_TRACKS_SIZE);
+		length += SERVICE_TRACKS_SIZE;
+	}
+
+	unsigned char status = SERVICE_ERROR;
+
+	pthread_mutex_lock(&serviceLock);
+
+	for (int attempt = 0; attempt < 2; attempt++)
+	{
+		if (serviceSocket < 0 && openConnection() < 0)
+			break;
+
+		if (write(serviceSocket, message, length) == length && readReply(&status, 1) == 0)
+		{
+			if (op == SERVICE_ACQUIRE && status == SERVICE_OK && readReply((unsigned char *)tracks, SERVICE_TRACKS_SIZE) < 0)
+				status = SERVICE_ERROR;
+			else
+				break;
+		}
+
+		printf("Warning: Lost the card service, reconnecting\n");
+		close(serviceSocket);
+		serviceSocket = -1;
+	}
+
+	pthread_mutex_unlock(&serviceLock);
+
+	return status;
+}
+
+/**
+ * Connects to the card service
+ *
+ * @returns 0 on success, -1 on failure
+ **/
+int serviceConnect(const char *path)
+{
+	if (strlen(path) >= sizeof(servicePath))
+	{
+		printf("Error: Card service path %s is too long\n", path);
+		return -1;
+	}
+
+	strcpy(servicePath, path);
+
+	pthread_mutex_lock(&serviceLock);
+	int result = openConnection();
+	pthread_mutex_unlock(&serviceLock);
+
+	if (result < 0)
+	{
+		printf("Error: Couldn't connect to the card service at %s\n", path);
+		servicePath[0] = '\0';
+	}
+
+	return result;
+}
+
+int serviceEnabled()
+{
+	return servicePath[0] != '\0';
+}
+
+/**
+ * Takes the lease on a card and fetches its tracks
+ *
+ * @returns 0 on success, -1 if another cabinet holds the card or the service is unreachable
+ **/
+int serviceAcquire(const char *cardPath, unsigned char tracks[3][TRACK_SIZE])
+{
+	unsigned char status = request(SERVICE_ACQUIRE, cardPath, tracks);
+
+	if (status == SERVICE_LEASED)
+		printf("Error: %s is in use in another cabinet\n", cardPath);
+	else if (status != SERVICE_OK)
+		printf("Error: The card service couldn't load %s\n", cardPath);
+
+	return status == SERVICE_OK ? 0 : -1;
+}
+
+/**
+ * Hands the tracks of a leased card to the service to write out
+ *
+ * @returns 0 on success, -1 on failure
+ **/
+int serviceSave(const char *cardPath, unsigned char tracks[3][TRACK_SIZE])
+{
+	unsigned char status = request(SERVICE_SAVE, cardPath, tracks);
+
+	if (status != SERVICE_OK)
+		printf("Error: The card service couldn't save %s\n", cardPath);
+
+	return status == SERVICE_OK ? 0 : -1;
+}
+
+void serviceRelease(const char *cardPath)
+{
+	request(SERVICE_RELEASE, cardPath, NULL);
+}
@@ -0,0 +1,13 @@
+#ifndef SERVICE_H
+#define SERVICE_H
+
+#include "cardd.h"
+#include "cardservice.h"
+
+int serviceConnect(const char *path);
+int serviceEnabled();
+int serviceAcquire(const char *cardPath, unsigned char tracks[3][TRACK_SIZE]);
+int serviceSave(const char *cardPath, unsigned char tracks[3][TRACK_SIZE]);
+void serviceRelease(const char *cardPath);
+
+#endif
@@ -0,0 +1,418 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "clock.h"
+#include "hash.h"
+#include "probes.h"
+#include "session.h"
+#include "workqueue.h"
+
+/**
+ * Per session activity log
+ *
+ * Each card's time in a reader, from going in to coming out, is one
+ * session. While the card is in the reader the protocol loop counts its
+ * commands and bytes into the reader's open session, which costs no more
+ * than a few additions. When the card comes out the finished session is
+ * handed to the session thread through a queue, so a reply never waits on
+ * the log.
+ *
+ * The session thread appends sessions to segment files, one or more for
+ * each day. A segment is laid out by column, every session's card ID
+ * together, then every insert time and so on, and is memory mapped by
+ * both the writer and the cardstats query tool. Adding up a month of
+ * session lengths only touches the pages of the two columns it needs.
+ *
+ * A card still in a reader when cardd stops has no session logged for
+ * the time before the restart.
+ **/
+
+#define MS_PER_DAY (24ULL * 60 * 60 * 1000)
+
+/* Columns start on their own cache line */
+#define COLUMN_ALIGN 64
+
+static const unsigned int columnWidths[SESSION_COLUMNS] = {
+	[SESSION_CARD_ID] = 8,
+	[SESSION_INSERTED_MS] = 8,
+	[SESSION_DURATION_MS] = 4,
+	[SESSION_READER] = 1,
+	[SESSION_FLAGS] = 1,
+	[SESSION_COUNT_READS] = 4,
+	[SESSION_COUNT_WRITES] = 4,
+	[SESSION_COUNT_ERASES] = 4,
+	[SESSION_COUNT_PRINTS] = 4,
+	[SESSION_COUNT_OTHERS] = 4,
+	[SESSION_BYTES_READ] = 4,
+	[SESSION_BYTES_WRITTEN] = 4,
+	[SESSION_ERRORS] = 4,
+};
+
+static char sessionPath[512];
+static int enabled = 0;
+
+static unsigned int logged;
+
+/* The segment being appended to, only touched by the session thread */
+static SessionSegment *segment;
+static unsigned long long segmentSize;
+
+/**
+ * The start of the local day a time falls in, which names its segments
+ **/
+static unsigned long long dayStartMs(unsigned long long timeMs, struct tm *day)
+{
+	time_t seconds = timeMs / 1000;
+	localtime_r(&seconds, day);
+	day->tm_hour = day->tm_min = day->tm_sec = 0;
+	day->tm_isdst = -1;
+	return mktime(day) * 1000ULL;
+}
+
+unsigned long long sessionCardId(const char *cardPath)
+{
+	return hashPath(cardPath);
+}
+
+static void closeSegment()
+{
+	if (!segment)
+		return;
+
+	msync(segment, segmentSize, MS_SYNC);
+	munmap(segment, segmentSize);
+	segment = NULL;
+}
+
+/**
+ * Maps a segment file, laying out a new one
+ *
+ * @returns 0 on success, 1 if the segment is full, -1 on failure
+ **/
+static int mapSegment(const char *path, unsigned long long dayStart)
+{
+	unsigned long long size = (sizeof(SessionSegment) + COLUMN_ALIGN - 1) / COLUMN_ALIGN * COLUMN_ALIGN;
+	unsigned int offset[SESSION_COLUMNS];
+
+	for (int i = 0; i < SESSION_COLUMNS; i++)
+	{
+		offset[i] = size;
+		size += (columnWidths[i] * SESSION_SEGMENT_RECORDS + COLUMN_ALIGN - 1) / COLUMN_ALIGN * COLUMN_ALIGN;
+	}
+
+	int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return -1;
+
+	struct stat status;
+	if (fstat(fd, &status) < 0 || (status.st_size == 0 && ftruncate(fd, size) < 0))
+	{
+		close(fd);
+		return -1;
+	}
+
+	int created = status.st_size == 0;
+	if (!created && status.st_size != size)
+	{
+		close(fd);
+		return 1;
+	}
+
+	SessionSegment *mapped = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (mapped == MAP_FAILED)
+		return -1;
+
+	if (created)
+	{
+		mapped->capacity = SESSION_SEGMENT_RECORDS;
+		mapped->count = 0;
+		mapped->dayStartMs = dayStart;
+		memcpy(mapped->width, columnWidths, sizeof(mapped->width));
+		memcpy(mapped->offset, offset, sizeof(mapped->offset));
+		__sync_synchronize();
+		memcpy(mapped->magic, SESSION_MAGIC, SESSION_MAGIC_SIZE);
+	}
+	else if (memcmp(mapped->magic, SESSION_MAGIC, SESSION_MAGIC_SIZE) != 0 || mapped->capacity != SESSION_SEGMENT_RECORDS ||
+			 memcmp(mapped->offset, offset, sizeof(offset)) != 0 || mapped->count >= mapped->capacity)
+	{
+		munmap(mapped, size);
+		return 1;
+	}
+
+	segment = mapped;
+	segmentSize = size;
+	return 0;
+}
+
+/**
+ * Makes sure the segment being appended to is for the day of the session
+ * and has room for it, moving on to the next segment if not
+ **/
+static int openSegment(unsigned long long timeMs)
+{
+	struct tm day;
+	unsigned long long dayStart = dayStartMs(timeMs, &day);
+
+	if (segment && segment->dayStartMs == dayStart && segment->count < segment->capacity)
+		return 0;
+
+	closeSegment();
+
+	for (int part = 0; part < 1000; part++)
+	{
+		char path[600];
+		snprintf(path, sizeof(path), "%s/%04d-%02d-%02d.%03d.seg", sessionPath, day.tm_year + 1900, day.tm_mon + 1, day.tm_mday, part);
+
+		int result = mapSegment(path, dayStart);
+		if (result < 0)
+		{
+			printf("Error: Couldn't open session segment %s\n", path);
+			return -1;
+		}
+
+		if (result == 0)
+			return 0;
+	}
+
+	return -1;
+}
+
+static unsigned long long columnValue(const SessionRecord *record, SessionColumn column)
+{
+	switch (column)
+	{
+	case SESSION_CARD_ID:
+		return record->cardId;
+	case SESSION_INSERTED_MS:
+		return record->insertedMs;
+	case SESSION_DURATION_MS:
+		return record->durationMs;
+	case SESSION_READER:
+		return record->reader;
+	case SESSION_FLAGS:
+		return record->flags;
+	case SESSION_COUNT_READS:
+	case SESSION_COUNT_WRITES:
+	case SESSION_COUNT_ERASES:
+	case SESSION_COUNT_PRINTS:
+	case SESSION_COUNT_OTHERS:
+		return record->opcodes[column - SESSION_COUNT_READS];
+	case SESSION_BYTES_READ:
+		return record->bytesRead;
+	case SESSION_BYTES_WRITTEN:
+		return record->bytesWritten;
+	case SESSION_ERRORS:
+		return record->errors;
+	default:
+		return 0;
+	}
+}
+
+static int appendSession(const SessionRecord *record)
+{
+	if (openSegment(record->insertedMs + record->durationMs) < 0)
+		return -1;
+
+	unsigned int index = segment->count;
+	unsigned char *base = (unsigned char *)segment;
+
+	for (int i = 0; i < SESSION_COLUMNS; i++)
+	{
+		unsigned char *value = base + segment->offset[i] + (unsigned long long)index * columnWidths[i];
+		unsigned long long number = columnValue(record, i);
+
+		if (columnWidths[i] == 8)
+			*(unsigned long long *)value = number;
+		else if (columnWidths[i] == 4)
+			*(unsigned int *)value = number;
+		else
+			*value = number;
+	}
+
+	// Readers of the segment only look at sessions below the count
+	__sync_synchronize();
+	segment->count = index + 1;
+
+	return 0;
+}
+
+static void logSession(void *data)
+{
+	SessionRecord *record = data;
+
+	if (appendSession(record) < 0)
+		printf("Error: Couldn't log a session of reader %u\n", record->reader);
+	else
+		__atomic_add_fetch(&logged, 1, __ATOMIC_RELAXED);
+}
+
+static void syncSegment()
+{
+	if (segment)
+		msync(segment, segmentSize, MS_SYNC);
+}
+
+static WorkQueue queue = {
+	.entrySize = sizeof(SessionRecord),
+	.capacity = SESSION_QUEUE_SIZE,
+	.handle = logSession,
+	.idle = syncSegment,
+};
+
+/**
+ * Opens the session log and starts the session thread
+ *
+ * @returns 0 on success, -1 on failure
+ **/
+int sessionLogInit(const char *directory)
+{
+	if (strlen(directory) >= sizeof(sessionPath))
+		return -1;
+
+	if (mkdir(directory, 0755) < 0 && errno != EEXIST)
+	{
+		printf("Error: Couldn't create session log directory %s\n", directory);
+		return -1;
+	}
+
+	strcpy(sessionPath, directory);
+
+	if (workQueueStart(&queue) < 0)
+		return -1;
+
+	enabled = 1;
+	return 0;
+}
+
+int sessionLogEnabled()
+{
+	return enabled;
+}
+
+void sessionGetStats(SessionStats *stats)
+{
+	stats->logged = __atomic_load_n(&logged, __ATOMIC_RELAXED);
+	stats->dropped = workQueueDropped(&queue);
+}
+
+/**
+ * Gives a reader somewhere to count its sessions, starting one straight
+ * away if it was restored with a card in it
+ *
+ * @returns 0 on success or if the session log is off, -1 on failure
+ **/
+int sessionInit(CardReader *reader)
+{
+	if (!enabled)
+		return 0;
+
+	reader->session = calloc(1, sizeof(ReaderSession));
+	if (!reader->session)
+		return -1;
+
+	pthread_mutex_lock(&reader->lock);
+	sessionCardMoved(reader);
+	pthread_mutex_unlock(&reader->lock);
+
+	return 0;
+}
+
+static void finishSession(CardReader *reader, ReaderSession *session)
+{
+	SessionRecord *record = &session->record;
+	record->durationMs = clockWallMs() - record->insertedMs;
+	session->open = 0;
+
+	PROBE3(session__end, reader->id, record->durationMs, record->errors);
+
+	if (workQueuePush(&queue, record, 0) < 0)
+		PROBE1(session__drop, reader->id);
+}
+
+/**
+ * Opens or closes the reader's session to match where its card is
+ *
+ * Called with the reader locked whenever the card moves. A different card
+ * turning up without the last one coming out, as a dispensed card does,
+ * closes the old session and opens a new one.
+ **/
+void sessionCardMoved(CardReader *reader)
+{
+	ReaderSession *session = reader->session;
+	if (!session)
+		return;
+
+	int inside = reader->cardPosition != NOT_INSERTED;
+	unsigned long long cardId = inside ? sessionCardId(reader->cardPath) : 0;
+
+	if (session->open && (!inside || cardId != session->record.cardId))
+		finishSession(reader, session);
+
+	if (!inside || session->open)
+		return;
+
+	memset(&session->record, 0, sizeof(session->record));
+	session->record.cardId = cardId;
+	session->record.reader = reader->id;
+	session->record.insertedMs = clockWallMs();
+	if (reader->cardPosition == DISPENCING_FROM_BACK)
+		session->record.flags |= SESSION_DISPENSED;
+	session->open = 1;
+}
+
+/**
+ * Counts a command from the host against the card in the reader
+ *
+ * @param bytesRead Track bytes sent back to the host
+ * @param bytesWritten Track bytes the host wrote to the card
+ **/
+void sessionCommand(CardReader *reader, unsigned char opcode, unsigned int bytesRead, unsigned int bytesWritten)
+{
+	ReaderSession *session = reader->session;
+	if (!session)
+		return;
+
+	pthread_mutex_lock(&reader->lock);
+
+	if (session->open)
+	{
+		SessionRecord *record = &session->record;
+
+		switch (opcode)
+		{
+		case READ:
+			record->opcodes[SESSION_READS]++;
+			break;
+		case WRITE:
+			record->opcodes[SESSION_WRITES]++;
+			break;
+		case ERASE:
+			record->opcodes[SESSION_ERASES]++;
+			break;
+		case PRINT:
+			record->opcodes[SESSION_PRINTS]++;
+			break;
+		default:
+			record->opcodes[SESSION_OTHERS]++;
+			break;
+		}
+
+		record->bytesRead += bytesRead;
+		record->bytesWritten += bytesWritten;
+		if (reader->readerStatus != STATUS_NO_ERR)
+			record->errors++;
+	}
+
+	pthread_mutex_unlock(&reader->lock);
+}
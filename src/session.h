@@ -0,0 +1,111 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <pthread.h>
+
+#include "cardd.h"
+
+/* Default directory the session log segments are kept in */
+#define DEFAULT_SESSION_PATH "/var/tmp/cardd/sessions"
+
+#define SESSION_MAGIC "CARDSES1"
+#define SESSION_MAGIC_SIZE 8
+
+/* Sessions per segment file, a busy day carries on in another segment */
+#define SESSION_SEGMENT_RECORDS 65536
+
+/* Finished sessions waiting for the session thread, beyond this they are dropped */
+#define SESSION_QUEUE_SIZE 256
+
+/* The card was taken from the dispenser rather than inserted */
+#define SESSION_DISPENSED 0x01
+
+/* Commands counted for each session */
+typedef enum
+{
+	SESSION_READS,
+	SESSION_WRITES,
+	SESSION_ERASES,
+	SESSION_PRINTS,
+	SESSION_OTHERS,
+	SESSION_OPCODES,
+} SessionOpcode;
+
+/**
+ * Everything kept about one card from going into a reader to coming out
+ *
+ * The card ID is the FNV-1a hash of the card's real path, the same card in
+ * any reader has the same ID however its path was written.
+ **/
+typedef struct
+{
+	unsigned long long cardId;
+	unsigned long long insertedMs;
+	unsigned int durationMs;
+	unsigned int reader;
+	unsigned int opcodes[SESSION_OPCODES];
+	unsigned int bytesRead;
+	unsigned int bytesWritten;
+	unsigned int errors;
+	unsigned int flags;
+} SessionRecord;
+
+/* The columns of a segment, each one an array of SESSION_SEGMENT_RECORDS values */
+typedef enum
+{
+	SESSION_CARD_ID,
+	SESSION_INSERTED_MS,
+	SESSION_DURATION_MS,
+	SESSION_READER,
+	SESSION_FLAGS,
+	SESSION_COUNT_READS,
+	SESSION_COUNT_WRITES,
+	SESSION_COUNT_ERASES,
+	SESSION_COUNT_PRINTS,
+	SESSION_COUNT_OTHERS,
+	SESSION_BYTES_READ,
+	SESSION_BYTES_WRITTEN,
+	SESSION_ERRORS,
+	SESSION_COLUMNS,
+} SessionColumn;
+
+/**
+ * The first page of a segment file
+ *
+ * Each column starts at its offset and holds one value of its width for
+ * every session in the segment. Count is only raised once every column
+ * of a session has been written, so a reader of the file never sees half
+ * a session.
+ **/
+typedef struct
+{
+	char magic[SESSION_MAGIC_SIZE];
+	unsigned int capacity;
+	volatile unsigned int count;
+	unsigned long long dayStartMs;
+	unsigned int width[SESSION_COLUMNS];
+	unsigned int offset[SESSION_COLUMNS];
+} SessionSegment;
+
+/* The session a reader's card is part of, open while the card is in the reader */
+typedef struct ReaderSession
+{
+	int open;
+	SessionRecord record;
+} ReaderSession;
+
+typedef struct
+{
+	unsigned int logged;
+	unsigned int dropped;
+} SessionStats;
+
+int sessionLogInit(const char *directory);
+int sessionLogEnabled();
+void sessionGetStats(SessionStats *stats);
+int sessionInit(CardReader *reader);
+void sessionCardMoved(CardReader *reader);
+void sessionCommand(CardReader *reader, unsigned char opcode, unsigned int bytesRead, unsigned int bytesWritten);
+unsigned long long sessionCardId(const char *cardPath);
+
+#endif
@@ -0,0 +1,638 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "clock.h"
+#include "simulation.h"
+
+/**
+ * Virtual-time soak testing
+ *
+ * The simulation stands in for the serial port. readBytes hands the
+ * protocol loop the next frame from an in-memory host script and
+ * writeBytes hands the reply straight back to be checked, so the real
+ * protocol loop runs as fast as the CPU allows while the virtual clock
+ * moves forward by the host's polling interval between frames.
+ *
+ * A script is a list of steps, one per line:
+ *
+ *   repeat <n>              run the whole script n times
+ *   interval <ms>           virtual time between host frames
+ *   insert <path>           a player inserts a card
+ *   eject                   a player takes the card out
+ *   command <hex bytes>     send a command, an ACK is expected
+ *   enquiry [data=<n>]      send an ENQ, a status reply is expected
+ *   poll <max> [data=<n>]   send ENQs until the job is no longer running
+ *   wait <ms>               the host stays quiet for a while
+ **/
+
+typedef enum
+{
+	STEP_INSERT,
+	STEP_EJECT,
+	STEP_COMMAND,
+	STEP_ENQUIRY,
+	STEP_POLL,
+	STEP_WAIT,
+} StepType;
+
+typedef enum
+{
+	AWAIT_NOTHING,
+	AWAIT_ACK,
+	AWAIT_STATUS,
+} Awaiting;
+
+typedef enum
+{
+	ANOMALY_NO_REPLY,
+	ANOMALY_BAD_ACK,
+	ANOMALY_BAD_FRAME,
+	ANOMALY_BAD_CHECKSUM,
+	ANOMALY_WRONG_COMMAND,
+	ANOMALY_WRONG_DATA_LENGTH,
+	ANOMALY_JOB_STUCK,
+	ANOMALY_READER_ERROR,
+	ANOMALY_TYPES,
+} AnomalyType;
+
+static const char *anomalyNames[] = {
+	[ANOMALY_NO_REPLY] = "no reply",
+	[ANOMALY_BAD_ACK] = "bad ack",
+	[ANOMALY_BAD_FRAME] = "malformed reply",
+	[ANOMALY_BAD_CHECKSUM] = "bad reply checksum",
+	[ANOMALY_WRONG_COMMAND] = "wrong last command",
+	[ANOMALY_WRONG_DATA_LENGTH] = "wrong data length",
+	[ANOMALY_JOB_STUCK] = "job never finished",
+	[ANOMALY_READER_ERROR] = "reader error status",
+};
+
+typedef struct
+{
+	StepType type;
+	int line;
+	unsigned char frame[BUFFER_SIZE];
+	int frameLength;
+	unsigned char opcode;
+	unsigned int value;
+	int expectData;
+	char path[256];
+} SimulationStep;
+
+typedef struct
+{
+	unsigned long long transactions;
+	unsigned long long latencyNs;
+	unsigned long long rssBytes;
+} SimulationDecile;
+
+static struct
+{
+	CardReader *reader;
+	SimulationStep *steps;
+	int stepCount;
+	unsigned long long repeat;
+	unsigned long long iteration;
+	unsigned int intervalMs;
+
+	int step;
+	unsigned int polls;
+	Awaiting awaiting;
+	unsigned char reply[BUFFER_SIZE];
+	int replyLength;
+	unsigned char lastOpcode;
+	unsigned long long sentAt;
+	int finished;
+	int stdoutCopy;
+
+	unsigned long long startedAt;
+	unsigned long long startRss;
+	unsigned long long transactions;
+	unsigned long long latencyHistogram[64];
+	unsigned long long latencyMax;
+	SimulationDecile deciles[10];
+	unsigned long long anomalies[ANOMALY_TYPES];
+	char anomalyLog[SIMULATION_ANOMALY_LOG_SIZE][160];
+	int anomalyLogLength;
+} simulation;
+
+static unsigned long long realNs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned long long residentBytes()
+{
+	unsigned long long size = 0, resident = 0;
+	FILE *file = fopen("/proc/self/statm", "r");
+
+	if (!file)
+		return 0;
+
+	if (fscanf(file, "%llu %llu", &size, &resident) != 2)
+		resident = 0;
+
+	fclose(file);
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+static int currentDecile()
+{
+	int decile = simulation.iteration * 10 / simulation.repeat;
+	return decile > 9 ? 9 : decile;
+}
+
+static void anomaly(AnomalyType type)
+{
+	simulation.anomalies[type]++;
+
+	if (simulation.anomalyLogLength == SIMULATION_ANOMALY_LOG_SIZE)
+		return;
+
+	snprintf(simulation.anomalyLog[simulation.anomalyLogLength++], 160,
+			 "iteration %llu, script line %d, virtual %llums: %s",
+			 simulation.iteration, simulation.steps[simulation.step].line, clockNowMs(), anomalyNames[type]);
+}
+
+static int buildFrame(unsigned char *frame, unsigned char *data, int length)
+{
+	int index = 0;
+	unsigned char checksum = length + 2;
+
+	frame[index++] = START_OF_TEXT;
+	frame[index++] = length + 2;
+	for (int i = 0; i < length; i++)
+	{
+		frame[index++] = data[i];
+		checksum ^= data[i];
+	}
+	frame[index++] = END_OF_TEXT;
+	checksum ^= END_OF_TEXT;
+	frame[index++] = checksum;
+
+	return index;
+}
+
+static int parseExpectData(char *argument)
+{
+	if (argument && strncmp(argument, "data=", 5) == 0)
+		return atoi(argument + 5);
+	return -1;
+}
+
+/**
+ * Parses a host script into memory
+ *
+ * @returns 0 on success, -1 on failure
+ **/
+static int parseScript(const char *scriptPath)
+{
+	FILE *file = fopen(scriptPath, "r");
+	if (!file)
+	{
+		printf("Error: Couldn't open simulation script %s\n", scriptPath);
+		return -1;
+	}
+
+	int capacity = 64;
+	simulation.steps = calloc(capacity, sizeof(SimulationStep));
+
+	char line[1024];
+	int lineNumber = 0;
+
+	while (fgets(line, sizeof(line), file))
+	{
+		lineNumber++;
+
+		char *comment = strchr(line, '#');
+		if (comment)
+			*comment = '\0';
+
+		char *keyword = strtok(line, " \t\r\n");
+		if (!keyword)
+			continue;
+
+		if (strcmp(keyword, "repeat") == 0)
+		{
+			char *value = strtok(NULL, " \t\r\n");
+			simulation.repeat = value ? strtoull(value, NULL, 10) : 1;
+			continue;
+		}
+
+		if (strcmp(keyword, "interval") == 0)
+		{
+			char *value = strtok(NULL, " \t\r\n");
+			simulation.intervalMs = value ? atoi(value) : DEFAULT_SIMULATION_INTERVAL_MS;
+			continue;
+		}
+
+		if (simulation.stepCount == capacity)
+		{
+			capacity *= 2;
+			simulation.steps = realloc(simulation.steps, capacity * sizeof(SimulationStep));
+		}
+
+		SimulationStep *step = &simulation.steps[simulation.stepCount];
+		memset(step, 0, sizeof(*step));
+		step->line = lineNumber;
+		step->expectData = -1;
+
+		if (strcmp(keyword, "insert") == 0)
+		{
+			char *path = strtok(NULL, " \t\r\n");
+			if (!path || strlen(path) >= sizeof(step->path))
+				goto error;
+			step->type = STEP_INSERT;
+			strcpy(step->path, path);
+		}
+		else if (strcmp(keyword, "eject") == 0)
+		{
+			step->type = STEP_EJECT;
+		}
+		else if (strcmp(keyword, "wait") == 0)
+		{
+			char *value = strtok(NULL, " \t\r\n");
+			if (!value)
+				goto error;
+			step->type = STEP_WAIT;
+			step->value = atoi(value);
+		}
+		else if (strcmp(keyword, "command") == 0)
+		{
+			unsigned char packet[BUFFER_SIZE];
+			int length = 0;
+			char *byte;
+
+			while ((byte = strtok(NULL, " \t\r\n")) && length < BUFFER_SIZE - 8)
+				packet[length++] = strtol(byte, NULL, 16);
+
+			if (length == 0)
+				goto error;
+
+			step->type = STEP_COMMAND;
+			step->opcode = packet[0];
+			step->frameLength = buildFrame(step->frame, packet, length);
+		}
+		else if (strcmp(keyword, "enquiry") == 0)
+		{
+			step->type = STEP_ENQUIRY;
+			step->frame[0] = ENQUIRY;
+			step->frameLength = 1;
+			step->expectData = parseExpectData(strtok(NULL, " \t\r\n"));
+		}
+		else if (strcmp(keyword, "poll") == 0)
+		{
+			char *value = strtok(NULL, " \t\r\n");
+			if (!value)
+				goto error;
+			step->type = STEP_POLL;
+			step->value = atoi(value);
+			step->frame[0] = ENQUIRY;
+			step->frameLength = 1;
+			step->expectData = parseExpectData(strtok(NULL, " \t\r\n"));
+		}
+		else
+		{
+			goto error;
+		}
+
+		simulation.stepCount++;
+	}
+
+	fclose(file);
+
+	if (simulation.stepCount == 0)
+	{
+		printf("Error: Simulation script %s has no steps\n", scriptPath);
+		return -1;
+	}
+
+	return 0;
+
+error:
+	printf("Error: Simulation script %s line %d is invalid\n", scriptPath, lineNumber);
+	fclose(file);
+	return -1;
+}
+
+/**
+ * Loads the host script and takes the place of the serial port
+ *
+ * Everything the daemon prints is sent to /dev/null while the simulation
+ * runs, the report is printed at the end.
+ *
+ * @param reader The reader the simulated host talks to
+ * @param scriptPath The path of the host script
+ * @returns 0 on success, -1 on failure
+ **/
+int simulationInit(CardReader *reader, const char *scriptPath)
+{
+	memset(&simulation, 0, sizeof(simulation));
+	simulation.reader = reader;
+	simulation.repeat = 1;
+	simulation.intervalMs = DEFAULT_SIMULATION_INTERVAL_MS;
+
+	if (parseScript(scriptPath) < 0)
+		return -1;
+
+	if (simulation.repeat == 0)
+		simulation.repeat = 1;
+
+	printf("Simulating %llu iterations of %d steps from %s\n", simulation.repeat, simulation.stepCount, scriptPath);
+	fflush(stdout);
+
+	simulation.stdoutCopy = dup(STDOUT_FILENO);
+	int devNull = open("/dev/null", O_WRONLY);
+	if (devNull >= 0)
+	{
+		dup2(devNull, STDOUT_FILENO);
+		close(devNull);
+	}
+
+	simulation.startRss = residentBytes();
+	simulation.startedAt = realNs();
+
+	return 0;
+}
+
+int simulationFinished()
+{
+	return simulation.finished;
+}
+
+static void completeTransaction()
+{
+	unsigned long long latency = realNs() - simulation.sentAt;
+	int bucket = 63 - __builtin_clzll(latency | 1);
+
+	simulation.transactions++;
+	simulation.latencyHistogram[bucket]++;
+	if (latency > simulation.latencyMax)
+		simulation.latencyMax = latency;
+
+	SimulationDecile *decile = &simulation.deciles[currentDecile()];
+	decile->transactions++;
+	decile->latencyNs += latency;
+
+	simulation.awaiting = AWAIT_NOTHING;
+	simulation.replyLength = 0;
+}
+
+static void nextStep()
+{
+	simulation.step++;
+	simulation.polls = 0;
+}
+
+/**
+ * Hands the protocol loop the next frame from the host script
+ *
+ * Steps that don't send anything, such as inserting a card or waiting,
+ * are carried out on the way to the next frame.
+ *
+ * @returns The number of bytes in buffer, or -1 when the script is done
+ **/
+int simulationRead(unsigned char *buffer, int amount)
+{
+	if (simulation.finished)
+		return -1;
+
+	// The daemon went back to reading without finishing its reply
+	if (simulation.awaiting != AWAIT_NOTHING)
+	{
+		anomaly(ANOMALY_NO_REPLY);
+		simulation.awaiting = AWAIT_NOTHING;
+		simulation.replyLength = 0;
+		nextStep();
+	}
+
+	while (1)
+	{
+		if (simulation.step == simulation.stepCount)
+		{
+			simulation.step = 0;
+			simulation.iteration++;
+
+			int decile = currentDecile();
+			if (simulation.deciles[decile].rssBytes == 0)
+				simulation.deciles[decile].rssBytes = residentBytes();
+
+			if (simulation.iteration == simulation.repeat)
+			{
+				simulation.deciles[9].rssBytes = residentBytes();
+				simulation.finished = 1;
+				return -1;
+			}
+		}
+
+		SimulationStep *step = &simulation.steps[simulation.step];
+
+		switch (step->type)
+		{
+		case STEP_INSERT:
+			insertCard(simulation.reader, step->path);
+			nextStep();
+			continue;
+
+		case STEP_EJECT:
+			moveCard(simulation.reader, NOT_INSERTED, NOT_INSERTED, 0);
+			nextStep();
+			continue;
+
+		case STEP_WAIT:
+			clockAdvanceNs(step->value * 1000000ULL);
+			nextStep();
+			continue;
+
+		case STEP_COMMAND:
+		case STEP_ENQUIRY:
+		case STEP_POLL:
+			if (step->frameLength > amount)
+			{
+				simulation.finished = 1;
+				return -1;
+			}
+
+			clockAdvanceNs(simulation.intervalMs * 1000000ULL);
+
+			if (step->type == STEP_COMMAND)
+				simulation.lastOpcode = step->opcode;
+
+			memcpy(buffer, step->frame, step->frameLength);
+			simulation.awaiting = step->type == STEP_COMMAND ? AWAIT_ACK : AWAIT_STATUS;
+			simulation.replyLength = 0;
+			simulation.sentAt = realNs();
+			return step->frameLength;
+		}
+	}
+}
+
+/**
+ * Checks a complete status reply against what the host expects
+ **/
+static void checkStatusReply()
+{
+	SimulationStep *step = &simulation.steps[simulation.step];
+	unsigned char *reply = simulation.reply;
+	int length = reply[1];
+
+	if (reply[0] != START_OF_TEXT || length < 6 || reply[length] != END_OF_TEXT)
+	{
+		anomaly(ANOMALY_BAD_FRAME);
+		completeTransaction();
+		nextStep();
+		return;
+	}
+
+	unsigned char checksum = 0;
+	for (int i = 1; i < length + 1; i++)
+		checksum ^= reply[i];
+
+	if (checksum != reply[length + 1])
+		anomaly(ANOMALY_BAD_CHECKSUM);
+
+	if (reply[2] != simulation.lastOpcode)
+		anomaly(ANOMALY_WRONG_COMMAND);
+
+	if (reply[4] != STATUS_NO_ERR)
+		anomaly(ANOMALY_READER_ERROR);
+
+	unsigned char jobStatus = reply[5];
+	int dataLength = length - 6;
+
+	completeTransaction();
+
+	if (step->type == STEP_POLL && jobStatus == STATUS_RUNNING_COMMAND)
+	{
+		if (++simulation.polls < step->value)
+			return;
+		anomaly(ANOMALY_JOB_STUCK);
+	}
+	else if (step->expectData >= 0 && dataLength != step->expectData)
+	{
+		anomaly(ANOMALY_WRONG_DATA_LENGTH);
+	}
+
+	nextStep();
+}
+
+/**
+ * Takes a reply from the protocol loop and checks it once complete
+ *
+ * @returns The number of bytes accepted, which is always all of them
+ **/
+int simulationWrite(unsigned char *buffer, int amount)
+{
+	if (simulation.replyLength + amount > BUFFER_SIZE)
+	{
+		anomaly(ANOMALY_BAD_FRAME);
+		simulation.replyLength = 0;
+		return amount;
+	}
+
+	memcpy(&simulation.reply[simulation.replyLength], buffer, amount);
+	simulation.replyLength += amount;
+
+	switch (simulation.awaiting)
+	{
+	case AWAIT_ACK:
+		if (simulation.reply[0] != ACK)
+			anomaly(ANOMALY_BAD_ACK);
+		completeTransaction();
+		nextStep();
+		break;
+
+	case AWAIT_STATUS:
+		if (simulation.replyLength >= 2 && simulation.replyLength >= simulation.reply[1] + 2)
+			checkStatusReply();
+		break;
+
+	case AWAIT_NOTHING:
+		// A reply nobody asked for, such as a second ACK
+		anomaly(ANOMALY_BAD_FRAME);
+		simulation.replyLength = 0;
+		break;
+	}
+
+	return amount;
+}
+
+/**
+ * Prints the soak test report
+ *
+ * @returns EXIT_SUCCESS if the script ran to the end without anomalies
+ **/
+int simulationReport()
+{
+	unsigned long long elapsed = realNs() - simulation.startedAt;
+
+	fflush(stdout);
+	if (simulation.stdoutCopy >= 0)
+	{
+		dup2(simulation.stdoutCopy, STDOUT_FILENO);
+		close(simulation.stdoutCopy);
+	}
+
+	double seconds = elapsed / 1e9;
+	unsigned long long anomalies = 0;
+	for (int i = 0; i < ANOMALY_TYPES; i++)
+		anomalies += simulation.anomalies[i];
+
+	printf("\nSimulation report\n\n");
+	printf("       Iterations: %llu\n", simulation.iteration);
+	printf("     Transactions: %llu\n", simulation.transactions);
+	printf("     Virtual time: %.1fs\n", clockNowMs() / 1000.0);
+	printf("        Real time: %.3fs (%.0f transactions/s, %.0fx real time)\n",
+		   seconds, simulation.transactions / seconds, clockNowNs() / (double)elapsed);
+	printf("      Max latency: %lluns\n", simulation.latencyMax);
+
+	unsigned long long cumulative = 0;
+	for (int bucket = 0; bucket < 64; bucket++)
+	{
+		cumulative += simulation.latencyHistogram[bucket];
+		if (cumulative * 100 >= simulation.transactions * 99)
+		{
+			printf("      p99 latency: <%lluns\n", 2ULL << bucket);
+			break;
+		}
+	}
+
+	printf("\n  Decile  Transactions   Mean latency   Resident memory\n");
+	double firstMean = 0, lastMean = 0;
+	for (int i = 0; i < 10; i++)
+	{
+		SimulationDecile *decile = &simulation.deciles[i];
+		double mean = decile->transactions ? (double)decile->latencyNs / decile->transactions : 0;
+		if (decile->transactions && firstMean == 0)
+			firstMean = mean;
+		if (decile->transactions)
+			lastMean = mean;
+		printf("  %6d  %12llu  %11.0fns  %13llukB\n", i + 1, decile->transactions, mean, decile->rssBytes / 1024);
+	}
+
+	unsigned long long endRss = residentBytes();
+	printf("\n   Latency drift: %+.1f%% (last decile against first)\n", firstMean ? (lastMean - firstMean) / firstMean * 100.0 : 0.0);
+	printf("   Memory growth: %+lldkB (%llukB to %llukB)\n",
+		   ((long long)endRss - (long long)simulation.startRss) / 1024, simulation.startRss / 1024, endRss / 1024);
+
+	printf("\n       Anomalies: %llu\n", anomalies);
+	for (int i = 0; i < ANOMALY_TYPES; i++)
+	{
+		if (simulation.anomalies[i])
+			printf("  %18s: %llu\n", anomalyNames[i], simulation.anomalies[i]);
+	}
+	for (int i = 0; i < simulation.anomalyLogLength; i++)
+		printf("  %s\n", simulation.anomalyLog[i]);
+
+	if (!simulation.finished)
+		printf("\n  The daemon stopped before the script finished\n");
+
+	free(simulation.steps);
+
+	return anomalies || !simulation.finished ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,18 @@
+#ifndef SIMULATION_H
+#define SIMULATION_H
+
+#include "cardd.h"
+
+/* How often the simulated host sends a frame unless the script says otherwise */
+#define DEFAULT_SIMULATION_INTERVAL_MS 16
+
+/* How many anomalies are described individually in the report */
+#define SIMULATION_ANOMALY_LOG_SIZE 16
+
+int simulationInit(CardReader *reader, const char *scriptPath);
+int simulationRead(unsigned char *buffer, int amount);
+int simulationWrite(unsigned char *buffer, int amount);
+int simulationFinished();
+int simulationReport();
+
+#endif
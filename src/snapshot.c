@@ -0,0 +1,147 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "probes.h"
+#include "snapshot.h"
+
+static pthread_mutex_t snapshotMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Opens and maps the snapshot file of a reader
+ *
+ * Each reader gets its own small file named after its id in the state
+ * directory. The file is mapped shared so every update lands in the page
+ * cache straight away and survives the daemon crashing or restarting.
+ *
+ * @param reader The reader to open the snapshot for
+ * @param directory The directory the snapshot files are kept in
+ * @returns 0 on success, -1 on failure
+ **/
+int snapshotOpen(CardReader *reader, const char *directory)
+{
+	if (mkdir(directory, 0755) < 0 && errno != EEXIST)
+	{
+		printf("Error: Couldn't create state directory %s\n", directory);
+		return -1;
+	}
+
+	char path[512];
+	snprintf(path, sizeof(path), "%s/reader%d.state", directory, reader->id);
+
+	int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0)
+	{
+		printf("Error: Couldn't open state snapshot %s\n", path);
+		return -1;
+	}
+
+	if (ftruncate(fd, sizeof(ReaderSnapshot)) < 0)
+	{
+		printf("Error: Couldn't size state snapshot %s\n", path);
+		close(fd);
+		return -1;
+	}
+
+	ReaderSnapshot *snapshot = mmap(NULL, sizeof(ReaderSnapshot), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (snapshot == MAP_FAILED)
+	{
+		printf("Error: Couldn't map state snapshot %s\n", path);
+		return -1;
+	}
+
+	reader->snapshot = snapshot;
+	return 0;
+}
+
+/**
+ * Restores the reader from its snapshot
+ *
+ * A card that was moving when the snapshot was taken is restored at the
+ * end of its movement, so the host sees it exactly where it expects it.
+ *
+ * @param reader The reader to restore into
+ * @returns 1 if the reader was restored, 0 if there was no valid snapshot
+ **/
+int snapshotRestore(CardReader *reader)
+{
+	ReaderSnapshot *snapshot = reader->snapshot;
+
+	if (!snapshot)
+		return 0;
+
+	if (snapshot->magic != SNAPSHOT_MAGIC || snapshot->version != SNAPSHOT_VERSION)
+		return 0;
+
+	if (snapshot->sequence & 1)
+	{
+		printf("Warning: Reader %d state snapshot was torn, ignoring it\n", reader->id);
+		return 0;
+	}
+
+	reader->cardPosition = snapshot->cardPosition;
+	reader->coverClosed = snapshot->coverClosed;
+	reader->dispenserFull = snapshot->dispenserFull;
+	reader->lastCommand = snapshot->lastCommand;
+	reader->readerStatus = snapshot->readerStatus;
+	memcpy(reader->cardPath, snapshot->cardPath, sizeof(reader->cardPath));
+	reader->cardPath[sizeof(reader->cardPath) - 1] = '\0';
+	memcpy(reader->tracks, snapshot->tracks, sizeof(reader->tracks));
+
+	return 1;
+}
+
+/**
+ * Writes the current state of the reader into its snapshot
+ *
+ * This is cheap enough to call on every state change, it is a couple of
+ * hundred bytes copied into an already mapped page. Called with
+ * reader->lock held, which every change to reader->tracks also takes.
+ **/
+void snapshotSave(CardReader *reader)
+{
+	ReaderSnapshot *snapshot = reader->snapshot;
+
+	if (!snapshot)
+		return;
+
+	pthread_mutex_lock(&snapshotMutex);
+
+	snapshot->sequence++;
+	__sync_synchronize();
+
+	snapshot->magic = SNAPSHOT_MAGIC;
+	snapshot->version = SNAPSHOT_VERSION;
+	snapshot->cardPosition = reader->moving ? reader->motionTarget : reader->cardPosition;
+	snapshot->coverClosed = reader->coverClosed;
+	snapshot->dispenserFull = reader->dispenserFull;
+	snapshot->lastCommand = reader->lastCommand;
+	snapshot->readerStatus = reader->readerStatus;
+	memcpy(snapshot->cardPath, reader->cardPath, sizeof(snapshot->cardPath));
+	memcpy(snapshot->tracks, reader->tracks, sizeof(snapshot->tracks));
+
+	__sync_synchronize();
+	snapshot->sequence++;
+
+	pthread_mutex_unlock(&snapshotMutex);
+
+	PROBE3(snapshot__save, reader->id, snapshot->cardPosition, snapshot->sequence);
+}
+
+/**
+ * Unmaps the snapshot of a reader, the file is kept for the next start
+ **/
+void snapshotClose(CardReader *reader)
+{
+	if (!reader->snapshot)
+		return;
+
+	munmap(reader->snapshot, sizeof(ReaderSnapshot));
+	reader->snapshot = NULL;
+}
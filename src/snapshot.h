@@ -0,0 +1,39 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <pthread.h>
+
+#include "cardd.h"
+
+#define SNAPSHOT_MAGIC 0x43415244 // CARD
+#define SNAPSHOT_VERSION 1
+
+/* Default directory for the reader state snapshots */
+#define DEFAULT_STATE_PATH "/var/tmp/cardd"
+
+/**
+ * The state of a reader as kept in its memory mapped snapshot file
+ *
+ * The sequence number is odd while an update is in progress, so a snapshot
+ * torn by a power cut mid update is detected and ignored on restore.
+ **/
+typedef struct ReaderSnapshot
+{
+	unsigned int magic;
+	unsigned int version;
+	volatile unsigned int sequence;
+	int cardPosition;
+	int coverClosed;
+	int dispenserFull;
+	unsigned char lastCommand;
+	unsigned char readerStatus;
+	char cardPath[256];
+	unsigned char tracks[3][TRACK_SIZE];
+} ReaderSnapshot;
+
+int snapshotOpen(CardReader *reader, const char *directory);
+int snapshotRestore(CardReader *reader);
+void snapshotSave(CardReader *reader);
+void snapshotClose(CardReader *reader);
+
+#endif
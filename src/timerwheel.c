@@ -0,0 +1,326 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "clock.h"
+#include "timerwheel.h"
+
+static void listInit(Timer *head)
+{
+	head->next = head->prev = head;
+}
+
+static void listAppend(Timer *head, Timer *timer)
+{
+	timer->prev = head->prev;
+	timer->next = head;
+	head->prev->next = timer;
+	head->prev = timer;
+}
+
+static void listRemove(Timer *timer)
+{
+	timer->prev->next = timer->next;
+	timer->next->prev = timer->prev;
+	timer->next = timer->prev = timer;
+}
+
+/**
+ * Places a timer into the slot matching its expiry
+ *
+ * Timers due within the next 64 ticks go into level 0, otherwise into the
+ * lowest level whose range covers them, from where they are cascaded down
+ * as the wheel turns. Anything beyond the range of the wheel is clamped.
+ **/
+static void placeTimer(TimerWheel *wheel, Timer *timer)
+{
+	unsigned long long expires = timer->expires;
+
+	if (expires < wheel->current)
+		expires = wheel->current;
+
+	unsigned long long delta = expires - wheel->current;
+
+	for (int level = 0; level < TIMER_WHEEL_LEVELS; level++)
+	{
+		int shift = level * TIMER_WHEEL_BITS;
+		if (delta < (1ULL << (shift + TIMER_WHEEL_BITS)) || level == TIMER_WHEEL_LEVELS - 1)
+		{
+			if (level == TIMER_WHEEL_LEVELS - 1 && delta >= (1ULL << (shift + TIMER_WHEEL_BITS)))
+				expires = wheel->current + (1ULL << (shift + TIMER_WHEEL_BITS)) - 1;
+			listAppend(&wheel->slots[level][(expires >> shift) & TIMER_WHEEL_MASK], timer);
+			return;
+		}
+	}
+}
+
+/**
+ * Re-places every timer in a slot of a higher level
+ *
+ * @returns The index of the slot that was cascaded
+ **/
+static int cascade(TimerWheel *wheel, int level)
+{
+	int index = (wheel->current >> (level * TIMER_WHEEL_BITS)) & TIMER_WHEEL_MASK;
+	Timer *head = &wheel->slots[level][index];
+
+	Timer list;
+	listInit(&list);
+	while (head->next != head)
+	{
+		Timer *timer = head->next;
+		listRemove(timer);
+		listAppend(&list, timer);
+	}
+
+	while (list.next != &list)
+	{
+		Timer *timer = list.next;
+		listRemove(timer);
+		placeTimer(wheel, timer);
+	}
+
+	return index;
+}
+
+/**
+ * Arms the timerfd for the next tick that could have work on it
+ *
+ * Level 0 is scanned for the next occupied slot, and if it is empty the
+ * wheel sleeps until the next cascade boundary. The timerfd is disarmed
+ * completely when there are no timers so an idle daemon never wakes.
+ **/
+static void rearm(TimerWheel *wheel)
+{
+	if (wheel->fd < 0 || clockIsVirtual())
+		return;
+
+	struct itimerspec spec;
+	memset(&spec, 0, sizeof(spec));
+
+	if (wheel->count == 0 && wheel->running)
+	{
+		wheel->armed = 0;
+		timerfd_settime(wheel->fd, TFD_TIMER_ABSTIME, &spec, NULL);
+		return;
+	}
+
+	// Wake no later than the next cascade boundary, which may be the current tick
+	unsigned long long next = (wheel->current + TIMER_WHEEL_MASK) & ~(unsigned long long)TIMER_WHEEL_MASK;
+	for (unsigned long long tick = wheel->current; tick < next; tick++)
+	{
+		Timer *head = &wheel->slots[0][tick & TIMER_WHEEL_MASK];
+		if (head->next != head)
+		{
+			next = tick;
+			break;
+		}
+	}
+
+	if (!wheel->running)
+		next = 0;
+
+	unsigned long long ms = next * TIMER_WHEEL_TICK_MS;
+	spec.it_value.tv_sec = ms / 1000;
+	spec.it_value.tv_nsec = (ms % 1000) * 1000000 + 1;
+	wheel->armed = 1;
+	timerfd_settime(wheel->fd, TFD_TIMER_ABSTIME, &spec, NULL);
+}
+
+/**
+ * Initialises an empty timer wheel and its timerfd
+ *
+ * @returns 0 on success, -1 if the timerfd could not be created
+ **/
+int timerWheelInit(TimerWheel *wheel)
+{
+	memset(wheel, 0, sizeof(*wheel));
+
+	for (int level = 0; level < TIMER_WHEEL_LEVELS; level++)
+		for (int slot = 0; slot < TIMER_WHEEL_SLOTS; slot++)
+			listInit(&wheel->slots[level][slot]);
+	listInit(&wheel->expired);
+
+	pthread_mutex_init(&wheel->mutex, NULL);
+	wheel->current = clockNowMs() / TIMER_WHEEL_TICK_MS;
+
+	wheel->fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (wheel->fd < 0)
+	{
+		printf("Error: Failed to create timerfd\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Schedules a timer, replacing any previous schedule of the same timer
+ *
+ * @param wheel The wheel to schedule on
+ * @param timer The timer to schedule
+ * @param delayMs How long from now the timer should fire
+ * @param callback The function to call when the timer fires
+ * @param data The argument passed to the callback
+ **/
+void timerWheelSchedule(TimerWheel *wheel, Timer *timer, unsigned int delayMs, TimerCallback callback, void *data)
+{
+	pthread_mutex_lock(&wheel->mutex);
+
+	if (timer->pending)
+	{
+		listRemove(timer);
+		wheel->count--;
+	}
+
+	timer->callback = callback;
+	timer->data = data;
+	timer->expires = (clockNowMs() + delayMs) / TIMER_WHEEL_TICK_MS;
+	timer->pending = 1;
+	placeTimer(wheel, timer);
+	wheel->count++;
+
+	rearm(wheel);
+
+	pthread_mutex_unlock(&wheel->mutex);
+}
+
+/**
+ * Cancels a timer if it has not fired yet
+ **/
+void timerWheelCancel(TimerWheel *wheel, Timer *timer)
+{
+	pthread_mutex_lock(&wheel->mutex);
+
+	if (timer->pending)
+	{
+		listRemove(timer);
+		timer->pending = 0;
+		wheel->count--;
+		rearm(wheel);
+	}
+
+	pthread_mutex_unlock(&wheel->mutex);
+}
+
+/**
+ * Turns the wheel up to the given time and fires every timer that is due
+ *
+ * Callbacks are run one at a time with the wheel unlocked, so they are
+ * free to schedule or cancel timers themselves.
+ *
+ * @param wheel The wheel to turn
+ * @param nowMs The current time in milliseconds
+ **/
+void timerWheelAdvanceTo(TimerWheel *wheel, unsigned long long nowMs)
+{
+	unsigned long long now = nowMs / TIMER_WHEEL_TICK_MS;
+
+	pthread_mutex_lock(&wheel->mutex);
+
+	while (wheel->current <= now)
+	{
+		if (wheel->count == 0)
+		{
+			wheel->current = now + 1;
+			break;
+		}
+
+		int index = wheel->current & TIMER_WHEEL_MASK;
+		for (int level = 1; index == 0 && level < TIMER_WHEEL_LEVELS; level++)
+			index = cascade(wheel, level);
+
+		Timer *head = &wheel->slots[0][wheel->current & TIMER_WHEEL_MASK];
+		while (head->next != head)
+		{
+			Timer *timer = head->next;
+			listRemove(timer);
+			listAppend(&wheel->expired, timer);
+		}
+
+		wheel->current++;
+	}
+
+	while (wheel->expired.next != &wheel->expired)
+	{
+		Timer *timer = wheel->expired.next;
+		listRemove(timer);
+		timer->pending = 0;
+		wheel->count--;
+
+		TimerCallback callback = timer->callback;
+		void *data = timer->data;
+
+		pthread_mutex_unlock(&wheel->mutex);
+		callback(data);
+		pthread_mutex_lock(&wheel->mutex);
+	}
+
+	rearm(wheel);
+
+	pthread_mutex_unlock(&wheel->mutex);
+}
+
+/**
+ * Waits on the timerfd and turns the wheel whenever it fires
+ *
+ * A single one of these threads serves every reader in the daemon.
+ **/
+static void *timerWheelThread(void *vargp)
+{
+	TimerWheel *wheel = (TimerWheel *)vargp;
+
+	while (wheel->running)
+	{
+		unsigned long long expirations;
+		if (read(wheel->fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+			continue;
+
+		timerWheelAdvanceTo(wheel, clockNowMs());
+	}
+
+	return 0;
+}
+
+/**
+ * Starts the thread that drives the wheel from its timerfd
+ *
+ * On virtual time there is no thread, whoever advances the clock is
+ * expected to turn the wheel with timerWheelAdvanceTo.
+ *
+ * @returns 0 on success, -1 on failure
+ **/
+int timerWheelStart(TimerWheel *wheel)
+{
+	if (clockIsVirtual())
+		return 0;
+
+	wheel->running = 1;
+
+	if (pthread_create(&wheel->thread, NULL, timerWheelThread, wheel) != 0)
+	{
+		printf("Error: Failed to start the timer thread\n");
+		wheel->running = 0;
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Stops the timer thread, pending timers are left unfired
+ **/
+void timerWheelStop(TimerWheel *wheel)
+{
+	if (!wheel->running)
+		return;
+
+	pthread_mutex_lock(&wheel->mutex);
+	wheel->running = 0;
+	rearm(wheel);
+	pthread_mutex_unlock(&wheel->mutex);
+
+	pthread_join(wheel->thread, NULL);
+}
@@ -0,0 +1,51 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <pthread.h>
+
+/* Wheel geometry, 4 levels of 64 slots at 1ms per tick covers ~4.6 hours */
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_TICK_MS 1
+
+typedef void (*TimerCallback)(void *data);
+
+/**
+ * A single timer, embedded in whatever struct owns it
+ *
+ * Timers are intrusive so that scheduling never allocates, which keeps
+ * thousands of outstanding timers across many readers cheap.
+ **/
+typedef struct Timer
+{
+	struct Timer *next;
+	struct Timer *prev;
+	unsigned long long expires;
+	TimerCallback callback;
+	void *data;
+	int pending;
+} Timer;
+
+typedef struct
+{
+	Timer slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+	Timer expired;
+	unsigned long long current;
+	int count;
+	int armed;
+	int fd;
+	int running;
+	pthread_t thread;
+	pthread_mutex_t mutex;
+} TimerWheel;
+
+int timerWheelInit(TimerWheel *wheel);
+int timerWheelStart(TimerWheel *wheel);
+void timerWheelStop(TimerWheel *wheel);
+void timerWheelSchedule(TimerWheel *wheel, Timer *timer, unsigned int delayMs, TimerCallback callback, void *data);
+void timerWheelCancel(TimerWheel *wheel, Timer *timer);
+void timerWheelAdvanceTo(TimerWheel *wheel, unsigned long long nowMs);
+
+#endif
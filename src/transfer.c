@@ -0,0 +1,270 @@
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "transfer.h"
+
+static unsigned int checksumTable[256];
+static pthread_once_t checksumTableOnce = PTHREAD_ONCE_INIT;
+
+static void buildChecksumTable()
+{
+	for (unsigned int i = 0; i < 256; i++)
+	{
+		unsigned int crc = i;
+		for (int bit = 0; bit < 8; bit++)
+			crc = crc & 1 ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+		checksumTable[i] = crc;
+	}
+}
+
+/**
+ * Updates a CRC32, start with a crc of 0
+ **/
+unsigned int transferChecksum(unsigned int crc, const unsigned char *data, int length)
+{
+	pthread_once(&checksumTableOnce, buildChecksumTable);
+
+	crc = ~crc;
+	for (int i = 0; i < length; i++)
+		crc = checksumTable[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+	return ~crc;
+}
+
+static void putNumber(unsigned char *bytes, unsigned int number)
+{
+	bytes[0] = number >> 24;
+	bytes[1] = number >> 16;
+	bytes[2] = number >> 8;
+	bytes[3] = number;
+}
+
+static unsigned int getNumber(const unsigned char *bytes)
+{
+	return (bytes[0] << 24) | (bytes[1] << 16) | (bytes[2] << 8) | bytes[3];
+}
+
+/**
+ * Writes the whole buffer, carrying on after short writes
+ *
+ * @returns 0 on success, -1 on failure
+ **/
+int transferWriteAll(int fd, const void *buffer, int length)
+{
+	int written = 0;
+	while (written < length)
+	{
+		int bytesWritten = write(fd, (const unsigned char *)buffer + written, length - written);
+		if (bytesWritten < 0 && errno == EINTR)
+			continue;
+		if (bytesWritten < 1)
+			return -1;
+		written += bytesWritten;
+	}
+	return 0;
+}
+
+/**
+ * Reads exactly the given number of bytes
+ *
+ * @returns 0 on success, -1 on failure or if the stream ended early
+ **/
+int transferReadAll(int fd, void *buffer, int length)
+{
+	int received = 0;
+	while (received < length)
+	{
+		int bytesRead = read(fd, (unsigned char *)buffer + received, length - received);
+		if (bytesRead < 0 && errno == EINTR)
+			continue;
+		if (bytesRead < 1)
+			return -1;
+		received += bytesRead;
+	}
+	return 0;
+}
+
+int transferWriteNumber(int fd, unsigned int number)
+{
+	unsigned char bytes[4];
+	putNumber(bytes, number);
+	return transferWriteAll(fd, bytes, 4);
+}
+
+int transferReadNumber(int fd, unsigned int *number)
+{
+	unsigned char bytes[4];
+	if (transferReadAll(fd, bytes, 4) < 0)
+		return -1;
+	*number = getNumber(bytes);
+	return 0;
+}
+
+/**
+ * Writes the start of a stream
+ *
+ * @param count The number of cards in the stream, used for progress only
+ **/
+int transferWriteHeader(int fd, unsigned int count)
+{
+	unsigned char header[TRANSFER_MAGIC_SIZE + 4];
+	memcpy(header, TRANSFER_MAGIC, TRANSFER_MAGIC_SIZE);
+	putNumber(&header[TRANSFER_MAGIC_SIZE], count);
+	return transferWriteAll(fd, header, sizeof(header));
+}
+
+/**
+ * Reads and checks the start of a stream
+ *
+ * @returns 0 on success, -1 if this isn't a card stream
+ **/
+int transferReadHeader(int fd, unsigned int *count)
+{
+	unsigned char header[TRANSFER_MAGIC_SIZE + 4];
+	if (transferReadAll(fd, header, sizeof(header)) < 0)
+		return -1;
+	if (memcmp(header, TRANSFER_MAGIC, TRANSFER_MAGIC_SIZE) != 0)
+		return -1;
+	*count = getNumber(&header[TRANSFER_MAGIC_SIZE]);
+	return 0;
+}
+
+void transferChunkReset(TransferChunk *chunk)
+{
+	chunk->count = 0;
+	chunk->length = 0;
+	chunk->offset = 0;
+}
+
+/**
+ * Appends a card to a chunk
+ *
+ * @returns 0 on success, -1 if the chunk is full or the name too long
+ **/
+int transferChunkAdd(TransferChunk *chunk, const char *name, const unsigned char *tracks)
+{
+	int nameLength = strlen(name);
+
+	if (nameLength == 0 || nameLength >= TRANSFER_NAME_SIZE)
+		return -1;
+
+	if (chunk->length + 1 + nameLength + TRANSFER_TRACKS_SIZE + 4 > TRANSFER_CHUNK_SIZE)
+		return -1;
+
+	unsigned char *record = &chunk->payload[chunk->length];
+	record[0] = nameLength;
+	memcpy(&record[1], name, nameLength);
+	memcpy(&record[1 + nameLength], tracks, TRANSFER_TRACKS_SIZE);
+	putNumber(&record[1 + nameLength + TRANSFER_TRACKS_SIZE], transferChecksum(0, record, 1 + nameLength + TRANSFER_TRACKS_SIZE));
+
+	chunk->length += 1 + nameLength + TRANSFER_TRACKS_SIZE + 4;
+	chunk->count++;
+
+	return 0;
+}
+
+/**
+ * Takes the next card out of a chunk
+ *
+ * @param name A buffer of TRANSFER_NAME_SIZE bytes for the card name
+ * @param tracks A buffer of TRANSFER_TRACKS_SIZE bytes for the card image
+ * @returns 1 if a card was read, 0 at the end of the chunk, -1 if the card
+ *          failed its checksum and was skipped, -2 if the chunk is corrupt
+ **/
+int transferChunkNext(TransferChunk *chunk, char *name, unsigned char *tracks)
+{
+	if (chunk->offset == chunk->length)
+		return 0;
+
+	unsigned char *record = &chunk->payload[chunk->offset];
+	int nameLength = record[0];
+	int recordLength = 1 + nameLength + TRANSFER_TRACKS_SIZE + 4;
+
+	if (nameLength == 0 || chunk->offset + recordLength > chunk->length)
+		return -2;
+
+	chunk->offset += recordLength;
+
+	unsigned int expected = getNumber(&record[1 + nameLength + TRANSFER_TRACKS_SIZE]);
+	if (transferChecksum(0, record, 1 + nameLength + TRANSFER_TRACKS_SIZE) != expected)
+		return -1;
+
+	memcpy(name, &record[1], nameLength);
+	name[nameLength] = '\0';
+	memcpy(tracks, &record[1 + nameLength], TRANSFER_TRACKS_SIZE);
+
+	return 1;
+}
+
+/**
+ * Writes a chunk in a single call and empties it
+ *
+ * An empty chunk marks the end of the stream.
+ *
+ * @returns 0 on success, -1 on failure
+ **/
+int transferChunkWrite(int fd, TransferChunk *chunk)
+{
+	unsigned char header[8];
+	putNumber(&header[0], chunk->count);
+	putNumber(&header[4], chunk->length);
+
+	struct iovec parts[2] = {
+		{.iov_base = header, .iov_len = sizeof(header)},
+		{.iov_base = chunk->payload, .iov_len = chunk->length},
+	};
+
+	int total = sizeof(header) + chunk->length;
+	int written = writev(fd, parts, 2);
+
+	// Fall back to plain writes for whatever a short writev left over
+	if (written < 0 && errno != EINTR)
+		return -1;
+	if (written < 0)
+		written = 0;
+
+	if (written < (int)sizeof(header))
+	{
+		if (transferWriteAll(fd, &header[written], sizeof(header) - written) < 0)
+			return -1;
+		written = sizeof(header);
+	}
+
+	if (written < total && transferWriteAll(fd, &chunk->payload[written - sizeof(header)], total - written) < 0)
+		return -1;
+
+	transferChunkReset(chunk);
+	return 0;
+}
+
+/**
+ * Reads the next chunk of a stream
+ *
+ * @returns The number of cards in the chunk, 0 at the end of the stream or
+ *          -1 if the stream is broken
+ **/
+int transferChunkRead(int fd, TransferChunk *chunk)
+{
+	unsigned char header[8];
+
+	transferChunkReset(chunk);
+
+	if (transferReadAll(fd, header, sizeof(header)) < 0)
+		return -1;
+
+	unsigned int count = getNumber(&header[0]);
+	unsigned int length = getNumber(&header[4]);
+
+	if (length > TRANSFER_CHUNK_SIZE || (count == 0) != (length == 0))
+		return -1;
+
+	if (transferReadAll(fd, chunk->payload, length) < 0)
+		return -1;
+
+	chunk->count = count;
+	chunk->length = length;
+
+	return count;
+}
@@ -0,0 +1,49 @@
+#ifndef TRANSFER_H
+#define TRANSFER_H
+
+/**
+ * The bulk transfer format shared by cardd and cardctl
+ *
+ * A stream is an 8 byte magic and the number of cards that follow, then
+ * chunks of up to TRANSFER_CHUNK_SIZE bytes of cards, then an empty chunk
+ * marking the end. Every chunk starts with its card count and payload
+ * length, and every card in it is its name, its tracks and a CRC32 of
+ * both. All numbers are 32 bit big endian.
+ *
+ * The same stream is written to disk by `cardctl export` and sent back by
+ * `cardctl import`, so an export file can be checked without the daemon.
+ **/
+
+#define TRANSFER_MAGIC "CARDXFR1"
+#define TRANSFER_MAGIC_SIZE 8
+#define TRANSFER_CHUNK_SIZE (256 * 1024)
+#define TRANSFER_NAME_SIZE 256
+
+/* Three tracks of TRACK_SIZE bytes, the size of a card image on disk */
+#define TRANSFER_TRACKS_SIZE (3 * 69)
+
+/* The largest a single card can be in a chunk */
+#define TRANSFER_RECORD_MAX (1 + TRANSFER_NAME_SIZE + TRANSFER_TRACKS_SIZE + 4)
+
+typedef struct
+{
+	unsigned int count;
+	unsigned int length;
+	unsigned int offset;
+	unsigned char payload[TRANSFER_CHUNK_SIZE];
+} TransferChunk;
+
+unsigned int transferChecksum(unsigned int crc, const unsigned char *data, int length);
+int transferWriteAll(int fd, const void *buffer, int length);
+int transferReadAll(int fd, void *buffer, int length);
+int transferWriteHeader(int fd, unsigned int count);
+int transferReadHeader(int fd, unsigned int *count);
+void transferChunkReset(TransferChunk *chunk);
+int transferChunkAdd(TransferChunk *chunk, const char *name, const unsigned char *tracks);
+int transferChunkNext(TransferChunk *chunk, char *name, unsigned char *tracks);
+int transferChunkWrite(int fd, TransferChunk *chunk);
+int transferChunkRead(int fd, TransferChunk *chunk);
+int transferWriteNumber(int fd, unsigned int number);
+int transferReadNumber(int fd, unsigned int *number);
+
+#endif
@@ -0,0 +1,751 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "clock.h"
+#include "uring.h"
+
+/**
+ * io_uring backend for the serial port and the card files
+ *
+ * The serial port gets a ring of its own, owned by whichever thread reads
+ * the port. A multishot read is kept outstanding on it so bytes are
+ * already in the completion queue by the time the protocol loop asks for
+ * them, and waiting for them is a single io_uring_enter rather than a
+ * select and a read.
+ *
+ * Card files go through a second ring shared under a lock. A save is
+ * submitted as one linked chain of open, write, fsync and close, and a
+ * load as open, read and close, so each costs one system call however
+ * many steps it has. Both rings use registered files and the file ring a
+ * registered buffer, so the kernel doesn't look them up on every request.
+ *
+ * Anything that fails to set up, or later fails in a way that suggests the
+ * kernel can't do it, leaves cardd on its plain read and write path.
+ **/
+
+/* Linux 6.7, newer than the kernel headers on some build hosts */
+#define URING_OP_READ_MULTISHOT 49
+
+#define URING_TAG_READ 1
+#define URING_TAG_WRITABLE 2
+
+#define URING_CARD_SIZE 4096
+
+typedef struct
+{
+	int fd;
+	unsigned int entries;
+	unsigned int *sqHead;
+	unsigned int *sqTail;
+	unsigned int *sqMask;
+	unsigned int *sqArray;
+	unsigned int *cqHead;
+	unsigned int *cqTail;
+	unsigned int *cqMask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *rings;
+	size_t ringsSize;
+	size_t sqesSize;
+	unsigned int localTail;
+	unsigned int toSubmit;
+} Ring;
+
+/* A read completion that hasn't been handed to the caller yet */
+typedef struct
+{
+	unsigned short bufferId;
+	int offset;
+	int length;
+} ReadChunk;
+
+static Ring serialRing = {.fd = -1};
+static int serialEnabled = 0;
+static int readArmed = 0;
+static int writableArmed = 0;
+
+static struct io_uring_buf_ring *bufferRing;
+static unsigned short bufferRingTail;
+static unsigned char readBuffers[URING_READ_BUFFERS][URING_READ_BUFFER_SIZE];
+
+static ReadChunk chunks[URING_READ_BUFFERS];
+static int chunkHead = 0;
+static int chunkCount = 0;
+
+static Ring fileRing = {.fd = -1};
+static int filesEnabled = 0;
+static pthread_mutex_t fileLock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned char cardBuffer[URING_CARD_SIZE] __attribute__((aligned(4096)));
+
+static int ringOpen(Ring *ring, unsigned int entries)
+{
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+
+	ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+	if (ring->fd < 0)
+		return -1;
+
+	// Waiting with a timeout needs the extended arguments of Linux 5.11
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG))
+	{
+		close(ring->fd);
+		ring->fd = -1;
+		errno = ENOSYS;
+		return -1;
+	}
+
+	size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->ringsSize = sqSize > cqSize ? sqSize : cqSize;
+	ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	ring->rings = mmap(NULL, ring->ringsSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+
+	if (ring->rings == MAP_FAILED || ring->sqes == MAP_FAILED)
+	{
+		if (ring->rings != MAP_FAILED)
+			munmap(ring->rings, ring->ringsSize);
+		if (ring->sqes != MAP_FAILED)
+			munmap(ring->sqes, ring->sqesSize);
+		close(ring->fd);
+		ring->fd = -1;
+		return -1;
+	}
+
+	unsigned char *base = ring->rings;
+	ring->entries = params.sq_entries;
+	ring->sqHead = (unsigned int *)(base + params.sq_off.head);
+	ring->sqTail = (unsigned int *)(base + params.sq_off.tail);
+	ring->sqMask = (unsigned int *)(base + params.sq_off.ring_mask);
+	ring->sqArray = (unsigned int *)(base + params.sq_off.array);
+	ring->cqHead = (unsigned int *)(base + params.cq_off.head);
+	ring->cqTail = (unsigned int *)(base + params.cq_off.tail);
+	ring->cqMask = (unsigned int *)(base + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(base + params.cq_off.cqes);
+	ring->localTail = *ring->sqTail;
+	ring->toSubmit = 0;
+
+	return 0;
+}
+
+static void ringClose(Ring *ring)
+{
+	if (ring->fd < 0)
+		return;
+
+	munmap(ring->sqes, ring->sqesSize);
+	munmap(ring->rings, ring->ringsSize);
+	close(ring->fd);
+	ring->fd = -1;
+}
+
+static int ringRegister(Ring *ring, unsigned int opcode, void *argument, unsigned int count)
+{
+	return syscall(__NR_io_uring_register, ring->fd, opcode, argument, count);
+}
+
+/**
+ * Takes the next free submission entry, cleared
+ *
+ * @returns The entry, or NULL if the submission queue is full
+ **/
+static struct io_uring_sqe *ringEntry(Ring *ring)
+{
+	unsigned int head = __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+	if (ring->localTail - head >= ring->entries)
+		return NULL;
+
+	unsigned int index = ring->localTail & *ring->sqMask;
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sqArray[index] = index;
+	ring->localTail++;
+	ring->toSubmit++;
+
+	return sqe;
+}
+
+/**
+ * Submits any new entries and waits for completions
+ *
+ * @param wait The number of completions to wait for
+ * @param timeoutNs How long to wait, or 0 to wait as long as it takes
+ * @returns 0 on success, or a negative errno, -ETIME if the time ran out
+ **/
+static int ringEnter(Ring *ring, unsigned int wait, unsigned long long timeoutNs)
+{
+	__atomic_store_n(ring->sqTail, ring->localTail, __ATOMIC_RELEASE);
+
+	unsigned int flags = wait ? IORING_ENTER_GETEVENTS : 0;
+	struct __kernel_timespec timeout = {
+		.tv_sec = timeoutNs / 1000000000ULL,
+		.tv_nsec = timeoutNs % 1000000000ULL,
+	};
+	struct io_uring_getevents_arg argument = {
+		.sigmask = 0,
+		.sigmask_sz = _NSIG / 8,
+		.ts = (unsigned long long)(unsigned long)&timeout,
+	};
+
+	if (timeoutNs)
+		flags |= IORING_ENTER_EXT_ARG;
+
+	int result = syscall(__NR_io_uring_enter, ring->fd, ring->toSubmit, wait, flags,
+						 timeoutNs ? (void *)&argument : NULL, timeoutNs ? sizeof(argument) : 0);
+
+	if (result < 0)
+		return -errno;
+
+	ring->toSubmit -= result < (int)ring->toSubmit ? result : ring->toSubmit;
+	return 0;
+}
+
+static struct io_uring_cqe *ringCompletion(Ring *ring)
+{
+	unsigned int head = *ring->cqHead;
+	if (head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	return &ring->cqes[head & *ring->cqMask];
+}
+
+static void ringCompletionSeen(Ring *ring)
+{
+	__atomic_store_n(ring->cqHead, *ring->cqHead + 1, __ATOMIC_RELEASE);
+}
+
+static int supportsOpcode(Ring *ring, int opcode)
+{
+	size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+	unsigned char storage[size];
+	struct io_uring_probe *probe = (struct io_uring_probe *)storage;
+	memset(storage, 0, size);
+
+	if (ringRegister(ring, IORING_REGISTER_PROBE, probe, 256) < 0)
+		return 0;
+
+	return opcode <= probe->last_op && (probe->ops[opcode].flags & IO_URING_OP_SUPPORTED);
+}
+
+/**
+ * Gives a read buffer back to the kernel once its bytes have been taken
+ **/
+static void recycleBuffer(unsigned short bufferId)
+{
+	struct io_uring_buf *buffer = &bufferRing->bufs[bufferRingTail & (URING_READ_BUFFERS - 1)];
+	buffer->addr = (unsigned long)readBuffers[bufferId];
+	buffer->len = URING_READ_BUFFER_SIZE;
+	buffer->bid = bufferId;
+	bufferRingTail++;
+	__atomic_store_n(&bufferRing->tail, bufferRingTail, __ATOMIC_RELEASE);
+}
+
+/**
+ * Closing the ring cancels the outstanding read and poll
+ **/
+static void serialClose()
+{
+	serialEnabled = 0;
+	ringClose(&serialRing);
+
+	if (bufferRing)
+		munmap(bufferRing, URING_READ_BUFFERS * sizeof(struct io_uring_buf));
+	bufferRing = NULL;
+}
+
+static int serialOpen(int serialFd)
+{
+	int error;
+
+	if (ringOpen(&serialRing, 8) < 0)
+		return -1;
+
+	if (!supportsOpcode(&serialRing, URING_OP_READ_MULTISHOT))
+	{
+		errno = EOPNOTSUPP;
+		goto fail;
+	}
+
+	if (ringRegister(&serialRing, IORING_REGISTER_FILES, &serialFd, 1) < 0)
+		goto fail;
+
+	bufferRing = mmap(NULL, URING_READ_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+					  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (bufferRing == MAP_FAILED)
+	{
+		bufferRing = NULL;
+		goto fail;
+	}
+
+	struct io_uring_buf_reg registration = {0};
+	registration.ring_addr = (unsigned long)bufferRing;
+	registration.ring_entries = URING_READ_BUFFERS;
+	registration.bgid = 0;
+
+	if (ringRegister(&serialRing, IORING_REGISTER_PBUF_RING, &registration, 1) < 0)
+		goto fail;
+
+	bufferRingTail = 0;
+	for (int i = 0; i < URING_READ_BUFFERS; i++)
+		recycleBuffer(i);
+
+	chunkHead = chunkCount = 0;
+	readArmed = writableArmed = 0;
+	serialEnabled = 1;
+	return 0;
+
+fail:
+	error = errno;
+	serialClose();
+	errno = error;
+	return -1;
+}
+
+static void serialFallback(const char *reason, int error)
+{
+	printf("Warning: io_uring serial reads failed (%s: %s), reading the serial port directly\n", reason, strerror(error));
+	serialClose();
+}
+
+/**
+ * Gives up on io_uring for card files, called with the file lock held
+ *
+ * Anything still on the ring goes with it, so a failed chain can't leave
+ * entries behind for the next one.
+ **/
+static void filesFallback(const char *reason, int error)
+{
+	printf("Warning: io_uring card file access failed (%s: %s), using the files directly\n", reason, strerror(error));
+	filesEnabled = 0;
+	ringClose(&fileRing);
+}
+
+static int filesOpen()
+{
+	if (ringOpen(&fileRing, 8) < 0)
+		return -1;
+
+	// One empty slot that each open installs the card file into
+	int sparse = -1;
+	struct iovec buffer = {.iov_base = cardBuffer, .iov_len = sizeof(cardBuffer)};
+
+	if (ringRegister(&fileRing, IORING_REGISTER_FILES, &sparse, 1) < 0 ||
+		ringRegister(&fileRing, IORING_REGISTER_BUFFERS, &buffer, 1) < 0)
+	{
+		ringClose(&fileRing);
+		return -1;
+	}
+
+	filesEnabled = 1;
+	return 0;
+}
+
+/**
+ * Sets up io_uring for the serial port and the card files
+ *
+ * Either part can fail on its own, leaving that part on the plain path.
+ *
+ * @param serialFd The serial port, or -1 for the card files only
+ * @returns 0 if anything is using io_uring, -1 if nothing is
+ **/
+int uringInit(int serialFd)
+{
+	if (filesEnabled || serialEnabled)
+		uringClose();
+
+	if (filesOpen() < 0)
+		printf("Warning: io_uring isn't available for card files (%s)\n", strerror(errno));
+
+	if (serialFd >= 0 && serialOpen(serialFd) < 0)
+		printf("Warning: io_uring isn't available for the serial port (%s)\n", strerror(errno));
+
+	return filesEnabled || serialEnabled ? 0 : -1;
+}
+
+void uringClose()
+{
+	if (serialEnabled)
+		serialClose();
+
+	pthread_mutex_lock(&fileLock);
+	if (filesEnabled)
+	{
+		filesEnabled = 0;
+		ringClose(&fileRing);
+	}
+	pthread_mutex_unlock(&fileLock);
+}
+
+int uringSerialEnabled()
+{
+	return serialEnabled;
+}
+
+int uringFilesEnabled()
+{
+	return filesEnabled;
+}
+
+static int armRead()
+{
+	struct io_uring_sqe *sqe = ringEntry(&serialRing);
+	if (!sqe)
+		return -1;
+
+	sqe->opcode = URING_OP_READ_MULTISHOT;
+	sqe->fd = 0;
+	sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+	sqe->buf_group = 0;
+	sqe->user_data = URING_TAG_READ;
+
+	readArmed = 1;
+	return 0;
+}
+
+static int armWritable()
+{
+	struct io_uring_sqe *sqe = ringEntry(&serialRing);
+	if (!sqe)
+		return -1;
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = 0;
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->poll32_events = POLLOUT;
+	sqe->user_data = URING_TAG_WRITABLE;
+
+	writableArmed = 1;
+	return 0;
+}
+
+/**
+ * Copies out as much of the oldest read completions as the caller has
+ * room for
+ **/
+static int takeChunks(unsigned char *buffer, int amount)
+{
+	int taken = 0;
+
+	while (chunkCount && taken < amount)
+	{
+		ReadChunk *chunk = &chunks[chunkHead];
+		int length = chunk->length - chunk->offset;
+		if (length > amount - taken)
+			length = amount - taken;
+
+		memcpy(buffer + taken, &readBuffers[chunk->bufferId][chunk->offset], length);
+		chunk->offset += length;
+		taken += length;
+
+		if (chunk->offset == chunk->length)
+		{
+			recycleBuffer(chunk->bufferId);
+			chunkHead = (chunkHead + 1) % URING_READ_BUFFERS;
+			chunkCount--;
+		}
+	}
+
+	return taken;
+}
+
+/**
+ * Handles every completion waiting on the serial ring
+ *
+ * @returns 0, or -1 if the read failed in a way that means falling back
+ **/
+static int reapSerial(int *writable, int *error)
+{
+	struct io_uring_cqe *cqe;
+
+	while ((cqe = ringCompletion(&serialRing)))
+	{
+		unsigned long long tag = cqe->user_data;
+		int result = cqe->res;
+		unsigned int flags = cqe->flags;
+		ringCompletionSeen(&serialRing);
+
+		if (tag == URING_TAG_WRITABLE)
+		{
+			writableArmed = 0;
+			*writable = 1;
+			continue;
+		}
+
+		if (!(flags & IORING_CQE_F_MORE))
+			readArmed = 0;
+
+		if (result > 0 && (flags & IORING_CQE_F_BUFFER))
+		{
+			int tail = (chunkHead + chunkCount) % URING_READ_BUFFERS;
+			chunks[tail].bufferId = flags >> IORING_CQE_BUFFER_SHIFT;
+			chunks[tail].offset = 0;
+			chunks[tail].length = result;
+			chunkCount++;
+		}
+		else if (result < 0 && result != -ENOBUFS && result != -EINTR && result != -EAGAIN)
+		{
+			// Running out of buffers only means the caller is behind
+			*error = -result;
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Waits for bytes from the serial port
+ *
+ * @param timeoutMs How long to wait for anything to happen
+ * @param flushing Set to also wake up when the port is writable again
+ * @param writable Set if the port became writable
+ * @returns The number of bytes read, 0 if the port only became writable,
+ *          or -1 if the time ran out first
+ **/
+int uringSerialRead(unsigned char *buffer, int amount, unsigned int timeoutMs, int flushing, int *writable)
+{
+	*writable = 0;
+
+	unsigned long long deadline = clockNowNs() + timeoutMs * 1000000ULL;
+	int error = 0;
+
+	while (1)
+	{
+		if (reapSerial(writable, &error) < 0)
+		{
+			serialFallback("read", error);
+			return -1;
+		}
+
+		if (chunkCount)
+			return takeChunks(buffer, amount);
+
+		if (*writable)
+			return 0;
+
+		if (!readArmed && armRead() < 0)
+			return -1;
+
+		if (flushing && !writableArmed && armWritable() < 0)
+			return -1;
+
+		unsigned long long now = clockNowNs();
+		if (now >= deadline)
+			return -1;
+
+		int result = ringEnter(&serialRing, 1, deadline - now);
+		if (result == -ETIME || result == -EINTR)
+		{
+			// Pick up anything that landed with the timeout
+			if (reapSerial(writable, &error) < 0)
+			{
+				serialFallback("read", error);
+				return -1;
+			}
+			if (chunkCount)
+				return takeChunks(buffer, amount);
+			return *writable ? 0 : -1;
+		}
+
+		if (result < 0)
+		{
+			serialFallback("wait", -result);
+			return -1;
+		}
+	}
+}
+
+/**
+ * Submits a chain of file operations and collects every result
+ *
+ * Called with the file lock held. Each step is hard linked to the next so
+ * the close at the end always runs, even after a failed step.
+ *
+ * @param results Filled with the result of each step in order
+ * @returns 0 once every step has completed, -1 if they couldn't be run
+ **/
+static int runChain(int steps, int *results)
+{
+	for (int seen = 0; seen < steps;)
+	{
+		struct io_uring_cqe *cqe = ringCompletion(&fileRing);
+		if (!cqe)
+		{
+			// A reload signal can interrupt the wait, the chain carries on
+			int result = ringEnter(&fileRing, steps - seen, 0);
+			if (result < 0 && result != -EINTR)
+			{
+				filesFallback("wait", -result);
+				return -1;
+			}
+			continue;
+		}
+
+		if (cqe->user_data < (unsigned long long)steps)
+			results[cqe->user_data] = cqe->res;
+		ringCompletionSeen(&fileRing);
+		seen++;
+	}
+
+	return 0;
+}
+
+static void prepareOpen(struct io_uring_sqe *sqe, const char *path, int flags)
+{
+	sqe->opcode = IORING_OP_OPENAT;
+	sqe->fd = AT_FDCWD;
+	sqe->addr = (unsigned long)path;
+	sqe->open_flags = flags;
+	sqe->len = 0644;
+	sqe->file_index = 1;
+	sqe->flags = IOSQE_IO_HARDLINK;
+	sqe->user_data = 0;
+}
+
+static void prepareClose(struct io_uring_sqe *sqe, int step)
+{
+	sqe->opcode = IORING_OP_CLOSE;
+	sqe->file_index = 1;
+	sqe->user_data = step;
+}
+
+/**
+ * Writes a card file with a single submission of open, write, fsync and
+ * close
+ *
+ * @returns The number of bytes written and flushed to disk, or -1
+ **/
+int uringSaveCard(const char *path, const unsigned char *tracks, int length)
+{
+	if (length > URING_CARD_SIZE)
+		return -1;
+
+	pthread_mutex_lock(&fileLock);
+
+	if (!filesEnabled)
+	{
+		pthread_mutex_unlock(&fileLock);
+		return -1;
+	}
+
+	memcpy(cardBuffer, tracks, length);
+
+	struct io_uring_sqe *openStep = ringEntry(&fileRing);
+	struct io_uring_sqe *writeStep = ringEntry(&fileRing);
+	struct io_uring_sqe *syncStep = ringEntry(&fileRing);
+	struct io_uring_sqe *closeStep = ringEntry(&fileRing);
+
+	if (!openStep || !writeStep || !syncStep || !closeStep)
+	{
+		filesFallback("submit", EBUSY);
+		pthread_mutex_unlock(&fileLock);
+		return -1;
+	}
+
+	prepareOpen(openStep, path, O_WRONLY | O_CREAT | O_TRUNC);
+
+	writeStep->opcode = IORING_OP_WRITE_FIXED;
+	writeStep->fd = 0;
+	writeStep->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+	writeStep->addr = (unsigned long)cardBuffer;
+	writeStep->len = length;
+	writeStep->off = 0;
+	writeStep->buf_index = 0;
+	writeStep->user_data = 1;
+
+	syncStep->opcode = IORING_OP_FSYNC;
+	syncStep->fd = 0;
+	syncStep->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+	syncStep->fsync_flags = IORING_FSYNC_DATASYNC;
+	syncStep->user_data = 2;
+
+	prepareClose(closeStep, 3);
+
+	int results[4] = {-1, -1, -1, -1};
+	int result = runChain(4, results);
+
+	pthread_mutex_unlock(&fileLock);
+
+	// Leave errno as the failed step would have for the caller's message
+	int failed = results[0] < 0 ? results[0] : results[1] < 0 ? results[1] : results[2];
+	if (result < 0 || failed < 0)
+	{
+		if (result == 0)
+			errno = -failed;
+		return -1;
+	}
+
+	return results[1];
+}
+
+/**
+ * Reads a card file with a single submission of open, read and close
+ *
+ * @returns The number of bytes read, or -1 if the file couldn't be opened
+ **/
+int uringLoadCard(const char *path, unsigned char *tracks, int length)
+{
+	if (length > URING_CARD_SIZE)
+		return -1;
+
+	pthread_mutex_lock(&fileLock);
+
+	if (!filesEnabled)
+	{
+		pthread_mutex_unlock(&fileLock);
+		return -1;
+	}
+
+	struct io_uring_sqe *openStep = ringEntry(&fileRing);
+	struct io_uring_sqe *readStep = ringEntry(&fileRing);
+	struct io_uring_sqe *closeStep = ringEntry(&fileRing);
+
+	if (!openStep || !readStep || !closeStep)
+	{
+		filesFallback("submit", EBUSY);
+		pthread_mutex_unlock(&fileLock);
+		return -1;
+	}
+
+	prepareOpen(openStep, path, O_RDONLY);
+
+	readStep->opcode = IORING_OP_READ_FIXED;
+	readStep->fd = 0;
+	readStep->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+	readStep->addr = (unsigned long)cardBuffer;
+	readStep->len = length;
+	readStep->off = 0;
+	readStep->buf_index = 0;
+	readStep->user_data = 1;
+
+	prepareClose(closeStep, 2);
+
+	int results[3] = {-1, -1, -1};
+	int result = runChain(3, results);
+
+	if (result == 0 && results[0] >= 0 && results[1] > 0)
+		memcpy(tracks, cardBuffer, results[1]);
+
+	pthread_mutex_unlock(&fileLock);
+
+	if (result < 0 || results[0] < 0)
+	{
+		if (result == 0)
+			errno = -results[0];
+		return -1;
+	}
+
+	return results[1] < 0 ? 0 : results[1];
+}
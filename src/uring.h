@@ -0,0 +1,19 @@
+#ifndef URING_H
+#define URING_H
+
+/* Set CARD_IO_URING to 1 to try io_uring for the serial port and card files */
+#define DEFAULT_IO_URING 0
+
+/* Buffers the kernel fills from the serial port while a read is outstanding */
+#define URING_READ_BUFFERS 8
+#define URING_READ_BUFFER_SIZE 1024
+
+int uringInit(int serialFd);
+void uringClose();
+int uringSerialEnabled();
+int uringFilesEnabled();
+int uringSerialRead(unsigned char *buffer, int amount, unsigned int timeoutMs, int flushing, int *writable);
+int uringSaveCard(const char *path, const unsigned char *tracks, int length);
+int uringLoadCard(const char *path, unsigned char *tracks, int length);
+
+#endif
@@ -0,0 +1,268 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "clock.h"
+#include "probes.h"
+#include "watchdog.h"
+
+/**
+ * Reply deadline monitoring
+ *
+ * The host only waits so long for an answer to each frame. Every frame is
+ * timed from its first byte arriving to the last byte of the reply being
+ * written, or on the ring fetched by the host, with the time split into
+ * reading, parsing, dispatching the command, card file I/O and writing the
+ * reply. Replies that come close to the budget are counted, replies that
+ * miss it are also kept with their breakdown in a ring buffer for
+ * `cardctl deadlines`.
+ *
+ * Each reader is timed on its own, the readers on a ring share the budget.
+ * The marks are all made by the reader's protocol loop, apart from the
+ * arrival of ring bytes and the host fetching ring replies, which the ring
+ * thread stamps. File I/O from other threads, such as a queued card being
+ * inserted or a card job on a worker, doesn't hold up a reply and isn't
+ * counted; the time the protocol loop spends waiting for a card job is.
+ **/
+
+static unsigned int budget;
+
+void watchdogInit(unsigned int budgetUs)
+{
+	__atomic_store_n(&budget, budgetUs, __ATOMIC_RELAXED);
+}
+
+int watchdogReaderInit(CardReader *reader)
+{
+	ReaderWatchdog *watchdog = calloc(1, sizeof(ReaderWatchdog));
+	if (!watchdog)
+		return -1;
+
+	pthread_mutex_init(&watchdog->lock, NULL);
+	reader->watchdog = watchdog;
+	return 0;
+}
+
+/**
+ * Changes the budget without losing the counters, for a configuration reload
+ **/
+void watchdogSetBudget(unsigned int budgetUs)
+{
+	__atomic_store_n(&budget, budgetUs, __ATOMIC_RELAXED);
+}
+
+unsigned int watchdogBudget()
+{
+	return __atomic_load_n(&budget, __ATOMIC_RELAXED);
+}
+
+/**
+ * Whether the caller is the protocol loop of a reader being timed
+ **/
+static ReaderWatchdog *timed(CardReader *reader)
+{
+	ReaderWatchdog *watchdog = reader->watchdog;
+	if (!watchdog || !watchdog->active || !pthread_equal(pthread_self(), watchdog->thread))
+		return NULL;
+	return watchdog;
+}
+
+static void finish(CardReader *reader, unsigned long long now);
+
+/**
+ * Called by the protocol loop when it reads the first bytes of a new frame
+ *
+ * @param arrivedNs When the first of the bytes arrived
+ **/
+void watchdogFrameStart(CardReader *reader, unsigned long long arrivedNs)
+{
+	ReaderWatchdog *watchdog = reader->watchdog;
+	if (!watchdog)
+		return;
+
+	// The host has moved on, so a reply it never fetched in full is done
+	pthread_mutex_lock(&watchdog->lock);
+	if (watchdog->fetching)
+		finish(reader, watchdog->fetched ? watchdog->fetchedAt : arrivedNs);
+	pthread_mutex_unlock(&watchdog->lock);
+
+	watchdog->thread = pthread_self();
+	watchdog->frameStart = arrivedNs;
+	watchdog->frameRead = watchdog->frameStart;
+	watchdog->frameParsed = watchdog->frameStart;
+	watchdog->replyStart = 0;
+	watchdog->fileIo = 0;
+	watchdog->active = 1;
+}
+
+/**
+ * Called after every read that adds to the frame
+ **/
+void watchdogFrameRead(CardReader *reader)
+{
+	ReaderWatchdog *watchdog = timed(reader);
+	if (watchdog)
+		watchdog->frameRead = clockNowNs();
+}
+
+/**
+ * Called once the frame is complete and its checksum checked
+ **/
+void watchdogFrameParsed(CardReader *reader)
+{
+	ReaderWatchdog *watchdog = timed(reader);
+	if (watchdog)
+		watchdog->frameParsed = clockNowNs();
+}
+
+void watchdogFileIo(CardReader *reader, unsigned long long ns)
+{
+	ReaderWatchdog *watchdog = timed(reader);
+	if (watchdog)
+		watchdog->fileIo += ns;
+}
+
+void watchdogReplyStart(CardReader *reader)
+{
+	ReaderWatchdog *watchdog = timed(reader);
+	if (!watchdog)
+		return;
+
+	pthread_mutex_lock(&watchdog->lock);
+	watchdog->replyStart = clockNowNs();
+	watchdog->fetched = 0;
+	pthread_mutex_unlock(&watchdog->lock);
+}
+
+/**
+ * Called once the reply has been written
+ *
+ * @param opcode ENQUIRY for a status reply or the command being acknowledged
+ * @param unfetched How many bytes of the reply the host still has to fetch
+ *                  off the ring before the transaction is done, 0 if it
+ *                  is done now
+ **/
+void watchdogReplyDone(CardReader *reader, unsigned char opcode, int unfetched)
+{
+	ReaderWatchdog *watchdog = timed(reader);
+	if (!watchdog)
+		return;
+
+	watchdog->active = 0;
+
+	pthread_mutex_lock(&watchdog->lock);
+
+	watchdog->opcode = opcode;
+
+	// The ring thread may already have seen the host fetch some of it
+	if (unfetched > watchdog->fetched)
+	{
+		watchdog->fetching = 1;
+		watchdog->unfetched = unfetched;
+	}
+	else
+	{
+		finish(reader, clockNowNs());
+	}
+
+	pthread_mutex_unlock(&watchdog->lock);
+}
+
+/**
+ * Called by the ring thread for each reply byte the host fetches
+ **/
+void watchdogReplyFetched(CardReader *reader)
+{
+	ReaderWatchdog *watchdog = reader->watchdog;
+	if (!watchdog)
+		return;
+
+	pthread_mutex_lock(&watchdog->lock);
+
+	watchdog->fetched++;
+	watchdog->fetchedAt = clockNowNs();
+
+	if (watchdog->fetching && watchdog->fetched >= watchdog->unfetched)
+		finish(reader, watchdog->fetchedAt);
+
+	pthread_mutex_unlock(&watchdog->lock);
+}
+
+/**
+ * Closes the transaction, called with the lock held
+ *
+ * @param now When the last byte of the reply went out
+ **/
+static void finish(CardReader *reader, unsigned long long now)
+{
+	ReaderWatchdog *watchdog = reader->watchdog;
+	unsigned char opcode = watchdog->opcode;
+
+	watchdog->fetching = 0;
+
+	unsigned long long replyStart = watchdog->replyStart ? watchdog->replyStart : now;
+	unsigned int totalUs = (now - watchdog->frameStart) / 1000;
+	unsigned int budgetUs = watchdogBudget();
+
+	WatchdogReport *report = &watchdog->report;
+	report->transactions++;
+
+	if (totalUs > report->worstUs)
+		report->worstUs = totalUs;
+
+	if (budgetUs == 0 || totalUs * 100ULL < budgetUs * (unsigned long long)WATCHDOG_NEAR_MISS_PERCENT)
+		return;
+
+	if (totalUs <= budgetUs)
+	{
+		report->nearMisses++;
+		return;
+	}
+
+	WatchdogMiss *miss = &report->log[report->misses % WATCHDOG_LOG_SIZE];
+	report->misses++;
+	if (report->count < WATCHDOG_LOG_SIZE)
+		report->count++;
+
+	unsigned long long dispatch = replyStart - watchdog->frameParsed;
+	unsigned long long fileIo = watchdog->fileIo < dispatch ? watchdog->fileIo : dispatch;
+
+	miss->when = time(NULL);
+	miss->opcode = opcode;
+	miss->totalUs = totalUs;
+	miss->phaseUs[WATCHDOG_READ] = (watchdog->frameRead - watchdog->frameStart) / 1000;
+	miss->phaseUs[WATCHDOG_PARSE] = (watchdog->frameParsed - watchdog->frameRead) / 1000;
+	miss->phaseUs[WATCHDOG_DISPATCH] = (dispatch - fileIo) / 1000;
+	miss->phaseUs[WATCHDOG_FILE_IO] = fileIo / 1000;
+	miss->phaseUs[WATCHDOG_WRITE] = (now - replyStart) / 1000;
+
+	PROBE4(deadline__miss, reader->id, opcode, totalUs, budgetUs);
+}
+
+/**
+ * Copies a reader's counters and missed deadlines, oldest miss first
+ **/
+void watchdogGetReport(CardReader *reader, WatchdogReport *report)
+{
+	ReaderWatchdog *watchdog = reader->watchdog;
+
+	memset(report, 0, sizeof(*report));
+	report->budgetUs = watchdogBudget();
+	if (!watchdog)
+		return;
+
+	pthread_mutex_lock(&watchdog->lock);
+
+	*report = watchdog->report;
+	report->budgetUs = watchdogBudget();
+
+	int oldest = watchdog->report.misses % WATCHDOG_LOG_SIZE;
+	if (watchdog->report.count == WATCHDOG_LOG_SIZE)
+	{
+		for (int i = 0; i < WATCHDOG_LOG_SIZE; i++)
+			report->log[i] = watchdog->report.log[(oldest + i) % WATCHDOG_LOG_SIZE];
+	}
+
+	pthread_mutex_unlock(&watchdog->lock);
+}
@@ -0,0 +1,82 @@
+#ifndef WATCHDOG_H
+#define WATCHDOG_H
+
+#include <pthread.h>
+
+#include "cardd.h"
+
+/* How many missed deadlines are kept for cardctl to look at */
+#define WATCHDOG_LOG_SIZE 32
+
+/* A reply slower than this share of the budget counts as a near miss */
+#define WATCHDOG_NEAR_MISS_PERCENT 75
+
+typedef enum
+{
+	WATCHDOG_READ,
+	WATCHDOG_PARSE,
+	WATCHDOG_DISPATCH,
+	WATCHDOG_FILE_IO,
+	WATCHDOG_WRITE,
+	WATCHDOG_PHASES,
+} WatchdogPhase;
+
+/* The time breakdown of one transaction that missed its deadline */
+typedef struct
+{
+	unsigned int when;
+	unsigned char opcode;
+	unsigned int totalUs;
+	unsigned int phaseUs[WATCHDOG_PHASES];
+} WatchdogMiss;
+
+typedef struct
+{
+	unsigned int budgetUs;
+	unsigned long long transactions;
+	unsigned long long nearMisses;
+	unsigned long long misses;
+	unsigned int worstUs;
+	int count;
+	WatchdogMiss log[WATCHDOG_LOG_SIZE];
+} WatchdogReport;
+
+/**
+ * The transaction being timed for one reader and its report
+ *
+ * The marks are made by the reader's protocol loop. On the ring a reply is
+ * only done once the host has fetched it, which the ring thread reports,
+ * so the fetch counts and the report are kept under the lock.
+ **/
+typedef struct ReaderWatchdog
+{
+	pthread_mutex_t lock;
+	pthread_t thread;
+	int active;
+	unsigned long long frameStart;
+	unsigned long long frameRead;
+	unsigned long long frameParsed;
+	unsigned long long replyStart;
+	unsigned long long fileIo;
+	unsigned char opcode;
+	int fetching;
+	int unfetched;
+	int fetched;
+	unsigned long long fetchedAt;
+	WatchdogReport report;
+} ReaderWatchdog;
+
+void watchdogInit(unsigned int budgetUs);
+int watchdogReaderInit(CardReader *reader);
+void watchdogSetBudget(unsigned int budgetUs);
+unsigned int watchdogBudget();
+void watchdogFrameStart(CardReader *reader, unsigned long long arrivedNs);
+void watchdogFrameRead(CardReader *reader);
+void watchdogFrameParsed(CardReader *reader);
+void watchdogFileIo(CardReader *reader, unsigned long long ns);
+void watchdogReplyStart(CardReader *reader);
+void watchdogReplyDone(CardReader *reader, unsigned char opcode, int unfetched);
+void watchdogReplyFetched(CardReader *reader);
+void watchdogGetReport(CardReader *reader, WatchdogReport *report);
+
+#endif
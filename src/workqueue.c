@@ -0,0 +1,133 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "clock.h"
+#include "workqueue.h"
+
+static void *workQueueThread(void *data)
+{
+	WorkQueue *queue = data;
+	unsigned char *entry = malloc(queue->entrySize);
+	unsigned long long nextPeriodicMs = 0;
+	int handled = 0;
+
+	if (queue->begin)
+		queue->begin();
+
+	for (;;)
+	{
+		if (queue->periodic && clockWallMs() >= nextPeriodicMs)
+		{
+			queue->periodic();
+			nextPeriodicMs = clockWallMs() + queue->periodMs;
+		}
+
+		int taken = 0;
+
+		pthread_mutex_lock(&queue->lock);
+
+		if (queue->count == 0 && !handled)
+		{
+			if (queue->periodic)
+			{
+				// The condition waits on the real clock whatever clock the daemon uses
+				unsigned long long nowMs = clockWallMs();
+				unsigned long long waitMs = nextPeriodicMs > nowMs ? nextPeriodicMs - nowMs : 0;
+				struct timespec now;
+				clock_gettime(CLOCK_REALTIME, &now);
+				unsigned long long deadlineNs = now.tv_sec * 1000000000ULL + now.tv_nsec + waitMs * 1000000ULL;
+				struct timespec deadline = {.tv_sec = deadlineNs / 1000000000ULL, .tv_nsec = deadlineNs % 1000000000ULL};
+				pthread_cond_timedwait(&queue->ready, &queue->lock, &deadline);
+			}
+			else
+			{
+				pthread_cond_wait(&queue->ready, &queue->lock);
+			}
+		}
+
+		if (queue->count)
+		{
+			memcpy(entry, &queue->entries[queue->head * queue->entrySize], queue->entrySize);
+			queue->head = (queue->head + 1) % queue->capacity;
+			queue->count--;
+			taken = 1;
+			pthread_cond_signal(&queue->space);
+		}
+
+		pthread_mutex_unlock(&queue->lock);
+
+		if (taken)
+		{
+			queue->handle(entry);
+			handled = 1;
+		}
+		else if (handled)
+		{
+			// Once the queue is empty rather than after every entry
+			if (queue->idle)
+				queue->idle();
+			handled = 0;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Sets up the queue described by the fields filled in and starts its thread
+ *
+ * @returns 0 on success, -1 on failure
+ **/
+int workQueueStart(WorkQueue *queue)
+{
+	queue->entries = calloc(queue->capacity, queue->entrySize);
+	if (!queue->entries)
+		return -1;
+
+	pthread_mutex_init(&queue->lock, NULL);
+	pthread_cond_init(&queue->ready, NULL);
+	pthread_cond_init(&queue->space, NULL);
+	queue->head = queue->count = 0;
+
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, workQueueThread, queue) != 0)
+		return -1;
+	pthread_detach(thread);
+
+	return 0;
+}
+
+/**
+ * Hands an entry to the queue's thread
+ *
+ * @param wait Set to wait for room rather than drop the entry
+ * @returns 0 on success, -1 if the queue was full and the entry dropped
+ **/
+int workQueuePush(WorkQueue *queue, const void *entry, int wait)
+{
+	pthread_mutex_lock(&queue->lock);
+
+	while (wait && queue->count == queue->capacity)
+		pthread_cond_wait(&queue->space, &queue->lock);
+
+	if (queue->count == queue->capacity)
+	{
+		__atomic_add_fetch(&queue->dropped, 1, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&queue->lock);
+		return -1;
+	}
+
+	memcpy(&queue->entries[((queue->head + queue->count) % queue->capacity) * queue->entrySize], entry, queue->entrySize);
+	queue->count++;
+
+	pthread_cond_signal(&queue->ready);
+	pthread_mutex_unlock(&queue->lock);
+
+	return 0;
+}
+
+unsigned int workQueueDropped(WorkQueue *queue)
+{
+	return __atomic_load_n(&queue->dropped, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,43 @@
+#ifndef WORKQUEUE_H
+#define WORKQUEUE_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+/**
+ * A bounded queue of fixed size entries drained by a background thread
+ *
+ * The history, search index and session log each hand their work to a
+ * thread of their own through one of these, so the protocol loop never
+ * waits on storage. A full queue drops the entry and counts it rather
+ * than holding up whoever is adding to it, unless they ask to wait.
+ *
+ * The thread calls begin once before taking anything, handle for every
+ * entry, idle once the queue has emptied after handling something, so
+ * writes can be synced in batches, and periodic every periodMs. Any of
+ * them but handle can be NULL.
+ **/
+typedef struct
+{
+	size_t entrySize;
+	int capacity;
+	void (*begin)(void);
+	void (*handle)(void *entry);
+	void (*idle)(void);
+	void (*periodic)(void);
+	unsigned long long periodMs;
+
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	pthread_cond_t space;
+	unsigned char *entries;
+	int head;
+	int count;
+	unsigned int dropped;
+} WorkQueue;
+
+int workQueueStart(WorkQueue *queue);
+int workQueuePush(WorkQueue *queue, const void *entry, int wait);
+unsigned int workQueueDropped(WorkQueue *queue);
+
+#endif